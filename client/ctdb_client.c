@@ -713,6 +713,94 @@ again:
 	return h;
 }
 
+struct migrate_records_state {
+	struct ctdb_db_context *ctdb_db;
+	ctdb_migrate_record_fn fn;
+	void *private_data;
+	int count;
+};
+
+/*
+  called as each record of a ctdb_migrate_records batch becomes local
+ */
+static void migrate_records_handler(struct ctdb_context *ctdb, uint64_t srvid,
+				    TDB_DATA data, void *p)
+{
+	struct migrate_records_state *state = (struct migrate_records_state *)p;
+
+	state->count++;
+	if (state->fn != NULL) {
+		state->fn(state->ctdb_db, data, state->private_data);
+	}
+}
+
+/*
+  migrate a batch of records to this node with a single request to the
+  local daemon, rather than one ctdb_fetch_lock() round trip per key.
+  The daemon sends one request to each node currently holding some of
+  the records, and fn (if not NULL) is called with each key as its
+  record arrives, typically to ctdb_fetch_lock() it straight away.
+
+  returns the number of records that were migrated, or -1 on error
+ */
+int ctdb_migrate_records(struct ctdb_db_context *ctdb_db,
+			 uint32_t num_keys, TDB_DATA *keys,
+			 ctdb_migrate_record_fn fn, void *private_data)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_marshall_buffer *m = NULL;
+	struct migrate_records_state state;
+	uint64_t srvid = CTDB_SRVID_MIGRATE_RANGE | getpid();
+	TDB_DATA indata;
+	int32_t status;
+	uint32_t i;
+	int ret;
+
+	if (num_keys == 0) {
+		return 0;
+	}
+
+	for (i=0; i<num_keys; i++) {
+		m = ctdb_marshall_add(ctdb, m, ctdb_db->db_id, 0,
+				      keys[i], NULL, tdb_null);
+		if (m == NULL) {
+			DEBUG(DEBUG_ERR,(__location__ " Failed to marshall keys\n"));
+			return -1;
+		}
+	}
+	indata = ctdb_marshall_finish(m);
+
+	state.ctdb_db = ctdb_db;
+	state.fn = fn;
+	state.private_data = private_data;
+	state.count = 0;
+
+	ret = ctdb_client_set_message_handler(ctdb, srvid,
+					      migrate_records_handler, &state);
+	if (ret != 0) {
+		DEBUG(DEBUG_ERR,("Failed to setup migrate records handler\n"));
+		talloc_free(m);
+		return -1;
+	}
+
+	ret = ctdb_control(ctdb, CTDB_CURRENT_NODE, srvid,
+			   CTDB_CONTROL_MIGRATE_RECORDS, 0, indata,
+			   NULL, NULL, &status, NULL, NULL);
+	talloc_free(m);
+
+	if (ctdb_client_remove_message_handler(ctdb, srvid, &state) != 0) {
+		DEBUG(DEBUG_ERR,("Failed to remove migrate records handler\n"));
+		return -1;
+	}
+
+	if (ret != 0 || status != 0) {
+		DEBUG(DEBUG_ERR,("ctdb_migrate_records failed\n"));
+		return -1;
+	}
+
+	return state.count;
+}
+
 /*
   get a readonly lock on a record, and return the records data. Blocks until it gets the lock
  */
@@ -889,6 +977,7 @@ int ctdb_fetch(struct ctdb_db_context *ctdb_db, TALLOC_CTX *mem_ctx,
 	int ret;
 
 	call.call_id = CTDB_FETCH_FUNC;
+	call.flags = 0;
 	call.call_data.dptr = NULL;
 	call.call_data.dsize = 0;
 	call.key = key;
@@ -3325,10 +3414,8 @@ struct ctdb_context *ctdb_init(struct event_context *ev)
 		return NULL;
 	}
 	ctdb->ev  = ev;
-	ctdb->idr = idr_init(ctdb);
-	/* Wrap early to exercise code. */
-	ctdb->lastid = INT_MAX-200;
-	CTDB_NO_MEMORY_NULL(ctdb, ctdb->idr);
+	ctdb->reqids = ctdb_reqid_init(ctdb);
+	CTDB_NO_MEMORY_NULL(ctdb, ctdb->reqids);
 
 	ret = ctdb_set_socketname(ctdb, CTDB_PATH);
 	if (ret != 0) {
@@ -4672,6 +4759,30 @@ int ctdb_ctrl_set_db_priority(struct ctdb_context *ctdb, struct timeval timeout,
 	return 0;
 }
 
+int ctdb_ctrl_set_db_ship_call(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, struct ctdb_db_ship_call *ship_call)
+{
+	int ret;
+	int32_t res;
+	TDB_DATA data;
+	TALLOC_CTX *tmp_ctx = talloc_new(NULL);
+
+	data.dptr = (uint8_t*)ship_call;
+	data.dsize = sizeof(*ship_call);
+
+	ret = ctdb_control(ctdb, destnode, 0, 
+			   CTDB_CONTROL_SET_DB_SHIP_CALL, 0, data,
+			   tmp_ctx, NULL, &res, &timeout, NULL);
+	if (ret != 0 || res != 0) {
+		DEBUG(DEBUG_ERR,(__location__ " ctdb_control for set_db_ship_call failed\n"));
+		talloc_free(tmp_ctx);
+		return -1;
+	}
+
+	talloc_free(tmp_ctx);
+
+	return 0;
+}
+
 int ctdb_ctrl_get_db_priority(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, uint32_t db_id, uint32_t *priority)
 {
 	int ret;
@@ -4720,6 +4831,93 @@ int ctdb_ctrl_getstathistory(struct ctdb_context *ctdb, struct timeval timeout,
 	return 0;
 }
 
+int ctdb_ctrl_getstathistory_range(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, TALLOC_CTX *mem_ctx, struct timeval start, struct timeval end, struct ctdb_statistics_wire **stats)
+{
+	int ret;
+	TDB_DATA indata, outdata;
+	int32_t res;
+	struct ctdb_statistics_range range;
+
+	range.start = start;
+	range.end   = end;
+
+	indata.dptr  = (uint8_t *)&range;
+	indata.dsize = sizeof(range);
+
+	ret = ctdb_control(ctdb, destnode, 0,
+			   CTDB_CONTROL_GET_STAT_HISTORY_RANGE, 0, indata,
+			   mem_ctx, &outdata, &res, &timeout, NULL);
+	if (ret != 0 || res != 0 || outdata.dsize < offsetof(struct ctdb_statistics_wire, stats)) {
+		DEBUG(DEBUG_ERR,(__location__ " ctdb_control for getstathistory_range failed ret:%d res:%d\n", ret, res));
+		return -1;
+	}
+
+	*stats = (struct ctdb_statistics_wire *)talloc_memdup(mem_ctx, outdata.dptr, outdata.dsize);
+	talloc_free(outdata.dptr);
+
+	return 0;
+}
+
+int ctdb_ctrl_getclientstats(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, TALLOC_CTX *mem_ctx, struct ctdb_client_statistics_wire **stats)
+{
+	int ret;
+	TDB_DATA outdata;
+	int32_t res;
+	struct ctdb_client_statistics_wire *wire;
+
+	ret = ctdb_control(ctdb, destnode, 0,
+			   CTDB_CONTROL_GET_CLIENT_STATISTICS, 0, tdb_null,
+			   mem_ctx, &outdata, &res, &timeout, NULL);
+	if (ret != 0 || res != 0 || outdata.dsize < offsetof(struct ctdb_client_statistics_wire, stats)) {
+		DEBUG(DEBUG_ERR,(__location__ " ctdb_control for getclientstats failed ret:%d res:%d\n", ret, res));
+		return -1;
+	}
+
+	wire = (struct ctdb_client_statistics_wire *)outdata.dptr;
+	if (outdata.dsize != offsetof(struct ctdb_client_statistics_wire, stats) +
+			     wire->num * sizeof(struct ctdb_client_statistics)) {
+		DEBUG(DEBUG_ERR,(__location__ " Wrong client statistics size %zi for %u clients\n",
+				 outdata.dsize, wire->num));
+		talloc_free(outdata.dptr);
+		return -1;
+	}
+
+	*stats = (struct ctdb_client_statistics_wire *)talloc_memdup(mem_ctx, outdata.dptr, outdata.dsize);
+	talloc_free(outdata.dptr);
+
+	return 0;
+}
+
+int ctdb_ctrl_getstreamstats(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, TALLOC_CTX *mem_ctx, struct ctdb_stream_statistics_wire **stats)
+{
+	int ret;
+	TDB_DATA outdata;
+	int32_t res;
+	struct ctdb_stream_statistics_wire *wire;
+
+	ret = ctdb_control(ctdb, destnode, 0,
+			   CTDB_CONTROL_GET_STREAM_STATISTICS, 0, tdb_null,
+			   mem_ctx, &outdata, &res, &timeout, NULL);
+	if (ret != 0 || res != 0 || outdata.dsize < offsetof(struct ctdb_stream_statistics_wire, stats)) {
+		DEBUG(DEBUG_ERR,(__location__ " ctdb_control for getstreamstats failed ret:%d res:%d\n", ret, res));
+		return -1;
+	}
+
+	wire = (struct ctdb_stream_statistics_wire *)outdata.dptr;
+	if (outdata.dsize != offsetof(struct ctdb_stream_statistics_wire, stats) +
+			     wire->num * sizeof(struct ctdb_stream_statistics)) {
+		DEBUG(DEBUG_ERR,(__location__ " Wrong stream statistics size %zi for %u streams\n",
+				 outdata.dsize, wire->num));
+		talloc_free(outdata.dptr);
+		return -1;
+	}
+
+	*stats = (struct ctdb_stream_statistics_wire *)talloc_memdup(mem_ctx, outdata.dptr, outdata.dsize);
+	talloc_free(outdata.dptr);
+
+	return 0;
+}
+
 struct ctdb_ltdb_header *ctdb_header_from_record_handle(struct ctdb_record_handle *h)
 {
 	if (h == NULL) {
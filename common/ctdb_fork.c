@@ -176,3 +176,21 @@ ctdb_kill(struct ctdb_context *ctdb, pid_t pid, int signum)
 
 	return kill(pid, signum);
 }
+
+/*
+ * Wait for a child started with ctdb_fork() and stop tracking it
+ */
+pid_t ctdb_waitpid(struct ctdb_context *ctdb, pid_t pid, int *status)
+{
+	pid_t ret;
+
+	do {
+		ret = waitpid(pid, status, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == pid && getpid() == ctdb->ctdbd_pid) {
+		talloc_free(trbt_lookup32(ctdb->child_processes, pid));
+	}
+
+	return ret;
+}
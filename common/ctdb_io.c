@@ -44,14 +44,28 @@ struct ctdb_queue_pkt {
 	uint8_t *data;
 	uint32_t length;
 	uint32_t full_length;
+	struct timeval queued_time;
+};
+
+/*
+  the packets of one priority class waiting to be written
+ */
+struct ctdb_queue_list {
+	struct ctdb_queue_pkt *out_queue;
+	int64_t credit;		/* bytes left in this turn of the round robin */
+	struct ctdb_queue_class_statistics stats;
 };
 
 struct ctdb_queue {
 	struct ctdb_context *ctdb;
 	struct tevent_immediate *im;
 	struct ctdb_buffer buffer; /* input buffer */
-	struct ctdb_queue_pkt *out_queue, *out_queue_tail;
+	struct ctdb_queue_list out[CTDB_QUEUE_NUM_CLASSES];
+	struct ctdb_queue_pkt *out_current;	/* being written */
+	enum ctdb_queue_class out_current_class;
+	enum ctdb_queue_class rr_class;
 	uint32_t out_queue_length;
+	uint64_t out_queue_bytes;
 	struct fd_event *fde;
 	int fd;
 	size_t alignment;
@@ -59,6 +73,9 @@ struct ctdb_queue {
 	ctdb_queue_cb_fn_t callback;
 	bool *destroyed;
 	const char *name;
+	bool read_paused;
+	bool limited;	/* MaxQueueBytes applies, see ctdb_queue_set_limited() */
+	bool congested;
 };
 
 
@@ -68,6 +85,73 @@ int ctdb_queue_length(struct ctdb_queue *queue)
 	return queue->out_queue_length;
 }
 
+bool ctdb_queue_is_connected(struct ctdb_queue *queue)
+{
+	return queue->fd != -1;
+}
+
+void ctdb_queue_statistics(struct ctdb_queue *queue,
+			   struct ctdb_queue_class_statistics *stats)
+{
+	int i;
+
+	for (i=0; i<CTDB_QUEUE_NUM_CLASSES; i++) {
+		stats[i] = queue->out[i].stats;
+	}
+}
+
+/*
+  control replies above this size are bulk traffic
+ */
+#define CTDB_BULK_REPLY_SIZE	(64*1024)
+
+/*
+  the priority class of a packet to another node. Keepalives, election
+  messages and dmaster replies are small and late ones cause node
+  timeouts or hold up calls, so they overtake everything else. Recovery
+  and traverse traffic can be large and goes last
+ */
+enum ctdb_queue_class ctdb_queue_pkt_class(struct ctdb_req_header *hdr)
+{
+	struct ctdb_req_control *c;
+	struct ctdb_req_message *m;
+
+	switch (hdr->operation) {
+	case CTDB_REQ_KEEPALIVE:
+	case CTDB_REPLY_DMASTER:
+		return CTDB_QUEUE_CLASS_CONTROL;
+	case CTDB_REQ_MESSAGE:
+		m = (struct ctdb_req_message *)hdr;
+		if (m->srvid == CTDB_SRVID_RECOVERY) {
+			return CTDB_QUEUE_CLASS_CONTROL;
+		}
+		return CTDB_QUEUE_CLASS_NORMAL;
+	case CTDB_REQ_CONTROL:
+		c = (struct ctdb_req_control *)hdr;
+		switch (c->opcode) {
+		case CTDB_CONTROL_PULL_DB:
+		case CTDB_CONTROL_PUSH_DB:
+		case CTDB_CONTROL_TRAVERSE_ALL:
+		case CTDB_CONTROL_TRAVERSE_ALL_EXT:
+		case CTDB_CONTROL_TRAVERSE_DATA:
+		case CTDB_CONTROL_RECEIVE_RECORDS:
+		case CTDB_CONTROL_TRY_DELETE_RECORDS:
+		case CTDB_CONTROL_GET_STAT_HISTORY:
+		case CTDB_CONTROL_GET_STAT_HISTORY_RANGE:
+			return CTDB_QUEUE_CLASS_BULK;
+		}
+		return CTDB_QUEUE_CLASS_NORMAL;
+	case CTDB_REPLY_CONTROL:
+		/* replies do not say what they answer */
+		if (hdr->length > CTDB_BULK_REPLY_SIZE) {
+			return CTDB_QUEUE_CLASS_BULK;
+		}
+		return CTDB_QUEUE_CLASS_NORMAL;
+	}
+
+	return CTDB_QUEUE_CLASS_NORMAL;
+}
+
 static void queue_process(struct ctdb_queue *queue);
 
 static void queue_process_event(struct tevent_context *ev, struct tevent_immediate *im,
@@ -90,6 +174,10 @@ static void queue_process(struct ctdb_queue *queue)
 	uint32_t pkt_size;
 	uint8_t *data;
 
+	if (queue->read_paused) {
+		return;
+	}
+
 	if (queue->buffer.length < sizeof(pkt_size)) {
 		return;
 	}
@@ -220,13 +308,189 @@ static void queue_dead(struct event_context *ev, struct tevent_immediate *im,
 }
 
 
+/*
+  close the socket of a queue and report it dead from an event
+ */
+static void queue_set_dead(struct ctdb_queue *queue)
+{
+	talloc_free(queue->fde);
+	queue->fde = NULL;
+	queue->fd = -1;
+	tevent_schedule_immediate(queue->im, queue->ctdb->ev,
+				  queue_dead, queue);
+}
+
+/*
+  the bytes that count against MaxQueueBytes. Control packets are
+  small and must get through, so they are not counted
+ */
+static uint64_t queue_limited_bytes(struct ctdb_queue *queue)
+{
+	return queue->out_queue_bytes -
+		queue->out[CTDB_QUEUE_CLASS_CONTROL].stats.queued_bytes;
+}
+
+/*
+  a connected limited queue holding more than MaxQueueBytes is
+  congested until it has drained to half of that. While any queue is
+  congested the daemon stops taking on requests from its clients
+ */
+static void queue_update_congestion(struct ctdb_queue *queue)
+{
+	struct ctdb_context *ctdb = queue->ctdb;
+	uint32_t max_bytes = ctdb->tunable.max_queue_bytes;
+	uint64_t bytes = queue_limited_bytes(queue);
+	bool congested;
+
+	if (!queue->limited || max_bytes == 0 || queue->fd == -1) {
+		congested = false;
+	} else if (queue->congested) {
+		congested = bytes > max_bytes / 2;
+	} else {
+		congested = bytes > max_bytes;
+	}
+
+	if (congested == queue->congested) {
+		return;
+	}
+	queue->congested = congested;
+
+	if (congested) {
+		DEBUG(DEBUG_INFO,("Queue %s holds %llu bytes, holding back "
+				  "client requests\n", queue->name,
+				  (unsigned long long)bytes));
+		ctdb->num_congested_queues++;
+		return;
+	}
+
+	ctdb->num_congested_queues--;
+	if (ctdb->num_congested_queues == 0 && ctdb->upcalls != NULL &&
+	    ctdb->upcalls->queues_drained != NULL) {
+		ctdb->upcalls->queues_drained(ctdb);
+	}
+}
+
+/*
+  take a packet off the queue
+ */
+static void queue_pkt_remove(struct ctdb_queue *queue,
+			     enum ctdb_queue_class cls,
+			     struct ctdb_queue_pkt *pkt)
+{
+	struct ctdb_queue_list *list = &queue->out[cls];
+
+	DLIST_REMOVE(list->out_queue, pkt);
+	list->stats.queued--;
+	list->stats.queued_bytes -= pkt->full_length;
+	queue->out_queue_length--;
+	queue->out_queue_bytes -= pkt->full_length;
+	if (queue->out_current == pkt) {
+		queue->out_current = NULL;
+	}
+	talloc_free(pkt);
+
+	if (queue->congested) {
+		queue_update_congestion(queue);
+	}
+}
+
+/*
+  a queued packet has been written completely
+ */
+static void queue_pkt_sent(struct ctdb_queue *queue,
+			   enum ctdb_queue_class cls,
+			   struct ctdb_queue_pkt *pkt)
+{
+	struct latency_counter *counter = &queue->out[cls].stats.wait;
+	double l = timeval_elapsed(&pkt->queued_time);
+
+	if (counter->num == 0 || l < counter->min) {
+		counter->min = l;
+	}
+	if (l > counter->max) {
+		counter->max = l;
+	}
+	counter->total += l;
+	counter->num++;
+
+	queue_pkt_remove(queue, cls, pkt);
+}
+
+/*
+  the bytes a class may write in one turn of the round robin
+ */
+static int64_t queue_quantum(struct ctdb_queue *queue, enum ctdb_queue_class cls)
+{
+	uint32_t weight;
+
+	if (cls == CTDB_QUEUE_CLASS_BULK) {
+		weight = queue->ctdb->tunable.queue_bulk_weight;
+	} else {
+		weight = queue->ctdb->tunable.queue_normal_weight;
+	}
+
+	return (int64_t)MAX(weight, 1) * QUEUE_BUFFER_SIZE;
+}
+
+/*
+  choose the next packet to write. A packet that has been partly
+  written is always finished first. Control packets have strict
+  priority. Normal and bulk packets take turns, a class writing up to
+  its weight in QUEUE_BUFFER_SIZE units per turn, so a large bulk
+  transfer gets its share without holding up calls for long. A class
+  with nothing to write does not keep the other one waiting
+ */
+static struct ctdb_queue_pkt *queue_next_pkt(struct ctdb_queue *queue,
+					     enum ctdb_queue_class *cls)
+{
+	enum ctdb_queue_class c, other;
+	struct ctdb_queue_pkt *pkt;
+
+	if (queue->out_current != NULL) {
+		*cls = queue->out_current_class;
+		return queue->out_current;
+	}
+
+	if (queue->out[CTDB_QUEUE_CLASS_CONTROL].out_queue != NULL) {
+		c = CTDB_QUEUE_CLASS_CONTROL;
+		goto found;
+	}
+
+	c = queue->rr_class;
+	other = (c == CTDB_QUEUE_CLASS_BULK) ?
+		CTDB_QUEUE_CLASS_NORMAL : CTDB_QUEUE_CLASS_BULK;
+
+	if (queue->out[c].out_queue != NULL && queue->out[c].credit > 0) {
+		goto found;
+	}
+
+	/* this turn is over */
+	if (queue->out[other].out_queue != NULL) {
+		c = other;
+	} else if (queue->out[c].out_queue == NULL) {
+		return NULL;
+	}
+	queue->rr_class = c;
+	queue->out[c].credit = queue_quantum(queue, c);
+
+found:
+	pkt = queue->out[c].out_queue;
+	queue->out[c].credit -= pkt->length;
+	queue->out_current = pkt;
+	queue->out_current_class = c;
+	*cls = c;
+	return pkt;
+}
+
 /*
   called when an incoming connection is writeable
 */
 static void queue_io_write(struct ctdb_queue *queue)
 {
-	while (queue->out_queue) {
-		struct ctdb_queue_pkt *pkt = queue->out_queue;
+	struct ctdb_queue_pkt *pkt;
+	enum ctdb_queue_class cls;
+
+	while ((pkt = queue_next_pkt(queue, &cls)) != NULL) {
 		ssize_t n;
 		if (queue->ctdb->flags & CTDB_FLAG_TORTURE) {
 			n = write(queue->fd, pkt->data, 1);
@@ -237,15 +501,9 @@ static void queue_io_write(struct ctdb_queue *queue)
 		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
 			if (pkt->length != pkt->full_length) {
 				/* partial packet sent - we have to drop it */
-				DLIST_REMOVE(queue->out_queue, pkt);
-				queue->out_queue_length--;
-				talloc_free(pkt);
+				queue_pkt_remove(queue, cls, pkt);
 			}
-			talloc_free(queue->fde);
-			queue->fde = NULL;
-			queue->fd = -1;
-			tevent_schedule_immediate(queue->im, queue->ctdb->ev,
-						  queue_dead, queue);
+			queue_set_dead(queue);
 			return;
 		}
 		if (n <= 0) return;
@@ -256,9 +514,7 @@ static void queue_io_write(struct ctdb_queue *queue)
 			return;
 		}
 
-		DLIST_REMOVE(queue->out_queue, pkt);
-		queue->out_queue_length--;
-		talloc_free(pkt);
+		queue_pkt_sent(queue, cls, pkt);
 	}
 
 	EVENT_FD_NOT_WRITEABLE(queue->fde);
@@ -280,13 +536,52 @@ static void queue_io_handler(struct event_context *ev, struct fd_event *fde,
 }
 
 
+/*
+  the queue holds more than twice MaxQueueBytes although client
+  requests have been held back, so the other end is not keeping up.
+  Drop everything queued and the connection, just as if the connection
+  had failed
+ */
+static void queue_overflow(struct ctdb_queue *queue)
+{
+	struct ctdb_queue_pkt *pkt;
+	int i;
+
+	DEBUG(DEBUG_ERR,("Queue %s holds %llu bytes, dropping %u packets\n",
+			 queue->name, (unsigned long long)queue->out_queue_bytes,
+			 queue->out_queue_length));
+
+	for (i=0; i<CTDB_QUEUE_NUM_CLASSES; i++) {
+		while ((pkt = queue->out[i].out_queue) != NULL) {
+			queue->out[i].stats.num_dropped++;
+			queue_pkt_remove(queue, i, pkt);
+		}
+	}
+
+	if (queue->fd != -1) {
+		queue_set_dead(queue);
+	}
+}
+
 /*
   queue a packet for sending
 */
 int ctdb_queue_send(struct ctdb_queue *queue, uint8_t *data, uint32_t length)
 {
+	return ctdb_queue_send_class(queue, data, length,
+				     CTDB_QUEUE_CLASS_NORMAL);
+}
+
+/*
+  queue a packet for sending in a given priority class
+*/
+int ctdb_queue_send_class(struct ctdb_queue *queue, uint8_t *data,
+			  uint32_t length, enum ctdb_queue_class cls)
+{
+	struct ctdb_queue_list *list = &queue->out[cls];
 	struct ctdb_queue_pkt *pkt;
 	uint32_t length2, full_length;
+	uint64_t max_bytes = queue->ctdb->tunable.max_queue_bytes;
 
 	if (queue->alignment) {
 		/* enforce the length and alignment rules from the tcp packet allocator */
@@ -301,18 +596,27 @@ int ctdb_queue_send(struct ctdb_queue *queue, uint8_t *data, uint32_t length)
 	}
 
 	full_length = length2;
+
+	list->stats.num_packets++;
+
+	if (queue->limited && max_bytes != 0 &&
+	    cls != CTDB_QUEUE_CLASS_CONTROL &&
+	    queue_limited_bytes(queue) > 0 &&
+	    queue_limited_bytes(queue) + full_length > 2 * max_bytes) {
+		list->stats.num_dropped++;
+		queue_overflow(queue);
+		/* as with a failed write, the dead node is handled via
+		   a separate event */
+		return 0;
+	}
 	
 	/* if the queue is empty then try an immediate write, avoiding
 	   queue overhead. This relies on non-blocking sockets */
-	if (queue->out_queue == NULL && queue->fd != -1 &&
+	if (queue->out_queue_length == 0 && queue->fd != -1 &&
 	    !(queue->ctdb->flags & CTDB_FLAG_TORTURE)) {
 		ssize_t n = write(queue->fd, data, length2);
 		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-			talloc_free(queue->fde);
-			queue->fde = NULL;
-			queue->fd = -1;
-			tevent_schedule_immediate(queue->im, queue->ctdb->ev,
-						  queue_dead, queue);
+			queue_set_dead(queue);
 			/* yes, we report success, as the dead node is 
 			   handled via a separate event */
 			return 0;
@@ -332,14 +636,34 @@ int ctdb_queue_send(struct ctdb_queue *queue, uint8_t *data, uint32_t length)
 
 	pkt->length = length2;
 	pkt->full_length = full_length;
+	pkt->queued_time = timeval_current();
 
-	if (queue->out_queue == NULL && queue->fd != -1) {
+	if (queue->out_queue_length == 0 && queue->fd != -1) {
 		EVENT_FD_WRITEABLE(queue->fde);
 	}
 
-	DLIST_ADD_END(queue->out_queue, pkt, NULL);
+	if (length2 != full_length) {
+		/* the rest must follow before anything else */
+		queue->out_current = pkt;
+		queue->out_current_class = cls;
+	}
+
+	DLIST_ADD_END(list->out_queue, pkt, NULL);
 
 	queue->out_queue_length++;
+	queue->out_queue_bytes += full_length;
+	list->stats.queued++;
+	list->stats.queued_bytes += full_length;
+	if (list->stats.queued > list->stats.max_queued) {
+		list->stats.max_queued = list->stats.queued;
+	}
+	if (list->stats.queued_bytes > list->stats.max_queued_bytes) {
+		list->stats.max_queued_bytes = list->stats.queued_bytes;
+	}
+
+	if (queue->limited && cls != CTDB_QUEUE_CLASS_CONTROL) {
+		queue_update_congestion(queue);
+	}
 
 	if (queue->ctdb->tunable.verbose_memory_names != 0) {
 		struct ctdb_req_header *hdr = (struct ctdb_req_header *)pkt->data;
@@ -373,32 +697,86 @@ int ctdb_queue_send(struct ctdb_queue *queue, uint8_t *data, uint32_t length)
  */
 int ctdb_queue_set_fd(struct ctdb_queue *queue, int fd)
 {
+	struct ctdb_queue_pkt *pkt = queue->out_current;
+
+	if (pkt != NULL && pkt->length != pkt->full_length) {
+		/* the rest of a partly written packet makes no sense
+		   on a new connection */
+		queue_pkt_remove(queue, queue->out_current_class, pkt);
+	}
+	queue->out_current = NULL;
+
 	queue->fd = fd;
 	talloc_free(queue->fde);
 	queue->fde = NULL;
 
 	if (fd != -1) {
-		queue->fde = event_add_fd(queue->ctdb->ev, queue, fd, EVENT_FD_READ,
+		queue->fde = event_add_fd(queue->ctdb->ev, queue, fd,
+					  queue->read_paused ? 0 : EVENT_FD_READ,
 					  queue_io_handler, queue);
 		if (queue->fde == NULL) {
 			return -1;
 		}
 		tevent_fd_set_auto_close(queue->fde);
 
-		if (queue->out_queue) {
+		if (queue->out_queue_length > 0) {
 			EVENT_FD_WRITEABLE(queue->fde);		
 		}
 	}
 
+	queue_update_congestion(queue);
+
 	return 0;
 }
 
+/*
+  make MaxQueueBytes apply to a queue. This is only used for the
+  queues to other nodes
+ */
+void ctdb_queue_set_limited(struct ctdb_queue *queue)
+{
+	queue->limited = true;
+	queue_update_congestion(queue);
+}
+
+/*
+  stop or restart reading from the queue. While reading is paused no
+  more data is taken off the socket and packets that have already been
+  read stay in the buffer, so the sender is throttled by the socket
+  buffer filling up. Sending is not affected
+ */
+void ctdb_queue_pause_read(struct ctdb_queue *queue, bool paused)
+{
+	if (queue->read_paused == paused) {
+		return;
+	}
+	queue->read_paused = paused;
+
+	if (queue->fde != NULL) {
+		if (paused) {
+			EVENT_FD_NOT_READABLE(queue->fde);
+		} else {
+			EVENT_FD_READABLE(queue->fde);
+		}
+	}
+
+	if (!paused && queue->fd != -1 && queue->buffer.length > 0) {
+		/* pick up where queue_process() stopped */
+		tevent_schedule_immediate(queue->im, queue->ctdb->ev,
+					  queue_process_event, queue);
+	}
+}
+
 /* If someone sets up this pointer, they want to know if the queue is freed */
 static int queue_destructor(struct ctdb_queue *queue)
 {
 	TALLOC_FREE(queue->buffer.data);
 	queue->buffer.length = 0;
 	queue->buffer.size = 0;
+	if (queue->congested) {
+		queue->limited = false;
+		queue_update_congestion(queue);
+	}
 	if (queue->destroyed != NULL)
 		*queue->destroyed = true;
 	return 0;
@@ -427,6 +805,7 @@ struct ctdb_queue *ctdb_queue_setup(struct ctdb_context *ctdb,
 
 	queue->ctdb = ctdb;
 	queue->fd = fd;
+	queue->rr_class = CTDB_QUEUE_CLASS_NORMAL;
 	queue->alignment = alignment;
 	queue->private_data = private_data;
 	queue->callback = callback;
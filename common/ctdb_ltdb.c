@@ -69,57 +69,153 @@ static void ltdb_initial_header(struct ctdb_db_context *ctdb_db,
 }
 
 
+struct ctdb_ltdb_parse_state {
+	ctdb_ltdb_parser_fn parser;
+	void *private_data;
+};
+
+static int ctdb_ltdb_parser(TDB_DATA key, TDB_DATA rec, void *private_data)
+{
+	struct ctdb_ltdb_parse_state *state = private_data;
+	struct ctdb_ltdb_header header;
+	TDB_DATA data;
+
+	if (rec.dsize < sizeof(header)) {
+		return -1;
+	}
+
+	/* the header is not necessarily aligned in the mmap */
+	memcpy(&header, rec.dptr, sizeof(header));
+	data.dptr = rec.dptr + sizeof(header);
+	data.dsize = rec.dsize - sizeof(header);
+
+	return state->parser(&header, data, state->private_data);
+}
+
 /*
-  fetch a record from the ltdb, separating out the header information
-  and returning the body of the record. A valid (initial) header is
-  returned if the record is not present
+  look at a record in place, without copying it out of the ltdb.
+  The data passed to the parser is only valid during the call.
+  Returns -1 if the record does not exist or is not a ctdb record,
+  otherwise the return value of the parser
 */
-int ctdb_ltdb_fetch(struct ctdb_db_context *ctdb_db, 
-		    TDB_DATA key, struct ctdb_ltdb_header *header, 
-		    TALLOC_CTX *mem_ctx, TDB_DATA *data)
+int ctdb_ltdb_parse(struct ctdb_db_context *ctdb_db, TDB_DATA key,
+		    ctdb_ltdb_parser_fn parser, void *private_data)
 {
-	TDB_DATA rec;
-	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_ltdb_parse_state state;
 
-	rec = tdb_fetch(ctdb_db->ltdb->tdb, key);
-	if (rec.dsize < sizeof(*header)) {
-		TDB_DATA d2;
-		/* return an initial header */
-		if (rec.dptr) free(rec.dptr);
-		if (ctdb->vnn_map == NULL) {
-			/* called from the client */
-			ZERO_STRUCTP(data);
-			header->dmaster = (uint32_t)-1;
-			return -1;
-		}
-		ltdb_initial_header(ctdb_db, key, header);
-		ZERO_STRUCT(d2);
-		if (data) {
-			*data = d2;
-		}
-		if (ctdb_db->persistent || header->dmaster == ctdb_db->ctdb->pnn) {
-			ctdb_ltdb_store(ctdb_db, key, header, d2);
-		}
+	state.parser = parser;
+	state.private_data = private_data;
+
+	return tdb_parse_record(ctdb_db->ltdb->tdb, key,
+				ctdb_ltdb_parser, &state);
+}
+
+struct ctdb_ltdb_fetch_state {
+	struct ctdb_ltdb_header *header;
+	TALLOC_CTX *mem_ctx;
+	TDB_DATA *data;
+	bool local_only;
+	uint32_t pnn;
+	bool no_memory;
+};
+
+static int ctdb_ltdb_fetch_parser(struct ctdb_ltdb_header *header,
+				  TDB_DATA data, void *private_data)
+{
+	struct ctdb_ltdb_fetch_state *state = private_data;
+
+	*state->header = *header;
+
+	if (state->data == NULL) {
 		return 0;
 	}
 
-	*header = *(struct ctdb_ltdb_header *)rec.dptr;
+	/* only the header is needed to redirect a call for a record
+	   held by another node */
+	if (state->local_only &&
+	    header->dmaster != state->pnn &&
+	    !(header->flags & CTDB_REC_RO_FLAGS)) {
+		ZERO_STRUCTP(state->data);
+		return 0;
+	}
 
-	if (data) {
-		data->dsize = rec.dsize - sizeof(struct ctdb_ltdb_header);
-		data->dptr = talloc_memdup(mem_ctx, 
-					   sizeof(struct ctdb_ltdb_header)+rec.dptr,
-					   data->dsize);
+	state->data->dsize = data.dsize;
+	state->data->dptr = talloc_memdup(state->mem_ctx, data.dptr, data.dsize);
+	if (state->data->dptr == NULL) {
+		state->no_memory = true;
+		return -1;
 	}
 
-	free(rec.dptr);
+	return 0;
+}
+
+static int ltdb_fetch(struct ctdb_db_context *ctdb_db,
+		      TDB_DATA key, struct ctdb_ltdb_header *header,
+		      TALLOC_CTX *mem_ctx, TDB_DATA *data, bool local_only)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_ltdb_fetch_state state;
+	int ret;
+
+	state.header = header;
+	state.mem_ctx = mem_ctx;
+	state.data = data;
+	state.local_only = local_only;
+	state.pnn = ctdb->pnn;
+	state.no_memory = false;
+
 	if (data) {
+		ZERO_STRUCTP(data);
+	}
+
+	ret = ctdb_ltdb_parse(ctdb_db, key, ctdb_ltdb_fetch_parser, &state);
+	if (ret == 0) {
+		return 0;
+	}
+	if (state.no_memory) {
 		CTDB_NO_MEMORY(ctdb, data->dptr);
 	}
 
+	/* return an initial header */
+	if (ctdb->vnn_map == NULL) {
+		/* called from the client */
+		header->dmaster = (uint32_t)-1;
+		return -1;
+	}
+	ltdb_initial_header(ctdb_db, key, header);
+	if (ctdb_db->persistent || header->dmaster == ctdb_db->ctdb->pnn) {
+		TDB_DATA d2;
+
+		ZERO_STRUCT(d2);
+		ctdb_ltdb_store(ctdb_db, key, header, d2);
+	}
 	return 0;
 }
 
+/*
+  fetch a record from the ltdb, separating out the header information
+  and returning the body of the record. A valid (initial) header is
+  returned if the record is not present
+*/
+int ctdb_ltdb_fetch(struct ctdb_db_context *ctdb_db, 
+		    TDB_DATA key, struct ctdb_ltdb_header *header, 
+		    TALLOC_CTX *mem_ctx, TDB_DATA *data)
+{
+	return ltdb_fetch(ctdb_db, key, header, mem_ctx, data, false);
+}
+
+/*
+  like ctdb_ltdb_fetch, but only return the body of the record if
+  this node holds it: if it is the dmaster or the record has read-only
+  state.  Otherwise data is {NULL, 0}
+*/
+int ctdb_ltdb_fetch_local(struct ctdb_db_context *ctdb_db,
+			  TDB_DATA key, struct ctdb_ltdb_header *header,
+			  TALLOC_CTX *mem_ctx, TDB_DATA *data)
+{
+	return ltdb_fetch(ctdb_db, key, header, mem_ctx, data, true);
+}
+
 /*
   fetch a record from the ltdb, separating out the header information
   and returning the body of the record.
@@ -130,27 +226,25 @@ int ctdb_ltdb_fetch_with_header(struct ctdb_db_context *ctdb_db,
 		    TDB_DATA key, struct ctdb_ltdb_header *header, 
 		    TALLOC_CTX *mem_ctx, TDB_DATA *data)
 {
-	TDB_DATA rec;
+	struct ctdb_ltdb_fetch_state state;
+	int ret;
 
-	rec = tdb_fetch(ctdb_db->ltdb->tdb, key);
-	if (rec.dsize < sizeof(*header)) {
-		free(rec.dptr);
+	state.header = header;
+	state.mem_ctx = mem_ctx;
+	state.data = data;
+	state.local_only = false;
+	state.no_memory = false;
 
+	data->dsize = 0;
+	data->dptr = NULL;
+
+	ret = ctdb_ltdb_parse(ctdb_db, key, ctdb_ltdb_fetch_parser, &state);
+	if (ret != 0) {
 		data->dsize = 0;
 		data->dptr = NULL;
 		return -1;
 	}
 
-	*header = *(struct ctdb_ltdb_header *)rec.dptr;
-	if (data) {
-		data->dsize = rec.dsize - sizeof(struct ctdb_ltdb_header);
-		data->dptr = talloc_memdup(mem_ctx, 
-					   sizeof(struct ctdb_ltdb_header)+rec.dptr,
-					   data->dsize);
-	}
-
-	free(rec.dptr);
-
 	return 0;
 }
 
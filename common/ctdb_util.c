@@ -135,53 +135,211 @@ uint32_t ctdb_hash(const TDB_DATA *key)
 }
 
 /*
-  a type checking varient of idr_find
+  Request ids index a flat table of slots. The table has 2^bits slots,
+  the low bits of an id are the slot and the bits above are a
+  generation, which is bumped whenever the slot is freed. A late reply
+  to a request that has gone away finds a different id in the slot and
+  is ignored, and one that finds a slot of another type is refused.
+
+  Free slots are reused oldest first, so an id only comes round again
+  after the whole table has been through all the generations. A small
+  table leaves more bits for the generation.
  */
-static void *_idr_find_type(struct idr_context *idp, int id, const char *type, const char *location)
+#define CTDB_REQID_INITIAL_BITS		10
+#define CTDB_REQID_MAX_BITS		20
+#define CTDB_REQID_NONE			((uint32_t)-1)
+
+struct ctdb_reqid_slot {
+	void *ptr;
+	const char *type;
+	uint32_t reqid;
+	uint32_t next_free;
+};
+
+struct ctdb_reqid_table {
+	struct ctdb_reqid_slot *slots;
+	uint32_t bits, size;
+	uint32_t free_head, free_tail;
+};
+
+static void ctdb_reqid_free_append(struct ctdb_reqid_table *t, uint32_t i)
+{
+	t->slots[i].next_free = CTDB_REQID_NONE;
+	if (t->free_tail == CTDB_REQID_NONE) {
+		t->free_head = i;
+	} else {
+		t->slots[t->free_tail].next_free = i;
+	}
+	t->free_tail = i;
+}
+
+/*
+  double the table, up to 2^CTDB_REQID_MAX_BITS slots
+
+  The slot of an id becomes one bit wider, so old slot i is split with
+  new slot i + half. Of its id and the next generation of it, the one
+  with the new bit clear stays in slot i and the other goes to the new
+  slot, along with the request if the id is in use. Both have never
+  been handed out before.
+ */
+static bool ctdb_reqid_grow(struct ctdb_reqid_table *t)
+{
+	struct ctdb_reqid_slot *slots;
+	uint32_t i, half, r, lo, hi;
+
+	if (t->bits >= CTDB_REQID_MAX_BITS) {
+		return false;
+	}
+
+	half = t->size;
+	slots = talloc_realloc(t, t->slots, struct ctdb_reqid_slot, half * 2);
+	if (slots == NULL) {
+		return false;
+	}
+	t->slots = slots;
+	t->bits++;
+	t->size = half * 2;
+
+	for (i=0; i<half; i++) {
+		r = slots[i].reqid;
+		if (r & half) {
+			hi = r;
+			lo = r + half;
+		} else {
+			lo = r;
+			hi = r + half;
+		}
+
+		slots[i+half].ptr  = NULL;
+		slots[i+half].type = NULL;
+
+		if (slots[i].ptr != NULL && r == hi) {
+			slots[i+half].ptr  = slots[i].ptr;
+			slots[i+half].type = slots[i].type;
+			slots[i+half].reqid = hi;
+			slots[i+half].next_free = CTDB_REQID_NONE;
+			slots[i].ptr   = NULL;
+			slots[i].type  = NULL;
+			slots[i].reqid = lo;
+			ctdb_reqid_free_append(t, i);
+		} else {
+			slots[i].reqid = lo;
+			slots[i+half].reqid = hi;
+			ctdb_reqid_free_append(t, i+half);
+		}
+	}
+
+	return true;
+}
+
+struct ctdb_reqid_table *ctdb_reqid_init(TALLOC_CTX *mem_ctx)
+{
+	struct ctdb_reqid_table *t;
+	uint32_t i;
+
+	t = talloc_zero(mem_ctx, struct ctdb_reqid_table);
+	if (t == NULL) {
+		return NULL;
+	}
+	t->free_head = CTDB_REQID_NONE;
+	t->free_tail = CTDB_REQID_NONE;
+
+	t->bits = CTDB_REQID_INITIAL_BITS;
+	t->size = 1U << t->bits;
+	t->slots = talloc_array(t, struct ctdb_reqid_slot, t->size);
+	if (t->slots == NULL) {
+		talloc_free(t);
+		return NULL;
+	}
+
+	for (i=0; i<t->size; i++) {
+		t->slots[i].ptr   = NULL;
+		t->slots[i].type  = NULL;
+		t->slots[i].reqid = i;
+		ctdb_reqid_free_append(t, i);
+	}
+
+	return t;
+}
+
+/*
+  the slot of a request id that is in use, or NULL
+ */
+static struct ctdb_reqid_slot *ctdb_reqid_slot(struct ctdb_reqid_table *t,
+					       uint32_t reqid)
 {
-	void *p = idr_find(idp, id);
-	if (p && talloc_check_name(p, type) == NULL) {
-		DEBUG(DEBUG_ERR,("%s idr_find_type expected type %s  but got %s\n",
-			 location, type, talloc_get_name(p)));
+	struct ctdb_reqid_slot *s = &t->slots[reqid & (t->size - 1)];
+
+	if (s->reqid != reqid || s->ptr == NULL) {
 		return NULL;
 	}
-	return p;
+	return s;
 }
 
 uint32_t ctdb_reqid_new(struct ctdb_context *ctdb, void *state)
 {
-	int id = idr_get_new_above(ctdb->idr, state, ctdb->lastid+1, INT_MAX);
-	if (id < 0) {
-		DEBUG(DEBUG_DEBUG, ("Reqid wrap!\n"));
-		id = idr_get_new(ctdb->idr, state, INT_MAX);
+	struct ctdb_reqid_table *t = ctdb->reqids;
+	struct ctdb_reqid_slot *s;
+
+	if (t->free_head == CTDB_REQID_NONE && !ctdb_reqid_grow(t)) {
+		DEBUG(DEBUG_ERR, ("Out of request ids, %u requests in flight\n",
+				  t->size));
+		return CTDB_BAD_REQID;
+	}
+
+	s = &t->slots[t->free_head];
+	t->free_head = s->next_free;
+	if (t->free_head == CTDB_REQID_NONE) {
+		t->free_tail = CTDB_REQID_NONE;
 	}
-	ctdb->lastid = id;
-	return id;
+
+	if (s->reqid == CTDB_BAD_REQID) {
+		s->reqid += t->size;
+	}
+
+	s->ptr       = state;
+	s->type      = talloc_get_name(state);
+	s->next_free = CTDB_REQID_NONE;
+	return s->reqid;
 }
 
 void *_ctdb_reqid_find(struct ctdb_context *ctdb, uint32_t reqid, const char *type, const char *location)
 {
-	void *p;
+	struct ctdb_reqid_slot *s;
 
-	p = _idr_find_type(ctdb->idr, reqid, type, location);
-	if (p == NULL) {
-		DEBUG(DEBUG_WARNING, ("Could not find idr:%u\n",reqid));
+	s = ctdb_reqid_slot(ctdb->reqids, reqid);
+	if (s == NULL) {
+		DEBUG(DEBUG_WARNING, ("Could not find reqid:%u\n",reqid));
+		return NULL;
+	}
+
+	if (s->type != type && strcmp(s->type, type) != 0) {
+		DEBUG(DEBUG_ERR,("%s reqid_find expected type %s  but got %s\n",
+			 location, type, s->type));
+		return NULL;
 	}
 
-	return p;
+	return s->ptr;
 }
 
 
 void ctdb_reqid_remove(struct ctdb_context *ctdb, uint32_t reqid)
 {
-	int ret;
+	struct ctdb_reqid_table *t = ctdb->reqids;
+	struct ctdb_reqid_slot *s;
 
-	ret = idr_remove(ctdb->idr, reqid);
-	if (ret != 0) {
-		DEBUG(DEBUG_ERR, ("Removing idr that does not exist\n"));
+	s = ctdb_reqid_slot(t, reqid);
+	if (s == NULL) {
+		DEBUG(DEBUG_ERR, ("Removing reqid that does not exist\n"));
+		return;
 	}
-}
 
+	s->ptr    = NULL;
+	s->type   = NULL;
+	s->reqid += t->size;
+
+	ctdb_reqid_free_append(t, s - t->slots);
+}
 
 /*
   form a ctdb_rec_data record from a key/data pair
@@ -0,0 +1,345 @@
+/*
+   a talloc based hash index keyed by tdb keys
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "../include/ctdb_private.h"
+#include "key_index.h"
+
+#define KEY_INDEX_MIN_SIZE	16
+#define KEY_INDEX_MIN_SLAB	256
+
+/*
+  a slot is empty when data is NULL. The key bytes live in the slab
+  at keyofs.
+ */
+struct key_index_slot {
+	void *data;
+	uint32_t hash;
+	uint32_t keylen;
+	uint32_t keyofs;
+};
+
+struct key_index {
+	struct key_index_slot *slots;
+	uint32_t size;		/* power of 2, 0 once the index is being freed */
+	uint32_t count;
+	uint8_t *slab;
+	uint32_t slab_size;
+	uint32_t slab_used;
+	uint32_t slab_dead;	/* bytes belonging to removed keys */
+};
+
+/*
+  children of the index may try to remove themselves from it while it
+  is being freed, so make sure they find it empty
+ */
+static int key_index_destructor(struct key_index *index)
+{
+	index->size  = 0;
+	index->count = 0;
+	return 0;
+}
+
+struct key_index *key_index_create(TALLOC_CTX *mem_ctx)
+{
+	struct key_index *index;
+
+	index = talloc_zero(mem_ctx, struct key_index);
+	if (index == NULL) {
+		return NULL;
+	}
+
+	index->slots = talloc_zero_array(index, struct key_index_slot,
+					 KEY_INDEX_MIN_SIZE);
+	if (index->slots == NULL) {
+		talloc_free(index);
+		return NULL;
+	}
+	index->size = KEY_INDEX_MIN_SIZE;
+
+	talloc_set_destructor(index, key_index_destructor);
+
+	return index;
+}
+
+/*
+  find the slot holding key, or the empty slot where it would go.
+  Returns true if the key was found
+ */
+static bool key_index_find(struct key_index *index, uint32_t hash,
+			   TDB_DATA key, uint32_t *pos)
+{
+	uint32_t mask = index->size - 1;
+	uint32_t i = hash & mask;
+
+	while (1) {
+		struct key_index_slot *s = &index->slots[i];
+
+		if (s->data == NULL) {
+			*pos = i;
+			return false;
+		}
+		if (s->hash == hash && s->keylen == key.dsize &&
+		    memcmp(index->slab + s->keyofs, key.dptr, key.dsize) == 0) {
+			*pos = i;
+			return true;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+/*
+  double the number of slots. Entries are placed by their stored hash
+  so no keys need to be compared
+ */
+static int key_index_grow(struct key_index *index)
+{
+	struct key_index_slot *slots;
+	uint32_t size = index->size * 2;
+	uint32_t mask = size - 1;
+	uint32_t i;
+
+	slots = talloc_zero_array(index, struct key_index_slot, size);
+	if (slots == NULL) {
+		return -1;
+	}
+
+	for (i=0; i<index->size; i++) {
+		struct key_index_slot *s = &index->slots[i];
+		uint32_t j;
+
+		if (s->data == NULL) {
+			continue;
+		}
+		j = s->hash & mask;
+		while (slots[j].data != NULL) {
+			j = (j + 1) & mask;
+		}
+		slots[j] = *s;
+	}
+
+	talloc_free(index->slots);
+	index->slots = slots;
+	index->size  = size;
+
+	return 0;
+}
+
+/*
+  make room for len more bytes in the slab, either by squeezing out
+  the keys of removed entries or by growing it
+ */
+static int key_index_slab_reserve(struct key_index *index, uint32_t len)
+{
+	uint32_t live = index->slab_used - index->slab_dead;
+	uint32_t size;
+	uint8_t *slab;
+	uint32_t i;
+
+	if (index->slab_used + len <= index->slab_size) {
+		return 0;
+	}
+
+	size = MAX(index->slab_size, KEY_INDEX_MIN_SLAB);
+	while (size < live + len || size < 2 * live) {
+		size *= 2;
+	}
+
+	if (index->slab_dead == 0 && size > index->slab_size) {
+		slab = talloc_realloc(index, index->slab, uint8_t, size);
+		if (slab == NULL) {
+			return -1;
+		}
+		index->slab = slab;
+		index->slab_size = size;
+		return 0;
+	}
+
+	slab = talloc_array(index, uint8_t, size);
+	if (slab == NULL) {
+		return -1;
+	}
+
+	live = 0;
+	for (i=0; i<index->size; i++) {
+		struct key_index_slot *s = &index->slots[i];
+
+		if (s->data == NULL) {
+			continue;
+		}
+		memcpy(slab + live, index->slab + s->keyofs, s->keylen);
+		s->keyofs = live;
+		live += s->keylen;
+	}
+
+	talloc_free(index->slab);
+	index->slab = slab;
+	index->slab_size = size;
+	index->slab_used = live;
+	index->slab_dead = 0;
+
+	return 0;
+}
+
+void *key_index_lookup(struct key_index *index, TDB_DATA key)
+{
+	/* most indexes are empty most of the time, don't hash for them */
+	if (index->count == 0) {
+		return NULL;
+	}
+	return key_index_lookup_hash(index, ctdb_hash(&key), key);
+}
+
+void *key_index_lookup_hash(struct key_index *index, uint32_t hash,
+			    TDB_DATA key)
+{
+	uint32_t pos;
+
+	if (index->count == 0) {
+		return NULL;
+	}
+
+	if (!key_index_find(index, hash, key, &pos)) {
+		return NULL;
+	}
+	return index->slots[pos].data;
+}
+
+int key_index_insert(struct key_index *index, TDB_DATA key, void *data)
+{
+	return key_index_insert_hash(index, ctdb_hash(&key), key, data);
+}
+
+int key_index_insert_hash(struct key_index *index, uint32_t hash,
+			  TDB_DATA key, void *data)
+{
+	struct key_index_slot *s;
+	uint32_t pos;
+
+	if (index->size == 0 || data == NULL) {
+		return -1;
+	}
+
+	if (key_index_find(index, hash, key, &pos)) {
+		index->slots[pos].data = data;
+		return 0;
+	}
+
+	if (key_index_slab_reserve(index, key.dsize) != 0) {
+		return -1;
+	}
+
+	/* keep the load factor at or below 3/4 */
+	if ((index->count + 1) * 4 > index->size * 3) {
+		if (key_index_grow(index) != 0) {
+			return -1;
+		}
+		key_index_find(index, hash, key, &pos);
+	}
+
+	s = &index->slots[pos];
+	s->data   = data;
+	s->hash   = hash;
+	s->keylen = key.dsize;
+	s->keyofs = index->slab_used;
+	memcpy(index->slab + s->keyofs, key.dptr, key.dsize);
+
+	index->slab_used += key.dsize;
+	index->count++;
+
+	return 0;
+}
+
+void *key_index_remove(struct key_index *index, TDB_DATA key)
+{
+	if (index->count == 0) {
+		return NULL;
+	}
+	return key_index_remove_hash(index, ctdb_hash(&key), key);
+}
+
+void *key_index_remove_hash(struct key_index *index, uint32_t hash,
+			    TDB_DATA key)
+{
+	uint32_t mask = index->size - 1;
+	uint32_t i, j;
+	void *data;
+
+	if (index->count == 0) {
+		return NULL;
+	}
+
+	if (!key_index_find(index, hash, key, &i)) {
+		return NULL;
+	}
+
+	data = index->slots[i].data;
+	index->slab_dead += index->slots[i].keylen;
+	index->count--;
+
+	/* shift back any following entries that would no longer be
+	   reachable from their home slot once this one is empty */
+	j = i;
+	while (1) {
+		uint32_t home;
+
+		j = (j + 1) & mask;
+		if (index->slots[j].data == NULL) {
+			break;
+		}
+		home = index->slots[j].hash & mask;
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && (home <= i && home > j))) {
+			index->slots[i] = index->slots[j];
+			i = j;
+		}
+	}
+	index->slots[i].data = NULL;
+
+	if (index->count == 0) {
+		index->slab_used = 0;
+		index->slab_dead = 0;
+	}
+
+	return data;
+}
+
+uint32_t key_index_count(struct key_index *index)
+{
+	return index->count;
+}
+
+int key_index_traverse(struct key_index *index,
+		       int (*callback)(void *param, void *data), void *param)
+{
+	uint32_t i;
+
+	for (i=0; i<index->size; i++) {
+		void *data = index->slots[i].data;
+		int ret;
+
+		if (data == NULL) {
+			continue;
+		}
+		ret = callback(param, data);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
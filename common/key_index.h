@@ -0,0 +1,67 @@
+/*
+   a talloc based hash index keyed by tdb keys
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _KEY_INDEX_H
+#define _KEY_INDEX_H
+
+/*
+  An open addressing hash table mapping record keys to data pointers.
+  The key bytes are copied into one slab owned by the index, so entries
+  cost no allocations of their own and lookups never allocate.
+
+  The index does not own the data it points to. Data that should go
+  away with the index can simply be allocated as a talloc child of it.
+*/
+struct key_index;
+
+/* Create an empty index */
+struct key_index *key_index_create(TALLOC_CTX *mem_ctx);
+
+/* Return the data stored for key, or NULL */
+void *key_index_lookup(struct key_index *index, TDB_DATA key);
+
+/* Store data (which must not be NULL) for key, replacing any previous
+   entry. Returns 0 on success, -1 if out of memory */
+int key_index_insert(struct key_index *index, TDB_DATA key, void *data);
+
+/* Remove the entry for key and return its data, or NULL if there
+   was none */
+void *key_index_remove(struct key_index *index, TDB_DATA key);
+
+/* The same, for callers that already have ctdb_hash(&key) at hand.
+   Passing any other hash gives undefined results */
+void *key_index_lookup_hash(struct key_index *index, uint32_t hash,
+			    TDB_DATA key);
+int key_index_insert_hash(struct key_index *index, uint32_t hash,
+			  TDB_DATA key, void *data);
+void *key_index_remove_hash(struct key_index *index, uint32_t hash,
+			    TDB_DATA key);
+
+/* Number of entries in the index */
+uint32_t key_index_count(struct key_index *index);
+
+/* Call callback on the data of every entry.
+   returns 0 if the traverse completed
+   !0 if the traverse was aborted
+
+   If the callback returns !0 the traverse will be aborted.
+   The callback must not add or remove entries.
+*/
+int key_index_traverse(struct key_index *index,
+		       int (*callback)(void *param, void *data), void *param);
+
+#endif /* _KEY_INDEX_H */
@@ -189,7 +189,8 @@ static void ctdb_ibw_restart(struct ctdb_node *node)
 /*
  * transport packet allocator - allows transport to control memory for packets
  */
-static void *ctdb_ibw_allocate_pkt(TALLOC_CTX *mem_ctx, size_t size)
+static void *ctdb_ibw_allocate_pkt(struct ctdb_context *ctdb,
+				   TALLOC_CTX *mem_ctx, size_t size)
 {
 	/* TODO: use ibw_alloc_send_buf instead... */
 	return talloc_size(mem_ctx, size);
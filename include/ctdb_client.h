@@ -169,6 +169,16 @@ struct ctdb_record_handle *ctdb_fetch_lock(struct ctdb_db_context *ctdb_db, TALL
 
 struct ctdb_record_handle *ctdb_fetch_readonly_lock(struct ctdb_db_context *ctdb_db, TALLOC_CTX *mem_ctx, TDB_DATA key, TDB_DATA *data, int read_only);
 
+/*
+   Migrate a batch of records to the local node with one request,
+   calling fn for each key as its record arrives
+*/
+typedef void (*ctdb_migrate_record_fn)(struct ctdb_db_context *ctdb_db,
+				       TDB_DATA key, void *private_data);
+int ctdb_migrate_records(struct ctdb_db_context *ctdb_db,
+			 uint32_t num_keys, TDB_DATA *keys,
+			 ctdb_migrate_record_fn fn, void *private_data);
+
 int ctdb_record_store(struct ctdb_record_handle *h, TDB_DATA data);
 
 int ctdb_fetch(struct ctdb_db_context *ctdb_db, TALLOC_CTX *mem_ctx,
@@ -597,7 +607,18 @@ struct ctdb_db_priority {
 int ctdb_ctrl_set_db_priority(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, struct ctdb_db_priority *db_prio);
 int ctdb_ctrl_get_db_priority(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, uint32_t db_id, uint32_t *priority);
 
+struct ctdb_db_ship_call {
+	uint32_t db_id;
+	uint32_t call_id;
+	uint32_t ship;
+};
+
+int ctdb_ctrl_set_db_ship_call(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, struct ctdb_db_ship_call *ship_call);
+
 int ctdb_ctrl_getstathistory(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, TALLOC_CTX *mem_ctx, struct ctdb_statistics_wire **stats);
+int ctdb_ctrl_getstathistory_range(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, TALLOC_CTX *mem_ctx, struct timeval start, struct timeval end, struct ctdb_statistics_wire **stats);
+int ctdb_ctrl_getclientstats(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, TALLOC_CTX *mem_ctx, struct ctdb_client_statistics_wire **stats);
+int ctdb_ctrl_getstreamstats(struct ctdb_context *ctdb, struct timeval timeout, uint32_t destnode, TALLOC_CTX *mem_ctx, struct ctdb_stream_statistics_wire **stats);
 
 
 
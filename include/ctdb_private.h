@@ -119,6 +119,8 @@ struct ctdb_tunable {
 	uint32_t hopcount_make_sticky;
 	uint32_t sticky_duration;
 	uint32_t sticky_pindown;
+	uint32_t sticky_pindown_min;
+	uint32_t sticky_pindown_max;
 	uint32_t no_ip_takeover;
 	uint32_t db_record_count_warn;
 	uint32_t db_record_size_warn;
@@ -126,6 +128,32 @@ struct ctdb_tunable {
 	uint32_t pulldb_preallocation_size;
 	uint32_t no_ip_host_on_all_disabled;
 	uint32_t samba3_hack;
+	uint32_t lock_processes_per_db;
+	uint32_t stat_history_depth;
+	uint32_t stat_rollup_depth;
+	uint32_t traverse_workers;
+	uint32_t database_hash_size_max;
+	uint32_t mutex_enabled;
+	uint32_t hot_keys;
+	uint32_t hot_keys_half_life;
+	uint32_t client_max_inflight;
+	uint32_t client_max_queued;
+	uint32_t client_quantum;
+	uint32_t worker_processes;
+	uint32_t recover_full_check_interval;
+	uint32_t reclock_lease_time;
+	uint32_t heartbeat_interval;
+	uint32_t dead_node_phi;
+	uint32_t heartbeat_min_stddev;
+	uint32_t dmaster_hint_cache_size;
+	uint32_t ship_call_migrate_count;
+	uint32_t tcp_streams;
+	uint32_t queue_normal_weight;
+	uint32_t queue_bulk_weight;
+	uint32_t max_queue_bytes;
+	uint32_t mem_pools;
+	uint32_t lock_processes_max;
+	uint32_t call_shards;
 };
 
 /*
@@ -135,6 +163,7 @@ struct ctdb_registered_call {
 	struct ctdb_registered_call *next, *prev;
 	uint32_t id;
 	ctdb_fn_t fn;
+	bool ship; /* run at the dmaster instead of migrating */
 };
 
 /*
@@ -166,6 +195,7 @@ typedef void (*ctdb_control_callback_fn_t)(struct ctdb_context *,
   structure describing a connected client in the daemon
  */
 struct ctdb_client {
+	struct ctdb_client *next, *prev; /* on ctdb->ready_clients */
 	struct ctdb_context *ctdb;
 	int fd;
 	struct ctdb_queue *queue;
@@ -175,6 +205,12 @@ struct ctdb_client {
 	uint32_t db_id;
 	uint32_t num_persistent_updates;
 	struct ctdb_client_notify_list *notify;
+
+	/* requests read from the client but not yet processed */
+	struct ctdb_client_request *requests, *requests_tail;
+	uint32_t num_inflight;
+	bool ready;
+	struct ctdb_client_statistics statistics;
 };
 
 struct ctdb_iface;
@@ -224,6 +260,14 @@ struct ctdb_node {
 	uint32_t dead_count;
 	uint32_t rx_cnt;
 	uint32_t tx_cnt;
+	struct timeval last_rx;
+	struct timeval last_tx;
+	struct ctdb_arrival_window *arrivals;
+
+	/* the node has gone quiet for long enough that it may be dead.
+	   Also tracked inside the recovery daemon, which is told about
+	   changes by the main daemon */
+	bool suspect;
 
 	/* used to track node capabilities, is only valid/tracked inside the
 	   recovery daemon.
@@ -253,9 +297,11 @@ struct ctdb_methods {
 	int (*add_node)(struct ctdb_node *); /* setup a new node */	
 	int (*connect_node)(struct ctdb_node *); /* connect to node */
 	int (*queue_pkt)(struct ctdb_node *, uint8_t *data, uint32_t length);
-	void *(*allocate_pkt)(TALLOC_CTX *mem_ctx, size_t );
+	void *(*allocate_pkt)(struct ctdb_context *, TALLOC_CTX *mem_ctx, size_t );
 	void (*shutdown)(struct ctdb_context *); /* shutdown transport */
 	void (*restart)(struct ctdb_node *); /* stop and restart the connection */
+	/* fill in the statistics of the streams to a node, returns how many */
+	uint32_t (*stream_statistics)(struct ctdb_node *, struct ctdb_stream_statistics *);
 };
 
 /*
@@ -270,6 +316,10 @@ struct ctdb_upcalls {
 
 	/* node_connected is called when a connection to a node is established */
 	void (*node_connected)(struct ctdb_node *);
+
+	/* queues_drained is called when no queue to another node holds
+	   more than MaxQueueBytes any more */
+	void (*queues_drained)(struct ctdb_context *);
 };
 
 /* list of message handlers - needs to be changed to a more efficient data
@@ -444,6 +494,18 @@ void ctdb_shutdown_sequence(struct ctdb_context *ctdb, int exit_code);
 #define CTDB_MONITORING_DISABLED	1
 
 #define NUM_DB_PRIORITIES 3
+
+/* ring buffer of statistics snapshots, the newest entry is at next-1 */
+struct ctdb_statistics_ring {
+	struct ctdb_statistics *stats;
+	uint32_t size;
+	uint32_t num;
+	uint32_t next;
+};
+
+/* one rollup entry in the statistics history covers this many seconds */
+#define STAT_ROLLUP_INTERVAL 60
+
 /* main state of the ctdb daemon */
 struct ctdb_context {
 	struct tevent_context *ev;
@@ -453,6 +515,7 @@ struct ctdb_context {
 	uint32_t recovery_mode;
 	TALLOC_CTX *tickle_update_context;
 	TALLOC_CTX *keepalive_ctx;
+	struct timeval keepalive_tick;
 	TALLOC_CTX *check_public_ifaces_ctx;
 	struct ctdb_tunable tunable;
 	enum ctdb_freeze_mode freeze_mode[NUM_DB_PRIORITIES+1];
@@ -465,19 +528,18 @@ struct ctdb_context {
 	const char *db_directory_persistent;
 	const char *db_directory_state;
 	struct tdb_wrap *db_persistent_health;
+	struct tdb_wrap *db_hash_sizes;
 	uint32_t db_persistent_startup_generation;
 	uint64_t db_persistent_check_errors;
 	uint64_t max_persistent_check_errors;
 	const char *transport;
 	char *recovery_lock_file;
-	int recovery_lock_fd;
 	uint32_t pnn; /* our own pnn */
 	uint32_t num_nodes;
 	uint32_t num_connected;
 	unsigned flags;
 	uint32_t capabilities;
-	struct idr_context *idr;
-	int lastid;
+	struct ctdb_reqid_table *reqids;
 	struct ctdb_node **nodes; /* array of nodes in the cluster - indexed by vnn */
 	struct ctdb_vnn *vnn; /* list of public ip addresses and interfaces */
 	struct ctdb_vnn *single_ip_vnn; /* a structure for the single ip */
@@ -492,8 +554,9 @@ struct ctdb_context {
 	struct ctdb_daemon_data daemon;
 	struct ctdb_statistics statistics;
 	struct ctdb_statistics statistics_current;
-#define MAX_STAT_HISTORY 100
-	struct ctdb_statistics statistics_history[MAX_STAT_HISTORY];
+	struct ctdb_statistics_ring statistics_history;
+	struct ctdb_statistics_ring statistics_rollup;
+	struct ctdb_statistics statistics_rollup_current;
 	struct ctdb_vnn_map *vnn_map;
 	uint32_t num_clients;
 	uint32_t recovery_master;
@@ -532,6 +595,27 @@ struct ctdb_context {
 	/* mapping from pid to ctdb_client * */
 	struct ctdb_client_pid_list *client_pids;
 
+	/* clients with queued requests that may be processed */
+	struct ctdb_client *ready_clients;
+	struct tevent_immediate *client_sched_im;
+
+	/* queues to other nodes holding more than MaxQueueBytes */
+	uint32_t num_congested_queues;
+
+	/* long lived processes running traverses and vacuuming */
+	struct ctdb_worker_pool *worker_pool;
+
+	/* processes running the record work of calls and migrations */
+	struct ctdb_call_shards *call_shards;
+	struct ctdb_call_shard_reply *call_shard_reply;
+
+	/* pools for packets and call state, see server/ctdb_mem_pools.c */
+	struct ctdb_mem_pools *mem_pools;
+
+	/* bumped whenever the state checked by the recovery daemons changes */
+	uint32_t state_generation;
+	struct tevent_immediate *state_change_im;
+
 	/* used in the recovery daemon to remember the ip allocation */
 	struct trbt_tree *ip_tree;
 
@@ -553,8 +637,9 @@ struct ctdb_context {
 	/* Used for locking record/db/alldb */
 	int lock_num_current;
 	int lock_num_pending;
-	struct lock_context *lock_current;
-	struct lock_context *lock_pending;
+	struct lock_context *lock_current; /* alldb locks only */
+	struct lock_context *lock_pending; /* alldb locks only */
+	struct ctdb_db_context *lock_next_db; /* round-robin scheduling */
 };
 
 struct ctdb_db_context {
@@ -578,8 +663,8 @@ struct ctdb_db_context {
 	int pending_requests;
 	struct revokechild_handle *revokechild_active;
 	struct ctdb_persistent_state *persistent_state;
-	struct trbt_tree *delete_queue;
-	struct trbt_tree *sticky_records; 
+	struct key_index *delete_queue;
+	struct key_index *sticky_records;
 	int (*ctdb_ltdb_store_fn)(struct ctdb_db_context *ctdb_db,
 				  TDB_DATA key,
 				  struct ctdb_ltdb_header *header,
@@ -588,9 +673,18 @@ struct ctdb_db_context {
 	/* used to track which records we are currently fetching
 	   so we can avoid sending duplicate fetch requests
 	*/
-	struct trbt_tree *deferred_fetch;
+	struct key_index *deferred_fetch;
 
 	struct ctdb_db_statistics statistics;
+	struct ctdb_hot_keys *hot_keys;
+	struct ctdb_dmaster_hints *dmaster_hints;
+	struct ctdb_ship_owner *ship_owners;
+
+	/* Used for locking record/db, scheduled per database */
+	int lock_num_current;
+	struct lock_context *lock_current;
+	struct lock_context *lock_pending;
+	struct lock_context **lock_index; /* indexed by key hash */
 };
 
 
@@ -671,6 +765,22 @@ struct ctdb_node_flag_change {
 	uint32_t old_flags;
 };
 
+/*
+  sent to all recovery daemons when the state of a node changes
+ */
+struct ctdb_state_change {
+	uint32_t pnn;
+	uint32_t generation;
+};
+
+/*
+  sent to the local recovery daemon when a node becomes suspect
+ */
+struct ctdb_node_suspicion {
+	uint32_t pnn;
+	uint32_t suspect;
+};
+
 /*
   struct for admin setting a ban
  */
@@ -725,15 +835,23 @@ uint32_t ctdb_hash(const TDB_DATA *key);
 uint32_t ctdb_hash_string(const char *str);
 void ctdb_request_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr);
 void ctdb_request_dmaster(struct ctdb_context *ctdb, struct ctdb_req_header *hdr);
+void ctdb_request_migrate(struct ctdb_context *ctdb, struct ctdb_req_header *hdr);
 void ctdb_request_message(struct ctdb_context *ctdb, struct ctdb_req_header *hdr);
 void ctdb_reply_dmaster(struct ctdb_context *ctdb, struct ctdb_req_header *hdr);
 void ctdb_reply_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr);
 void ctdb_reply_error(struct ctdb_context *ctdb, struct ctdb_req_header *hdr);
 
 uint32_t ctdb_lmaster(struct ctdb_context *ctdb, const TDB_DATA *key);
+typedef int (*ctdb_ltdb_parser_fn)(struct ctdb_ltdb_header *header,
+				   TDB_DATA data, void *private_data);
+int ctdb_ltdb_parse(struct ctdb_db_context *ctdb_db, TDB_DATA key,
+		    ctdb_ltdb_parser_fn parser, void *private_data);
 int ctdb_ltdb_fetch(struct ctdb_db_context *ctdb_db, 
 		    TDB_DATA key, struct ctdb_ltdb_header *header, 
 		    TALLOC_CTX *mem_ctx, TDB_DATA *data);
+int ctdb_ltdb_fetch_local(struct ctdb_db_context *ctdb_db,
+			  TDB_DATA key, struct ctdb_ltdb_header *header,
+			  TALLOC_CTX *mem_ctx, TDB_DATA *data);
 int ctdb_ltdb_store(struct ctdb_db_context *ctdb_db, TDB_DATA key, 
 		    struct ctdb_ltdb_header *header, TDB_DATA data);
 int ctdb_ltdb_delete(struct ctdb_db_context *ctdb_db, TDB_DATA key);
@@ -775,11 +893,32 @@ int ctdbd_call_recv(struct ctdb_call_state *state, struct ctdb_call *call);
 */
 int ctdb_queue_send(struct ctdb_queue *queue, uint8_t *data, uint32_t length);
 
+/*
+  queue a packet for sending in a given priority class
+*/
+int ctdb_queue_send_class(struct ctdb_queue *queue, uint8_t *data,
+			  uint32_t length, enum ctdb_queue_class cls);
+
+/*
+  the priority class a packet between nodes should be queued in
+*/
+enum ctdb_queue_class ctdb_queue_pkt_class(struct ctdb_req_header *hdr);
+
 /*
   setup the fd used by the queue
  */
 int ctdb_queue_set_fd(struct ctdb_queue *queue, int fd);
 
+/*
+  make MaxQueueBytes apply to a queue
+ */
+void ctdb_queue_set_limited(struct ctdb_queue *queue);
+
+/*
+  stop or restart reading packets from the queue
+ */
+void ctdb_queue_pause_read(struct ctdb_queue *queue, bool paused);
+
 /*
   setup a packet queue on a socket
  */
@@ -810,6 +949,9 @@ struct ctdb_req_header *_ctdb_transport_allocate(struct ctdb_context *ctdb,
 	(type *)_ctdb_transport_allocate(ctdb, mem_ctx, operation, length, sizeof(type), #type)
 
 int ctdb_queue_length(struct ctdb_queue *queue);
+bool ctdb_queue_is_connected(struct ctdb_queue *queue);
+void ctdb_queue_statistics(struct ctdb_queue *queue,
+			   struct ctdb_queue_class_statistics *stats);
 
 /*
   lock a record in the ltdb, given a key
@@ -858,6 +1000,10 @@ struct ctdb_call_state *ctdb_daemon_call_send_remote(struct ctdb_db_context *ctd
 						     struct ctdb_call *call, 
 						     struct ctdb_ltdb_header *header);
 
+int32_t ctdb_control_migrate_records(struct ctdb_context *ctdb,
+				     struct ctdb_req_control *c,
+				     TDB_DATA indata, bool *async_reply);
+
 int ctdb_call_local(struct ctdb_db_context *ctdb_db, struct ctdb_call *call,
 		    struct ctdb_ltdb_header *header, TALLOC_CTX *mem_ctx,
 		    TDB_DATA *data, bool updatetdb);
@@ -870,6 +1016,7 @@ int ctdb_socket_connect(struct ctdb_context *ctdb);
 void ctdb_client_read_cb(uint8_t *data, size_t cnt, void *args);
 
 #define CTDB_BAD_REQID ((uint32_t)-1)
+struct ctdb_reqid_table *ctdb_reqid_init(TALLOC_CTX *mem_ctx);
 uint32_t ctdb_reqid_new(struct ctdb_context *ctdb, void *state);
 void *_ctdb_reqid_find(struct ctdb_context *ctdb, uint32_t reqid, const char *type, const char *location);
 void ctdb_reqid_remove(struct ctdb_context *ctdb, uint32_t reqid);
@@ -1020,6 +1167,21 @@ int32_t ctdb_control_traverse_data(struct ctdb_context *ctdb, TDB_DATA data, TDB
 int32_t ctdb_control_traverse_kill(struct ctdb_context *ctdb, TDB_DATA indata, 
 				    TDB_DATA *outdata, uint32_t srcnode);
 
+/*
+  parallel traverse of a local tdb
+
+  the optional filter function is called in the traverse workers and
+  returns 1 to pass the record to the merge function, 0 to skip it or -1
+  to abort the traverse.  The merge function is called in the calling
+  process.
+ */
+typedef int (*ctdb_traverse_filter_fn)(TDB_DATA key, TDB_DATA data, void *private_data);
+typedef int (*ctdb_traverse_merge_fn)(struct ctdb_rec_data *rec, void *private_data);
+int ctdb_traverse_parallel(struct ctdb_context *ctdb, struct tdb_context *tdb,
+			   ctdb_traverse_filter_fn filter,
+			   ctdb_traverse_merge_fn merge,
+			   void *private_data);
+
 int ctdb_dispatch_message(struct ctdb_context *ctdb, uint64_t srvid, TDB_DATA data);
 bool ctdb_check_message_handler(struct ctdb_context *ctdb, uint64_t srvid);
 
@@ -1065,11 +1227,14 @@ void ctdb_start_monitoring(struct ctdb_context *ctdb);
 void ctdb_start_tcp_tickle_update(struct ctdb_context *ctdb);
 void ctdb_send_keepalive(struct ctdb_context *ctdb, uint32_t destnode);
 void ctdb_start_keepalive(struct ctdb_context *ctdb);
+void ctdb_node_packet_received(struct ctdb_node *node);
+void ctdb_node_reset_arrivals(struct ctdb_node *node);
 void ctdb_stop_keepalive(struct ctdb_context *ctdb);
 int32_t ctdb_run_eventscripts(struct ctdb_context *ctdb, struct ctdb_req_control *c, TDB_DATA data, bool *async_reply);
 
 
 void ctdb_daemon_cancel_controls(struct ctdb_context *ctdb, struct ctdb_node *node);
+void ctdb_daemon_queues_drained(struct ctdb_context *ctdb);
 void ctdb_call_resend_all(struct ctdb_context *ctdb);
 void ctdb_node_dead(struct ctdb_node *node);
 void ctdb_node_connected(struct ctdb_node *node);
@@ -1083,6 +1248,7 @@ pid_t ctdb_fork_no_free_ringbuffer(struct ctdb_context *ctdb);
 void ctdb_set_child_info(TALLOC_CTX *mem_ctx, const char *child_name_fmt, ...);
 bool ctdb_is_child_process(void);
 int ctdb_kill(struct ctdb_context *ctdb, pid_t pid, int signum);
+pid_t ctdb_waitpid(struct ctdb_context *ctdb, pid_t pid, int *status);
 
 int32_t ctdb_control_takeover_ip(struct ctdb_context *ctdb, 
 				 struct ctdb_req_control *c,
@@ -1246,7 +1412,20 @@ void ctdb_release_all_ips(struct ctdb_context *ctdb);
 void set_nonblocking(int fd);
 void set_close_on_exec(int fd);
 
-bool ctdb_recovery_lock(struct ctdb_context *ctdb, bool keep);
+typedef void (*cluster_mutex_handler_t)(char status, double latency,
+					void *private_data);
+typedef void (*cluster_mutex_lost_handler_t)(void *private_data);
+
+struct ctdb_cluster_mutex_handle;
+struct ctdb_cluster_mutex_handle *
+ctdb_cluster_mutex(TALLOC_CTX *mem_ctx,
+		   struct ctdb_context *ctdb,
+		   const char *argstring,
+		   int timeout,
+		   cluster_mutex_handler_t handler,
+		   void *private_data,
+		   cluster_mutex_lost_handler_t lost_handler,
+		   void *lost_data);
 
 int ctdb_set_recovery_lock_file(struct ctdb_context *ctdb, const char *file);
 
@@ -1262,6 +1441,7 @@ int32_t ctdb_control_del_public_address(struct ctdb_context *ctdb, TDB_DATA inda
 void ctdb_tunables_set_defaults(struct ctdb_context *ctdb);
 
 int32_t ctdb_control_modflags(struct ctdb_context *ctdb, TDB_DATA indata);
+void ctdb_state_changed(struct ctdb_context *ctdb);
 
 int ctdb_ctrl_get_all_tunables(struct ctdb_context *ctdb, 
 			       struct timeval timeout, 
@@ -1419,6 +1599,103 @@ int32_t ctdb_control_continue_node(struct ctdb_context *ctdb);
 
 void ctdb_stop_vacuuming(struct ctdb_context *ctdb);
 int ctdb_vacuum_init(struct ctdb_db_context *ctdb_db);
+int32_t ctdb_vacuum_job(struct ctdb_db_context *ctdb_db, TDB_DATA data);
+
+/*
+  jobs run by the pre-forked worker processes
+ */
+enum ctdb_worker_job_type {
+	CTDB_WORKER_JOB_TRAVERSE = 1,
+	CTDB_WORKER_JOB_VACUUM   = 2,
+};
+
+struct ctdb_worker_job;
+typedef void (*ctdb_worker_done_fn_t)(int32_t status, void *private_data);
+
+struct ctdb_worker_job *ctdb_worker_job_send(struct ctdb_db_context *ctdb_db,
+					     TALLOC_CTX *mem_ctx,
+					     enum ctdb_worker_job_type type,
+					     TDB_DATA data,
+					     ctdb_worker_done_fn_t fn,
+					     void *private_data);
+void ctdb_workers_restart(struct ctdb_context *ctdb);
+int ctdb_worker_reopen_dbs(struct ctdb_context *ctdb);
+int32_t ctdb_traverse_local_job(struct ctdb_db_context *ctdb_db, TDB_DATA data);
+
+/*
+  record operations run by the call shard processes
+ */
+enum ctdb_call_shard_op {
+	CTDB_CALL_SHARD_CALL           = 1,
+	CTDB_CALL_SHARD_MIGRATE        = 2,
+	CTDB_CALL_SHARD_DMASTER        = 3,
+	CTDB_CALL_SHARD_BECOME_DMASTER = 4,
+};
+
+enum ctdb_call_shard_result {
+	CTDB_CALL_SHARD_FALLBACK = 0,	/* the daemon has to do it itself */
+	CTDB_CALL_SHARD_ANSWERED = 1,	/* the call was run */
+	CTDB_CALL_SHARD_MIGRATED = 2,	/* the record was handed on */
+	CTDB_CALL_SHARD_REMOTE   = 3,	/* another node is dmaster */
+	CTDB_CALL_SHARD_FAILED   = 4,	/* the record could not be stored */
+};
+
+/* what the daemon has to do with its delete queue for the record */
+#define CTDB_CALL_SHARD_SCHEDULE_FOR_DELETION	1
+#define CTDB_CALL_SHARD_REMOVE_FROM_DELETE_QUEUE 2
+
+struct ctdb_call_shard_request {
+	uint32_t length;
+	uint32_t op;
+	uint32_t db_id;
+	uint32_t generation;
+	uint32_t callid;
+	uint32_t flags;
+	uint32_t srcnode;
+	uint32_t dmaster;	/* the new dmaster */
+	uint32_t lmaster;
+	uint32_t record_flags;
+	uint64_t rsn;
+	uint32_t keylen;
+	uint32_t calldatalen;
+	uint32_t datalen;
+	uint8_t data[1];
+};
+
+struct ctdb_call_shard_reply {
+	uint32_t length;
+	uint32_t result;
+	int32_t ret;		/* of ctdb_call_local() */
+	int32_t status;		/* of the call */
+	uint32_t delete_queue;
+	uint32_t datalen;
+	struct ctdb_ltdb_header header;
+	struct ctdb_ltdb_header delete_header;
+	uint8_t data[1];
+};
+
+typedef void (*ctdb_call_shard_fn_t)(struct ctdb_call_shard_reply *reply,
+				     void *private_data);
+
+struct ctdb_call_shard_request *ctdb_call_shard_request(TALLOC_CTX *mem_ctx,
+							struct ctdb_db_context *ctdb_db,
+							enum ctdb_call_shard_op op,
+							TDB_DATA key,
+							TDB_DATA call_data,
+							TDB_DATA data);
+int ctdb_call_shard_send(struct ctdb_db_context *ctdb_db,
+			 struct ctdb_call_shard_request *req,
+			 ctdb_call_shard_fn_t fn, void *private_data);
+void ctdb_call_shard_delete_queue(struct ctdb_db_context *ctdb_db,
+				  struct ctdb_call_shard_reply *reply,
+				  TDB_DATA key);
+bool ctdb_call_shard_current(struct ctdb_context *ctdb, uint32_t generation);
+bool ctdb_call_shards_enabled(struct ctdb_context *ctdb);
+void ctdb_call_shards_update(struct ctdb_context *ctdb);
+void ctdb_call_shards_restart(struct ctdb_context *ctdb);
+struct ctdb_call_shard_reply *ctdb_call_shard_run(struct ctdb_context *ctdb,
+						  TALLOC_CTX *mem_ctx,
+						  struct ctdb_call_shard_request *req);
 
 int32_t ctdb_control_enable_script(struct ctdb_context *ctdb, TDB_DATA indata);
 int32_t ctdb_control_disable_script(struct ctdb_context *ctdb, TDB_DATA indata);
@@ -1427,6 +1704,7 @@ void ctdb_local_node_got_banned(struct ctdb_context *ctdb);
 int32_t ctdb_control_set_ban_state(struct ctdb_context *ctdb, TDB_DATA indata);
 int32_t ctdb_control_get_ban_state(struct ctdb_context *ctdb, TDB_DATA *outdata);
 int32_t ctdb_control_set_db_priority(struct ctdb_context *ctdb, TDB_DATA indata);
+int32_t ctdb_control_set_db_ship_call(struct ctdb_context *ctdb, TDB_DATA indata);
 void ctdb_ban_self(struct ctdb_context *ctdb);
 
 int32_t ctdb_control_register_notify(struct ctdb_context *ctdb, uint32_t client_id, TDB_DATA indata);
@@ -1457,6 +1735,10 @@ struct ctdb_log_state *ctdb_fork_with_logging(TALLOC_CTX *mem_ctx,
 					      void *logfn_private, pid_t *pid);
 
 int32_t ctdb_control_process_exists(struct ctdb_context *ctdb, pid_t pid);
+int32_t ctdb_control_get_stream_statistics(struct ctdb_context *ctdb,
+					   TDB_DATA *outdata);
+int32_t ctdb_control_get_client_statistics(struct ctdb_context *ctdb,
+					   TDB_DATA *outdata);
 struct ctdb_client *ctdb_find_client_by_pid(struct ctdb_context *ctdb, pid_t pid);
 
 int32_t ctdb_control_get_db_seqnum(struct ctdb_context *ctdb,
@@ -1470,6 +1752,8 @@ int ctdb_update_persistent_health(struct ctdb_context *ctdb,
 				  const char *reason,/* NULL means healthy */
 				  int num_healthy_nodes);
 int ctdb_recheck_persistent_health(struct ctdb_context *ctdb);
+void ctdb_db_note_record_count(struct ctdb_db_context *ctdb_db,
+			       uint32_t count);
 
 void ctdb_run_notification_script(struct ctdb_context *ctdb, const char *event);
 
@@ -1488,6 +1772,10 @@ int ctdb_statistics_init(struct ctdb_context *ctdb);
 int32_t ctdb_control_get_stat_history(struct ctdb_context *ctdb,
 				      struct ctdb_req_control *c,
 				      TDB_DATA *outdata);
+int32_t ctdb_control_get_stat_history_range(struct ctdb_context *ctdb,
+					    struct ctdb_req_control *c,
+					    TDB_DATA indata,
+					    TDB_DATA *outdata);
 
 int ctdb_deferred_drop_all_ips(struct ctdb_context *ctdb);
 
@@ -1541,8 +1829,25 @@ int32_t ctdb_control_get_db_statistics(struct ctdb_context *ctdb,
 				uint32_t db_id,
 				TDB_DATA *outdata);
 
+void ctdb_db_hot_keys_update(struct ctdb_db_context *ctdb_db, TDB_DATA key,
+			     bool migrated);
+void ctdb_db_hot_keys_get(struct ctdb_db_context *ctdb_db,
+			  struct ctdb_db_statistics *stats);
+
 int ctdb_set_db_sticky(struct ctdb_context *ctdb, struct ctdb_db_context *ctdb_db);
 
+void ctdb_dmaster_hint_update(struct ctdb_db_context *ctdb_db, TDB_DATA key,
+			      uint32_t dmaster);
+bool ctdb_dmaster_hint_lookup(struct ctdb_db_context *ctdb_db, TDB_DATA key,
+			      uint32_t *dmaster);
+
+void *_ctdb_mem_pool_alloc(struct ctdb_context *ctdb, TALLOC_CTX *mem_ctx,
+			   size_t size, const char *name);
+void *_ctdb_mem_pool_zero(struct ctdb_context *ctdb, TALLOC_CTX *mem_ctx,
+			  size_t size, const char *name);
+#define ctdb_mem_pool_zero(ctdb, mem_ctx, type) \
+	(type *)_ctdb_mem_pool_zero(ctdb, mem_ctx, sizeof(type), #type)
+
 /*
   description for a message to reload all ips via recovery master/daemon
  */
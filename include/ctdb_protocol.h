@@ -48,6 +48,7 @@ struct ctdb_call {
 #define CTDB_IMMEDIATE_MIGRATION		0x00000001
 #define CTDB_CALL_FLAG_VACUUM_MIGRATION		0x00000002
 #define CTDB_WANT_READONLY			0x00000004
+#define CTDB_CALL_FLAG_DMASTER_HINT		0x00000008
 	uint32_t flags;
 };
 
@@ -108,6 +109,18 @@ struct ctdb_call_info {
  */
 #define CTDB_SRVID_RECD_UPDATE_IP 0xF500000000000000LL
 
+/*
+   a message ID to tell the recovery daemons that the nodemap, vnnmap,
+   recovery mode or recovery master of a node may have changed
+ */
+#define CTDB_SRVID_STATE_CHANGED 0xF600000000000000LL
+
+/*
+   a message ID to tell the local recovery daemon that a node has
+   become, or is no longer, suspected of being dead
+ */
+#define CTDB_SRVID_NODE_SUSPICION 0xF601000000000000LL
+
 /*
   a message to tell the recovery daemon to fetch a set of records
  */
@@ -194,6 +207,9 @@ struct ctdb_call_info {
 /* Range of ports reserved for traversals */
 #define CTDB_SRVID_TRAVERSE_RANGE  0xBE00000000000000LL
 
+/* Range of ports reserved for reporting batched record migrations */
+#define CTDB_SRVID_MIGRATE_RANGE  0xAE00000000000000LL
+
 /* used on the domain socket, send a pdu to the local daemon */
 #define CTDB_CURRENT_NODE     0xF0000001
 /* send a broadcast to all nodes in the cluster, active or not */
@@ -265,6 +281,7 @@ enum ctdb_operation {
 	CTDB_REQ_CONTROL        = 7,
 	CTDB_REPLY_CONTROL      = 8,
 	CTDB_REQ_KEEPALIVE      = 9,
+	CTDB_REQ_MIGRATE        = 10,
 };
 
 #define CTDB_MAGIC 0x43544442 /* CTDB */
@@ -404,6 +421,11 @@ enum ctdb_controls {CTDB_CONTROL_PROCESS_EXISTS          = 0,
 		    CTDB_CONTROL_RECEIVE_RECORDS	 = 136,
 		    CTDB_CONTROL_IPREALLOCATED		 = 137,
 		    CTDB_CONTROL_GET_RUNSTATE		 = 138,
+		    CTDB_CONTROL_GET_STAT_HISTORY_RANGE	 = 139,
+		    CTDB_CONTROL_MIGRATE_RECORDS	 = 140,
+		    CTDB_CONTROL_GET_CLIENT_STATISTICS	 = 141,
+		    CTDB_CONTROL_SET_DB_SHIP_CALL	 = 142,
+		    CTDB_CONTROL_GET_STREAM_STATISTICS	 = 143,
 };
 
 /*
@@ -464,6 +486,18 @@ struct ctdb_reply_dmaster {
 	uint8_t  data[1];
 };
 
+/*
+  a batch of keys to be migrated to the sending node. data[] holds
+  count ctdb_rec_data entries, each carrying a key and the reqid the
+  sender allocated for it
+ */
+struct ctdb_req_migrate {
+	struct ctdb_req_header hdr;
+	uint32_t db_id;
+	uint32_t count;
+	uint8_t  data[1];
+};
+
 struct ctdb_req_message {
 	struct ctdb_req_header hdr;
 	uint64_t srvid;
@@ -631,7 +665,8 @@ struct ctdb_traverse_start_ext {
   ctdb statistics information
  */
 #define MAX_COUNT_BUCKETS 16
-#define MAX_HOT_KEYS      10
+#define MAX_HOT_KEYS      32
+#define CTDB_MAX_STREAMS  8
 
 struct ctdb_statistics {
 	uint32_t num_clients;
@@ -675,6 +710,37 @@ struct ctdb_statistics {
 		struct latency_counter latency;
 		uint32_t buckets[MAX_COUNT_BUCKETS];
 	} locks;
+	struct {
+		uint32_t num_spawned;
+		uint32_t num_jobs;
+		uint32_t num_current;
+		uint32_t num_pending;
+		uint32_t num_failed;
+		struct latency_counter queue_latency;
+		struct latency_counter latency;
+	} workers;
+	struct {
+		uint32_t hits;
+		uint32_t misses;
+		uint32_t stale;
+		uint32_t hops_saved;
+	} dmaster_hints;
+	struct {
+		uint32_t calls;
+		uint32_t migrations;
+	} shipped;
+	struct {
+		uint32_t allocs;
+		uint32_t hits;		/* served from a pool */
+		uint32_t pools;		/* pools started */
+	} mem_pools;
+	struct {
+		uint32_t num_spawned;
+		uint32_t num_requests;
+		uint32_t num_fallbacks;
+		uint32_t num_current;
+		struct latency_counter latency;
+	} call_shards;
 	uint32_t total_calls;
 	uint32_t pending_calls;
 	uint32_t childwrite_calls;
@@ -700,6 +766,14 @@ struct ctdb_statistics_wire {
 	struct ctdb_statistics stats[1];
 };
 
+/*
+ * time range for statistics history
+ */
+struct ctdb_statistics_range {
+	struct timeval start;
+	struct timeval end;
+};
+
 /*
  * db statistics
  */
@@ -711,18 +785,101 @@ struct ctdb_db_statistics {
 		uint32_t num_failed;
 		struct latency_counter latency;
 		uint32_t buckets[MAX_COUNT_BUCKETS];
+		uint32_t queue_buckets[MAX_COUNT_BUCKETS];
 	} locks;
 	uint32_t db_ro_delegations;
 	uint32_t db_ro_revokes;
 	uint32_t hop_count_bucket[MAX_COUNT_BUCKETS];
+	struct {
+		uint32_t made_sticky;
+		uint32_t released;
+		uint32_t pindowns;
+		uint32_t pindown_ms;	/* moving average */
+		uint32_t deferred;
+		uint32_t idle_pindowns;
+	} sticky;
+	struct {
+		uint32_t hits;
+		uint32_t misses;
+		uint32_t stale;
+		uint32_t hops_saved;
+	} dmaster_hints;
+	struct {
+		uint32_t calls;
+		uint32_t migrations;
+	} shipped;
 	uint32_t num_hot_keys;
 	struct {
 		uint32_t count;
+		uint32_t migrations;
 		TDB_DATA key;
 	} hot_keys[MAX_HOT_KEYS];
 	char hot_keys_wire[1];
 };
 
+/*
+ * request queue statistics for a client connection
+ */
+struct ctdb_client_statistics {
+	uint32_t client_id;
+	uint32_t pid;
+	uint32_t inflight;	/* calls and controls being processed */
+	uint32_t max_inflight;
+	uint32_t queued;	/* requests waiting to be processed */
+	uint32_t max_queued;
+	uint32_t read_paused;	/* socket is currently not being read */
+	uint32_t num_requests;
+	uint32_t num_queued;	/* requests that had to wait */
+	uint32_t num_read_pauses;
+	struct latency_counter queue_latency;
+};
+
+struct ctdb_client_statistics_wire {
+	uint32_t num;
+	struct ctdb_client_statistics stats[1];
+};
+
+/*
+ * priority classes of the packets on a queue, see common/ctdb_io.c
+ */
+enum ctdb_queue_class {
+	CTDB_QUEUE_CLASS_CONTROL = 0,	/* keepalives, elections, dmaster replies */
+	CTDB_QUEUE_CLASS_NORMAL  = 1,
+	CTDB_QUEUE_CLASS_BULK    = 2,	/* recovery and traverse traffic */
+};
+#define CTDB_QUEUE_NUM_CLASSES 3
+
+struct ctdb_queue_class_statistics {
+	uint32_t num_packets;
+	uint32_t queued;	/* packets waiting to be written */
+	uint32_t max_queued;
+	uint32_t num_dropped;	/* dropped as the queue was over MaxQueueBytes */
+	uint64_t queued_bytes;
+	uint64_t max_queued_bytes;
+	struct latency_counter wait;
+};
+
+/*
+ * queue statistics for one stream of the connection to a node
+ */
+struct ctdb_stream_statistics {
+	uint32_t pnn;
+	uint32_t stream;
+	uint32_t bulk;		/* carries recovery and traverse traffic */
+	uint32_t connected;
+	uint32_t num_packets;
+	uint32_t queued;	/* packets waiting to be written */
+	uint32_t max_queued;
+	uint32_t pad;
+	uint64_t num_bytes;
+	struct ctdb_queue_class_statistics classes[CTDB_QUEUE_NUM_CLASSES];
+};
+
+struct ctdb_stream_statistics_wire {
+	uint32_t num;
+	struct ctdb_stream_statistics stats[1];
+};
+
 /*
  * wire format for interface list
  */
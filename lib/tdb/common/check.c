@@ -39,7 +39,13 @@ static bool tdb_check_header(struct tdb_context *tdb, tdb_off_t *recovery)
 	if (hdr.version != TDB_VERSION)
 		goto corrupt;
 
-	if (hdr.rwlocks != 0 && hdr.rwlocks != TDB_HASH_RWLOCK_MAGIC)
+	if (hdr.rwlocks != 0 &&
+	    hdr.rwlocks != TDB_HASH_RWLOCK_MAGIC &&
+	    hdr.rwlocks != TDB_FEATURE_FLAG_MAGIC)
+		goto corrupt;
+
+	if (hdr.rwlocks == TDB_FEATURE_FLAG_MAGIC &&
+	    (hdr.feature_flags & ~TDB_SUPPORTED_FEATURE_FLAGS))
 		goto corrupt;
 
 	tdb_header_hash(tdb, &h1, &h2);
@@ -72,20 +72,15 @@ static int tdb_oob(struct tdb_context *tdb, tdb_off_t off, tdb_len_t len,
 		return -1;
 	}
 
-	/* Unmap, update size, remap.  We do this unconditionally, to handle
-	 * the unusual case where the db is truncated.
+	/* Update size, remap if needed.  We do this unconditionally, to
+	 * handle the unusual case where the db is truncated.
 	 *
 	 * This can happen to a child using tdb_reopen_all(true) on a
 	 * TDB_CLEAR_IF_FIRST tdb whose parent crashes: the next
 	 * opener will truncate the database. */
-	if (tdb_munmap(tdb) == -1) {
-		tdb->ecode = TDB_ERR_IO;
+	if (tdb_remap(tdb, st.st_size) != 0) {
 		return -1;
 	}
-	tdb->map_size = st.st_size;
-	if (tdb_mmap(tdb) != 0) {
-		return - 1;
-	}
 
 	if (st.st_size < (size_t)off + len) {
 		if (!probe) {
@@ -230,12 +225,13 @@ int tdb_munmap(struct tdb_context *tdb)
 	if (tdb->map_ptr) {
 		int ret;
 
-		ret = munmap(tdb->map_ptr, tdb->map_size);
+		ret = munmap(tdb->map_ptr, tdb->map_reserved);
 		if (ret != 0)
 			return ret;
 	}
 #endif
 	tdb->map_ptr = NULL;
+	tdb->map_reserved = 0;
 	return 0;
 }
 
@@ -249,6 +245,28 @@ static bool should_mmap(const struct tdb_context *tdb)
 #endif
 }
 
+/* How much address space to map for the file. Pages of a shared
+   mapping beyond EOF become usable as soon as the file is extended,
+   so the file can grow into the reservation without a remap. */
+static size_t tdb_map_reserve(const struct tdb_context *tdb)
+{
+#ifdef HAVE_INCOHERENT_MMAP
+	return tdb->map_size;
+#else
+	size_t reserve;
+
+	/* Don't waste a small address space */
+	if (sizeof(void *) < 8) {
+		return tdb->map_size;
+	}
+
+	reserve = MAX((size_t)tdb->map_size * 2, TDB_MAP_RESERVE_MIN);
+
+	/* tdb offsets are 32 bit, the file can't grow beyond that */
+	return MIN(reserve, (size_t)UINT32_MAX + 1);
+#endif
+}
+
 int tdb_mmap(struct tdb_context *tdb)
 {
 	if (tdb->flags & TDB_INTERNAL)
@@ -256,10 +274,20 @@ int tdb_mmap(struct tdb_context *tdb)
 
 #ifdef HAVE_MMAP
 	if (should_mmap(tdb)) {
-		tdb->map_ptr = mmap(NULL, tdb->map_size, 
+		size_t reserve = tdb_map_reserve(tdb);
+
+		tdb->map_ptr = mmap(NULL, reserve,
 				    PROT_READ|(tdb->read_only? 0:PROT_WRITE), 
 				    MAP_SHARED|MAP_FILE, tdb->fd, 0);
 
+		if (tdb->map_ptr == MAP_FAILED && reserve > tdb->map_size) {
+			/* Maybe limited address space: map just the file */
+			reserve = tdb->map_size;
+			tdb->map_ptr = mmap(NULL, reserve,
+					    PROT_READ|(tdb->read_only? 0:PROT_WRITE),
+					    MAP_SHARED|MAP_FILE, tdb->fd, 0);
+		}
+
 		/*
 		 * NB. When mmap fails it returns MAP_FAILED *NOT* NULL !!!!
 		 */
@@ -272,6 +300,8 @@ int tdb_mmap(struct tdb_context *tdb)
 			tdb->ecode = TDB_ERR_IO;
 			return -1;
 #endif
+		} else {
+			tdb->map_reserved = reserve;
 		}
 	} else {
 		tdb->map_ptr = NULL;
@@ -282,6 +312,26 @@ int tdb_mmap(struct tdb_context *tdb)
 	return 0;
 }
 
+/* Adjust the mapping to a new file size.  The mapping only has to
+   move when the file outgrew the reserved address space. */
+int tdb_remap(struct tdb_context *tdb, tdb_len_t size)
+{
+	if (tdb->map_ptr && size <= tdb->map_reserved) {
+		tdb->map_size = size;
+		return 0;
+	}
+
+	if (tdb->map_ptr) {
+		tdb->num_remaps++;
+	}
+	if (tdb_munmap(tdb) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	tdb->map_size = size;
+	return tdb_mmap(tdb);
+}
+
 /* expand a file.  we prefer to use ftruncate, as that is what posix
   says to use for mmap expansion */
 static int tdb_expand_file(struct tdb_context *tdb, tdb_off_t size, tdb_off_t addition)
@@ -411,9 +461,7 @@ int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
 	} else {
 		/* Explicitly remap: if we're in a transaction, this won't
 		 * happen automatically! */
-		tdb_munmap(tdb);
-		tdb->map_size += size;
-		if (tdb_mmap(tdb) != 0) {
+		if (tdb_remap(tdb, tdb->map_size + size) != 0) {
 			goto fail;
 		}
 	}
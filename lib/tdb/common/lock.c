@@ -152,16 +152,20 @@ int tdb_brlock(struct tdb_context *tdb,
 		return -1;
 	}
 
-	do {
-		ret = fcntl_lock(tdb, rw_type, offset, len,
-				 flags & TDB_LOCK_WAIT);
-		/* Check for a sigalarm break. */
-		if (ret == -1 && errno == EINTR &&
-				tdb->interrupt_sig_ptr &&
-				*tdb->interrupt_sig_ptr) {
-			break;
-		}
-	} while (ret == -1 && errno == EINTR);
+	/* With TDB_MUTEX_LOCKING the chain locks are mutexes */
+	if (!tdb_mutex_lock(tdb, rw_type, offset, len,
+			    flags & TDB_LOCK_WAIT, &ret)) {
+		do {
+			ret = fcntl_lock(tdb, rw_type, offset, len,
+					 flags & TDB_LOCK_WAIT);
+			/* Check for a sigalarm break. */
+			if (ret == -1 && errno == EINTR &&
+					tdb->interrupt_sig_ptr &&
+					*tdb->interrupt_sig_ptr) {
+				break;
+			}
+		} while (ret == -1 && errno == EINTR);
+	}
 
 	if (ret == -1) {
 		tdb->ecode = TDB_ERR_LOCK;
@@ -186,9 +190,11 @@ int tdb_brunlock(struct tdb_context *tdb,
 		return 0;
 	}
 
-	do {
-		ret = fcntl_unlock(tdb, rw_type, offset, len);
-	} while (ret == -1 && errno == EINTR);
+	if (!tdb_mutex_unlock(tdb, rw_type, offset, len, &ret)) {
+		do {
+			ret = fcntl_unlock(tdb, rw_type, offset, len);
+		} while (ret == -1 && errno == EINTR);
+	}
 
 	if (ret == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_TRACE,"tdb_brunlock failed (fd=%d) at offset %d rw_type=%d len=%d\n",
@@ -206,6 +212,7 @@ int tdb_brunlock(struct tdb_context *tdb,
 int tdb_allrecord_upgrade(struct tdb_context *tdb)
 {
 	int count = 1000;
+	tdb_off_t off = FREELIST_TOP;
 
 	if (tdb->allrecord_lock.count != 1) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR,
@@ -220,9 +227,19 @@ int tdb_allrecord_upgrade(struct tdb_context *tdb)
 		return -1;
 	}
 
+	if (tdb_have_mutexes(tdb)) {
+		if (tdb_mutex_allrecord_upgrade(tdb) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_TRACE,
+				 "tdb_allrecord_upgrade failed\n"));
+			return -1;
+		}
+		/* Only the record locks are left to upgrade */
+		off = lock_offset(tdb->header.hash_size);
+	}
+
 	while (count--) {
 		struct timeval tv;
-		if (tdb_brlock(tdb, F_WRLCK, FREELIST_TOP, 0,
+		if (tdb_brlock(tdb, F_WRLCK, off, 0,
 			       TDB_LOCK_WAIT|TDB_LOCK_PROBE) == 0) {
 			tdb->allrecord_lock.ltype = F_WRLCK;
 			tdb->allrecord_lock.off = 0;
@@ -236,6 +253,9 @@ int tdb_allrecord_upgrade(struct tdb_context *tdb)
 		tv.tv_usec = 1;
 		select(0, NULL, NULL, NULL, &tv);
 	}
+	if (tdb_have_mutexes(tdb)) {
+		tdb_mutex_allrecord_downgrade(tdb);
+	}
 	TDB_LOG((tdb, TDB_DEBUG_TRACE,"tdb_allrecord_upgrade failed\n"));
 	return -1;
 }
@@ -301,24 +321,80 @@ int tdb_nest_lock(struct tdb_context *tdb, uint32_t offset, int ltype,
 	return 0;
 }
 
+/*
+  Take the allrecord mutex and the record locks. The kernel can't see
+  mutex waits, so it can't detect deadlocks between them and the fcntl
+  record locks: a traverse holds a record lock while waiting for the
+  next chain. So we never wait for the record locks with the allrecord
+  mutex held, but back off and wait for them with no locks held.
+*/
+static int allrecord_mutex_brlock(struct tdb_context *tdb, int ltype,
+				  enum tdb_lock_flags flags)
+{
+	tdb_off_t off = lock_offset(tdb->header.hash_size);
+	enum tdb_lock_flags nb_flags = (flags & ~TDB_LOCK_WAIT);
+	int saved_errno;
+
+	while (true) {
+		if (tdb_mutex_allrecord_lock(tdb, ltype, flags) == -1) {
+			return -1;
+		}
+		if (tdb_brlock(tdb, ltype, off, 0,
+			       nb_flags|TDB_LOCK_PROBE) == 0) {
+			return 0;
+		}
+		saved_errno = errno;
+		tdb_mutex_allrecord_unlock(tdb);
+		errno = saved_errno;
+
+		if (!(flags & TDB_LOCK_WAIT) || errno != EAGAIN) {
+			return -1;
+		}
+
+		/* Wait until the record locks are free, then retry */
+		if (tdb_brlock(tdb, ltype, off, 0, flags) == -1) {
+			return -1;
+		}
+		tdb_brunlock(tdb, ltype, off, 0);
+	}
+}
+
+/* release what tdb_allrecord_lock() took */
+static int allrecord_brunlock(struct tdb_context *tdb, int ltype)
+{
+	if (tdb_have_mutexes(tdb)) {
+		if (tdb_mutex_allrecord_unlock(tdb) == -1) {
+			return -1;
+		}
+		return tdb_brunlock(tdb, ltype,
+				    lock_offset(tdb->header.hash_size), 0);
+	}
+	return tdb_brunlock(tdb, ltype, FREELIST_TOP, 0);
+}
+
 static int tdb_lock_and_recover(struct tdb_context *tdb)
 {
 	int ret;
 
 	/* We need to match locking order in transaction commit. */
-	if (tdb_brlock(tdb, F_WRLCK, FREELIST_TOP, 0, TDB_LOCK_WAIT)) {
+	if (tdb_have_mutexes(tdb)) {
+		ret = allrecord_mutex_brlock(tdb, F_WRLCK, TDB_LOCK_WAIT);
+	} else {
+		ret = tdb_brlock(tdb, F_WRLCK, FREELIST_TOP, 0, TDB_LOCK_WAIT);
+	}
+	if (ret == -1) {
 		return -1;
 	}
 
 	if (tdb_brlock(tdb, F_WRLCK, OPEN_LOCK, 1, TDB_LOCK_WAIT)) {
-		tdb_brunlock(tdb, F_WRLCK, FREELIST_TOP, 0);
+		allrecord_brunlock(tdb, F_WRLCK);
 		return -1;
 	}
 
 	ret = tdb_transaction_recover(tdb);
 
 	tdb_brunlock(tdb, F_WRLCK, OPEN_LOCK, 1);
-	tdb_brunlock(tdb, F_WRLCK, FREELIST_TOP, 0);
+	allrecord_brunlock(tdb, F_WRLCK);
 
 	return ret;
 }
@@ -566,18 +642,25 @@ int tdb_allrecord_lock(struct tdb_context *tdb, int ltype,
 	 *    chain locks.
 	 *
 	 * It is (1) which cause the starvation problem, so we're only
-	 * gradual for that. */
-	if (tdb_chainlock_gradual(tdb, ltype, flags, FREELIST_TOP,
-				  tdb->header.hash_size * 4) == -1) {
-		return -1;
-	}
+	 * gradual for that. With mutexes, the allrecord mutex takes
+	 * care of (1). */
+	if (tdb_have_mutexes(tdb)) {
+		if (allrecord_mutex_brlock(tdb, ltype, flags) == -1) {
+			return -1;
+		}
+	} else {
+		if (tdb_chainlock_gradual(tdb, ltype, flags, FREELIST_TOP,
+					  tdb->header.hash_size * 4) == -1) {
+			return -1;
+		}
 
-	/* Grab individual record locks. */
-	if (tdb_brlock(tdb, ltype, lock_offset(tdb->header.hash_size), 0,
-		       flags) == -1) {
-		tdb_brunlock(tdb, ltype, FREELIST_TOP,
-			     tdb->header.hash_size * 4);
-		return -1;
+		/* Grab individual record locks. */
+		if (tdb_brlock(tdb, ltype, lock_offset(tdb->header.hash_size),
+			       0, flags) == -1) {
+			tdb_brunlock(tdb, ltype, FREELIST_TOP,
+				     tdb->header.hash_size * 4);
+			return -1;
+		}
 	}
 
 	tdb->allrecord_lock.count = 1;
@@ -632,7 +715,7 @@ int tdb_allrecord_unlock(struct tdb_context *tdb, int ltype, bool mark_lock)
 		return 0;
 	}
 
-	if (!mark_lock && tdb_brunlock(tdb, ltype, FREELIST_TOP, 0)) {
+	if (!mark_lock && allrecord_brunlock(tdb, ltype)) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_unlockall failed (%s)\n", strerror(errno)));
 		return -1;
 	}
@@ -840,7 +923,7 @@ void tdb_release_transaction_locks(struct tdb_context *tdb)
 	unsigned int i, active = 0;
 
 	if (tdb->allrecord_lock.count != 0) {
-		tdb_brunlock(tdb, tdb->allrecord_lock.ltype, FREELIST_TOP, 0);
+		allrecord_brunlock(tdb, tdb->allrecord_lock.ltype);
 		tdb->allrecord_lock.count = 0;
 	}
 
@@ -0,0 +1,652 @@
+ /*
+   Unix SMB/CIFS implementation.
+
+   trivial database library - robust mutex hash chain locks
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "tdb_private.h"
+
+/*
+  With TDB_MUTEX_LOCKING the hash chain and freelist locks are robust,
+  process shared pthread mutexes instead of fcntl byte range locks. An
+  uncontended lock is then a single atomic operation in user space
+  rather than a system call walking the kernel's per-inode lock list.
+
+  The mutexes live in a separate file "<name>.mutex" next to the tdb,
+  so the layout of the tdb itself stays the same. The tdb header only
+  carries a feature flag, so that every opener knows it has to use the
+  mutexes and older versions of tdb refuse to open the database.
+
+  Record locks, the transaction lock and the open/active locks remain
+  fcntl locks.
+*/
+
+#ifdef USE_TDB_MUTEX_LOCKING
+
+#include <pthread.h>
+
+#define TDB_MUTEX_MAGIC (0x7a4d7458U)
+
+struct tdb_mutexes {
+	uint32_t magic;
+	uint32_t hash_size;
+
+	/* F_UNLCK, F_RDLCK or F_WRLCK, protected by allrecord_mutex */
+	short int allrecord_lock;
+	pthread_mutex_t allrecord_mutex;
+
+	/* index 0 is the freelist, index i+1 is hash chain i */
+	pthread_mutex_t hashchains[1];
+};
+
+static size_t tdb_mutex_size(uint32_t hash_size)
+{
+	return offsetof(struct tdb_mutexes, hashchains) +
+		(hash_size + 1) * sizeof(pthread_mutex_t);
+}
+
+static char *tdb_mutex_path(struct tdb_context *tdb)
+{
+	size_t len = strlen(tdb->name) + sizeof(".mutex");
+	char *path;
+
+	path = (char *)malloc(len);
+	if (path == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	snprintf(path, len, "%s.mutex", tdb->name);
+	return path;
+}
+
+bool tdb_have_mutexes(struct tdb_context *tdb)
+{
+	return tdb->mutexes != NULL;
+}
+
+/*
+  Map a lock offset to a mutex: the freelist lock is at FREELIST_TOP-4,
+  the chain locks follow it in steps of 4 bytes.
+*/
+static bool tdb_mutex_index(struct tdb_context *tdb, off_t off, off_t len,
+			    unsigned int *idx)
+{
+	off_t start = FREELIST_TOP - sizeof(tdb_off_t);
+	off_t end = FREELIST_TOP + tdb->header.hash_size * sizeof(tdb_off_t);
+
+	if (len != 1) {
+		return false;
+	}
+	if ((off < start) || (off >= end)) {
+		return false;
+	}
+	if (((off - start) % sizeof(tdb_off_t)) != 0) {
+		return false;
+	}
+	*idx = (off - start) / sizeof(tdb_off_t);
+	return true;
+}
+
+/* Do we hold a chain lock other than the freelist? */
+static bool tdb_have_mutex_chainlocks(struct tdb_context *tdb)
+{
+	int i;
+
+	for (i = 0; i < tdb->num_lockrecs; i++) {
+		unsigned int idx;
+
+		if (!tdb_mutex_index(tdb, tdb->lockrecs[i].off, 1, &idx)) {
+			continue;
+		}
+		if (idx != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+  Lock a mutex, returning 0 or an errno value. A mutex whose owner died
+  is ours now: fcntl locks are silently dropped when a process dies, we
+  do the same here.
+*/
+static int chain_mutex_lock(pthread_mutex_t *m, bool waitflag)
+{
+	int ret;
+
+	if (waitflag) {
+		ret = pthread_mutex_lock(m);
+	} else {
+		ret = pthread_mutex_trylock(m);
+		if (ret == EBUSY) {
+			ret = EAGAIN;
+		}
+	}
+	if (ret == EOWNERDEAD) {
+		ret = pthread_mutex_consistent(m);
+	}
+	return ret;
+}
+
+static int allrecord_mutex_lock(struct tdb_mutexes *m, bool waitflag)
+{
+	int ret;
+
+	if (waitflag) {
+		ret = pthread_mutex_lock(&m->allrecord_mutex);
+	} else {
+		ret = pthread_mutex_trylock(&m->allrecord_mutex);
+		if (ret == EBUSY) {
+			ret = EAGAIN;
+		}
+	}
+	if (ret == EOWNERDEAD) {
+		/* The allrecord lock holder died, e.g. a killed lock helper */
+		m->allrecord_lock = F_UNLCK;
+		ret = pthread_mutex_consistent(&m->allrecord_mutex);
+	}
+	return ret;
+}
+
+/*
+  Returns false if this is not a mutex protected lock and the caller has
+  to fall back to fcntl, true with *pret set otherwise.
+*/
+bool tdb_mutex_lock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		    bool waitflag, int *pret)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	pthread_mutex_t *chain;
+	unsigned int idx;
+	int ret;
+
+	if (m == NULL) {
+		return false;
+	}
+	if (!tdb_mutex_index(tdb, off, len, &idx)) {
+		return false;
+	}
+	chain = &m->hashchains[idx];
+
+again:
+	ret = chain_mutex_lock(chain, waitflag);
+	if (ret != 0) {
+		goto fail;
+	}
+
+	if (idx == 0) {
+		/* The allrecord lock does not cover the freelist */
+		goto done;
+	}
+
+	if (tdb_have_mutex_chainlocks(tdb)) {
+		/*
+		 * An allrecord locker walks all chains and waits for us
+		 * to drop the one we already hold. Waiting for it here
+		 * would deadlock, so we only check the allrecord lock
+		 * for the first chain.
+		 */
+		goto done;
+	}
+
+	if ((m->allrecord_lock == F_UNLCK) ||
+	    ((m->allrecord_lock == F_RDLCK) && (rw == F_RDLCK))) {
+		goto done;
+	}
+
+	/* Someone holds or is taking the allrecord lock: wait for it */
+	pthread_mutex_unlock(chain);
+
+	/*
+	 * Without waitflag this still succeeds if the allrecord lock
+	 * holder is gone, cleaning up the stale allrecord_lock.
+	 */
+	ret = allrecord_mutex_lock(m, waitflag);
+	if (ret != 0) {
+		goto fail;
+	}
+	pthread_mutex_unlock(&m->allrecord_mutex);
+	goto again;
+
+done:
+	*pret = 0;
+	return true;
+
+fail:
+	errno = ret;
+	*pret = -1;
+	return true;
+}
+
+bool tdb_mutex_unlock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		      int *pret)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	unsigned int idx;
+	int ret;
+
+	if (m == NULL) {
+		return false;
+	}
+	if (!tdb_mutex_index(tdb, off, len, &idx)) {
+		return false;
+	}
+
+	ret = pthread_mutex_unlock(&m->hashchains[idx]);
+	if (ret != 0) {
+		errno = ret;
+		*pret = -1;
+		return true;
+	}
+	*pret = 0;
+	return true;
+}
+
+/* Wait for all current chain lock holders to go away */
+static int tdb_mutex_drain_chains(struct tdb_mutexes *m, bool waitflag)
+{
+	uint32_t i;
+	int ret;
+
+	for (i = 1; i <= m->hash_size; i++) {
+		ret = chain_mutex_lock(&m->hashchains[i], waitflag);
+		if (ret != 0) {
+			return ret;
+		}
+		pthread_mutex_unlock(&m->hashchains[i]);
+	}
+	return 0;
+}
+
+/*
+  Take the allrecord lock: announce it in allrecord_lock so that new
+  chain lockers back off, then wait for the existing ones to finish.
+*/
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype,
+			     enum tdb_lock_flags flags)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	bool waitflag = (flags & TDB_LOCK_WAIT);
+	int ret;
+
+	if (tdb->flags & TDB_NOLOCK) {
+		return 0;
+	}
+
+	if (flags & TDB_LOCK_MARK_ONLY) {
+		return 0;
+	}
+
+	ret = allrecord_mutex_lock(m, waitflag);
+	if (ret != 0) {
+		goto fail;
+	}
+
+	if (m->allrecord_lock != F_UNLCK) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_allrecord_lock: "
+			 "allrecord_lock is %d with the mutex held\n",
+			 (int)m->allrecord_lock));
+		pthread_mutex_unlock(&m->allrecord_mutex);
+		ret = EIO;
+		goto fail;
+	}
+	m->allrecord_lock = ltype;
+
+	ret = tdb_mutex_drain_chains(m, waitflag);
+	if (ret != 0) {
+		m->allrecord_lock = F_UNLCK;
+		pthread_mutex_unlock(&m->allrecord_mutex);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	tdb->ecode = TDB_ERR_LOCK;
+	if (!(flags & TDB_LOCK_PROBE) && ret != EAGAIN) {
+		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_mutex_allrecord_lock "
+			 "failed: %s\n", strerror(ret)));
+	}
+	errno = ret;
+	return -1;
+}
+
+int tdb_mutex_allrecord_unlock(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	int ret;
+
+	if (tdb->flags & TDB_NOLOCK) {
+		return 0;
+	}
+
+	m->allrecord_lock = F_UNLCK;
+
+	ret = pthread_mutex_unlock(&m->allrecord_mutex);
+	if (ret != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_allrecord_unlock "
+			 "failed: %s\n", strerror(ret)));
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+/* Readers that got in under our read lock have to finish first */
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	int ret;
+
+	if (tdb->flags & TDB_NOLOCK) {
+		return 0;
+	}
+
+	m->allrecord_lock = F_WRLCK;
+
+	ret = tdb_mutex_drain_chains(m, true);
+	if (ret != 0) {
+		m->allrecord_lock = F_RDLCK;
+		tdb->ecode = TDB_ERR_LOCK;
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+void tdb_mutex_allrecord_downgrade(struct tdb_context *tdb)
+{
+	if (tdb->flags & TDB_NOLOCK) {
+		return;
+	}
+	tdb->mutexes->allrecord_lock = F_RDLCK;
+}
+
+/* Create and initialise the mutex area for a new database */
+int tdb_mutex_init(struct tdb_context *tdb, uint32_t hash_size)
+{
+	struct tdb_mutexes *m;
+	pthread_mutexattr_t ma;
+	struct stat st;
+	size_t size = tdb_mutex_size(hash_size);
+	char *path;
+	uint32_t i;
+	int fd, ret;
+
+	if (fstat(tdb->fd, &st) == -1) {
+		return -1;
+	}
+
+	path = tdb_mutex_path(tdb);
+	if (path == NULL) {
+		return -1;
+	}
+
+	fd = open(path, O_RDWR|O_CREAT, st.st_mode & 0777);
+	if (fd == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_init: "
+			 "could not open %s: %s\n", path, strerror(errno)));
+		SAFE_FREE(path);
+		return -1;
+	}
+	SAFE_FREE(path);
+
+	if (ftruncate(fd, size) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	m = (struct tdb_mutexes *)mmap(NULL, size, PROT_READ|PROT_WRITE,
+				       MAP_SHARED|MAP_FILE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		return -1;
+	}
+
+	memset(m, 0, size);
+	m->magic = TDB_MUTEX_MAGIC;
+	m->hash_size = hash_size;
+	m->allrecord_lock = F_UNLCK;
+
+	ret = pthread_mutexattr_init(&ma);
+	if (ret != 0) {
+		goto fail;
+	}
+	ret = pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	if (ret == 0) {
+		ret = pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	}
+	if (ret == 0) {
+		ret = pthread_mutex_init(&m->allrecord_mutex, &ma);
+	}
+	for (i = 0; ret == 0 && i <= hash_size; i++) {
+		ret = pthread_mutex_init(&m->hashchains[i], &ma);
+	}
+	pthread_mutexattr_destroy(&ma);
+	if (ret != 0) {
+		goto fail;
+	}
+
+	munmap(m, size);
+	return 0;
+
+fail:
+	TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_mutex_init: "
+		 "failed to initialise mutexes: %s\n", strerror(ret)));
+	munmap(m, size);
+	errno = ret;
+	return -1;
+}
+
+int tdb_mutex_mmap(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m;
+	struct stat st;
+	size_t size = tdb_mutex_size(tdb->header.hash_size);
+	char *path;
+	int fd;
+
+	if (!tdb_runtime_check_for_robust_mutexes()) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_mmap: "
+			 "%s needs robust mutexes which are not available\n",
+			 tdb->name));
+		errno = EINVAL;
+		return -1;
+	}
+
+	path = tdb_mutex_path(tdb);
+	if (path == NULL) {
+		return -1;
+	}
+
+	fd = open(path, O_RDWR);
+	if (fd == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_mmap: "
+			 "could not open %s: %s\n", path, strerror(errno)));
+		SAFE_FREE(path);
+		return -1;
+	}
+	SAFE_FREE(path);
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < size) {
+		close(fd);
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_mmap: "
+			 "mutex area of %s too small\n", tdb->name));
+		errno = EIO;
+		return -1;
+	}
+
+	m = (struct tdb_mutexes *)mmap(NULL, size, PROT_READ|PROT_WRITE,
+				       MAP_SHARED|MAP_FILE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		return -1;
+	}
+
+	if ((m->magic != TDB_MUTEX_MAGIC) ||
+	    (m->hash_size != tdb->header.hash_size)) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_mmap: "
+			 "mutex area does not match %s\n", tdb->name));
+		munmap(m, size);
+		errno = EIO;
+		return -1;
+	}
+
+	tdb->mutexes = m;
+	return 0;
+}
+
+int tdb_mutex_munmap(struct tdb_context *tdb)
+{
+	size_t size;
+	int ret;
+
+	if (tdb->mutexes == NULL) {
+		return 0;
+	}
+
+	size = tdb_mutex_size(tdb->mutexes->hash_size);
+	ret = munmap(tdb->mutexes, size);
+	tdb->mutexes = NULL;
+	return ret;
+}
+
+/*
+  Check that robust process shared mutexes actually work here: some
+  platforms have the functions but fail when they are used.
+*/
+_PUBLIC_ bool tdb_runtime_check_for_robust_mutexes(void)
+{
+	static int result = -1;
+	pthread_mutexattr_t ma;
+	pthread_mutex_t *m;
+	int ret;
+
+	if (result != -1) {
+		return result;
+	}
+	result = 0;
+
+	m = (pthread_mutex_t *)mmap(NULL, sizeof(pthread_mutex_t),
+				    PROT_READ|PROT_WRITE,
+				    MAP_SHARED|MAP_ANON, -1, 0);
+	if (m == MAP_FAILED) {
+		return false;
+	}
+
+	ret = pthread_mutexattr_init(&ma);
+	if (ret != 0) {
+		goto done;
+	}
+	ret = pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	if (ret == 0) {
+		ret = pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	}
+	if (ret == 0) {
+		ret = pthread_mutex_init(m, &ma);
+	}
+	pthread_mutexattr_destroy(&ma);
+	if (ret != 0) {
+		goto done;
+	}
+
+	if (pthread_mutex_lock(m) == 0 &&
+	    pthread_mutex_unlock(m) == 0) {
+		result = 1;
+	}
+	pthread_mutex_destroy(m);
+
+done:
+	munmap(m, sizeof(pthread_mutex_t));
+	return result;
+}
+
+#else
+
+bool tdb_have_mutexes(struct tdb_context *tdb)
+{
+	return false;
+}
+
+bool tdb_mutex_lock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		    bool waitflag, int *pret)
+{
+	return false;
+}
+
+bool tdb_mutex_unlock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		      int *pret)
+{
+	return false;
+}
+
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype,
+			     enum tdb_lock_flags flags)
+{
+	tdb->ecode = TDB_ERR_LOCK;
+	errno = ENOSYS;
+	return -1;
+}
+
+int tdb_mutex_allrecord_unlock(struct tdb_context *tdb)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb)
+{
+	tdb->ecode = TDB_ERR_LOCK;
+	errno = ENOSYS;
+	return -1;
+}
+
+void tdb_mutex_allrecord_downgrade(struct tdb_context *tdb)
+{
+}
+
+int tdb_mutex_init(struct tdb_context *tdb, uint32_t hash_size)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int tdb_mutex_mmap(struct tdb_context *tdb)
+{
+	TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_mmap: "
+		 "%s needs mutex locking which is not supported\n",
+		 tdb->name));
+	errno = EINVAL;
+	return -1;
+}
+
+int tdb_mutex_munmap(struct tdb_context *tdb)
+{
+	return 0;
+}
+
+_PUBLIC_ bool tdb_runtime_check_for_robust_mutexes(void)
+{
+	return false;
+}
+
+#endif /* USE_TDB_MUTEX_LOCKING */
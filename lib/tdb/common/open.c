@@ -75,6 +75,12 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	if (tdb->flags & TDB_INCOMPATIBLE_HASH)
 		newdb->rwlocks = TDB_HASH_RWLOCK_MAGIC;
 
+	/* The feature flags also keep out tdbs that don't know them. */
+	if (tdb->flags & TDB_MUTEX_LOCKING) {
+		newdb->rwlocks = TDB_FEATURE_FLAG_MAGIC;
+		newdb->feature_flags |= TDB_FEATURE_FLAG_MUTEX;
+	}
+
 	if (tdb->flags & TDB_INTERNAL) {
 		tdb->map_size = size;
 		tdb->map_ptr = (char *)newdb;
@@ -89,6 +95,10 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	if (ftruncate(tdb->fd, 0) == -1)
 		goto fail;
 
+	if ((tdb->flags & TDB_MUTEX_LOCKING) &&
+	    tdb_mutex_init(tdb, hash_size) == -1)
+		goto fail;
+
 	/* This creates an endian-converted header, as if read from disk */
 	CONVERT(*newdb);
 	memcpy(&tdb->header, newdb, sizeof(tdb->header));
@@ -260,6 +270,33 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		tdb->flags &= ~TDB_CLEAR_IF_FIRST;
 	}
 
+	if (tdb->flags & (TDB_NOLOCK|TDB_INTERNAL)) {
+		/* No locks, no mutexes */
+		tdb->flags &= ~TDB_MUTEX_LOCKING;
+	}
+
+	if (tdb->flags & TDB_MUTEX_LOCKING) {
+		/*
+		 * The mutex area is (re)initialised when the database
+		 * is created, which we only may do if nobody else has
+		 * it open.
+		 */
+		if (!(tdb->flags & TDB_CLEAR_IF_FIRST)) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+				 "TDB_MUTEX_LOCKING requires "
+				 "TDB_CLEAR_IF_FIRST for %s\n", name));
+			errno = EINVAL;
+			goto fail;
+		}
+		if (!tdb_runtime_check_for_robust_mutexes()) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+				 "TDB_MUTEX_LOCKING is not supported "
+				 "on this system\n"));
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+
 	if ((tdb->flags & TDB_ALLOW_NESTING) &&
 	    (tdb->flags & TDB_DISALLOW_NESTING)) {
 		tdb->ecode = TDB_ERR_NESTING;
@@ -376,11 +413,22 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		goto fail;
 
 	if (tdb->header.rwlocks != 0 &&
-	    tdb->header.rwlocks != TDB_HASH_RWLOCK_MAGIC) {
+	    tdb->header.rwlocks != TDB_HASH_RWLOCK_MAGIC &&
+	    tdb->header.rwlocks != TDB_FEATURE_FLAG_MAGIC) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: spinlocks no longer supported\n"));
 		goto fail;
 	}
 
+	if (tdb->header.rwlocks != TDB_FEATURE_FLAG_MAGIC) {
+		tdb->header.feature_flags = 0;
+	} else if (tdb->header.feature_flags & ~TDB_SUPPORTED_FEATURE_FLAGS) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			 "unsupported features 0x%x in %s\n",
+			 tdb->header.feature_flags, name));
+		errno = EIO;
+		goto fail;
+	}
+
 	if ((tdb->header.magic1_hash == 0) && (tdb->header.magic2_hash == 0)) {
 		/* older TDB without magic hash references */
 		tdb->hash_fn = tdb_old_hash;
@@ -423,6 +471,21 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 	tdb->device = st.st_dev;
 	tdb->inode = st.st_ino;
 	tdb_mmap(tdb);
+
+	/* Whoever created the database decides about the mutexes */
+	if (tdb->header.feature_flags & TDB_FEATURE_FLAG_MUTEX) {
+		if (!(tdb->flags & TDB_NOLOCK)) {
+			if (tdb_mutex_mmap(tdb) == -1) {
+				goto fail;
+			}
+			tdb->flags |= TDB_MUTEX_LOCKING;
+		}
+	} else if (tdb->flags & TDB_MUTEX_LOCKING) {
+		TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_open_ex: "
+			 "%s was created without TDB_MUTEX_LOCKING\n",
+			 name));
+		tdb->flags &= ~TDB_MUTEX_LOCKING;
+	}
 	if (locked) {
 		if (tdb_nest_unlock(tdb, ACTIVE_LOCK, F_WRLCK, false) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
@@ -491,6 +554,7 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		else
 			tdb_munmap(tdb);
 	}
+	tdb_mutex_munmap(tdb);
 	if (tdb->fd != -1)
 		if (close(tdb->fd) != 0)
 			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: failed to close tdb->fd on error!\n"));
@@ -532,6 +596,7 @@ _PUBLIC_ int tdb_close(struct tdb_context *tdb)
 		else
 			tdb_munmap(tdb);
 	}
+	tdb_mutex_munmap(tdb);
 	SAFE_FREE(tdb->name);
 	if (tdb->fd != -1) {
 		ret = close(tdb->fd);
@@ -19,6 +19,7 @@
 
 #define SUMMARY_FORMAT \
 	"Size of file/data: %u/%zu\n" \
+	"Number of remaps: %u\n" \
 	"Number of records: %zu\n" \
 	"Smallest/average/largest keys: %zu/%zu/%zu\n" \
 	"Smallest/average/largest data: %zu/%zu/%zu\n" \
@@ -163,13 +164,14 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 		tally_add(&hash, get_hash_length(tdb, off));
 
 	/* 20 is max length of a %zu. */
-	len = strlen(SUMMARY_FORMAT) + 35*20 + 1;
+	len = strlen(SUMMARY_FORMAT) + 36*20 + 1;
 	ret = (char *)malloc(len);
 	if (!ret)
 		goto unlock;
 
 	snprintf(ret, len, SUMMARY_FORMAT,
 		 tdb->map_size, keys.total+data.total,
+		 tdb->num_remaps,
 		 keys.num,
 		 keys.min, tally_mean(&keys), keys.max,
 		 data.min, tally_mean(&data), data.max,
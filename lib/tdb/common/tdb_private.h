@@ -53,6 +53,9 @@ typedef uint32_t tdb_off_t;
 #define TDB_RECOVERY_MAGIC (0xf53bc0e7U)
 #define TDB_RECOVERY_INVALID_MAGIC (0x0)
 #define TDB_HASH_RWLOCK_MAGIC (0xbad1a51U)
+#define TDB_FEATURE_FLAG_MAGIC (0xbad1a52U)
+#define TDB_FEATURE_FLAG_MUTEX 0x0001
+#define TDB_SUPPORTED_FEATURE_FLAGS (TDB_FEATURE_FLAG_MUTEX)
 #define TDB_ALIGNMENT 4
 #define DEFAULT_HASH_SIZE 131
 #define FREELIST_TOP (sizeof(struct tdb_header))
@@ -67,6 +70,7 @@ typedef uint32_t tdb_off_t;
 #define TDB_SEQNUM_OFS    offsetof(struct tdb_header, sequence_number)
 #define TDB_PAD_BYTE 0x42
 #define TDB_PAD_U32  0x42424242
+#define TDB_MAP_RESERVE_MIN (64*1024*1024)
 
 /* NB assumes there is a local variable called "tdb" that is the
  * current context, also takes doubly-parenthesized print-style
@@ -152,7 +156,8 @@ struct tdb_header {
 	tdb_off_t sequence_number; /* used when TDB_SEQNUM is set */
 	uint32_t magic1_hash; /* hash of TDB_MAGIC_FOOD. */
 	uint32_t magic2_hash; /* hash of TDB_MAGIC. */
-	tdb_off_t reserved[27];
+	uint32_t feature_flags; /* valid if rwlocks == TDB_FEATURE_FLAG_MAGIC */
+	tdb_off_t reserved[26];
 };
 
 struct tdb_lock_type {
@@ -166,6 +171,8 @@ struct tdb_traverse_lock {
 	uint32_t off;
 	uint32_t hash;
 	int lock_rw;
+	uint32_t hash_start; /* first chain of a range traverse */
+	uint32_t hash_end; /* end of a range traverse, 0 for all chains */
 };
 
 enum tdb_lock_flags {
@@ -186,11 +193,15 @@ struct tdb_methods {
 	int (*tdb_expand_file)(struct tdb_context *, tdb_off_t , tdb_off_t );
 };
 
+struct tdb_mutexes;
+
 struct tdb_context {
 	char *name; /* the name of the database */
 	void *map_ptr; /* where it is currently mapped */
 	int fd; /* open file descriptor for the database */
 	tdb_len_t map_size; /* how much space has been mapped */
+	size_t map_reserved; /* address space reserved at map_ptr */
+	uint32_t num_remaps; /* times the mapping had to be moved */
 	int read_only; /* opened read-only */
 	int traverse_read; /* read-only traversal */
 	int traverse_write; /* read-write traversal */
@@ -215,6 +226,7 @@ struct tdb_context {
 	int tracefd;
 #endif
 	volatile sig_atomic_t *interrupt_sig_ptr;
+	struct tdb_mutexes *mutexes; /* mmapped chain mutexes, if any */
 };
 
 
@@ -223,6 +235,7 @@ struct tdb_context {
 */
 int tdb_munmap(struct tdb_context *tdb);
 int tdb_mmap(struct tdb_context *tdb);
+int tdb_remap(struct tdb_context *tdb, tdb_len_t size);
 int tdb_lock(struct tdb_context *tdb, int list, int ltype);
 int tdb_lock_nonblock(struct tdb_context *tdb, int list, int ltype);
 int tdb_nest_lock(struct tdb_context *tdb, uint32_t offset, int ltype,
@@ -282,4 +295,17 @@ void tdb_header_hash(struct tdb_context *tdb,
 		     uint32_t *magic1_hash, uint32_t *magic2_hash);
 unsigned int tdb_old_hash(TDB_DATA *key);
 size_t tdb_dead_space(struct tdb_context *tdb, tdb_off_t off);
+bool tdb_have_mutexes(struct tdb_context *tdb);
+bool tdb_mutex_lock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		    bool waitflag, int *pret);
+bool tdb_mutex_unlock(struct tdb_context *tdb, int rw, off_t off, off_t len,
+		      int *pret);
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype,
+			     enum tdb_lock_flags flags);
+int tdb_mutex_allrecord_unlock(struct tdb_context *tdb);
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb);
+void tdb_mutex_allrecord_downgrade(struct tdb_context *tdb);
+int tdb_mutex_init(struct tdb_context *tdb, uint32_t hash_size);
+int tdb_mutex_mmap(struct tdb_context *tdb);
+int tdb_mutex_munmap(struct tdb_context *tdb);
 #endif /* TDB_PRIVATE_H */
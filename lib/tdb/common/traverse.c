@@ -35,10 +35,15 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			 struct tdb_record *rec)
 {
 	int want_next = (tlock->off != 0);
+	uint32_t hash_end = tdb->header.hash_size;
+
+	if (tlock->hash_end != 0 && tlock->hash_end < hash_end) {
+		hash_end = tlock->hash_end;
+	}
 
 	/* Lock each chain from the start one. */
-	for (; tlock->hash < tdb->header.hash_size; tlock->hash++) {
-		if (!tlock->off && tlock->hash != 0) {
+	for (; tlock->hash < hash_end; tlock->hash++) {
+		if (!tlock->off && tlock->hash != tlock->hash_start) {
 			/* this is an optimisation for the common case where
 			   the hash chain is empty, which is particularly
 			   common for the use of tdb with ldb, where large
@@ -68,7 +73,7 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			   system (testing using ldbtest).
 			*/
 			tdb->methods->next_hash_chain(tdb, &tlock->hash);
-			if (tlock->hash == tdb->header.hash_size) {
+			if (tlock->hash >= hash_end) {
 				continue;
 			}
 		}
@@ -234,6 +239,44 @@ _PUBLIC_ int tdb_traverse_read(struct tdb_context *tdb,
 	return ret;
 }
 
+/*
+  a read style traverse of the hash chains [start_chain, end_chain)
+
+  Traverses of disjoint chain ranges only take read locks on their own
+  chains, so they can run in parallel from separate processes.
+*/
+_PUBLIC_ int tdb_traverse_read_range(struct tdb_context *tdb,
+				     uint32_t start_chain, uint32_t end_chain,
+				     tdb_traverse_func fn, void *private_data)
+{
+	struct tdb_traverse_lock tl = { NULL, 0, 0, F_RDLCK };
+	int ret;
+
+	if (start_chain >= end_chain || end_chain > tdb->header.hash_size) {
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+
+	tl.hash = start_chain;
+	tl.hash_start = start_chain;
+	tl.hash_end = end_chain;
+
+	/* we need to get a read lock on the transaction lock here to
+	   cope with the lock ordering semantics of solaris10 */
+	if (tdb_transaction_lock(tdb, F_RDLCK, TDB_LOCK_WAIT)) {
+		return -1;
+	}
+
+	tdb->traverse_read++;
+	tdb_trace(tdb, "tdb_traverse_read_range_start");
+	ret = tdb_traverse_internal(tdb, fn, private_data, &tl);
+	tdb->traverse_read--;
+
+	tdb_transaction_unlock(tdb, F_RDLCK);
+
+	return ret;
+}
+
 /*
   a write style traverse - needs to get the transaction lock to
   prevent deadlocks
@@ -277,6 +320,7 @@ _PUBLIC_ TDB_DATA tdb_firstkey(struct tdb_context *tdb)
 	if (tdb_unlock_record(tdb, tdb->travlocks.off) != 0)
 		return tdb_null;
 	tdb->travlocks.off = tdb->travlocks.hash = 0;
+	tdb->travlocks.hash_start = tdb->travlocks.hash_end = 0;
 	tdb->travlocks.lock_rw = F_RDLCK;
 
 	/* Grab first record: locks chain and returned record. */
@@ -31,6 +31,7 @@ extern "C" {
 #endif
 
 #include <signal.h>
+#include <stdbool.h>
 
 /**
  * @defgroup tdb The tdb API
@@ -80,6 +81,7 @@ extern "C" {
 #define TDB_ALLOW_NESTING 512 /** Allow transactions to nest */
 #define TDB_DISALLOW_NESTING 1024 /** Disallow transactions to nest */
 #define TDB_INCOMPATIBLE_HASH 2048 /** Better hashing: can't be opened by tdb < 1.2.6. */
+#define TDB_MUTEX_LOCKING 4096 /** Use robust mutexes for chain locks: can't be opened by tdb < 1.2.13. */
 
 /** The tdb error codes */
 enum TDB_ERROR {TDB_SUCCESS=0, TDB_ERR_CORRUPT, TDB_ERR_IO, TDB_ERR_LOCK, 
@@ -143,12 +145,20 @@ struct tdb_logging_context {
  *                                        default 5.\n
  *                         TDB_ALLOW_NESTING - Allow transactions to nest.\n
  *                         TDB_DISALLOW_NESTING - Disallow transactions to nest.\n
+ *                         TDB_MUTEX_LOCKING - Use process shared robust
+ *                                             mutexes for the hash chain
+ *                                             locks. Requires
+ *                                             TDB_CLEAR_IF_FIRST, only
+ *                                             takes effect when creating
+ *                                             the database.\n
  *
  * @param[in]  open_flags Flags for the open(2) function.
  *
  * @param[in]  mode     The mode for the open(2) function.
  *
  * @return              A tdb context structure, NULL on error.
+ *
+ * @see tdb_runtime_check_for_robust_mutexes()
  */
 struct tdb_context *tdb_open(const char *name, int hash_size, int tdb_flags,
 		      int open_flags, mode_t mode);
@@ -434,6 +444,32 @@ int tdb_traverse(struct tdb_context *tdb, tdb_traverse_func fn, void *private_da
  */
 int tdb_traverse_read(struct tdb_context *tdb, tdb_traverse_func fn, void *private_data);
 
+/**
+ * @brief Traverse a range of hash chains of the database.
+ *
+ * This works like tdb_traverse_read(), but only visits the records in the
+ * hash chains from start_chain up to, but not including, end_chain. The
+ * number of hash chains is returned by tdb_hash_size(). Traverses of
+ * disjoint ranges only lock their own chains, so a database can be
+ * traversed in parallel by several processes, each taking a range.
+ *
+ * @param[in]  tdb      The database to traverse.
+ *
+ * @param[in]  start_chain The first hash chain to traverse.
+ *
+ * @param[in]  end_chain The hash chain to stop at.
+ *
+ * @param[in]  fn       The function to call on each entry.
+ *
+ * @param[in]  private_data The private data which should be passed to the
+ *                          traversing function.
+ *
+ * @return              The record count traversed, -1 on error.
+ */
+int tdb_traverse_read_range(struct tdb_context *tdb,
+			    uint32_t start_chain, uint32_t end_chain,
+			    tdb_traverse_func fn, void *private_data);
+
 /**
  * @brief Check if an entry in the database exists.
  *
@@ -740,6 +776,15 @@ size_t tdb_map_size(struct tdb_context *tdb);
  */
 int tdb_get_flags(struct tdb_context *tdb);
 
+/**
+ * @brief Check if robust process shared mutexes work on this system.
+ *
+ * TDB_MUTEX_LOCKING can only be used if this returns true.
+ *
+ * @return              true if TDB_MUTEX_LOCKING is usable, false if not.
+ */
+bool tdb_runtime_check_for_robust_mutexes(void);
+
 /**
  * @brief Add flags to the database.
  *
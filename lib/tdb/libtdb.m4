@@ -37,9 +37,17 @@ if test x"$INCLUDED_TDB" != x"no" ; then
        AC_MSG_ERROR([cannot find tdb source in $tdbpaths])
     fi
     TDB_OBJ="common/tdb.o common/dump.o common/transaction.o common/error.o common/traverse.o"
-    TDB_OBJ="$TDB_OBJ common/freelist.o common/freelistcheck.o common/io.o common/lock.o common/open.o common/check.o common/hash.o common/summary.o common/rescue.o"
+    TDB_OBJ="$TDB_OBJ common/freelist.o common/freelistcheck.o common/io.o common/lock.o common/mutex.o common/open.o common/check.o common/hash.o common/summary.o common/rescue.o"
     AC_SUBST(TDB_OBJ)
 
+    dnl robust process shared mutexes for TDB_MUTEX_LOCKING
+    AC_SEARCH_LIBS(pthread_mutexattr_setrobust, pthread)
+    AC_CHECK_FUNCS(pthread_mutexattr_setrobust pthread_mutex_consistent)
+    if test x"$ac_cv_func_pthread_mutexattr_setrobust" = x"yes" -a \
+            x"$ac_cv_func_pthread_mutex_consistent" = x"yes" ; then
+        AC_DEFINE(USE_TDB_MUTEX_LOCKING, 1, [Whether tdb can use robust mutexes for chain locks])
+    fi
+
     TDB_LIBS=""
     AC_SUBST(TDB_LIBS)
 
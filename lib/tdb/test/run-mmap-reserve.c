@@ -0,0 +1,115 @@
+#include "../common/tdb_private.h"
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/mutex.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "../common/summary.c"
+#include "tap-interface.h"
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+#define TEST_DB "run-mmap-reserve.tdb"
+
+static bool store_big(struct tdb_context *tdb, const char *k, size_t len)
+{
+	TDB_DATA key, data;
+	bool ret;
+
+	key.dptr = (unsigned char *)k;
+	key.dsize = strlen(k);
+	data.dsize = len;
+	data.dptr = calloc(1, len);
+	if (data.dptr == NULL) {
+		return false;
+	}
+	ret = (tdb_store(tdb, key, data, TDB_REPLACE) == 0);
+	free(data.dptr);
+	return ret;
+}
+
+/* Grow the file from another process */
+static bool grow_in_child(struct tdb_context *tdb, size_t len)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid == 0) {
+		/* Don't reuse the parent's handle */
+		tdb_close(tdb);
+		tdb = tdb_open_ex(TEST_DB, 0, TDB_DEFAULT, O_RDWR, 0,
+				  &taplogctx, NULL);
+		if (tdb == NULL || !store_big(tdb, "child", len)) {
+			_exit(1);
+		}
+		tdb_close(tdb);
+		_exit(0);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) != pid) {
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	TDB_DATA key, data;
+	void *map_ptr;
+	tdb_len_t map_size;
+	char *summary;
+
+	plan_tests(14);
+
+	tdb = tdb_open_ex(TEST_DB, 131, TDB_CLEAR_IF_FIRST,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->map_ptr);
+
+	if (sizeof(void *) < 8) {
+		diag("no mmap reservation on 32 bit platforms, skipping");
+		tdb_close(tdb);
+		return exit_status();
+	}
+	ok1(tdb->map_reserved >= TDB_MAP_RESERVE_MIN);
+
+	/* Growing within the reservation keeps the mapping in place */
+	map_ptr = tdb->map_ptr;
+	map_size = tdb->map_size;
+	ok1(store_big(tdb, "parent", 1024*1024));
+	ok1(tdb->map_size > map_size);
+	ok1(tdb->map_ptr == map_ptr);
+	ok1(tdb->num_remaps == 0);
+
+	/* So does growth by someone else */
+	map_size = tdb->map_size;
+	ok1(grow_in_child(tdb, 4*1024*1024));
+	key.dptr = (unsigned char *)"child";
+	key.dsize = strlen("child");
+	data = tdb_fetch(tdb, key);
+	ok1(data.dsize == 4*1024*1024);
+	free(data.dptr);
+	ok1(tdb->map_size > map_size);
+	ok1(tdb->map_ptr == map_ptr && tdb->num_remaps == 0);
+
+	/* Outgrowing it moves the mapping once */
+	ok1(store_big(tdb, "parent", TDB_MAP_RESERVE_MIN));
+	ok1(tdb->num_remaps == 1);
+
+	summary = tdb_summary(tdb);
+	ok1(summary && strstr(summary, "Number of remaps: 1\n"));
+	free(summary);
+
+	tdb_close(tdb);
+
+	return exit_status();
+}
@@ -0,0 +1,127 @@
+#include "../common/tdb_private.h"
+#include "lock-tracking.h"
+#define fcntl fcntl_with_lockcheck
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/mutex.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "tap-interface.h"
+#undef fcntl
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+#define TEST_DB "run-mutex.tdb"
+
+enum child_op {
+	CHAINLOCK_NONBLOCK,	/* try to lock key's chain, report result */
+	CHAINLOCK_AND_DIE,	/* lock key's chain, exit holding it */
+	LOCKALL_AND_DIE,	/* lock the whole db, exit holding it */
+};
+
+/* Run op in a child with its own tdb handle, return its exit code */
+static int run_child(struct tdb_context *tdb, enum child_op op, TDB_DATA key)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid == 0) {
+		struct tdb_context *ctdb;
+
+		/* Don't reuse the parent's handle, it knows its locks */
+		tdb_close(tdb);
+		ctdb = tdb_open_ex(TEST_DB, 0, TDB_DEFAULT, O_RDWR, 0,
+				   &taplogctx, NULL);
+		if (ctdb == NULL) {
+			_exit(2);
+		}
+		if (!(tdb_get_flags(ctdb) & TDB_MUTEX_LOCKING)) {
+			_exit(3);
+		}
+		switch (op) {
+		case CHAINLOCK_NONBLOCK:
+			if (tdb_chainlock_nonblock(ctdb, key) != 0) {
+				_exit(1);
+			}
+			tdb_chainunlock(ctdb, key);
+			_exit(0);
+		case CHAINLOCK_AND_DIE:
+			_exit(tdb_chainlock(ctdb, key) == 0 ? 0 : 1);
+		case LOCKALL_AND_DIE:
+			_exit(tdb_lockall(ctdb) == 0 ? 0 : 1);
+		}
+		_exit(4);
+	}
+
+	if (pid == -1 || waitpid(pid, &status, 0) != pid) {
+		return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	TDB_DATA key, key2, data;
+
+	plan_tests(19);
+
+	if (!tdb_runtime_check_for_robust_mutexes()) {
+		diag("robust mutexes not supported, skipping");
+		return exit_status();
+	}
+
+	key.dptr = (void *)"hi";
+	key.dsize = strlen("hi");
+	key2.dptr = (void *)"there";
+	key2.dsize = strlen("there");
+	data = key;
+
+	/* The mutexes are set up on creation, so CLEAR_IF_FIRST is needed */
+	tdb = tdb_open_ex(TEST_DB, 1024, TDB_MUTEX_LOCKING,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb == NULL && errno == EINVAL);
+
+	tdb = tdb_open_ex(TEST_DB, 1024, TDB_CLEAR_IF_FIRST|TDB_MUTEX_LOCKING,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb_get_flags(tdb) & TDB_MUTEX_LOCKING);
+	ok1(tdb_store(tdb, key, data, TDB_INSERT) == 0);
+	ok1(tdb_store(tdb, key2, data, TDB_INSERT) == 0);
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+
+	/* A held chain lock keeps others out, other chains are free */
+	ok1(tdb_chainlock(tdb, key) == 0);
+	ok1(run_child(tdb, CHAINLOCK_NONBLOCK, key) == 1);
+	ok1(run_child(tdb, CHAINLOCK_NONBLOCK, key2) == 0);
+	ok1(tdb_chainunlock(tdb, key) == 0);
+	ok1(run_child(tdb, CHAINLOCK_NONBLOCK, key) == 0);
+
+	/* An allrecord lock keeps out all chain lockers */
+	ok1(tdb_lockall(tdb) == 0);
+	ok1(run_child(tdb, CHAINLOCK_NONBLOCK, key2) == 1);
+	ok1(tdb_unlockall(tdb) == 0);
+
+	/* Locks of dead processes are released */
+	ok1(run_child(tdb, CHAINLOCK_AND_DIE, key) == 0);
+	ok1(tdb_chainlock(tdb, key) == 0);
+	ok1(tdb_chainunlock(tdb, key) == 0);
+
+	ok1(run_child(tdb, LOCKALL_AND_DIE, key) == 0);
+	ok1(tdb_chainlock_nonblock(tdb, key2) == 0);
+	tdb_chainunlock(tdb, key2);
+
+	tdb_close(tdb);
+
+	return exit_status();
+}
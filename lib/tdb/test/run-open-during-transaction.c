@@ -18,6 +18,7 @@ static int ftruncate_check(int fd, off_t length);
 #include "../common/transaction.c"
 #include "../common/error.c"
 #include "../common/open.c"
+#include "../common/mutex.c"
 #include "../common/check.c"
 #include "../common/hash.c"
 #include "tap-interface.h"
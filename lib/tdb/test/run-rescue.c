@@ -7,6 +7,7 @@
 #include "../common/transaction.c"
 #include "../common/error.c"
 #include "../common/open.c"
+#include "../common/mutex.c"
 #include "../common/check.c"
 #include "../common/hash.c"
 #include "../common/rescue.c"
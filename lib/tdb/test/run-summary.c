@@ -7,6 +7,7 @@
 #include "../common/transaction.c"
 #include "../common/error.c"
 #include "../common/open.c"
+#include "../common/mutex.c"
 #include "../common/check.c"
 #include "../common/hash.c"
 #include "../common/summary.c"
@@ -24,7 +25,7 @@ int main(int argc, char *argv[])
 	TDB_DATA data = { (unsigned char *)&j, sizeof(j) };
 	char *summary;
 
-	plan_tests(sizeof(flags) / sizeof(flags[0]) * 14);
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 15);
 	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
 		tdb = tdb_open("run-summary.tdb", 131, flags[i],
 			       O_RDWR|O_CREAT|O_TRUNC, 0600);
@@ -43,6 +44,7 @@ int main(int argc, char *argv[])
 		summary = tdb_summary(tdb);
 		diag("%s", summary);
 		ok1(strstr(summary, "Size of file/data: "));
+		ok1(strstr(summary, "Number of remaps: 0\n"));
 		ok1(strstr(summary, "Number of records: 500\n"));
 		ok1(strstr(summary, "Smallest/average/largest keys: 4/4/4\n"));
 		ok1(strstr(summary, "Smallest/average/largest data: 0/2/4\n"));
@@ -35,6 +35,7 @@ static inline int fake_fdatasync(int fd)
 #include "../common/transaction.c"
 #include "../common/error.c"
 #include "../common/open.c"
+#include "../common/mutex.c"
 #include "../common/check.c"
 #include "../common/hash.c"
 #include "tap-interface.h"
@@ -0,0 +1,148 @@
+#include "../common/tdb_private.h"
+#include "lock-tracking.h"
+#define fcntl fcntl_with_lockcheck
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/mutex.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "tap-interface.h"
+#undef fcntl
+#include <stdlib.h>
+#include <stdbool.h>
+#include "external-agent.h"
+#include "logging.h"
+
+#define NUM_RECORDS 100
+#define NUM_CHAINS 31
+
+static struct agent *agent;
+
+struct range_state {
+	uint32_t start, end;
+	uint32_t agent_chain;
+	int seen[NUM_RECORDS];
+	bool wrong_chain;
+	bool agent_tried;
+	bool agent_blocked;
+};
+
+static int traverse(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data,
+		    void *p)
+{
+	struct range_state *state = p;
+	uint32_t chain = BUCKET(tdb->hash_fn(&key));
+	char buf[16];
+	int i;
+
+	if (chain < state->start || chain >= state->end) {
+		state->wrong_chain = true;
+	}
+
+	snprintf(buf, sizeof(buf), "%.*s", (int)key.dsize, (char *)key.dptr);
+	i = atoi(buf);
+	if (i >= 0 && i < NUM_RECORDS) {
+		state->seen[i]++;
+	}
+
+	/* Chains outside the range must not be locked */
+	if (!state->agent_tried &&
+	    (state->agent_chain < state->start ||
+	     state->agent_chain >= state->end)) {
+		state->agent_tried = true;
+		if (external_agent_operation(agent, STORE, "0") != SUCCESS) {
+			state->agent_blocked = true;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	struct range_state state;
+	TDB_DATA key, data;
+	char buf[16];
+	uint32_t ranges[] = { 0, 7, 19, NUM_CHAINS };
+	int i, j, count, total;
+	bool once;
+
+	plan_tests(13);
+	agent = prepare_external_agent();
+
+	tdb = tdb_open_ex("run-traverse-range.tdb", NUM_CHAINS,
+			  TDB_CLEAR_IF_FIRST, O_CREAT|O_TRUNC|O_RDWR,
+			  0600, &taplogctx, NULL);
+	ok1(tdb);
+
+	for (i = 0; i < NUM_RECORDS; i++) {
+		snprintf(buf, sizeof(buf), "%d", i);
+		key.dptr = (void *)buf;
+		key.dsize = strlen(buf);
+		data.dptr = (void *)buf;
+		data.dsize = strlen(buf);
+		if (tdb_store(tdb, key, data, TDB_INSERT) != 0) {
+			break;
+		}
+	}
+	ok1(i == NUM_RECORDS);
+
+	ok1(external_agent_operation(agent, OPEN, tdb_name(tdb)) == SUCCESS);
+
+	/* Disjoint ranges see every record exactly once */
+	memset(&state, 0, sizeof(state));
+	key.dptr = (void *)"0";
+	key.dsize = 1;
+	state.agent_chain = BUCKET(tdb->hash_fn(&key));
+	total = 0;
+	for (j = 0; j < 3; j++) {
+		state.agent_tried = false;
+		state.start = ranges[j];
+		state.end = ranges[j+1];
+		count = tdb_traverse_read_range(tdb, state.start, state.end,
+						traverse, &state);
+		if (count > 0) {
+			total += count;
+		}
+	}
+	ok1(total == NUM_RECORDS);
+	ok1(!state.wrong_chain);
+	ok1(!state.agent_blocked);
+
+	once = true;
+	for (i = 0; i < NUM_RECORDS; i++) {
+		if (state.seen[i] != 1) {
+			once = false;
+		}
+	}
+	ok1(once);
+
+	/* The whole range is the same as a full traverse */
+	memset(&state, 0, sizeof(state));
+	state.end = NUM_CHAINS;
+	state.agent_tried = true;
+	ok1(tdb_traverse_read_range(tdb, 0, NUM_CHAINS, traverse, &state)
+	    == tdb_traverse_read(tdb, NULL, NULL));
+
+	/* Invalid ranges */
+	ok1(tdb_traverse_read_range(tdb, 5, 5, traverse, &state) == -1);
+	ok1(tdb_error(tdb) == TDB_ERR_EINVAL);
+	ok1(tdb_traverse_read_range(tdb, 0, NUM_CHAINS+1, traverse, &state) == -1);
+
+	/* No locks are left behind */
+	ok1(external_agent_operation(agent, TRANSACTION_START, tdb_name(tdb))
+	    == SUCCESS);
+	ok1(external_agent_operation(agent, TRANSACTION_COMMIT, tdb_name(tdb))
+	    == SUCCESS);
+
+	tdb_close(tdb);
+
+	return exit_status();
+}
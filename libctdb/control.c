@@ -0,0 +1,471 @@
+/*
+   libctdb control wrappers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "libctdb_private.h"
+
+/* Remove type-safety macros. */
+#undef ctdb_getrecmaster_send
+#undef ctdb_getrecmode_send
+#undef ctdb_getpnn_send
+#undef ctdb_getdbstat_send
+#undef ctdb_check_message_handlers_send
+#undef ctdb_getcapabilities_send
+#undef ctdb_getdbseqnum_send
+#undef ctdb_getnodemap_send
+#undef ctdb_getifaces_send
+#undef ctdb_getpublicips_send
+#undef ctdb_getvnnmap_send
+
+/* Queue a control for destnode */
+static struct ctdb_request *send_control(struct ctdb_connection *ctdb,
+					 uint32_t opcode, uint32_t destnode,
+					 const void *indata, size_t inlen,
+					 ctdb_callback_t callback,
+					 void *private_data)
+{
+	struct ctdb_request *req;
+
+	req = new_ctdb_control_request(ctdb, opcode, destnode, 0,
+				       indata, inlen, callback, private_data);
+	if (req == NULL) {
+		DEBUG(ctdb, LOG_ERR, "Failed to allocate control %u", opcode);
+		return NULL;
+	}
+	ctdb_queue_request(ctdb, req);
+	return req;
+}
+
+/* Unpack a control whose answer is the status */
+static bool recv_status(struct ctdb_connection *ctdb,
+			struct ctdb_request *req,
+			enum ctdb_controls opcode,
+			const char *name,
+			uint32_t *result)
+{
+	struct ctdb_reply_control *reply;
+
+	reply = unpack_reply_control(req, opcode);
+	if (!reply || reply->status == -1) {
+		DEBUG(ctdb, LOG_ERR, "%s_recv: status -1", name);
+		return false;
+	}
+	*result = reply->status;
+	return true;
+}
+
+/* Unpack a control whose answer is in the data, at least minlen bytes */
+static struct ctdb_reply_control *recv_data(struct ctdb_connection *ctdb,
+					    struct ctdb_request *req,
+					    enum ctdb_controls opcode,
+					    const char *name,
+					    size_t minlen)
+{
+	struct ctdb_reply_control *reply;
+
+	reply = unpack_reply_control(req, opcode);
+	if (!reply || reply->status == -1) {
+		DEBUG(ctdb, LOG_ERR, "%s_recv: status -1", name);
+		return NULL;
+	}
+	if (reply->datalen < minlen) {
+		DEBUG(ctdb, LOG_ERR, "%s_recv: returned data is %d bytes",
+		      name, reply->datalen);
+		return NULL;
+	}
+	return reply;
+}
+
+struct ctdb_request *ctdb_getrecmaster_send(struct ctdb_connection *ctdb,
+					    uint32_t destnode,
+					    ctdb_callback_t callback,
+					    void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_GET_RECMASTER, destnode,
+			    NULL, 0, callback, private_data);
+}
+
+bool ctdb_getrecmaster_recv(struct ctdb_connection *ctdb,
+			    struct ctdb_request *req, uint32_t *recmaster)
+{
+	return recv_status(ctdb, req, CTDB_CONTROL_GET_RECMASTER,
+			   "ctdb_getrecmaster", recmaster);
+}
+
+struct ctdb_request *ctdb_getrecmode_send(struct ctdb_connection *ctdb,
+					  uint32_t destnode,
+					  ctdb_callback_t callback,
+					  void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_GET_RECMODE, destnode,
+			    NULL, 0, callback, private_data);
+}
+
+bool ctdb_getrecmode_recv(struct ctdb_connection *ctdb,
+			  struct ctdb_request *req, uint32_t *recmode)
+{
+	return recv_status(ctdb, req, CTDB_CONTROL_GET_RECMODE,
+			   "ctdb_getrecmode", recmode);
+}
+
+struct ctdb_request *ctdb_getpnn_send(struct ctdb_connection *ctdb,
+				      uint32_t destnode,
+				      ctdb_callback_t callback,
+				      void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_GET_PNN, destnode,
+			    NULL, 0, callback, private_data);
+}
+
+bool ctdb_getpnn_recv(struct ctdb_connection *ctdb,
+		      struct ctdb_request *req, uint32_t *pnn)
+{
+	return recv_status(ctdb, req, CTDB_CONTROL_GET_PNN,
+			   "ctdb_getpnn", pnn);
+}
+
+struct ctdb_request *ctdb_getcapabilities_send(struct ctdb_connection *ctdb,
+					       uint32_t destnode,
+					       ctdb_callback_t callback,
+					       void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_GET_CAPABILITIES, destnode,
+			    NULL, 0, callback, private_data);
+}
+
+bool ctdb_getcapabilities_recv(struct ctdb_connection *ctdb,
+			       struct ctdb_request *req,
+			       uint32_t *capabilities)
+{
+	struct ctdb_reply_control *reply;
+
+	reply = recv_data(ctdb, req, CTDB_CONTROL_GET_CAPABILITIES,
+			  "ctdb_getcapabilities", sizeof(uint32_t));
+	if (reply == NULL) {
+		return false;
+	}
+	memcpy(capabilities, reply->data, sizeof(uint32_t));
+	return true;
+}
+
+struct ctdb_request *ctdb_getdbstat_send(struct ctdb_connection *ctdb,
+					 uint32_t destnode,
+					 uint32_t db_id,
+					 ctdb_callback_t callback,
+					 void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_GET_DB_STATISTICS, destnode,
+			    &db_id, sizeof(db_id), callback, private_data);
+}
+
+bool ctdb_getdbstat_recv(struct ctdb_connection *ctdb,
+			 struct ctdb_request *req,
+			 struct ctdb_db_statistics **stat)
+{
+	struct ctdb_reply_control *reply;
+	struct ctdb_db_statistics *wire, *s;
+	const uint8_t *ptr, *end;
+	uint32_t i;
+
+	*stat = NULL;
+	reply = recv_data(ctdb, req, CTDB_CONTROL_GET_DB_STATISTICS,
+			  "ctdb_getdbstat",
+			  offsetof(struct ctdb_db_statistics, hot_keys_wire));
+	if (reply == NULL) {
+		return false;
+	}
+
+	wire = (struct ctdb_db_statistics *)reply->data;
+	if (wire->num_hot_keys > MAX_HOT_KEYS) {
+		DEBUG(ctdb, LOG_ERR, "ctdb_getdbstat_recv: %u hot keys",
+		      wire->num_hot_keys);
+		return false;
+	}
+
+	s = malloc(sizeof(*s));
+	if (s == NULL) {
+		return false;
+	}
+	memcpy(s, wire, offsetof(struct ctdb_db_statistics, hot_keys_wire));
+
+	/* The keys follow the structure, in order */
+	ptr = (const uint8_t *)wire->hot_keys_wire;
+	end = reply->data + reply->datalen;
+	for (i = 0; i < s->num_hot_keys; i++) {
+		s->hot_keys[i].key.dptr = NULL;
+	}
+	for (i = 0; i < s->num_hot_keys; i++) {
+		size_t len = s->hot_keys[i].key.dsize;
+
+		if (len > (size_t)(end - ptr)) {
+			DEBUG(ctdb, LOG_ERR,
+			      "ctdb_getdbstat_recv: truncated hot keys");
+			s->num_hot_keys = i;
+			ctdb_free_dbstat(s);
+			return false;
+		}
+		s->hot_keys[i].key.dptr = malloc(len + 1);
+		if (s->hot_keys[i].key.dptr == NULL) {
+			s->num_hot_keys = i;
+			ctdb_free_dbstat(s);
+			return false;
+		}
+		memcpy(s->hot_keys[i].key.dptr, ptr, len);
+		ptr += len;
+	}
+
+	*stat = s;
+	return true;
+}
+
+void ctdb_free_dbstat(struct ctdb_db_statistics *stat)
+{
+	uint32_t i;
+
+	if (stat == NULL) {
+		return;
+	}
+	for (i = 0; i < stat->num_hot_keys; i++) {
+		free(stat->hot_keys[i].key.dptr);
+	}
+	free(stat);
+}
+
+struct ctdb_request *
+ctdb_check_message_handlers_send(struct ctdb_connection *ctdb,
+				 uint32_t destnode,
+				 uint32_t num,
+				 uint64_t *mhs,
+				 ctdb_callback_t callback,
+				 void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_CHECK_SRVIDS, destnode,
+			    mhs, num * sizeof(uint64_t),
+			    callback, private_data);
+}
+
+bool ctdb_check_message_handlers_recv(struct ctdb_connection *ctdb,
+				      struct ctdb_request *req,
+				      uint32_t num,
+				      uint8_t *result)
+{
+	struct ctdb_reply_control *reply;
+	uint32_t i;
+
+	reply = recv_data(ctdb, req, CTDB_CONTROL_CHECK_SRVIDS,
+			  "ctdb_check_message_handlers", (num+7)/8);
+	if (reply == NULL) {
+		return false;
+	}
+	/* ctdbd answers with a bitmap */
+	for (i = 0; i < num; i++) {
+		result[i] = (reply->data[i/8] & (1 << (i%8))) ? 1 : 0;
+	}
+	return true;
+}
+
+struct ctdb_request *ctdb_getdbseqnum_send(struct ctdb_connection *ctdb,
+					   uint32_t destnode,
+					   uint32_t dbid,
+					   ctdb_callback_t callback,
+					   void *private_data)
+{
+	uint8_t indata[sizeof(uint64_t)];
+
+	/* ctdbd insists on 64 bits, of which it reads the first 32 */
+	memset(indata, 0, sizeof(indata));
+	memcpy(indata, &dbid, sizeof(dbid));
+	return send_control(ctdb, CTDB_CONTROL_GET_DB_SEQNUM, destnode,
+			    indata, sizeof(indata), callback, private_data);
+}
+
+bool ctdb_getdbseqnum_recv(struct ctdb_connection *ctdb,
+			   struct ctdb_request *req, uint64_t *seqnum)
+{
+	struct ctdb_reply_control *reply;
+
+	reply = recv_data(ctdb, req, CTDB_CONTROL_GET_DB_SEQNUM,
+			  "ctdb_getdbseqnum", sizeof(uint64_t));
+	if (reply == NULL) {
+		return false;
+	}
+	memcpy(seqnum, reply->data, sizeof(uint64_t));
+	return true;
+}
+
+/* Hand out a malloc'ed copy of a control's answer */
+static void *recv_copy(struct ctdb_connection *ctdb,
+		       struct ctdb_request *req,
+		       enum ctdb_controls opcode,
+		       const char *name,
+		       size_t hdrlen, size_t elemlen)
+{
+	struct ctdb_reply_control *reply;
+	uint32_t num;
+	void *copy;
+
+	reply = recv_data(ctdb, req, opcode, name, hdrlen);
+	if (reply == NULL) {
+		return NULL;
+	}
+	/* every one of these starts with the number of elements */
+	memcpy(&num, reply->data, sizeof(num));
+	if (reply->datalen < hdrlen + (size_t)num * elemlen) {
+		DEBUG(ctdb, LOG_ERR, "%s_recv: %u entries in %u bytes",
+		      name, num, reply->datalen);
+		return NULL;
+	}
+
+	copy = malloc(reply->datalen);
+	if (copy == NULL) {
+		DEBUG(ctdb, LOG_ERR, "%s_recv: out of memory", name);
+		return NULL;
+	}
+	memcpy(copy, reply->data, reply->datalen);
+	return copy;
+}
+
+struct ctdb_request *ctdb_getnodemap_send(struct ctdb_connection *ctdb,
+					  uint32_t destnode,
+					  ctdb_callback_t callback,
+					  void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_GET_NODEMAP, destnode,
+			    NULL, 0, callback, private_data);
+}
+
+bool ctdb_getnodemap_recv(struct ctdb_connection *ctdb,
+			  struct ctdb_request *req,
+			  struct ctdb_node_map **nodemap)
+{
+	*nodemap = recv_copy(ctdb, req, CTDB_CONTROL_GET_NODEMAP,
+			     "ctdb_getnodemap",
+			     offsetof(struct ctdb_node_map, nodes),
+			     sizeof(struct ctdb_node_and_flags));
+	return *nodemap != NULL;
+}
+
+void ctdb_free_nodemap(struct ctdb_node_map *nodemap)
+{
+	free(nodemap);
+}
+
+struct ctdb_request *ctdb_getifaces_send(struct ctdb_connection *ctdb,
+					 uint32_t destnode,
+					 ctdb_callback_t callback,
+					 void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_GET_IFACES, destnode,
+			    NULL, 0, callback, private_data);
+}
+
+bool ctdb_getifaces_recv(struct ctdb_connection *ctdb,
+			 struct ctdb_request *req,
+			 struct ctdb_ifaces_list **ifaces)
+{
+	*ifaces = recv_copy(ctdb, req, CTDB_CONTROL_GET_IFACES,
+			    "ctdb_getifaces",
+			    offsetof(struct ctdb_ifaces_list, ifaces),
+			    sizeof(struct ctdb_iface_info));
+	return *ifaces != NULL;
+}
+
+void ctdb_free_ifaces(struct ctdb_ifaces_list *ifaces)
+{
+	free(ifaces);
+}
+
+struct ctdb_request *ctdb_getpublicips_send(struct ctdb_connection *ctdb,
+					    uint32_t destnode,
+					    ctdb_callback_t callback,
+					    void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_GET_PUBLIC_IPS, destnode,
+			    NULL, 0, callback, private_data);
+}
+
+bool ctdb_getpublicips_recv(struct ctdb_connection *ctdb,
+			    struct ctdb_request *req,
+			    struct ctdb_all_public_ips **ips)
+{
+	*ips = recv_copy(ctdb, req, CTDB_CONTROL_GET_PUBLIC_IPS,
+			 "ctdb_getpublicips",
+			 offsetof(struct ctdb_all_public_ips, ips),
+			 sizeof(struct ctdb_public_ip));
+	return *ips != NULL;
+}
+
+void ctdb_free_publicips(struct ctdb_all_public_ips *ips)
+{
+	free(ips);
+}
+
+struct ctdb_request *ctdb_getvnnmap_send(struct ctdb_connection *ctdb,
+					 uint32_t destnode,
+					 ctdb_callback_t callback,
+					 void *private_data)
+{
+	return send_control(ctdb, CTDB_CONTROL_GETVNNMAP, destnode,
+			    NULL, 0, callback, private_data);
+}
+
+bool ctdb_getvnnmap_recv(struct ctdb_connection *ctdb,
+			 struct ctdb_request *req,
+			 struct ctdb_vnn_map **vnnmap)
+{
+	struct ctdb_reply_control *reply;
+	struct ctdb_vnn_map_wire *map;
+	struct ctdb_vnn_map *tmap;
+	size_t len;
+
+	*vnnmap = NULL;
+	reply = recv_data(ctdb, req, CTDB_CONTROL_GETVNNMAP,
+			  "ctdb_getvnnmap",
+			  offsetof(struct ctdb_vnn_map_wire, map));
+	if (reply == NULL) {
+		return false;
+	}
+
+	map = (struct ctdb_vnn_map_wire *)reply->data;
+	len = offsetof(struct ctdb_vnn_map_wire, map)
+		+ (size_t)map->size * sizeof(uint32_t);
+	if (reply->datalen < len) {
+		DEBUG(ctdb, LOG_ERR, "ctdb_getvnnmap_recv: %u entries in %u bytes",
+		      map->size, reply->datalen);
+		return false;
+	}
+
+	tmap = malloc(sizeof(*tmap));
+	if (tmap == NULL) {
+		return false;
+	}
+	tmap->generation = map->generation;
+	tmap->size = map->size;
+	tmap->map = malloc(sizeof(uint32_t) * map->size + 1);
+	if (tmap->map == NULL) {
+		free(tmap);
+		return false;
+	}
+	memcpy(tmap->map, map->map, sizeof(uint32_t) * map->size);
+
+	*vnnmap = tmap;
+	return true;
+}
+
+void ctdb_free_vnnmap(struct ctdb_vnn_map *vnnmap)
+{
+	free(vnnmap->map);
+	free(vnnmap);
+}
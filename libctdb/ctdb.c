@@ -0,0 +1,1176 @@
+/*
+   core of libctdb
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "libctdb_private.h"
+#include "system/filesys.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+/* Remove type-safety macros. */
+#undef ctdb_connect
+#undef ctdb_attachdb_send
+#undef ctdb_readrecordlock_async
+#undef ctdb_getpnn_send
+
+/* how many queued packets are handed to a single writev() */
+#define CTDB_MAX_IOV 64
+
+/* minimum size of the input buffer */
+#define CTDB_IN_BUFSIZE 16384
+
+struct ctdb_db {
+	struct ctdb_connection *ctdb;
+	bool persistent;
+	uint32_t tdb_flags;
+	uint32_t id;
+	struct tdb_context *tdb;
+
+	/* the request the user was handed by ctdb_attachdb_send() */
+	struct ctdb_request *attach_req;
+	ctdb_callback_t callback;
+	void *private_data;
+};
+
+struct ctdb_lock {
+	struct ctdb_lock *next, *prev;
+	struct ctdb_db *ctdb_db;
+	TDB_DATA key;
+	bool readonly;
+	/* we already asked ctdbd for a read-only copy */
+	bool tried_readonly;
+
+	/* the record as fetched (header included), while the lock is held */
+	TDB_DATA data;
+	struct ctdb_ltdb_header hdr;
+
+	ctdb_rrl_callback_t callback;
+	void *cbdata;
+};
+
+static void set_pnn(struct ctdb_connection *ctdb,
+		    struct ctdb_request *req,
+		    void *unused)
+{
+	if (!ctdb_getpnn_recv(ctdb, req, &ctdb->pnn)) {
+		DEBUG(ctdb, LOG_CRIT,
+		      "ctdb_connect(async): failed to get pnn");
+		ctdb->broken = true;
+	}
+	ctdb_request_free(req);
+}
+
+struct ctdb_connection *ctdb_connect(const char *addr,
+				     ctdb_log_fn_t log_func, void *log_priv)
+{
+	struct ctdb_connection *ctdb;
+	struct sockaddr_un sun;
+
+	ctdb = talloc_zero(NULL, struct ctdb_connection);
+	if (!ctdb) {
+		goto fail;
+	}
+	ctdb->outq = NULL;
+	ctdb->lock = NULL;
+	ctdb->waiting_locks = NULL;
+	ctdb->message_handlers = NULL;
+	ctdb->next_id = 0;
+	ctdb->broken = false;
+	ctdb->log = log_func;
+	ctdb->log_priv = log_priv;
+	ctdb->in = NULL;
+	ctdb->in_len = ctdb->in_used = 0;
+	/* not known until ctdbd answers, see set_pnn() */
+	ctdb->pnn = CTDB_CURRENT_NODE;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (!addr) {
+		addr = CTDB_PATH;
+	}
+	strncpy(sun.sun_path, addr, sizeof(sun.sun_path)-1);
+	ctdb->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ctdb->fd < 0) {
+		goto free_fail;
+	}
+
+	fcntl(ctdb->fd, F_SETFD, FD_CLOEXEC);
+
+	if (connect(ctdb->fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		goto close_fail;
+	}
+
+	fcntl(ctdb->fd, F_SETFL, fcntl(ctdb->fd, F_GETFL) | O_NONBLOCK);
+
+	/* Pnn is needed to tell whether we are dmaster of a record */
+	if (!ctdb_getpnn_send(ctdb, CTDB_CURRENT_NODE, set_pnn, NULL)) {
+		goto close_fail;
+	}
+
+	return ctdb;
+
+close_fail:
+	close(ctdb->fd);
+free_fail:
+	talloc_free(ctdb);
+fail:
+	return NULL;
+}
+
+void ctdb_disconnect(struct ctdb_connection *ctdb)
+{
+	if (ctdb->lock != NULL) {
+		ctdb_release_lock(ctdb->lock->ctdb_db, ctdb->lock);
+	}
+	close(ctdb->fd);
+	/* Just in case they try to reuse */
+	ctdb->fd = -1;
+	talloc_free(ctdb);
+}
+
+int ctdb_num_out_queue(struct ctdb_connection *ctdb)
+{
+	return ctdb->num_out_queue;
+}
+
+int ctdb_num_in_flight(struct ctdb_connection *ctdb)
+{
+	return ctdb->num_in_flight;
+}
+
+int ctdb_num_active(struct ctdb_connection *ctdb)
+{
+	return ctdb->num_out_queue + ctdb->num_in_flight;
+}
+
+int ctdb_get_fd(struct ctdb_connection *ctdb)
+{
+	return ctdb->fd;
+}
+
+int ctdb_which_events(struct ctdb_connection *ctdb)
+{
+	int events = POLLIN;
+
+	if (ctdb->outq) {
+		events |= POLLOUT;
+	}
+	return events;
+}
+
+struct ctdb_request *new_ctdb_request(struct ctdb_connection *ctdb,
+				      enum ctdb_operation operation,
+				      size_t len,
+				      ctdb_callback_t cb, void *cbdata)
+{
+	struct ctdb_request *req = talloc_zero(ctdb, struct ctdb_request);
+	struct ctdb_req_header *hdr;
+
+	if (!req) {
+		return NULL;
+	}
+
+	/* ctdbd expects packets padded to CTDB_DS_ALIGNMENT */
+	len = (len + (CTDB_DS_ALIGNMENT-1)) & ~(CTDB_DS_ALIGNMENT-1);
+	hdr = talloc_zero_size(req, len);
+	if (!hdr) {
+		talloc_free(req);
+		return NULL;
+	}
+	hdr->length       = len;
+	hdr->ctdb_magic   = CTDB_MAGIC;
+	hdr->ctdb_version = CTDB_VERSION;
+	hdr->operation    = operation;
+	hdr->srcnode      = ctdb->pnn;
+	hdr->reqid        = ctdb->next_id++;
+
+	req->ctdb = ctdb;
+	req->hdr.hdr = hdr;
+	req->written = 0;
+	req->in_flight = false;
+	req->cancelled = false;
+	req->callback = cb;
+	req->priv_data = cbdata;
+	req->extra = NULL;
+	req->extra_destructor = NULL;
+	return req;
+}
+
+struct ctdb_request *new_ctdb_control_request(struct ctdb_connection *ctdb,
+					      uint32_t opcode,
+					      uint32_t destnode,
+					      uint64_t srvid,
+					      const void *extra_data,
+					      size_t extra,
+					      ctdb_callback_t callback,
+					      void *cbdata)
+{
+	struct ctdb_request *req;
+	struct ctdb_req_control *pkt;
+
+	req = new_ctdb_request(ctdb, CTDB_REQ_CONTROL,
+			       offsetof(struct ctdb_req_control, data) + extra,
+			       callback, cbdata);
+	if (!req) {
+		return NULL;
+	}
+
+	pkt = req->hdr.control;
+	pkt->hdr.destnode = destnode;
+	pkt->opcode = opcode;
+	pkt->srvid = srvid;
+	pkt->client_id = 0;
+	pkt->flags = 0;
+	pkt->datalen = extra;
+	if (extra) {
+		memcpy(pkt->data, extra_data, extra);
+	}
+	return req;
+}
+
+void ctdb_queue_request(struct ctdb_connection *ctdb,
+			struct ctdb_request *req)
+{
+	DLIST_ADD_END(ctdb->outq, req, struct ctdb_request *);
+	ctdb->num_out_queue++;
+}
+
+static void free_request(struct ctdb_connection *ctdb,
+			 struct ctdb_request *req)
+{
+	if (req->extra_destructor) {
+		req->extra_destructor(ctdb, req);
+	}
+	talloc_free(req);
+}
+
+void ctdb_request_free(struct ctdb_request *req)
+{
+	struct ctdb_connection *ctdb = req->ctdb;
+
+	if (req->reply.hdr == NULL) {
+		DEBUG(ctdb, LOG_ALERT,
+		      "ctdb_request_free: request not complete! ctdb_cancel? %p",
+		      req);
+		ctdb_cancel(ctdb, req);
+		return;
+	}
+	free_request(ctdb, req);
+}
+
+void ctdb_cancel(struct ctdb_connection *ctdb, struct ctdb_request *req)
+{
+	if (req->reply.hdr != NULL) {
+		DEBUG(ctdb, LOG_ALERT,
+		      "ctdb_cancel: request completed! ctdb_request_free? %p",
+		      req);
+		ctdb_request_free(req);
+		return;
+	}
+
+	DEBUG(ctdb, LOG_DEBUG, "ctdb_cancel: %p (id %u)",
+	      req, req->hdr.hdr->reqid);
+
+	/* Not sent yet?  Then ctdbd never needs to hear of it. */
+	if (!req->in_flight && req->written == 0) {
+		DLIST_REMOVE(ctdb->outq, req);
+		ctdb->num_out_queue--;
+		free_request(ctdb, req);
+		return;
+	}
+
+	/* Otherwise the reply (if any) is dropped when it arrives */
+	req->cancelled = true;
+}
+
+struct ctdb_reply_control *unpack_reply_control(struct ctdb_request *req,
+						enum ctdb_controls control)
+{
+	struct ctdb_reply_control *inhdr = req->reply.control;
+	const char *str;
+
+	/* Cancelled or not yet arrived? */
+	if (inhdr == NULL) {
+		DEBUG(req->ctdb, LOG_ALERT,
+		      "This was not a ctdbd reply: request %p", req);
+		return NULL;
+	}
+
+	if (inhdr->hdr.operation != CTDB_REPLY_CONTROL) {
+		DEBUG(req->ctdb, LOG_ALERT,
+		      "Not a control reply: request %p, operation %u",
+		      req, inhdr->hdr.operation);
+		return NULL;
+	}
+
+	if (req->hdr.control->opcode != control) {
+		DEBUG(req->ctdb, LOG_ALERT,
+		      "Unexpected opcode %u in reply to control %u",
+		      req->hdr.control->opcode, control);
+		return NULL;
+	}
+
+	if (inhdr->datalen + inhdr->errorlen >
+	    inhdr->hdr.length - offsetof(struct ctdb_reply_control, data)) {
+		DEBUG(req->ctdb, LOG_ERR,
+		      "Truncated reply to control %u", control);
+		return NULL;
+	}
+
+	if (inhdr->errorlen != 0) {
+		str = (const char *)inhdr->data + inhdr->datalen;
+		DEBUG(req->ctdb, LOG_DEBUG, "Control %u failed: %.*s",
+		      control, (int)inhdr->errorlen, str);
+	}
+
+	return inhdr;
+}
+
+static void handle_incoming(struct ctdb_connection *ctdb,
+			    struct ctdb_req_header *hdr)
+{
+	struct ctdb_request **bucket, *i;
+
+	switch (hdr->operation) {
+	case CTDB_REQ_MESSAGE:
+		deliver_message(ctdb, hdr);
+		talloc_free(hdr);
+		return;
+	case CTDB_REPLY_CALL:
+	case CTDB_REPLY_CONTROL:
+	case CTDB_REPLY_ERROR:
+		break;
+	default:
+		DEBUG(ctdb, LOG_WARNING, "Unexpected operation %u from ctdbd",
+		      hdr->operation);
+		talloc_free(hdr);
+		return;
+	}
+
+	bucket = &ctdb->inflight[hdr->reqid % CTDB_REQID_HASH_SIZE];
+	for (i = *bucket; i; i = i->next) {
+		if (i->hdr.hdr->reqid == hdr->reqid) {
+			break;
+		}
+	}
+	if (i == NULL) {
+		DEBUG(ctdb, LOG_WARNING, "Unexpected ctdbd reply id %u",
+		      hdr->reqid);
+		talloc_free(hdr);
+		return;
+	}
+
+	DLIST_REMOVE(*bucket, i);
+	ctdb->num_in_flight--;
+	i->in_flight = false;
+	i->reply.hdr = talloc_steal(i, hdr);
+
+	if (i->cancelled) {
+		free_request(ctdb, i);
+		return;
+	}
+	i->callback(ctdb, i, i->priv_data);
+}
+
+/* Hand as many queued packets as the socket will take to writev() */
+static bool write_outq(struct ctdb_connection *ctdb)
+{
+	struct iovec iov[CTDB_MAX_IOV];
+	struct ctdb_request *req, *next;
+	int niov = 0;
+	ssize_t n;
+
+	for (req = ctdb->outq; req && niov < CTDB_MAX_IOV; req = req->next) {
+		iov[niov].iov_base = (uint8_t *)req->hdr.hdr + req->written;
+		iov[niov].iov_len = req->hdr.hdr->length - req->written;
+		niov++;
+	}
+	if (niov == 0) {
+		return true;
+	}
+
+	n = writev(ctdb->fd, iov, niov);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return true;
+		}
+		DEBUG(ctdb, LOG_ERR, "ctdb_service: writing to ctdbd: %s",
+		      strerror(errno));
+		return false;
+	}
+
+	for (req = ctdb->outq; req && n > 0; req = next) {
+		size_t left = req->hdr.hdr->length - req->written;
+
+		next = req->next;
+		if ((size_t)n < left) {
+			req->written += n;
+			break;
+		}
+		n -= left;
+		req->written += left;
+
+		DLIST_REMOVE(ctdb->outq, req);
+		ctdb->num_out_queue--;
+
+		/* Messages get no reply */
+		if (req->hdr.hdr->operation == CTDB_REQ_MESSAGE) {
+			free_request(ctdb, req);
+			continue;
+		}
+		DLIST_ADD(ctdb->inflight[req->hdr.hdr->reqid %
+					 CTDB_REQID_HASH_SIZE], req);
+		ctdb->num_in_flight++;
+		req->in_flight = true;
+	}
+	return true;
+}
+
+/* Read what is available and process every complete packet */
+static bool read_inq(struct ctdb_connection *ctdb)
+{
+	ssize_t n;
+
+	if (ctdb->in_len - ctdb->in_used < CTDB_IN_BUFSIZE / 2) {
+		size_t len = MAX(ctdb->in_len * 2, CTDB_IN_BUFSIZE);
+		uint8_t *in = talloc_realloc_size(ctdb, ctdb->in, len);
+
+		if (in == NULL) {
+			DEBUG(ctdb, LOG_ERR, "ctdb_service: out of memory");
+			return false;
+		}
+		ctdb->in = in;
+		ctdb->in_len = len;
+	}
+
+	n = read(ctdb->fd, ctdb->in + ctdb->in_used,
+		 ctdb->in_len - ctdb->in_used);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return true;
+		}
+		DEBUG(ctdb, LOG_ERR, "ctdb_service: reading from ctdbd: %s",
+		      strerror(errno));
+		return false;
+	}
+	if (n == 0) {
+		DEBUG(ctdb, LOG_ERR, "ctdb_service: ctdbd closed the socket");
+		return false;
+	}
+	ctdb->in_used += n;
+
+	while (ctdb->in_used >= sizeof(struct ctdb_req_header)) {
+		struct ctdb_req_header *hdr;
+		uint32_t len;
+
+		memcpy(&len, ctdb->in, sizeof(len));
+		if (len < sizeof(struct ctdb_req_header)) {
+			DEBUG(ctdb, LOG_ERR, "ctdb_service: bad packet length %u",
+			      len);
+			return false;
+		}
+		if (ctdb->in_used < len) {
+			/* make sure the rest of this packet fits */
+			if (ctdb->in_len < len) {
+				uint8_t *in = talloc_realloc_size(ctdb, ctdb->in,
+								  len);
+				if (in == NULL) {
+					return false;
+				}
+				ctdb->in = in;
+				ctdb->in_len = len;
+			}
+			break;
+		}
+
+		hdr = talloc_memdup(ctdb, ctdb->in, len);
+		if (hdr == NULL) {
+			DEBUG(ctdb, LOG_ERR, "ctdb_service: out of memory");
+			return false;
+		}
+		/* Consume it before any callback can get in here again */
+		memmove(ctdb->in, ctdb->in + len, ctdb->in_used - len);
+		ctdb->in_used -= len;
+
+		if (hdr->ctdb_magic != CTDB_MAGIC ||
+		    hdr->ctdb_version != CTDB_VERSION) {
+			DEBUG(ctdb, LOG_ERR, "ctdb_service: bad packet from ctdbd");
+			talloc_free(hdr);
+			return false;
+		}
+		handle_incoming(ctdb, hdr);
+	}
+	return true;
+}
+
+bool ctdb_service(struct ctdb_connection *ctdb, int revents)
+{
+	if (ctdb->broken) {
+		return false;
+	}
+
+	if (revents & (POLLERR|POLLHUP)) {
+		/* read will tell us what happened */
+		revents |= POLLIN;
+	}
+
+	if ((revents & POLLOUT) && !write_outq(ctdb)) {
+		ctdb->broken = true;
+		return false;
+	}
+
+	if ((revents & POLLIN) && !read_inq(ctdb)) {
+		ctdb->broken = true;
+		return false;
+	}
+
+	return !ctdb->broken;
+}
+
+static int db_destructor(struct ctdb_db *db)
+{
+	if (db->tdb) {
+		tdb_close(db->tdb);
+	}
+	return 0;
+}
+
+/* A database nobody called ctdb_attachdb_recv() for goes with the request */
+static void destroy_req_db(struct ctdb_connection *ctdb,
+			   struct ctdb_request *req)
+{
+	talloc_free(req->extra);
+}
+
+struct ctdb_db *ctdb_attachdb_recv(struct ctdb_connection *ctdb,
+				   struct ctdb_request *req)
+{
+	struct ctdb_request *dbpath_req = req->extra;
+	struct ctdb_db *db;
+
+	/* Never sent the dbpath request?  We've failed. */
+	if (!dbpath_req) {
+		/* FIXME: Save error? */
+		return NULL;
+	}
+
+	db = dbpath_req->extra;
+	if (db == NULL || db->tdb == NULL) {
+		return NULL;
+	}
+
+	/* The db now belongs to the connection */
+	talloc_steal(ctdb, db);
+	dbpath_req->extra = NULL;
+	return db;
+}
+
+static void attachdb_getdbpath_done(struct ctdb_connection *ctdb,
+				    struct ctdb_request *req,
+				    void *_db)
+{
+	struct ctdb_db *db = _db;
+	uint32_t tdb_flags = db->tdb_flags;
+	struct ctdb_reply_control *reply;
+	char *path;
+
+	/* Do we have an error? */
+	reply = unpack_reply_control(req, CTDB_CONTROL_GETDBPATH);
+	if (!reply || reply->status != 0 || reply->datalen == 0) {
+		DEBUG(db->ctdb, LOG_ERR,
+		      "ctdb_attachdb_send(async): failed to get db path");
+		goto done;
+	}
+
+	path = talloc_strndup(req, (const char *)reply->data,
+			      reply->datalen);
+	if (path == NULL) {
+		goto done;
+	}
+
+	/* The tdb flags ctdbd used are in the file: only local ones matter */
+	tdb_flags = db->persistent ? TDB_DEFAULT : TDB_NOSYNC;
+	tdb_flags |= TDB_DISALLOW_NESTING;
+
+	db->tdb = tdb_open(path, 0, tdb_flags, O_RDWR, 0);
+	if (db->tdb == NULL) {
+		DEBUG(db->ctdb, LOG_WARNING,
+		      "ctdb_attachdb_send(async): can't open tdb %s: %s",
+		      path, strerror(errno));
+		goto done;
+	}
+
+done:
+	/* Now complete the user's request */
+	db->callback(db->ctdb, db->attach_req, db->private_data);
+}
+
+static void attachdb_done(struct ctdb_connection *ctdb,
+			  struct ctdb_request *req,
+			  void *_db)
+{
+	struct ctdb_db *db = _db;
+	struct ctdb_request *req2;
+	struct ctdb_reply_control *reply;
+	enum ctdb_controls control = CTDB_CONTROL_DB_ATTACH;
+
+	if (db->persistent) {
+		control = CTDB_CONTROL_DB_ATTACH_PERSISTENT;
+	}
+
+	reply = unpack_reply_control(req, control);
+	if (!reply || reply->status != 0 ||
+	    reply->datalen != sizeof(uint32_t)) {
+		if (reply) {
+			DEBUG(ctdb, LOG_ERR,
+			      "ctdb_attachdb_send(async): DB_ATTACH status %i",
+			      reply->status);
+		}
+		/* We failed.  Hand request to user and have them discover it
+		 * via ctdb_attachdb_recv. */
+		db->callback(ctdb, req, db->private_data);
+		return;
+	}
+	memcpy(&db->id, reply->data, sizeof(db->id));
+
+	/* Now we do another call, to get the dbpath. */
+	req2 = new_ctdb_control_request(db->ctdb, CTDB_CONTROL_GETDBPATH,
+					CTDB_CURRENT_NODE, 0,
+					&db->id, sizeof(db->id),
+					attachdb_getdbpath_done, db);
+	if (!req2) {
+		DEBUG(db->ctdb, LOG_ERR,
+		      "ctdb_attachdb_send(async): failed to allocate");
+		db->callback(ctdb, req, db->private_data);
+		return;
+	}
+	req->extra = req2;
+	req2->extra = db;
+	req2->extra_destructor = destroy_req_db;
+	talloc_steal(req2, db);
+	ctdb_queue_request(db->ctdb, req2);
+}
+
+/* Free the dbpath request with the attach request */
+static void destroy_req_dbpath(struct ctdb_connection *ctdb,
+			       struct ctdb_request *req)
+{
+	struct ctdb_request *req2 = req->extra;
+
+	if (req2 == NULL) {
+		return;
+	}
+	if (req2->reply.hdr == NULL) {
+		ctdb_cancel(ctdb, req2);
+	} else {
+		free_request(ctdb, req2);
+	}
+}
+
+struct ctdb_request *
+ctdb_attachdb_send(struct ctdb_connection *ctdb,
+		   const char *name, bool persistent, uint32_t tdb_flags,
+		   ctdb_callback_t callback, void *private_data)
+{
+	struct ctdb_request *req;
+	struct ctdb_db *db;
+	uint32_t opcode;
+
+	/* FIXME: Search if db already open. */
+	db = talloc_zero(ctdb, struct ctdb_db);
+	if (!db) {
+		return NULL;
+	}
+
+	/* ctdbd uses the jenkins hash for all volatile databases */
+	if (!persistent) {
+		tdb_flags |= TDB_INCOMPATIBLE_HASH;
+	}
+
+	if (persistent) {
+		opcode = CTDB_CONTROL_DB_ATTACH_PERSISTENT;
+	} else {
+		opcode = CTDB_CONTROL_DB_ATTACH;
+	}
+
+	req = new_ctdb_control_request(ctdb, opcode, CTDB_CURRENT_NODE,
+				       tdb_flags, name, strlen(name) + 1,
+				       attachdb_done, db);
+	if (!req) {
+		DEBUG(ctdb, LOG_ERR, "ctdb_attachdb_send: failed allocating DB_ATTACH");
+		talloc_free(db);
+		return NULL;
+	}
+
+	db->ctdb = ctdb;
+	db->tdb_flags = tdb_flags;
+	db->persistent = persistent;
+	db->callback = callback;
+	db->private_data = private_data;
+	db->attach_req = req;
+	talloc_steal(req, db);
+	talloc_set_destructor(db, db_destructor);
+
+	req->extra_destructor = destroy_req_dbpath;
+
+	/* Flags get overloaded into srvid. */
+	ctdb_queue_request(ctdb, req);
+	DEBUG(db->ctdb, LOG_DEBUG,
+	      "ctdb_attachdb_send: DB_ATTACH request %p", req);
+	return req;
+}
+
+void ctdb_detachdb(struct ctdb_connection *ctdb, struct ctdb_db *db)
+{
+	if (ctdb->lock != NULL && ctdb->lock->ctdb_db == db) {
+		DEBUG(ctdb, LOG_ALERT, "ctdb_detachdb: still holding a lock");
+		ctdb_release_lock(db, ctdb->lock);
+	}
+	talloc_free(db);
+}
+
+static bool send_lock_request(struct ctdb_lock *lock);
+
+/*
+ * Take the chain lock and see whether the record can be used here.
+ * Returns 1 with the chain locked if so, 0 if ctdbd has to be asked
+ * and -1 on error.
+ */
+static int try_readrecordlock(struct ctdb_lock *lock, TDB_DATA *data)
+{
+	struct ctdb_connection *ctdb = lock->ctdb_db->ctdb;
+	struct tdb_context *tdb = lock->ctdb_db->tdb;
+	struct ctdb_ltdb_header *hdr;
+
+	if (tdb_chainlock(tdb, lock->key) != 0) {
+		DEBUG(ctdb, LOG_WARNING,
+		      "ctdb_readrecordlock_async: failed to chainlock: %s",
+		      tdb_errorstr(tdb));
+		return -1;
+	}
+
+	lock->data = tdb_fetch(tdb, lock->key);
+	if (lock->data.dsize < sizeof(*hdr)) {
+		goto remote;
+	}
+
+	hdr = (struct ctdb_ltdb_header *)lock->data.dptr;
+	if (hdr->dmaster == ctdb->pnn) {
+		/* a write lock has to revoke read-only copies first */
+		if (lock->readonly ||
+		    !(hdr->flags & CTDB_REC_RO_HAVE_DELEGATIONS)) {
+			goto granted;
+		}
+		goto remote;
+	}
+	if (lock->readonly &&
+	    (hdr->flags & (CTDB_REC_RO_HAVE_READONLY |
+			   CTDB_REC_RO_HAVE_DELEGATIONS))) {
+		goto granted;
+	}
+
+remote:
+	free(lock->data.dptr);
+	lock->data = tdb_null;
+	tdb_chainunlock(tdb, lock->key);
+	return 0;
+
+granted:
+	lock->hdr = *hdr;
+	data->dptr = lock->data.dptr + sizeof(*hdr);
+	data->dsize = lock->data.dsize - sizeof(*hdr);
+	ctdb->lock = lock;
+	return 1;
+}
+
+static void lock_failed(struct ctdb_lock *lock)
+{
+	lock->callback(lock->ctdb_db, NULL, tdb_null, lock->cbdata);
+	talloc_free(lock);
+}
+
+/* Try the lock again now ctdbd has (probably) brought the record here */
+static void retry_readrecordlock(struct ctdb_lock *lock)
+{
+	TDB_DATA data;
+
+	switch (try_readrecordlock(lock, &data)) {
+	case 1:
+		lock->callback(lock->ctdb_db, lock, data, lock->cbdata);
+		break;
+	case 0:
+		if (!send_lock_request(lock)) {
+			lock_failed(lock);
+		}
+		break;
+	default:
+		lock_failed(lock);
+		break;
+	}
+}
+
+static void readrecordlock_retry(struct ctdb_connection *ctdb,
+				 struct ctdb_request *req, void *_lock)
+{
+	struct ctdb_lock *lock = _lock;
+	struct ctdb_reply_call *reply = req->reply.call;
+
+	if (reply->hdr.operation != CTDB_REPLY_CALL || reply->status != 0) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_readrecordlock_async: call failed (op %u)",
+		      reply->hdr.operation);
+		ctdb_request_free(req);
+		lock_failed(lock);
+		return;
+	}
+	ctdb_request_free(req);
+
+	/* We can only hold one chain lock; queue up behind it. */
+	if (ctdb->lock != NULL) {
+		DLIST_ADD_END(ctdb->waiting_locks, lock, struct ctdb_lock *);
+		return;
+	}
+	retry_readrecordlock(lock);
+}
+
+static bool send_lock_request(struct ctdb_lock *lock)
+{
+	struct ctdb_connection *ctdb = lock->ctdb_db->ctdb;
+	struct ctdb_request *req;
+	struct ctdb_req_call *pkt;
+
+	req = new_ctdb_request(ctdb, CTDB_REQ_CALL,
+			       offsetof(struct ctdb_req_call, data)
+			       + lock->key.dsize,
+			       readrecordlock_retry, lock);
+	if (req == NULL) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_readrecordlock_async: allocation failed");
+		return false;
+	}
+
+	pkt = req->hdr.call;
+	/* Ask for a read-only copy once, migrate the record after that */
+	if (lock->readonly && !lock->tried_readonly) {
+		lock->tried_readonly = true;
+		pkt->flags = CTDB_WANT_READONLY;
+		pkt->callid = CTDB_FETCH_WITH_HEADER_FUNC;
+	} else {
+		pkt->flags = CTDB_IMMEDIATE_MIGRATION;
+		pkt->callid = CTDB_NULL_FUNC;
+	}
+	pkt->db_id = lock->ctdb_db->id;
+	pkt->hopcount = 0;
+	pkt->keylen = lock->key.dsize;
+	pkt->calldatalen = 0;
+	memcpy(pkt->data, lock->key.dptr, lock->key.dsize);
+	ctdb_queue_request(ctdb, req);
+	return true;
+}
+
+static bool readrecordlock_async(struct ctdb_db *ctdb_db, TDB_DATA key,
+				 bool readonly,
+				 ctdb_rrl_callback_t callback, void *cbdata)
+{
+	struct ctdb_connection *ctdb = ctdb_db->ctdb;
+	struct ctdb_lock *lock;
+	TDB_DATA data;
+
+	if (ctdb->lock != NULL) {
+		DEBUG(ctdb, LOG_ALERT,
+		      "ctdb_readrecordlock_async: already hold lock");
+		return false;
+	}
+
+	lock = talloc_zero(ctdb_db, struct ctdb_lock);
+	if (lock == NULL) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_readrecordlock_async: lock allocation failed");
+		return false;
+	}
+	lock->key.dptr = talloc_memdup(lock, key.dptr, key.dsize);
+	if (lock->key.dptr == NULL) {
+		talloc_free(lock);
+		return false;
+	}
+	lock->key.dsize = key.dsize;
+	lock->ctdb_db = ctdb_db;
+	lock->readonly = readonly;
+	lock->callback = callback;
+	lock->cbdata = cbdata;
+
+	switch (try_readrecordlock(lock, &data)) {
+	case 1:
+		callback(ctdb_db, lock, data, cbdata);
+		return true;
+	case 0:
+		if (send_lock_request(lock)) {
+			return true;
+		}
+		/* fall through */
+	default:
+		talloc_free(lock);
+		return false;
+	}
+}
+
+bool ctdb_readrecordlock_async(struct ctdb_db *ctdb_db, TDB_DATA key,
+			       ctdb_rrl_callback_t callback, void *cbdata)
+{
+	return readrecordlock_async(ctdb_db, key, false, callback, cbdata);
+}
+
+bool ctdb_readonlyrecordlock_async(struct ctdb_db *ctdb_db, TDB_DATA key,
+				   ctdb_rrl_callback_t callback, void *cbdata)
+{
+	return readrecordlock_async(ctdb_db, key, true, callback, cbdata);
+}
+
+bool ctdb_writerecord(struct ctdb_db *ctdb_db,
+		      struct ctdb_lock *lock, TDB_DATA data)
+{
+	struct ctdb_connection *ctdb = ctdb_db->ctdb;
+	TDB_DATA rec;
+	int ret;
+
+	if (lock == NULL || ctdb->lock != lock) {
+		DEBUG(ctdb, LOG_ALERT, "ctdb_writerecord: Can not write, lock not held");
+		return false;
+	}
+
+	if (ctdb_db->persistent) {
+		DEBUG(ctdb, LOG_ALERT, "ctdb_writerecord: cannot write to persistent db");
+		return false;
+	}
+
+	if (lock->readonly && lock->hdr.dmaster != ctdb->pnn) {
+		DEBUG(ctdb, LOG_ALERT, "ctdb_writerecord: read-only copy");
+		return false;
+	}
+
+	rec.dsize = sizeof(lock->hdr) + data.dsize;
+	rec.dptr = malloc(rec.dsize);
+	if (rec.dptr == NULL) {
+		DEBUG(ctdb, LOG_ERR, "ctdb_writerecord: out of memory");
+		return false;
+	}
+	memcpy(rec.dptr, &lock->hdr, sizeof(lock->hdr));
+	memcpy(rec.dptr + sizeof(lock->hdr), data.dptr, data.dsize);
+
+	ret = tdb_store(ctdb_db->tdb, lock->key, rec, TDB_REPLACE);
+	free(rec.dptr);
+	if (ret != 0) {
+		DEBUG(ctdb, LOG_ERR, "ctdb_writerecord: store failed: %s",
+		      tdb_errorstr(ctdb_db->tdb));
+		return false;
+	}
+	return true;
+}
+
+void ctdb_release_lock(struct ctdb_db *ctdb_db, struct ctdb_lock *lock)
+{
+	struct ctdb_connection *ctdb = ctdb_db->ctdb;
+	struct ctdb_lock *next;
+
+	if (lock == NULL || ctdb->lock != lock) {
+		DEBUG(ctdb, LOG_ALERT, "ctdb_release_lock: lock not held");
+		return;
+	}
+
+	tdb_chainunlock(ctdb_db->tdb, lock->key);
+	free(lock->data.dptr);
+	ctdb->lock = NULL;
+	talloc_free(lock);
+
+	/* Now somebody else can have their turn */
+	next = ctdb->waiting_locks;
+	if (next != NULL) {
+		DLIST_REMOVE(ctdb->waiting_locks, next);
+		retry_readrecordlock(next);
+	}
+}
+
+/* Traverse: records are delivered as messages to a private srvid */
+struct ctdb_traverse_state {
+	struct ctdb_db *ctdb_db;
+	uint64_t srvid;
+	bool finished;
+	ctdb_traverse_callback_t callback;
+	void *cbdata;
+};
+
+static void traverse_remhnd_cb(struct ctdb_connection *ctdb,
+			       struct ctdb_request *req, void *private_data)
+{
+	struct ctdb_traverse_state *state = private_data;
+
+	if (!ctdb_remove_message_handler_recv(ctdb, req)) {
+		DEBUG(ctdb, LOG_ERR,
+		      "Failed to remove message handler for traverse");
+	}
+	ctdb_request_free(req);
+	talloc_free(state);
+}
+
+static void traverse_msg_handler(struct ctdb_connection *ctdb,
+				 uint64_t srvid, TDB_DATA data, void *args);
+
+static void traverse_finish(struct ctdb_traverse_state *state, int status)
+{
+	struct ctdb_connection *ctdb = state->ctdb_db->ctdb;
+
+	if (status != TRAVERSE_STATUS_RECORD) {
+		state->callback(ctdb, state->ctdb_db, status,
+				tdb_null, tdb_null, state->cbdata);
+	}
+	state->finished = true;
+
+	if (!ctdb_remove_message_handler_send(ctdb, state->srvid,
+					      traverse_msg_handler, state,
+					      traverse_remhnd_cb, state)) {
+		DEBUG(ctdb, LOG_ERR,
+		      "Failed to remove message handler for traverse");
+	}
+}
+
+static void traverse_msg_handler(struct ctdb_connection *ctdb,
+				 uint64_t srvid, TDB_DATA data, void *args)
+{
+	struct ctdb_traverse_state *state = args;
+	struct ctdb_rec_data *d = (struct ctdb_rec_data *)data.dptr;
+	TDB_DATA key;
+
+	if (state->finished) {
+		return;
+	}
+
+	if (data.dsize < offsetof(struct ctdb_rec_data, data) ||
+	    data.dsize < d->length ||
+	    d->length < offsetof(struct ctdb_rec_data, data) +
+			d->keylen + d->datalen) {
+		DEBUG(ctdb, LOG_ERR, "Bad traverse record, size %u",
+		      (unsigned)data.dsize);
+		traverse_finish(state, TRAVERSE_STATUS_ERROR);
+		return;
+	}
+
+	if (d->keylen == 0 && d->datalen == 0) {
+		traverse_finish(state, TRAVERSE_STATUS_FINISHED);
+		return;
+	}
+
+	key.dsize = d->keylen;
+	key.dptr  = &d->data[0];
+	data.dsize = d->datalen;
+	data.dptr  = &d->data[d->keylen];
+
+	/* skip empty records, and the header of the others */
+	if (data.dsize <= sizeof(struct ctdb_ltdb_header)) {
+		return;
+	}
+	data.dsize -= sizeof(struct ctdb_ltdb_header);
+	data.dptr  += sizeof(struct ctdb_ltdb_header);
+
+	if (state->callback(ctdb, state->ctdb_db, TRAVERSE_STATUS_RECORD,
+			    key, data, state->cbdata) != 0) {
+		traverse_finish(state, TRAVERSE_STATUS_RECORD);
+	}
+}
+
+static void traverse_start_cb(struct ctdb_connection *ctdb,
+			      struct ctdb_request *req, void *private_data)
+{
+	struct ctdb_traverse_state *state = private_data;
+	struct ctdb_reply_control *reply;
+
+	reply = unpack_reply_control(req, CTDB_CONTROL_TRAVERSE_START_EXT);
+	if (!reply || reply->status != 0) {
+		DEBUG(ctdb, LOG_ERR, "Failed to start traverse");
+		if (!state->finished) {
+			traverse_finish(state, TRAVERSE_STATUS_ERROR);
+		}
+	}
+	ctdb_request_free(req);
+}
+
+static void traverse_handler_cb(struct ctdb_connection *ctdb,
+				struct ctdb_request *req, void *private_data)
+{
+	struct ctdb_traverse_state *state = private_data;
+	struct ctdb_traverse_start_ext t;
+	struct ctdb_request *req2;
+
+	if (!ctdb_set_message_handler_recv(ctdb, req)) {
+		DEBUG(ctdb, LOG_ERR,
+		      "Failed to register message handler for traverse");
+		ctdb_request_free(req);
+		state->callback(ctdb, state->ctdb_db, TRAVERSE_STATUS_ERROR,
+				tdb_null, tdb_null, state->cbdata);
+		talloc_free(state);
+		return;
+	}
+	ctdb_request_free(req);
+
+	memset(&t, 0, sizeof(t));
+	t.db_id = state->ctdb_db->id;
+	t.srvid = state->srvid;
+	t.reqid = 0;
+	t.withemptyrecords = false;
+
+	req2 = new_ctdb_control_request(ctdb, CTDB_CONTROL_TRAVERSE_START_EXT,
+					CTDB_CURRENT_NODE, 0, &t, sizeof(t),
+					traverse_start_cb, state);
+	if (req2 == NULL) {
+		DEBUG(ctdb, LOG_ERR, "Failed to allocate traverse control");
+		traverse_finish(state, TRAVERSE_STATUS_ERROR);
+		return;
+	}
+	ctdb_queue_request(ctdb, req2);
+}
+
+bool ctdb_traverse_async(struct ctdb_db *ctdb_db,
+			 ctdb_traverse_callback_t callback, void *cbdata)
+{
+	struct ctdb_connection *ctdb = ctdb_db->ctdb;
+	struct ctdb_traverse_state *state;
+	static uint32_t tid = 0;
+
+	state = talloc_zero(ctdb_db, struct ctdb_traverse_state);
+	if (state == NULL) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_traverse_async: no memory. allocate state failed");
+		return false;
+	}
+
+	/* unique over processes and over traverses within this one */
+	tid++;
+	state->srvid = CTDB_SRVID_TRAVERSE_RANGE
+		| ((uint64_t)getpid() << 16) | (tid & 0xFFFF);
+	state->ctdb_db = ctdb_db;
+	state->callback = callback;
+	state->cbdata = cbdata;
+
+	if (!ctdb_set_message_handler_send(ctdb, state->srvid,
+					   traverse_msg_handler, state,
+					   traverse_handler_cb, state)) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_traverse_async: failed to register message handler");
+		talloc_free(state);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,128 @@
+/*
+   ctdb database library: private definitions
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _LIBCTDB_PRIVATE_H
+#define _LIBCTDB_PRIVATE_H
+
+#include "replace.h"
+#include "talloc.h"
+#include "tdb.h"
+#include <syslog.h>
+#include <ctdb.h>
+#include <ctdb_protocol.h>
+#include "dlinklist.h"
+
+#ifndef COLD_ATTRIBUTE
+#if (__GNUC__ >= 4 && __GNUC_MINOR__ >= 3)
+#define COLD_ATTRIBUTE __attribute__((cold))
+#else
+#define COLD_ATTRIBUTE
+#endif
+#endif /* COLD_ATTRIBUTE */
+
+#define DEBUG(ctdb, lvl, format, args...) do { if (lvl <= ctdb_log_level) { ctdb_do_debug(ctdb, lvl, format , ## args ); }} while(0)
+
+void ctdb_do_debug(struct ctdb_connection *, int, const char *format, ...)
+	PRINTF_ATTRIBUTE(3, 4) COLD_ATTRIBUTE;
+
+/* In flight requests are hashed on their reqid, which we hand out
+   sequentially, so consecutive requests land in consecutive buckets */
+#define CTDB_REQID_HASH_SIZE 1024
+
+struct message_handler_info;
+
+struct ctdb_request {
+	struct ctdb_connection *ctdb;
+	struct ctdb_request *next, *prev;
+	bool cancelled;
+	bool in_flight;
+
+	/* the marshalled packet and how much of it has been written */
+	union {
+		struct ctdb_req_header *hdr;
+		struct ctdb_req_call *call;
+		struct ctdb_req_control *control;
+		struct ctdb_req_message *message;
+	} hdr;
+	size_t written;
+
+	/* the reply, once it has arrived */
+	union {
+		struct ctdb_req_header *hdr;
+		struct ctdb_reply_call *call;
+		struct ctdb_reply_control *control;
+	} reply;
+
+	ctdb_callback_t callback;
+	void *priv_data;
+
+	/* Extra per-request info. */
+	void (*extra_destructor)(struct ctdb_connection *,
+				 struct ctdb_request *);
+	void *extra;
+};
+
+struct ctdb_connection {
+	/* Socket to ctdbd. */
+	int fd;
+	/* Currently our failure mode is simple; return -1 from functions. */
+	bool broken;
+	/* Our pnn, or CTDB_CURRENT_NODE until ctdbd has told us. */
+	uint32_t pnn;
+	/* Requests not yet (completely) written to the socket */
+	struct ctdb_request *outq;
+	int num_out_queue;
+	/* Requests waiting for a reply, by reqid */
+	struct ctdb_request *inflight[CTDB_REQID_HASH_SIZE];
+	int num_in_flight;
+	/* Partially read input */
+	uint8_t *in;
+	size_t in_len, in_used;
+	/* Message handlers */
+	struct message_handler_info *message_handlers;
+	/* The record lock we hold, if any */
+	struct ctdb_lock *lock;
+	/* Locks whose record arrived while another lock was held */
+	struct ctdb_lock *waiting_locks;
+	/* Extra logging. */
+	ctdb_log_fn_t log;
+	void *log_priv;
+	/* Our unique reqid. */
+	uint32_t next_id;
+};
+
+/* ctdb.c */
+struct ctdb_request *new_ctdb_request(struct ctdb_connection *ctdb,
+				      enum ctdb_operation operation,
+				      size_t len,
+				      ctdb_callback_t cb, void *cbdata);
+struct ctdb_request *new_ctdb_control_request(struct ctdb_connection *ctdb,
+					      uint32_t opcode,
+					      uint32_t destnode,
+					      uint64_t srvid,
+					      const void *extra_data,
+					      size_t extra,
+					      ctdb_callback_t, void *);
+void ctdb_queue_request(struct ctdb_connection *ctdb,
+			struct ctdb_request *req);
+struct ctdb_reply_control *unpack_reply_control(struct ctdb_request *req,
+						enum ctdb_controls control);
+
+/* messages.c */
+void deliver_message(struct ctdb_connection *ctdb,
+		     struct ctdb_req_header *hdr);
+
+#endif /* _LIBCTDB_PRIVATE_H */
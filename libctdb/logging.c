@@ -0,0 +1,58 @@
+/*
+   libctdb logging
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "libctdb_private.h"
+
+int ctdb_log_level = LOG_WARNING;
+
+void ctdb_do_debug(struct ctdb_connection *ctdb,
+		   int severity, const char *format, ...)
+{
+	va_list ap;
+
+	if (ctdb->log == NULL) {
+		return;
+	}
+	va_start(ap, format);
+	ctdb->log(ctdb->log_priv, severity, format, ap);
+	va_end(ap);
+}
+
+/* A ready-made log function: one line per message to outf */
+void ctdb_log_file(FILE *outf, int priority, const char *format, va_list ap)
+{
+	const char *name;
+
+	switch (priority) {
+	case LOG_EMERG: name = "EMERG"; break;
+	case LOG_ALERT: name = "ALERT"; break;
+	case LOG_CRIT: name = "CRIT"; break;
+	case LOG_ERR: name = "ERR"; break;
+	case LOG_WARNING: name = "WARNING"; break;
+	case LOG_NOTICE: name = "NOTICE"; break;
+	case LOG_INFO: name = "INFO"; break;
+	case LOG_DEBUG: name = "DEBUG"; break;
+	default:
+		name = "UNKNOWN";
+		break;
+	}
+
+	fprintf(outf, "%s:", name);
+	vfprintf(outf, format, ap);
+	if (strlen(format) == 0 || format[strlen(format) - 1] != '\n') {
+		fprintf(outf, "\n");
+	}
+}
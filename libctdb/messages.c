@@ -0,0 +1,220 @@
+/*
+   libctdb message handling
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "libctdb_private.h"
+
+/* Remove type-safety macros. */
+#undef ctdb_set_message_handler_send
+#undef ctdb_set_message_handler_recv
+#undef ctdb_remove_message_handler_send
+#undef ctdb_check_message_handlers_send
+
+struct message_handler_info {
+	struct message_handler_info *next, *prev;
+
+	uint64_t srvid;
+	ctdb_message_fn_t handler;
+	void *handler_data;
+};
+
+void deliver_message(struct ctdb_connection *ctdb,
+		     struct ctdb_req_header *hdr)
+{
+	struct message_handler_info *i, *next;
+	struct ctdb_req_message *msg = (struct ctdb_req_message *)hdr;
+	TDB_DATA data;
+	bool found = false;
+
+	if (hdr->length < offsetof(struct ctdb_req_message, data) ||
+	    msg->datalen > hdr->length - offsetof(struct ctdb_req_message,
+						   data)) {
+		DEBUG(ctdb, LOG_ERR, "Truncated message for srvid %llu",
+		      (unsigned long long)msg->srvid);
+		return;
+	}
+
+	data.dptr = msg->data;
+	data.dsize = msg->datalen;
+
+	/* Note: we want to call *every* handler: there may be more than one */
+	for (i = ctdb->message_handlers; i; i = next) {
+		next = i->next;
+		if (i->srvid == msg->srvid) {
+			i->handler(ctdb, msg->srvid, data, i->handler_data);
+			found = true;
+		}
+	}
+	if (!found) {
+		DEBUG(ctdb, LOG_WARNING,
+		      "ctdb_service: messsage for unregistered srvid %llu",
+		      (unsigned long long)msg->srvid);
+	}
+}
+
+static void free_info(struct ctdb_connection *ctdb, struct ctdb_request *req)
+{
+	free(req->extra);
+}
+
+struct ctdb_request *
+ctdb_set_message_handler_send(struct ctdb_connection *ctdb, uint64_t srvid,
+			      ctdb_message_fn_t handler, void *handler_data,
+			      ctdb_callback_t callback, void *cbdata)
+{
+	struct message_handler_info *info;
+	struct ctdb_request *req;
+
+	info = malloc(sizeof(*info));
+	if (!info) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_set_message_handler_send: allocating info");
+		return NULL;
+	}
+
+	req = new_ctdb_control_request(ctdb, CTDB_CONTROL_REGISTER_SRVID,
+				       CTDB_CURRENT_NODE, srvid, NULL, 0,
+				       callback, cbdata);
+	if (!req) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_set_message_handler_send: allocating request");
+		free(info);
+		return NULL;
+	}
+	req->extra = info;
+	req->extra_destructor = free_info;
+
+	info->srvid = srvid;
+	info->handler = handler;
+	info->handler_data = handler_data;
+
+	ctdb_queue_request(ctdb, req);
+	DEBUG(ctdb, LOG_DEBUG,
+	      "ctdb_set_message_handler_send: sending request %u for id %llx",
+	      req->hdr.hdr->reqid, (unsigned long long)srvid);
+	return req;
+}
+
+bool ctdb_set_message_handler_recv(struct ctdb_connection *ctdb,
+				   struct ctdb_request *req)
+{
+	struct message_handler_info *info = req->extra;
+	struct ctdb_reply_control *reply;
+
+	reply = unpack_reply_control(req, CTDB_CONTROL_REGISTER_SRVID);
+	if (!reply) {
+		return false;
+	}
+	if (reply->status != 0) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_set_message_handler_recv: status %i",
+		      reply->status);
+		return false;
+	}
+
+	/* Put ourselves in list of handlers. */
+	DLIST_ADD(ctdb->message_handlers, info);
+	/* Keep safe from destructor */
+	req->extra = NULL;
+	return true;
+}
+
+struct ctdb_request *
+ctdb_remove_message_handler_send(struct ctdb_connection *ctdb, uint64_t srvid,
+				 ctdb_message_fn_t handler, void *hdata,
+				 ctdb_callback_t callback, void *cbdata)
+{
+	struct message_handler_info *i;
+	struct ctdb_request *req;
+
+	for (i = ctdb->message_handlers; i; i = i->next) {
+		if (i->srvid == srvid
+		    && i->handler == handler && i->handler_data == hdata) {
+			break;
+		}
+	}
+	if (!i) {
+		DEBUG(ctdb, LOG_ALERT,
+		      "ctdb_remove_message_handler_send: no such handler");
+		errno = ENOENT;
+		return NULL;
+	}
+
+	req = new_ctdb_control_request(ctdb, CTDB_CONTROL_DEREGISTER_SRVID,
+				       CTDB_CURRENT_NODE, srvid, NULL, 0,
+				       callback, cbdata);
+	if (!req) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_remove_message_handler_send: allocating request");
+		return NULL;
+	}
+	req->extra = i;
+	req->extra_destructor = NULL;
+
+	ctdb_queue_request(ctdb, req);
+	DEBUG(ctdb, LOG_DEBUG,
+	      "ctdb_remove_message_handler_send: sending request %u for id %llu",
+	      req->hdr.hdr->reqid, (unsigned long long)srvid);
+	return req;
+}
+
+bool ctdb_remove_message_handler_recv(struct ctdb_connection *ctdb,
+				      struct ctdb_request *req)
+{
+	struct message_handler_info *handler = req->extra;
+	struct ctdb_reply_control *reply;
+
+	reply = unpack_reply_control(req, CTDB_CONTROL_DEREGISTER_SRVID);
+	if (!reply) {
+		return false;
+	}
+	if (reply->status != 0) {
+		DEBUG(ctdb, LOG_ERR,
+		      "ctdb_remove_message_handler_recv: status %i",
+		      reply->status);
+		return false;
+	}
+
+	DLIST_REMOVE(ctdb->message_handlers, handler);
+	free(handler);
+	req->extra = NULL;
+	return true;
+}
+
+bool ctdb_send_message(struct ctdb_connection *ctdb,
+		      uint32_t pnn, uint64_t srvid,
+		      TDB_DATA data)
+{
+	struct ctdb_request *req;
+	struct ctdb_req_message *pkt;
+
+	/* We just discard it once it's finished: no reply. */
+	req = new_ctdb_request(ctdb, CTDB_REQ_MESSAGE,
+			       offsetof(struct ctdb_req_message, data)
+			       + data.dsize,
+			       NULL, NULL);
+	if (!req) {
+		DEBUG(ctdb, LOG_ERR, "ctdb_send_message: allocating message");
+		return false;
+	}
+
+	pkt = req->hdr.message;
+	pkt->hdr.destnode = pnn;
+	pkt->srvid = srvid;
+	pkt->datalen = data.dsize;
+	memcpy(pkt->data, data.dptr, data.dsize);
+	ctdb_queue_request(ctdb, req);
+	return true;
+}
@@ -54,6 +54,8 @@ ctdb_ban_node_event(struct event_context *ev, struct timed_event *te,
 		talloc_free(ctdb->banning_ctx);
 		ctdb->banning_ctx = NULL;
 	}
+
+	ctdb_state_changed(ctdb);
 }
 
 void ctdb_local_node_got_banned(struct ctdb_context *ctdb)
@@ -75,6 +77,7 @@ void ctdb_local_node_got_banned(struct ctdb_context *ctdb)
 	}
 	ctdb_release_all_ips(ctdb);
 	ctdb->recovery_mode = CTDB_RECOVERY_ACTIVE;
+	ctdb_state_changed(ctdb);
 }
 
 int32_t ctdb_control_set_ban_state(struct ctdb_context *ctdb, TDB_DATA indata)
@@ -104,6 +107,7 @@ int32_t ctdb_control_set_ban_state(struct ctdb_context *ctdb, TDB_DATA indata)
 
 			ctdb->nodes[bantime->pnn]->flags |= NODE_FLAGS_BANNED;
 		}
+		ctdb_state_changed(ctdb);
 		return 0;
 	}
 
@@ -115,6 +119,7 @@ int32_t ctdb_control_set_ban_state(struct ctdb_context *ctdb, TDB_DATA indata)
 	if (bantime->time == 0) {
 		DEBUG(DEBUG_ERR,("Unbanning this node\n"));
 		ctdb->nodes[bantime->pnn]->flags &= ~NODE_FLAGS_BANNED;
+		ctdb_state_changed(ctdb);
 		return 0;
 	}
 
@@ -133,6 +138,7 @@ int32_t ctdb_control_set_ban_state(struct ctdb_context *ctdb, TDB_DATA indata)
 
 	DEBUG(DEBUG_ERR,("Banning this node for %d seconds\n", bantime->time));
 	ctdb->nodes[bantime->pnn]->flags |= NODE_FLAGS_BANNED;
+	ctdb_state_changed(ctdb);
 
 	event_add_timed(ctdb->ev, ctdb->banning_ctx, timeval_current_ofs(bantime->time,0), ctdb_ban_node_event, ctdb);
 
@@ -26,12 +26,17 @@
 #include "system/network.h"
 #include "system/filesys.h"
 #include "../include/ctdb_private.h"
-#include "../common/rb_tree.h"
+#include "../common/key_index.h"
+#include "db_wrap.h"
 
 struct ctdb_sticky_record {
 	struct ctdb_context *ctdb;
 	struct ctdb_db_context *ctdb_db;
 	TDB_CONTEXT *pindown;
+	TDB_DATA key;
+	uint32_t pindown_ms;	/* how long the next pindown lasts */
+	uint32_t deferred;	/* requests deferred by the current pindown */
+	uint64_t requesters;	/* nodes (modulo 64) those requests came from */
 };
 
 /*
@@ -104,6 +109,82 @@ static void ctdb_send_error(struct ctdb_context *ctdb,
 }
 
 
+/*
+  dmaster hints are only followed for the first few hops of a call.
+  After that the call goes the long way via the lmaster, which always
+  knows the dmaster, so stale hints can not keep a call bouncing
+ */
+#define DMASTER_HINT_MAX_HOPS	4
+
+/*
+  look up the hinted dmaster of key, counting hits and misses
+ */
+static bool ctdb_call_dmaster_hint(struct ctdb_db_context *ctdb_db,
+				   TDB_DATA key, uint32_t *dmaster)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+
+	if (ctdb->tunable.dmaster_hint_cache_size == 0) {
+		return false;
+	}
+
+	if (!ctdb_dmaster_hint_lookup(ctdb_db, key, dmaster)) {
+		CTDB_INCREMENT_STAT(ctdb, dmaster_hints.misses);
+		CTDB_INCREMENT_DB_STAT(ctdb_db, dmaster_hints.misses);
+		return false;
+	}
+
+	CTDB_INCREMENT_STAT(ctdb, dmaster_hints.hits);
+	CTDB_INCREMENT_DB_STAT(ctdb_db, dmaster_hints.hits);
+	return true;
+}
+
+/*
+  count the hops a hint saves if it is right
+ */
+static void ctdb_call_dmaster_hint_saved(struct ctdb_db_context *ctdb_db,
+					 uint32_t hops)
+{
+	ctdb_db->ctdb->statistics.dmaster_hints.hops_saved += hops;
+	ctdb_db->statistics.dmaster_hints.hops_saved += hops;
+}
+
+/*
+  choose where to send a call for a record we are not dmaster of. That
+  is the dmaster in our copy of the record header, unless a hint says
+  the record has moved on from there. Calls sent on a hint are flagged
+  so that the receiver can tell if the hint was stale
+ */
+static uint32_t ctdb_call_dmaster_dest(struct ctdb_db_context *ctdb_db,
+				       TDB_DATA key, uint32_t dmaster,
+				       uint32_t *flags)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	uint32_t lmaster = ctdb_lmaster(ctdb, &key);
+	uint32_t hint;
+
+	if (dmaster >= ctdb->num_nodes) {
+		dmaster = lmaster;
+	}
+
+	if (!ctdb_call_dmaster_hint(ctdb_db, key, &hint)) {
+		return dmaster;
+	}
+
+	/* if the record has moved on, the header dmaster passes the call
+	   to the lmaster, which passes it to the real dmaster */
+	if (hint != dmaster) {
+		if (dmaster == lmaster || hint == lmaster) {
+			ctdb_call_dmaster_hint_saved(ctdb_db, 1);
+		} else {
+			ctdb_call_dmaster_hint_saved(ctdb_db, 2);
+		}
+	}
+
+	*flags |= CTDB_CALL_FLAG_DMASTER_HINT;
+	return hint;
+}
+
 /**
  * send a redirect reply
  *
@@ -116,6 +197,9 @@ static void ctdb_send_error(struct ctdb_context *ctdb,
  * the current DMASTER. Note that this works because of this: When
  * a record is migrated off a node, then the new DMASTER is stored
  * in the record's copy on the former DMASTER.
+ *
+ * A node that is not the LMASTER but has a dmaster hint for the record
+ * sends the call straight to the hinted node instead.
  */
 static void ctdb_call_send_redirect(struct ctdb_context *ctdb,
 				    struct ctdb_db_context *ctdb_db,
@@ -124,10 +208,24 @@ static void ctdb_call_send_redirect(struct ctdb_context *ctdb,
 				    struct ctdb_ltdb_header *header)
 {
 	uint32_t lmaster = ctdb_lmaster(ctdb, &key);
+	uint32_t hint;
+
+	if (c->flags & CTDB_CALL_FLAG_DMASTER_HINT) {
+		CTDB_INCREMENT_STAT(ctdb, dmaster_hints.stale);
+		CTDB_INCREMENT_DB_STAT(ctdb_db, dmaster_hints.stale);
+		c->flags &= ~CTDB_CALL_FLAG_DMASTER_HINT;
+	}
 
 	c->hdr.destnode = lmaster;
 	if (ctdb->pnn == lmaster) {
 		c->hdr.destnode = header->dmaster;
+	} else if (c->hopcount < DMASTER_HINT_MAX_HOPS &&
+		   ctdb_call_dmaster_hint(ctdb_db, key, &hint)) {
+		if (hint != lmaster) {
+			ctdb_call_dmaster_hint_saved(ctdb_db, 1);
+		}
+		c->hdr.destnode = hint;
+		c->flags |= CTDB_CALL_FLAG_DMASTER_HINT;
 	}
 	c->hopcount++;
 
@@ -144,6 +242,51 @@ static void ctdb_call_send_redirect(struct ctdb_context *ctdb,
 }
 
 
+/*
+  send the CTDB_REPLY_DMASTER for a record the lmaster has handed to
+  new_dmaster
+*/
+static void ctdb_send_dmaster_reply_pkt(struct ctdb_db_context *ctdb_db,
+					struct ctdb_ltdb_header *header,
+					TDB_DATA key, TDB_DATA data,
+					uint32_t new_dmaster,
+					uint32_t reqid)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_reply_dmaster *r;
+	int len;
+	TALLOC_CTX *tmp_ctx;
+
+	if (ctdb->methods == NULL) {
+		ctdb_fatal(ctdb, "ctdb_send_dmaster_reply cant update dmaster since transport is down");
+		return;
+	}
+
+	/* put the packet on a temporary context, allowing us to safely free
+	   it below even if ctdb_reply_dmaster() has freed it already */
+	tmp_ctx = talloc_new(ctdb);
+
+	/* send the CTDB_REPLY_DMASTER */
+	len = offsetof(struct ctdb_reply_dmaster, data) + key.dsize + data.dsize + sizeof(uint32_t);
+	r = ctdb_transport_allocate(ctdb, tmp_ctx, CTDB_REPLY_DMASTER, len,
+				    struct ctdb_reply_dmaster);
+	CTDB_NO_MEMORY_FATAL(ctdb, r);
+
+	r->hdr.destnode  = new_dmaster;
+	r->hdr.reqid     = reqid;
+	r->rsn           = header->rsn;
+	r->keylen        = key.dsize;
+	r->datalen       = data.dsize;
+	r->db_id         = ctdb_db->db_id;
+	memcpy(&r->data[0], key.dptr, key.dsize);
+	memcpy(&r->data[key.dsize], data.dptr, data.dsize);
+	memcpy(&r->data[key.dsize+data.dsize], &header->flags, sizeof(uint32_t));
+
+	ctdb_queue_packet(ctdb, &r->hdr);
+
+	talloc_free(tmp_ctx);
+}
+
 /*
   send a dmaster reply
 
@@ -157,9 +300,7 @@ static void ctdb_send_dmaster_reply(struct ctdb_db_context *ctdb_db,
 				    uint32_t reqid)
 {
 	struct ctdb_context *ctdb = ctdb_db->ctdb;
-	struct ctdb_reply_dmaster *r;
-	int ret, len;
-	TALLOC_CTX *tmp_ctx;
+	int ret;
 
 	if (ctdb->pnn != ctdb_lmaster(ctdb, &key)) {
 		DEBUG(DEBUG_ALERT,(__location__ " Caller is not lmaster!\n"));
@@ -173,34 +314,42 @@ static void ctdb_send_dmaster_reply(struct ctdb_db_context *ctdb_db,
 		return;
 	}
 
-	if (ctdb->methods == NULL) {
-		ctdb_fatal(ctdb, "ctdb_send_dmaster_reply cant update dmaster since transport is down");
-		return;
-	}
+	ctdb_send_dmaster_reply_pkt(ctdb_db, header, key, data, new_dmaster, reqid);
+}
 
-	/* put the packet on a temporary context, allowing us to safely free
-	   it below even if ctdb_reply_dmaster() has freed it already */
-	tmp_ctx = talloc_new(ctdb);
+/*
+  send the CTDB_REQ_DMASTER for a record we have handed to the sender of
+  the call c. header is the record header from before the hand over
+*/
+static void ctdb_call_send_dmaster_pkt(struct ctdb_db_context *ctdb_db,
+				       struct ctdb_req_call *c,
+				       struct ctdb_ltdb_header *header,
+				       TDB_DATA key, TDB_DATA data,
+				       uint32_t lmaster)
+{
+	struct ctdb_req_dmaster *r;
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	int len;
 
-	/* send the CTDB_REPLY_DMASTER */
-	len = offsetof(struct ctdb_reply_dmaster, data) + key.dsize + data.dsize + sizeof(uint32_t);
-	r = ctdb_transport_allocate(ctdb, tmp_ctx, CTDB_REPLY_DMASTER, len,
-				    struct ctdb_reply_dmaster);
+	len = offsetof(struct ctdb_req_dmaster, data) + key.dsize + data.dsize
+			+ sizeof(uint32_t);
+	r = ctdb_transport_allocate(ctdb, ctdb, CTDB_REQ_DMASTER, len, 
+				    struct ctdb_req_dmaster);
 	CTDB_NO_MEMORY_FATAL(ctdb, r);
-
-	r->hdr.destnode  = new_dmaster;
-	r->hdr.reqid     = reqid;
+	r->hdr.destnode  = lmaster;
+	r->hdr.reqid     = c->hdr.reqid;
+	r->db_id         = c->db_id;
 	r->rsn           = header->rsn;
+	r->dmaster       = c->hdr.srcnode;
 	r->keylen        = key.dsize;
 	r->datalen       = data.dsize;
-	r->db_id         = ctdb_db->db_id;
 	memcpy(&r->data[0], key.dptr, key.dsize);
 	memcpy(&r->data[key.dsize], data.dptr, data.dsize);
-	memcpy(&r->data[key.dsize+data.dsize], &header->flags, sizeof(uint32_t));
+	memcpy(&r->data[key.dsize + data.dsize], &header->flags, sizeof(uint32_t));
 
 	ctdb_queue_packet(ctdb, &r->hdr);
 
-	talloc_free(tmp_ctx);
+	talloc_free(r);
 }
 
 /*
@@ -215,9 +364,8 @@ static void ctdb_call_send_dmaster(struct ctdb_db_context *ctdb_db,
 				   struct ctdb_ltdb_header *header,
 				   TDB_DATA *key, TDB_DATA *data)
 {
-	struct ctdb_req_dmaster *r;
 	struct ctdb_context *ctdb = ctdb_db->ctdb;
-	int len;
+	struct ctdb_ltdb_header old_header;
 	uint32_t lmaster = ctdb_lmaster(ctdb, key);
 
 	if (ctdb->methods == NULL) {
@@ -234,79 +382,190 @@ static void ctdb_call_send_dmaster(struct ctdb_db_context *ctdb_db,
 					c->hdr.srcnode, c->hdr.reqid);
 		return;
 	}
-	
-	len = offsetof(struct ctdb_req_dmaster, data) + key->dsize + data->dsize
-			+ sizeof(uint32_t);
-	r = ctdb_transport_allocate(ctdb, ctdb, CTDB_REQ_DMASTER, len, 
-				    struct ctdb_req_dmaster);
-	CTDB_NO_MEMORY_FATAL(ctdb, r);
-	r->hdr.destnode  = lmaster;
-	r->hdr.reqid     = c->hdr.reqid;
-	r->db_id         = c->db_id;
-	r->rsn           = header->rsn;
-	r->dmaster       = c->hdr.srcnode;
-	r->keylen        = key->dsize;
-	r->datalen       = data->dsize;
-	memcpy(&r->data[0], key->dptr, key->dsize);
-	memcpy(&r->data[key->dsize], data->dptr, data->dsize);
-	memcpy(&r->data[key->dsize + data->dsize], &header->flags, sizeof(uint32_t));
+
+	ctdb_dmaster_hint_update(ctdb_db, *key, c->hdr.srcnode);
+
+	/* the lmaster gets the header we had */
+	old_header = *header;
 
 	header->dmaster = c->hdr.srcnode;
 	if (ctdb_ltdb_store(ctdb_db, *key, header, *data) != 0) {
 		ctdb_fatal(ctdb, "Failed to store record in ctdb_call_send_dmaster");
 	}
-	
+
+	ctdb_call_send_dmaster_pkt(ctdb_db, c, &old_header, *key, *data, lmaster);
+}
+
+/*
+  send the CTDB_REPLY_CALL for a call answered here
+*/
+static void ctdb_send_reply_call(struct ctdb_context *ctdb,
+				 struct ctdb_req_header *hdr,
+				 int32_t status, TDB_DATA reply_data)
+{
+	struct ctdb_reply_call *r;
+	int len;
+
+	len = offsetof(struct ctdb_reply_call, data) + reply_data.dsize;
+	r = ctdb_transport_allocate(ctdb, ctdb, CTDB_REPLY_CALL, len, 
+				    struct ctdb_reply_call);
+	CTDB_NO_MEMORY_FATAL(ctdb, r);
+	r->hdr.destnode  = hdr->srcnode;
+	r->hdr.reqid     = hdr->reqid;
+	r->status        = status;
+	r->datalen       = reply_data.dsize;
+	if (reply_data.dsize) {
+		memcpy(&r->data[0], reply_data.dptr, reply_data.dsize);
+	}
+
 	ctdb_queue_packet(ctdb, &r->hdr);
 
 	talloc_free(r);
 }
 
+/*
+  a packet whose record work is done by a call shard
+ */
+struct ctdb_call_shard_pkt {
+	struct ctdb_context *ctdb;
+	struct ctdb_db_context *ctdb_db;
+	struct ctdb_req_header *hdr;
+};
+
+static int ctdb_call_shard_pkt_send(struct ctdb_db_context *ctdb_db,
+				    struct ctdb_req_header *hdr,
+				    struct ctdb_call_shard_request *req,
+				    ctdb_call_shard_fn_t fn)
+{
+	struct ctdb_call_shard_pkt *pkt;
+	int ret;
+
+	pkt = talloc(ctdb_db, struct ctdb_call_shard_pkt);
+	if (pkt == NULL) {
+		talloc_free(req);
+		return -1;
+	}
+	pkt->ctdb    = ctdb_db->ctdb;
+	pkt->ctdb_db = ctdb_db;
+	pkt->hdr     = hdr;
+
+	ret = ctdb_call_shard_send(ctdb_db, req, fn, pkt);
+	talloc_free(req);
+	if (ret != 0) {
+		talloc_free(pkt);
+		return -1;
+	}
+
+	talloc_steal(pkt, hdr);
+	return 0;
+}
+
+/*
+  the checks ctdb_input_pkt() made before the packet went to a call
+  shard may no longer hold
+ */
+static bool ctdb_call_shard_pkt_current(struct ctdb_context *ctdb,
+					struct ctdb_req_header *hdr)
+{
+	if (ctdb->methods == NULL) {
+		return false;
+	}
+	if (ctdb->nodes[ctdb->pnn]->flags & NODE_FLAGS_BANNED) {
+		return false;
+	}
+	return ctdb->vnn_map->generation == hdr->generation;
+}
+
+static uint32_t sticky_requester_count(uint64_t requesters)
+{
+	uint32_t n = 0;
+
+	while (requesters != 0) {
+		requesters &= requesters - 1;
+		n++;
+	}
+	return n;
+}
+
+/*
+  a pindown has ended. Decide how long the next one should be from how
+  many requests it held up and from how many nodes:
+
+  - nobody asked for the record: it is not contended any more, so stop
+    treating it as sticky.
+  - the record is bouncing between us and one other node: double it,
+    so each side gets to do more work per migration.
+  - several nodes are queueing up: grow it more slowly, by 1/fanout,
+    since every extra millisecond is paid by all of them.
+ */
 static void ctdb_sticky_pindown_timeout(struct event_context *ev, struct timed_event *te, 
 				       struct timeval t, void *private_data)
 {
 	struct ctdb_sticky_record *sr = talloc_get_type(private_data, 
 						       struct ctdb_sticky_record);
+	struct ctdb_context *ctdb = sr->ctdb;
+	struct ctdb_db_context *ctdb_db = sr->ctdb_db;
+	uint32_t min_ms = ctdb->tunable.sticky_pindown_min;
+	uint32_t max_ms = MAX(ctdb->tunable.sticky_pindown_max, min_ms);
+	uint32_t fanout;
 
-	DEBUG(DEBUG_ERR,("Pindown timeout db:%s  unstick record\n", sr->ctdb_db->db_name));
 	if (sr->pindown != NULL) {
 		talloc_free(sr->pindown);
 		sr->pindown = NULL;
 	}
+
+	if (sr->deferred == 0) {
+		CTDB_INCREMENT_DB_STAT(ctdb_db, sticky.idle_pindowns);
+		DEBUG(DEBUG_INFO,("Sticky record in db:%s key:0x%08x no longer contended, unstick record\n",
+				  ctdb_db->db_name, ctdb_hash(&sr->key)));
+		CTDB_INCREMENT_DB_STAT(ctdb_db, sticky.released);
+		talloc_free(sr);
+		return;
+	}
+
+	fanout = sticky_requester_count(sr->requesters);
+	if (fanout == 0) {
+		fanout = 1;
+	}
+	sr->pindown_ms += sr->pindown_ms / fanout;
+
+	if (sr->pindown_ms < min_ms) {
+		sr->pindown_ms = min_ms;
+	}
+	if (sr->pindown_ms > max_ms) {
+		sr->pindown_ms = max_ms;
+	}
+
+	DEBUG(DEBUG_INFO,("Pindown timeout db:%s key:0x%08x deferred:%u next pindown:%u ms\n",
+			  ctdb_db->db_name, ctdb_hash(&sr->key),
+			  sr->deferred, sr->pindown_ms));
+
+	sr->deferred   = 0;
+	sr->requesters = 0;
 }
 
 static int
 ctdb_set_sticky_pindown(struct ctdb_context *ctdb, struct ctdb_db_context *ctdb_db, TDB_DATA key)
 {
-	TALLOC_CTX *tmp_ctx = talloc_new(NULL);
-	uint32_t *k;
 	struct ctdb_sticky_record *sr;
 
-	k = talloc_zero_size(tmp_ctx, ((key.dsize + 3) & 0xfffffffc) + 4);
-	if (k == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to allocate key for sticky record\n"));
-		talloc_free(tmp_ctx);
-		return -1;
-	}
-
-	k[0] = (key.dsize + 3) / 4 + 1;
-	memcpy(&k[1], key.dptr, key.dsize);
-
-	sr = trbt_lookuparray32(ctdb_db->sticky_records, k[0], &k[0]);
+	sr = key_index_lookup(ctdb_db->sticky_records, key);
 	if (sr == NULL) {
-		talloc_free(tmp_ctx);
 		return 0;
 	}
 
-	talloc_free(tmp_ctx);
-
 	if (sr->pindown == NULL) {
-		DEBUG(DEBUG_ERR,("Pinning down record in %s for %d ms\n", ctdb_db->db_name, ctdb->tunable.sticky_pindown));
+		DEBUG(DEBUG_INFO,("Pinning down record in %s for %u ms\n", ctdb_db->db_name, sr->pindown_ms));
 		sr->pindown = talloc_new(sr);
 		if (sr->pindown == NULL) {
 			DEBUG(DEBUG_ERR,("Failed to allocate pindown context for sticky record\n"));
 			return -1;
 		}
-		event_add_timed(ctdb->ev, sr->pindown, timeval_current_ofs(ctdb->tunable.sticky_pindown / 1000, (ctdb->tunable.sticky_pindown * 1000) % 1000000), ctdb_sticky_pindown_timeout, sr);
+		event_add_timed(ctdb->ev, sr->pindown, timeval_current_ofs(sr->pindown_ms / 1000, (sr->pindown_ms * 1000) % 1000000), ctdb_sticky_pindown_timeout, sr);
+
+		CTDB_INCREMENT_DB_STAT(ctdb_db, sticky.pindowns);
+		ctdb_db->statistics.sticky.pindown_ms =
+			(7 * ctdb_db->statistics.sticky.pindown_ms + sr->pindown_ms) / 8;
 	}
 
 	return 0;
@@ -334,6 +593,7 @@ static void ctdb_become_dmaster(struct ctdb_db_context *ctdb_db,
 	header.rsn = rsn;
 	header.dmaster = ctdb->pnn;
 	header.flags = record_flags;
+	ctdb_dmaster_hint_update(ctdb_db, key, ctdb->pnn);
 
 	state = ctdb_reqid_find(ctdb, hdr->reqid, struct ctdb_call_state);
 
@@ -415,15 +675,16 @@ static void ctdb_become_dmaster(struct ctdb_db_context *ctdb_db,
 
 
 /*
-  called when a CTDB_REQ_DMASTER packet comes in
+  handle a CTDB_REQ_DMASTER packet in the daemon
 
   this comes into the lmaster for a record when the current dmaster
   wants to give up the dmaster role and give it to someone else
 */
-void ctdb_request_dmaster(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
+static void ctdb_request_dmaster_main(struct ctdb_context *ctdb,
+				      struct ctdb_req_header *hdr)
 {
 	struct ctdb_req_dmaster *c = (struct ctdb_req_dmaster *)hdr;
-	TDB_DATA key, data, data2;
+	TDB_DATA key, data;
 	struct ctdb_ltdb_header header;
 	struct ctdb_db_context *ctdb_db;
 	uint32_t record_flags = 0;
@@ -449,7 +710,7 @@ void ctdb_request_dmaster(struct ctdb_context *ctdb, struct ctdb_req_header *hdr
 	}
 	
 	/* fetch the current record */
-	ret = ctdb_ltdb_lock_fetch_requeue(ctdb_db, key, &header, hdr, &data2,
+	ret = ctdb_ltdb_lock_fetch_requeue(ctdb_db, key, &header, hdr, NULL,
 					   ctdb_call_input_pkt, ctdb, false);
 	if (ret == -1) {
 		ctdb_fatal(ctdb, "ctdb_req_dmaster failed to fetch record");
@@ -481,6 +742,7 @@ void ctdb_request_dmaster(struct ctdb_context *ctdb, struct ctdb_req_header *hdr
 			DEBUG(DEBUG_ERR,("ctdb_req_dmaster from non-master. Force a recovery.\n"));
 
 			ctdb->recovery_mode = CTDB_RECOVERY_ACTIVE;
+			ctdb_state_changed(ctdb);
 			ctdb_ltdb_unlock(ctdb_db, key);
 			return;
 		}
@@ -513,6 +775,94 @@ void ctdb_request_dmaster(struct ctdb_context *ctdb, struct ctdb_req_header *hdr
 	}
 }
 
+static void ctdb_request_dmaster_shard_done(struct ctdb_call_shard_reply *reply,
+					    void *private_data)
+{
+	struct ctdb_call_shard_pkt *pkt = talloc_get_type(private_data,
+							  struct ctdb_call_shard_pkt);
+	struct ctdb_context *ctdb = pkt->ctdb;
+	struct ctdb_req_dmaster *c = (struct ctdb_req_dmaster *)pkt->hdr;
+	TDB_DATA key, data;
+
+	/* the shard died, the recovery it forced sorts this out */
+	if (reply == NULL) {
+		return;
+	}
+
+	key.dptr = c->data;
+	key.dsize = c->keylen;
+	data.dptr = c->data + c->keylen;
+	data.dsize = c->datalen;
+
+	ctdb_call_shard_delete_queue(pkt->ctdb_db, reply, key);
+
+	if (reply->result == CTDB_CALL_SHARD_FAILED) {
+		ctdb_fatal(ctdb, "ctdb_send_dmaster_reply unable to update dmaster");
+		return;
+	}
+
+	if (!ctdb_call_shard_pkt_current(ctdb, pkt->hdr)) {
+		return;
+	}
+
+	if (reply->result != CTDB_CALL_SHARD_MIGRATED) {
+		ctdb_request_dmaster_main(ctdb, pkt->hdr);
+		return;
+	}
+
+	ctdb_send_dmaster_reply_pkt(pkt->ctdb_db, &reply->header, key, data,
+				    c->dmaster, c->hdr.reqid);
+}
+
+/*
+  called when a CTDB_REQ_DMASTER packet comes in
+
+  The lmaster hands the record on to the new dmaster in a call shard,
+  unless it becomes the dmaster itself
+*/
+void ctdb_request_dmaster(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
+{
+	struct ctdb_req_dmaster *c = (struct ctdb_req_dmaster *)hdr;
+	struct ctdb_call_shard_request *req;
+	struct ctdb_db_context *ctdb_db;
+	TDB_DATA key, data;
+	size_t len;
+
+	if (!ctdb_call_shards_enabled(ctdb) || c->dmaster == ctdb->pnn) {
+		ctdb_request_dmaster_main(ctdb, hdr);
+		return;
+	}
+
+	ctdb_db = find_ctdb_db(ctdb, c->db_id);
+	key.dptr = c->data;
+	key.dsize = c->keylen;
+	data.dptr = c->data + c->keylen;
+	data.dsize = c->datalen;
+	len = offsetof(struct ctdb_req_dmaster, data) + key.dsize + data.dsize
+			+ sizeof(uint32_t);
+	if (ctdb_db == NULL || ctdb_db->persistent || len > c->hdr.length ||
+	    ctdb_lmaster(ctdb, &key) != ctdb->pnn) {
+		ctdb_request_dmaster_main(ctdb, hdr);
+		return;
+	}
+
+	req = ctdb_call_shard_request(ctdb, ctdb_db, CTDB_CALL_SHARD_DMASTER,
+				      key, tdb_null, data);
+	if (req == NULL) {
+		ctdb_request_dmaster_main(ctdb, hdr);
+		return;
+	}
+	req->srcnode      = c->hdr.srcnode;
+	req->dmaster      = c->dmaster;
+	req->rsn          = c->rsn;
+	req->record_flags = *(uint32_t *)&c->data[c->keylen + c->datalen];
+
+	if (ctdb_call_shard_pkt_send(ctdb_db, hdr, req,
+				     ctdb_request_dmaster_shard_done) != 0) {
+		ctdb_request_dmaster_main(ctdb, hdr);
+	}
+}
+
 static void ctdb_sticky_record_timeout(struct event_context *ev, struct timed_event *te, 
 				       struct timeval t, void *private_data)
 {
@@ -521,58 +871,58 @@ static void ctdb_sticky_record_timeout(struct event_context *ev, struct timed_ev
 	talloc_free(sr);
 }
 
-static void *ctdb_make_sticky_record_callback(void *parm, void *data)
+static int ctdb_sticky_record_destructor(struct ctdb_sticky_record *sr)
 {
-        if (data) {
-		DEBUG(DEBUG_ERR,("Already have sticky record registered. Free old %p and create new %p\n", data, parm));
-                talloc_free(data);
-        }
-        return parm;
+	if (key_index_lookup(sr->ctdb_db->sticky_records, sr->key) == sr) {
+		key_index_remove(sr->ctdb_db->sticky_records, sr->key);
+	}
+	return 0;
 }
 
 static int
 ctdb_make_record_sticky(struct ctdb_context *ctdb, struct ctdb_db_context *ctdb_db, TDB_DATA key)
 {
-	TALLOC_CTX *tmp_ctx = talloc_new(NULL);
-	uint32_t *k;
 	struct ctdb_sticky_record *sr;
 
-	k = talloc_zero_size(tmp_ctx, ((key.dsize + 3) & 0xfffffffc) + 4);
-	if (k == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to allocate key for sticky record\n"));
-		talloc_free(tmp_ctx);
-		return -1;
-	}
-
-	k[0] = (key.dsize + 3) / 4 + 1;
-	memcpy(&k[1], key.dptr, key.dsize);
-
-	sr = trbt_lookuparray32(ctdb_db->sticky_records, k[0], &k[0]);
+	sr = key_index_lookup(ctdb_db->sticky_records, key);
 	if (sr != NULL) {
-		talloc_free(tmp_ctx);
 		return 0;
 	}
 
 	sr = talloc(ctdb_db->sticky_records, struct ctdb_sticky_record);
 	if (sr == NULL) {
-		talloc_free(tmp_ctx);
 		DEBUG(DEBUG_ERR,("Failed to allocate sticky record structure\n"));
 		return -1;
 	}
 
-	sr->ctdb    = ctdb;
-	sr->ctdb_db = ctdb_db;
-	sr->pindown = NULL;
+	sr->ctdb       = ctdb;
+	sr->ctdb_db    = ctdb_db;
+	sr->pindown    = NULL;
+	sr->pindown_ms = ctdb->tunable.sticky_pindown;
+	sr->deferred   = 0;
+	sr->requesters = 0;
+	sr->key.dsize  = key.dsize;
+	sr->key.dptr  = talloc_memdup(sr, key.dptr, key.dsize);
+	if (sr->key.dptr == NULL && key.dsize != 0) {
+		DEBUG(DEBUG_ERR,("Failed to allocate key for sticky record\n"));
+		talloc_free(sr);
+		return -1;
+	}
 
 	DEBUG(DEBUG_ERR,("Make record sticky for %d seconds in db %s key:0x%08x.\n",
 			 ctdb->tunable.sticky_duration,
 			 ctdb_db->db_name, ctdb_hash(&key)));
 
-	trbt_insertarray32_callback(ctdb_db->sticky_records, k[0], &k[0], ctdb_make_sticky_record_callback, sr);
+	if (key_index_insert(ctdb_db->sticky_records, key, sr) != 0) {
+		DEBUG(DEBUG_ERR,("Failed to insert sticky record\n"));
+		talloc_free(sr);
+		return -1;
+	}
+	talloc_set_destructor(sr, ctdb_sticky_record_destructor);
+	CTDB_INCREMENT_DB_STAT(ctdb_db, sticky.made_sticky);
 
 	event_add_timed(ctdb->ev, sr, timeval_current_ofs(ctdb->tunable.sticky_duration, 0), ctdb_sticky_record_timeout, sr);
 
-	talloc_free(tmp_ctx);
 	return 0;
 }
 
@@ -615,29 +965,14 @@ static int pinned_down_destructor(struct pinned_down_deferred_call *pinned_down)
 static int
 ctdb_defer_pinned_down_request(struct ctdb_context *ctdb, struct ctdb_db_context *ctdb_db, TDB_DATA key, struct ctdb_req_header *hdr)
 {
-	TALLOC_CTX *tmp_ctx = talloc_new(NULL);
-	uint32_t *k;
 	struct ctdb_sticky_record *sr;
 	struct pinned_down_deferred_call *pinned_down;
 
-	k = talloc_zero_size(tmp_ctx, ((key.dsize + 3) & 0xfffffffc) + 4);
-	if (k == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to allocate key for sticky record\n"));
-		talloc_free(tmp_ctx);
-		return -1;
-	}
-
-	k[0] = (key.dsize + 3) / 4 + 1;
-	memcpy(&k[1], key.dptr, key.dsize);
-
-	sr = trbt_lookuparray32(ctdb_db->sticky_records, k[0], &k[0]);
+	sr = key_index_lookup(ctdb_db->sticky_records, key);
 	if (sr == NULL) {
-		talloc_free(tmp_ctx);
 		return -1;
 	}
 
-	talloc_free(tmp_ctx);
-
 	if (sr->pindown == NULL) {
 		return -1;
 	}
@@ -648,6 +983,12 @@ ctdb_defer_pinned_down_request(struct ctdb_context *ctdb, struct ctdb_db_context
 		return -1;
 	}
 
+	sr->deferred++;
+	if (hdr->srcnode != ctdb->pnn) {
+		sr->requesters |= ((uint64_t)1) << (hdr->srcnode % 64);
+	}
+	CTDB_INCREMENT_DB_STAT(ctdb_db, sticky.deferred);
+
 	pinned_down->ctdb = ctdb;
 	pinned_down->hdr  = hdr;
 
@@ -657,69 +998,126 @@ ctdb_defer_pinned_down_request(struct ctdb_context *ctdb, struct ctdb_db_context
 	return 0;
 }
 
-static void
-ctdb_update_db_stat_hot_keys(struct ctdb_db_context *ctdb_db, TDB_DATA key, int hopcount)
+/*
+  Calls that are shipped run at the dmaster and only the reply goes back,
+  the record stays put. For each record we track the last node that
+  shipped a call for it and how many calls in a row it has shipped, in
+  a small table indexed by the key hash. Once one node keeps asking
+  for a record it is cheaper to give it the record after all.
+ */
+#define SHIP_OWNERS_SIZE	256
+
+struct ctdb_ship_owner {
+	uint32_t hash;
+	uint32_t pnn;
+	uint32_t count;
+};
+
+/*
+  true if the call may be shipped at all
+ */
+static bool ctdb_call_shippable(struct ctdb_db_context *ctdb_db,
+				struct ctdb_req_call *c)
 {
-	int i, id;
+	struct ctdb_registered_call *fn;
 
-	/* smallest value is always at index 0 */
-	if (hopcount <= ctdb_db->statistics.hot_keys[0].count) {
-		return;
+	if (c->flags & (CTDB_IMMEDIATE_MIGRATION|CTDB_WANT_READONLY)) {
+		return false;
 	}
 
-	/* see if we already know this key */
-	for (i = 0; i < MAX_HOT_KEYS; i++) {
-		if (key.dsize != ctdb_db->statistics.hot_keys[i].key.dsize) {
-			continue;
-		}
-		if (memcmp(key.dptr, ctdb_db->statistics.hot_keys[i].key.dptr, key.dsize)) {
-			continue;
-		}
-		/* found an entry for this key */
-		if (hopcount <= ctdb_db->statistics.hot_keys[i].count) {
-			return;
+	for (fn=ctdb_db->calls; fn; fn=fn->next) {
+		if (fn->id == c->callid) {
+			break;
 		}
-		ctdb_db->statistics.hot_keys[i].count = hopcount;
-		goto sort_keys;
 	}
 
-	if (ctdb_db->statistics.num_hot_keys < MAX_HOT_KEYS) {
-		id = ctdb_db->statistics.num_hot_keys;
-		ctdb_db->statistics.num_hot_keys++;
-	} else {
-		id = 0;
-	}
+	return fn != NULL && fn->ship;
+}
+
+/*
+  decide whether a call from another node is run here instead of
+  migrating the record to it
+ */
+static bool ctdb_call_ship(struct ctdb_db_context *ctdb_db,
+			   struct ctdb_req_call *c, TDB_DATA key)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_ship_owner *owner;
+	uint32_t hash;
 
-	if (ctdb_db->statistics.hot_keys[id].key.dptr != NULL) {
-		talloc_free(ctdb_db->statistics.hot_keys[id].key.dptr);
+	if (!ctdb_call_shippable(ctdb_db, c)) {
+		return false;
 	}
-	ctdb_db->statistics.hot_keys[id].key.dsize = key.dsize;
-	ctdb_db->statistics.hot_keys[id].key.dptr  = talloc_memdup(ctdb_db, key.dptr, key.dsize);
-	ctdb_db->statistics.hot_keys[id].count = hopcount;
-	DEBUG(DEBUG_NOTICE,("Updated hot key database=%s key=0x%08x id=%d hop_count=%d\n",
-			    ctdb_db->db_name, ctdb_hash(&key), id, hopcount));
 
-sort_keys:
-	for (i = 1; i < MAX_HOT_KEYS; i++) {
-		if (ctdb_db->statistics.hot_keys[i].count == 0) {
-			continue;
+	if (ctdb->tunable.ship_call_migrate_count != 0) {
+		if (ctdb_db->ship_owners == NULL) {
+			ctdb_db->ship_owners = talloc_zero_array(ctdb_db,
+							struct ctdb_ship_owner,
+							SHIP_OWNERS_SIZE);
+			if (ctdb_db->ship_owners == NULL) {
+				return false;
+			}
+		}
+
+		hash = ctdb_hash(&key);
+		owner = &ctdb_db->ship_owners[hash % SHIP_OWNERS_SIZE];
+		if (owner->hash != hash || owner->pnn != c->hdr.srcnode) {
+			owner->hash  = hash;
+			owner->pnn   = c->hdr.srcnode;
+			owner->count = 0;
 		}
-		if (ctdb_db->statistics.hot_keys[i].count < ctdb_db->statistics.hot_keys[0].count) {
-			hopcount = ctdb_db->statistics.hot_keys[i].count;
-			ctdb_db->statistics.hot_keys[i].count = ctdb_db->statistics.hot_keys[0].count;
-			ctdb_db->statistics.hot_keys[0].count = hopcount;
 
-			key = ctdb_db->statistics.hot_keys[i].key;
-			ctdb_db->statistics.hot_keys[i].key = ctdb_db->statistics.hot_keys[0].key;
-			ctdb_db->statistics.hot_keys[0].key = key;
+		owner->count++;
+		if (owner->count >= ctdb->tunable.ship_call_migrate_count) {
+			owner->count = 0;
+			CTDB_INCREMENT_STAT(ctdb, shipped.migrations);
+			CTDB_INCREMENT_DB_STAT(ctdb_db, shipped.migrations);
+			return false;
 		}
 	}
+
+	CTDB_INCREMENT_STAT(ctdb, shipped.calls);
+	CTDB_INCREMENT_DB_STAT(ctdb_db, shipped.calls);
+	return true;
 }
 
 /*
-  called when a CTDB_REQ_CALL packet comes in
+  account for a call that is answered or migrated here
+ */
+static void ctdb_request_call_count(struct ctdb_db_context *ctdb_db,
+				    struct ctdb_req_call *c, TDB_DATA key)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	int tmp_count, bucket;
+
+	CTDB_UPDATE_STAT(ctdb, max_hop_count, c->hopcount);
+	tmp_count = c->hopcount;
+	bucket = 0;
+	while (tmp_count) {
+		tmp_count >>= 2;
+		bucket++;
+	}
+	if (bucket >= MAX_COUNT_BUCKETS) {
+		bucket = MAX_COUNT_BUCKETS - 1;
+	}
+	CTDB_INCREMENT_STAT(ctdb, hop_count_bucket[bucket]);
+	CTDB_INCREMENT_DB_STAT(ctdb_db, hop_count_bucket[bucket]);
+	ctdb_db_hot_keys_update(ctdb_db, key, false);
+
+	/* If this database supports sticky records, then check if the
+	   hopcount is big. If it is it means the record is hot and we
+	   should make it sticky.
+	*/
+	if (ctdb_db->sticky && c->hopcount >= ctdb->tunable.hopcount_make_sticky) {
+		ctdb_make_record_sticky(ctdb, ctdb_db, key);
+	}
+}
+
+/*
+  handle a CTDB_REQ_CALL packet in the daemon
 */
-void ctdb_request_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
+static void ctdb_request_call_main(struct ctdb_context *ctdb,
+				   struct ctdb_req_header *hdr)
 {
 	struct ctdb_req_call *c = (struct ctdb_req_call *)hdr;
 	TDB_DATA data;
@@ -728,7 +1126,6 @@ void ctdb_request_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 	struct ctdb_ltdb_header header;
 	struct ctdb_call *call;
 	struct ctdb_db_context *ctdb_db;
-	int tmp_count, bucket;
 
 	if (ctdb->methods == NULL) {
 		DEBUG(DEBUG_INFO,(__location__ " Failed ctdb_request_call. Transport is DOWN\n"));
@@ -913,34 +1310,15 @@ void ctdb_request_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 		return;
 	}
 
-	CTDB_UPDATE_STAT(ctdb, max_hop_count, c->hopcount);
-	tmp_count = c->hopcount;
-	bucket = 0;
-	while (tmp_count) {
-		tmp_count >>= 2;
-		bucket++;
-	}
-	if (bucket >= MAX_COUNT_BUCKETS) {
-		bucket = MAX_COUNT_BUCKETS - 1;
-	}
-	CTDB_INCREMENT_STAT(ctdb, hop_count_bucket[bucket]);
-	CTDB_INCREMENT_DB_STAT(ctdb_db, hop_count_bucket[bucket]);
-	ctdb_update_db_stat_hot_keys(ctdb_db, call->key, c->hopcount);
-
-	/* If this database supports sticky records, then check if the
-	   hopcount is big. If it is it means the record is hot and we
-	   should make it sticky.
-	*/
-	if (ctdb_db->sticky && c->hopcount >= ctdb->tunable.hopcount_make_sticky) {
-		ctdb_make_record_sticky(ctdb, ctdb_db, call->key);
-	}
+	ctdb_request_call_count(ctdb_db, c, call->key);
 
 
 	/* Try if possible to migrate the record off to the caller node.
 	 * From the clients perspective a fetch of the data is just as 
-	 * expensive as a migration.
+	 * expensive as a migration. Shipped calls are answered here.
 	 */
-	if (c->hdr.srcnode != ctdb->pnn) {
+	if (c->hdr.srcnode != ctdb->pnn &&
+	    !ctdb_call_ship(ctdb_db, c, call->key)) {
 		if (ctdb_db->persistent_state) {
 			DEBUG(DEBUG_INFO, (__location__ " refusing migration"
 			      " of key %s while transaction is active\n",
@@ -948,6 +1326,7 @@ void ctdb_request_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 		} else {
 			DEBUG(DEBUG_DEBUG,("pnn %u starting migration of %08x to %u\n",
 				 ctdb->pnn, ctdb_hash(&(call->key)), c->hdr.srcnode));
+			ctdb_db_hot_keys_update(ctdb_db, call->key, true);
 			ctdb_call_send_dmaster(ctdb_db, c, &header, &(call->key), &data);
 			talloc_free(data.dptr);
 
@@ -971,22 +1350,145 @@ void ctdb_request_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 		DEBUG(DEBUG_ERR,(__location__ " ctdb_ltdb_unlock() failed with error %d\n", ret));
 	}
 
-	len = offsetof(struct ctdb_reply_call, data) + call->reply_data.dsize;
-	r = ctdb_transport_allocate(ctdb, ctdb, CTDB_REPLY_CALL, len, 
-				    struct ctdb_reply_call);
-	CTDB_NO_MEMORY_FATAL(ctdb, r);
-	r->hdr.destnode  = hdr->srcnode;
-	r->hdr.reqid     = hdr->reqid;
-	r->status        = call->status;
-	r->datalen       = call->reply_data.dsize;
-	if (call->reply_data.dsize) {
-		memcpy(&r->data[0], call->reply_data.dptr, call->reply_data.dsize);
+	ctdb_send_reply_call(ctdb, hdr, call->status, call->reply_data);
+
+	talloc_free(call);
+}
+
+static void ctdb_request_call_shard_done(struct ctdb_call_shard_reply *reply,
+					 void *private_data)
+{
+	struct ctdb_call_shard_pkt *pkt = talloc_get_type(private_data,
+							  struct ctdb_call_shard_pkt);
+	struct ctdb_context *ctdb = pkt->ctdb;
+	struct ctdb_db_context *ctdb_db = pkt->ctdb_db;
+	struct ctdb_req_call *c = (struct ctdb_req_call *)pkt->hdr;
+	TDB_DATA key, data;
+	uint32_t lmaster;
+
+	/* the shard died, the recovery it forced sorts this out */
+	if (reply == NULL) {
+		return;
 	}
 
-	ctdb_queue_packet(ctdb, &r->hdr);
+	key.dptr = c->data;
+	key.dsize = c->keylen;
+	data.dptr = &reply->data[0];
+	data.dsize = reply->datalen;
 
-	talloc_free(r);
-	talloc_free(call);
+	ctdb_call_shard_delete_queue(ctdb_db, reply, key);
+
+	if (reply->result == CTDB_CALL_SHARD_FAILED) {
+		ctdb_fatal(ctdb, "Failed to store record in ctdb_call_send_dmaster");
+		return;
+	}
+
+	if (!ctdb_call_shard_pkt_current(ctdb, pkt->hdr)) {
+		return;
+	}
+
+	switch (reply->result) {
+	case CTDB_CALL_SHARD_REMOTE:
+		ctdb_call_send_redirect(ctdb, ctdb_db, key, c, &reply->header);
+		break;
+
+	case CTDB_CALL_SHARD_ANSWERED:
+		ctdb_request_call_count(ctdb_db, c, key);
+		if (reply->ret != 0) {
+			DEBUG(DEBUG_ERR,(__location__ " ctdb_call_local failed\n"));
+			reply->status = -1;
+		}
+		ctdb_send_reply_call(ctdb, pkt->hdr, reply->status, data);
+		break;
+
+	case CTDB_CALL_SHARD_MIGRATED:
+		ctdb_request_call_count(ctdb_db, c, key);
+		DEBUG(DEBUG_DEBUG,("pnn %u migrated %08x to %u\n",
+			 ctdb->pnn, ctdb_hash(&key), c->hdr.srcnode));
+		ctdb_db_hot_keys_update(ctdb_db, key, true);
+
+		lmaster = ctdb_lmaster(ctdb, &key);
+		if (lmaster == ctdb->pnn) {
+			ctdb_send_dmaster_reply_pkt(ctdb_db, &reply->header,
+						    key, data, c->hdr.srcnode,
+						    c->hdr.reqid);
+		} else {
+			ctdb_dmaster_hint_update(ctdb_db, key, c->hdr.srcnode);
+			ctdb_call_send_dmaster_pkt(ctdb_db, c, &reply->header,
+						   key, data, lmaster);
+		}
+		break;
+
+	default:
+		ctdb_request_call_main(ctdb, pkt->hdr);
+		break;
+	}
+}
+
+/*
+  hand the record work of a call to a call shard. Returns -1 if the
+  daemon has to handle the call itself
+ */
+static int ctdb_request_call_shard(struct ctdb_context *ctdb,
+				   struct ctdb_db_context *ctdb_db,
+				   struct ctdb_req_call *c)
+{
+	struct ctdb_call_shard_request *req;
+	enum ctdb_call_shard_op op = CTDB_CALL_SHARD_CALL;
+	TDB_DATA key, call_data;
+
+	if (ctdb_db->persistent || (c->flags & CTDB_WANT_READONLY)) {
+		return -1;
+	}
+
+	key.dptr = c->data;
+	key.dsize = c->keylen;
+	call_data.dptr = c->data + c->keylen;
+	call_data.dsize = c->calldatalen;
+
+	/* pinned down records and shipped calls are left to the daemon */
+	if (ctdb_db->sticky &&
+	    key_index_lookup(ctdb_db->sticky_records, key) != NULL) {
+		return -1;
+	}
+	if (c->hdr.srcnode != ctdb->pnn) {
+		if (ctdb_call_shippable(ctdb_db, c)) {
+			return -1;
+		}
+		op = CTDB_CALL_SHARD_MIGRATE;
+	}
+
+	req = ctdb_call_shard_request(ctdb, ctdb_db, op, key, call_data, tdb_null);
+	if (req == NULL) {
+		return -1;
+	}
+	req->callid  = c->callid;
+	req->flags   = c->flags;
+	req->srcnode = c->hdr.srcnode;
+	req->dmaster = c->hdr.srcnode;
+	req->lmaster = ctdb_lmaster(ctdb, &key);
+
+	return ctdb_call_shard_pkt_send(ctdb_db, &c->hdr, req,
+					ctdb_request_call_shard_done);
+}
+
+/*
+  called when a CTDB_REQ_CALL packet comes in
+*/
+void ctdb_request_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
+{
+	struct ctdb_req_call *c = (struct ctdb_req_call *)hdr;
+	struct ctdb_db_context *ctdb_db;
+
+	if (ctdb->methods != NULL && ctdb_call_shards_enabled(ctdb)) {
+		ctdb_db = find_ctdb_db(ctdb, c->db_id);
+		if (ctdb_db != NULL &&
+		    ctdb_request_call_shard(ctdb, ctdb_db, c) == 0) {
+			return;
+		}
+	}
+
+	ctdb_request_call_main(ctdb, hdr);
 }
 
 /**
@@ -1012,6 +1514,8 @@ void ctdb_reply_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 		return;
 	}
 
+	/* the call was answered by the dmaster */
+	ctdb_dmaster_hint_update(state->ctdb_db, state->call->key, hdr->srcnode);
 
 	/* read only delegation processing */
 	/* If we got a FETCH_WITH_HEADER we should check if this is a ro
@@ -1053,30 +1557,134 @@ void ctdb_reply_call(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 			goto finished_ro;
 		}
 
-		if (c->datalen < sizeof(struct ctdb_ltdb_header)) {
-			DEBUG(DEBUG_ERR,(__location__ " Got FETCH_WITH_HEADER reply with too little data: %d bytes\n", c->datalen));
-			ctdb_ltdb_unlock(ctdb_db, key);
-			goto finished_ro;
-		}
+		if (c->datalen < sizeof(struct ctdb_ltdb_header)) {
+			DEBUG(DEBUG_ERR,(__location__ " Got FETCH_WITH_HEADER reply with too little data: %d bytes\n", c->datalen));
+			ctdb_ltdb_unlock(ctdb_db, key);
+			goto finished_ro;
+		}
+
+		data.dsize = c->datalen - sizeof(struct ctdb_ltdb_header);
+		data.dptr  = &c->data[sizeof(struct ctdb_ltdb_header)];
+		ret = ctdb_ltdb_store(ctdb_db, key, header, data);
+		if (ret != 0) {
+			DEBUG(DEBUG_ERR, ("Failed to store new record in ctdb_reply_call\n"));
+			ctdb_ltdb_unlock(ctdb_db, key);
+			goto finished_ro;
+		}			
+
+		ctdb_ltdb_unlock(ctdb_db, key);
+	}
+finished_ro:
+
+	state->call->reply_data.dptr = c->data;
+	state->call->reply_data.dsize = c->datalen;
+	state->call->status = c->status;
+
+	talloc_steal(state, c);
+
+	state->state = CTDB_CALL_DONE;
+	if (state->async.fn) {
+		state->async.fn(state);
+	}
+}
+
+
+/*
+  handle a CTDB_REPLY_DMASTER packet in the daemon
+ */
+static void ctdb_reply_dmaster_main(struct ctdb_context *ctdb,
+				    struct ctdb_req_header *hdr)
+{
+	struct ctdb_reply_dmaster *c = (struct ctdb_reply_dmaster *)hdr;
+	struct ctdb_db_context *ctdb_db;
+	TDB_DATA key, data;
+	uint32_t record_flags = 0;
+	size_t len;
+	int ret;
+
+	ctdb_db = find_ctdb_db(ctdb, c->db_id);
+	if (ctdb_db == NULL) {
+		DEBUG(DEBUG_ERR,("Unknown db_id 0x%x in ctdb_reply_dmaster\n", c->db_id));
+		return;
+	}
+	
+	key.dptr = c->data;
+	key.dsize = c->keylen;
+	data.dptr = &c->data[key.dsize];
+	data.dsize = c->datalen;
+	len = offsetof(struct ctdb_reply_dmaster, data) + key.dsize + data.dsize
+		+ sizeof(uint32_t);
+	if (len <= c->hdr.length) {
+		record_flags = *(uint32_t *)&c->data[c->keylen + c->datalen];
+	}
+
+	ret = ctdb_ltdb_lock_requeue(ctdb_db, key, hdr,
+				     ctdb_call_input_pkt, ctdb, false);
+	if (ret == -2) {
+		return;
+	}
+	if (ret != 0) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to get lock in ctdb_reply_dmaster\n"));
+		return;
+	}
+
+	ctdb_become_dmaster(ctdb_db, hdr, key, data, c->rsn, record_flags);
+}
+
+
+static void ctdb_reply_dmaster_shard_done(struct ctdb_call_shard_reply *reply,
+					  void *private_data)
+{
+	struct ctdb_call_shard_pkt *pkt = talloc_get_type(private_data,
+							  struct ctdb_call_shard_pkt);
+	struct ctdb_context *ctdb = pkt->ctdb;
+	struct ctdb_db_context *ctdb_db = pkt->ctdb_db;
+	struct ctdb_reply_dmaster *c = (struct ctdb_reply_dmaster *)pkt->hdr;
+	struct ctdb_call_state *state;
+	TDB_DATA key;
+
+	/* the shard died, the call is resent after the recovery it forced */
+	if (reply == NULL) {
+		return;
+	}
+
+	key.dptr = c->data;
+	key.dsize = c->keylen;
+
+	ctdb_call_shard_delete_queue(ctdb_db, reply, key);
 
-		data.dsize = c->datalen - sizeof(struct ctdb_ltdb_header);
-		data.dptr  = &c->data[sizeof(struct ctdb_ltdb_header)];
-		ret = ctdb_ltdb_store(ctdb_db, key, header, data);
-		if (ret != 0) {
-			DEBUG(DEBUG_ERR, ("Failed to store new record in ctdb_reply_call\n"));
-			ctdb_ltdb_unlock(ctdb_db, key);
-			goto finished_ro;
-		}			
+	if (reply->result == CTDB_CALL_SHARD_FAILED) {
+		ctdb_fatal(ctdb, "ctdb_reply_dmaster store failed\n");
+		return;
+	}
 
-		ctdb_ltdb_unlock(ctdb_db, key);
+	if (reply->result != CTDB_CALL_SHARD_ANSWERED) {
+		if (ctdb_call_shard_pkt_current(ctdb, pkt->hdr)) {
+			ctdb_reply_dmaster_main(ctdb, pkt->hdr);
+		}
+		return;
 	}
-finished_ro:
 
-	state->call->reply_data.dptr = c->data;
-	state->call->reply_data.dsize = c->datalen;
-	state->call->status = c->status;
+	/* we are the dmaster now, whatever became of the call */
+	ctdb_dmaster_hint_update(ctdb_db, key, ctdb->pnn);
+	if (ctdb_db->sticky) {
+		ctdb_set_sticky_pindown(ctdb, ctdb_db, key);
+	}
 
-	talloc_steal(state, c);
+	state = ctdb_reqid_find(ctdb, c->hdr.reqid, struct ctdb_call_state);
+	if (state == NULL || state->reqid != c->hdr.reqid) {
+		DEBUG(DEBUG_ERR,("pnn %u Invalid reqid %u in ctdb_become_dmaster from node %u\n",
+			 ctdb->pnn, c->hdr.reqid, c->hdr.srcnode));
+		return;
+	}
+
+	if (reply->ret == 0) {
+		state->call->reply_data.dptr = talloc_memdup(state->call,
+							     &reply->data[0],
+							     reply->datalen);
+		state->call->reply_data.dsize = reply->datalen;
+		state->call->status = reply->status;
+	}
 
 	state->state = CTDB_CALL_DONE;
 	if (state->async.fn) {
@@ -1084,50 +1692,70 @@ finished_ro:
 	}
 }
 
-
 /**
  * called when a CTDB_REPLY_DMASTER packet comes in
  *
  * This packet comes in from the lmaster in response to a CTDB_REQ_CALL
  * request packet. It means that the current dmaster wants to give us
- * the dmaster role.
+ * the dmaster role. The record is stored and the call run in a call
+ * shard if there is one.
  */
 void ctdb_reply_dmaster(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 {
 	struct ctdb_reply_dmaster *c = (struct ctdb_reply_dmaster *)hdr;
+	struct ctdb_call_shard_request *req;
+	struct ctdb_call_state *state;
 	struct ctdb_db_context *ctdb_db;
 	TDB_DATA key, data;
-	uint32_t record_flags = 0;
+	uint32_t record_flags;
 	size_t len;
-	int ret;
 
-	ctdb_db = find_ctdb_db(ctdb, c->db_id);
-	if (ctdb_db == NULL) {
-		DEBUG(DEBUG_ERR,("Unknown db_id 0x%x in ctdb_reply_dmaster\n", c->db_id));
+	if (!ctdb_call_shards_enabled(ctdb)) {
+		ctdb_reply_dmaster_main(ctdb, hdr);
 		return;
 	}
-	
+
+	ctdb_db = find_ctdb_db(ctdb, c->db_id);
+	state = ctdb_reqid_find(ctdb, hdr->reqid, struct ctdb_call_state);
 	key.dptr = c->data;
 	key.dsize = c->keylen;
 	data.dptr = &c->data[key.dsize];
 	data.dsize = c->datalen;
 	len = offsetof(struct ctdb_reply_dmaster, data) + key.dsize + data.dsize
 		+ sizeof(uint32_t);
-	if (len <= c->hdr.length) {
-		record_flags = *(uint32_t *)&c->data[c->keylen + c->datalen];
+	if (ctdb_db == NULL || ctdb_db->persistent || len > c->hdr.length ||
+	    state == NULL || state->reqid != hdr->reqid ||
+	    state->ctdb_db != ctdb_db ||
+	    key.dsize != state->call->key.dsize ||
+	    memcmp(key.dptr, state->call->key.dptr, key.dsize) != 0) {
+		ctdb_reply_dmaster_main(ctdb, hdr);
+		return;
 	}
 
-	ret = ctdb_ltdb_lock_requeue(ctdb_db, key, hdr,
-				     ctdb_call_input_pkt, ctdb, false);
-	if (ret == -2) {
-		return;
+	record_flags = *(uint32_t *)&c->data[c->keylen + c->datalen];
+	if (state->call->flags & CTDB_CALL_FLAG_VACUUM_MIGRATION) {
+		/* see ctdb_become_dmaster() */
+		record_flags |= CTDB_REC_FLAG_VACUUM_MIGRATED;
 	}
-	if (ret != 0) {
-		DEBUG(DEBUG_ERR,(__location__ " Failed to get lock in ctdb_reply_dmaster\n"));
+
+	req = ctdb_call_shard_request(ctdb, ctdb_db,
+				      CTDB_CALL_SHARD_BECOME_DMASTER,
+				      key, state->call->call_data, data);
+	if (req == NULL) {
+		ctdb_reply_dmaster_main(ctdb, hdr);
 		return;
 	}
+	req->callid       = state->call->call_id;
+	req->flags        = state->call->flags;
+	req->srcnode      = c->hdr.srcnode;
+	req->dmaster      = ctdb->pnn;
+	req->rsn          = c->rsn;
+	req->record_flags = record_flags;
 
-	ctdb_become_dmaster(ctdb_db, hdr, key, data, c->rsn, record_flags);
+	if (ctdb_call_shard_pkt_send(ctdb_db, hdr, req,
+				     ctdb_reply_dmaster_shard_done) != 0) {
+		ctdb_reply_dmaster_main(ctdb, hdr);
+	}
 }
 
 
@@ -1192,6 +1820,7 @@ static void ctdb_call_resend(struct ctdb_call_state *state)
 
 	/* send the packet to ourselves, it will be redirected appropriately */
 	state->c->hdr.destnode = ctdb->pnn;
+	state->c->flags &= ~CTDB_CALL_FLAG_DMASTER_HINT;
 
 	ctdb_queue_packet(ctdb, &state->c->hdr);
 	DEBUG(DEBUG_NOTICE,("resent ctdb_call\n"));
@@ -1237,7 +1866,7 @@ struct ctdb_call_state *ctdb_call_local_send(struct ctdb_db_context *ctdb_db,
 	struct ctdb_context *ctdb = ctdb_db->ctdb;
 	int ret;
 
-	state = talloc_zero(ctdb_db, struct ctdb_call_state);
+	state = ctdb_mem_pool_zero(ctdb, ctdb_db, struct ctdb_call_state);
 	CTDB_NO_MEMORY_NULL(ctdb, state);
 
 	talloc_steal(state, data->dptr);
@@ -1260,25 +1889,19 @@ struct ctdb_call_state *ctdb_call_local_send(struct ctdb_db_context *ctdb_db,
 
 
 /*
-  make a remote ctdb call - async send. Called in daemon context.
-
-  This constructs a ctdb_call request and queues it for processing. 
-  This call never blocks.
+  set up the state and REQ_CALL packet for a remote ctdb call, without
+  sending it
 */
-struct ctdb_call_state *ctdb_daemon_call_send_remote(struct ctdb_db_context *ctdb_db, 
-						     struct ctdb_call *call, 
-						     struct ctdb_ltdb_header *header)
+static struct ctdb_call_state *ctdb_call_state_new(struct ctdb_db_context *ctdb_db,
+						   TALLOC_CTX *mem_ctx,
+						   struct ctdb_call *call,
+						   uint32_t destnode)
 {
 	uint32_t len;
 	struct ctdb_call_state *state;
 	struct ctdb_context *ctdb = ctdb_db->ctdb;
 
-	if (ctdb->methods == NULL) {
-		DEBUG(DEBUG_INFO,(__location__ " Failed send packet. Transport is down\n"));
-		return NULL;
-	}
-
-	state = talloc_zero(ctdb_db, struct ctdb_call_state);
+	state = ctdb_mem_pool_zero(ctdb, mem_ctx, struct ctdb_call_state);
 	CTDB_NO_MEMORY_NULL(ctdb, state);
 	state->call = talloc(state, struct ctdb_call);
 	CTDB_NO_MEMORY_NULL(ctdb, state->call);
@@ -1291,9 +1914,8 @@ struct ctdb_call_state *ctdb_daemon_call_send_remote(struct ctdb_db_context *ctd
 	state->c = ctdb_transport_allocate(ctdb, state, CTDB_REQ_CALL, len, 
 					   struct ctdb_req_call);
 	CTDB_NO_MEMORY_NULL(ctdb, state->c);
-	state->c->hdr.destnode  = header->dmaster;
+	state->c->hdr.destnode  = destnode;
 
-	/* this limits us to 16k outstanding messages - not unreasonable */
 	state->c->hdr.reqid     = state->reqid;
 	state->c->flags         = call->flags;
 	state->c->db_id         = ctdb_db->db_id;
@@ -1313,6 +1935,35 @@ struct ctdb_call_state *ctdb_daemon_call_send_remote(struct ctdb_db_context *ctd
 
 	DLIST_ADD(ctdb->pending_calls, state);
 
+	return state;
+}
+
+/*
+  make a remote ctdb call - async send. Called in daemon context.
+
+  This constructs a ctdb_call request and queues it for processing.
+  This call never blocks.
+*/
+struct ctdb_call_state *ctdb_daemon_call_send_remote(struct ctdb_db_context *ctdb_db,
+						     struct ctdb_call *call,
+						     struct ctdb_ltdb_header *header)
+{
+	struct ctdb_call_state *state;
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+
+	if (ctdb->methods == NULL) {
+		DEBUG(DEBUG_INFO,(__location__ " Failed send packet. Transport is down\n"));
+		return NULL;
+	}
+
+	state = ctdb_call_state_new(ctdb_db, ctdb_db, call, header->dmaster);
+	if (state == NULL) {
+		return NULL;
+	}
+	state->c->hdr.destnode = ctdb_call_dmaster_dest(ctdb_db, call->key,
+							header->dmaster,
+							&state->c->flags);
+
 	ctdb_queue_packet(ctdb, &state->c->hdr);
 
 	return state;
@@ -1350,6 +2001,292 @@ int ctdb_daemon_call_recv(struct ctdb_call_state *state, struct ctdb_call *call)
 }
 
 
+/*
+  step to the ctdb_rec_data following r (or the first one at data if r
+  is NULL), checking that it fits in the buffer ending at end
+ */
+static struct ctdb_rec_data *migrate_rec_next(uint8_t *data, uint8_t *end,
+					      struct ctdb_rec_data *r)
+{
+	if (r == NULL) {
+		r = (struct ctdb_rec_data *)data;
+	} else {
+		r = (struct ctdb_rec_data *)(r->length + (uint8_t *)r);
+	}
+
+	if ((uint8_t *)r + offsetof(struct ctdb_rec_data, data) > end ||
+	    r->length < offsetof(struct ctdb_rec_data, data) + r->keylen ||
+	    (uint8_t *)r + r->length > end) {
+		return NULL;
+	}
+	return r;
+}
+
+/*
+  called when a CTDB_REQ_MIGRATE packet comes in
+
+  The sending node wants every key in the batch migrated to it. Each
+  key is fed through the normal REQ_CALL path as an immediate migration,
+  using the reqid the sender allocated for it, so redirects, deferrals
+  and the REQ_DMASTER/REPLY_DMASTER exchange all happen exactly as they
+  would for a single call
+*/
+void ctdb_request_migrate(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
+{
+	struct ctdb_req_migrate *m = (struct ctdb_req_migrate *)hdr;
+	uint8_t *end = (uint8_t *)hdr + hdr->length;
+	struct ctdb_rec_data *r = NULL;
+	uint32_t i;
+
+	if (ctdb->methods == NULL) {
+		DEBUG(DEBUG_INFO,(__location__ " Failed ctdb_request_migrate. Transport is DOWN\n"));
+		return;
+	}
+
+	if (hdr->length < offsetof(struct ctdb_req_migrate, data)) {
+		DEBUG(DEBUG_ERR,(__location__ " Short migrate request from node %u\n",
+				 hdr->srcnode));
+		return;
+	}
+
+	for (i=0; i<m->count; i++) {
+		struct ctdb_req_call *c;
+		int len;
+
+		r = migrate_rec_next(m->data, end, r);
+		if (r == NULL) {
+			DEBUG(DEBUG_ERR,(__location__ " Truncated migrate request from node %u\n",
+					 hdr->srcnode));
+			return;
+		}
+
+		len = offsetof(struct ctdb_req_call, data) + r->keylen;
+		c = ctdb_transport_allocate(ctdb, ctdb, CTDB_REQ_CALL, len,
+					    struct ctdb_req_call);
+		CTDB_NO_MEMORY_FATAL(ctdb, c);
+
+		c->hdr.srcnode    = hdr->srcnode;
+		c->hdr.destnode   = ctdb->pnn;
+		c->hdr.generation = hdr->generation;
+		c->hdr.reqid      = r->reqid;
+		c->flags          = CTDB_IMMEDIATE_MIGRATION;
+		c->db_id          = m->db_id;
+		c->callid         = CTDB_NULL_FUNC;
+		c->keylen         = r->keylen;
+		memcpy(&c->data[0], &r->data[0], r->keylen);
+
+		/* this takes care of freeing the packet */
+		ctdb_input_pkt(ctdb, &c->hdr);
+	}
+}
+
+struct ctdb_migrate_records_state {
+	struct ctdb_context *ctdb;
+	struct ctdb_req_control *c;
+	uint64_t srvid;
+	uint32_t pending;
+	uint32_t failed;
+};
+
+/*
+  tell the client a record has arrived. This is dispatched directly
+  rather than through ctdb_daemon_send_message() so that it reaches the
+  client ahead of the control reply
+ */
+static void migrate_records_notify(struct ctdb_migrate_records_state *state,
+				   TDB_DATA key)
+{
+	if (state->srvid == 0) {
+		return;
+	}
+	if (ctdb_dispatch_message(state->ctdb, state->srvid, key) != 0) {
+		DEBUG(DEBUG_INFO,(__location__ " Failed to notify srvid 0x%llx\n",
+				  (unsigned long long)state->srvid));
+	}
+}
+
+static void migrate_record_done(struct ctdb_call_state *call_state)
+{
+	struct ctdb_migrate_records_state *state =
+		talloc_get_type(call_state->async.private_data,
+				struct ctdb_migrate_records_state);
+	struct ctdb_context *ctdb = state->ctdb;
+
+	if (call_state->state == CTDB_CALL_DONE) {
+		migrate_records_notify(state, call_state->call->key);
+	} else {
+		DEBUG(DEBUG_ERR,("Failed to migrate record in db %s: %s\n",
+				 call_state->ctdb_db->db_name,
+				 call_state->errmsg ? call_state->errmsg : "unknown error"));
+		state->failed++;
+	}
+	talloc_free(call_state);
+
+	state->pending--;
+	if (state->pending > 0) {
+		return;
+	}
+
+	ctdb_request_control_reply(ctdb, state->c, NULL,
+				   state->failed == 0 ? 0 : -1, NULL);
+	talloc_free(state);
+}
+
+/*
+  migrate a batch of records to this node for a local client
+
+  Records we are already dmaster for are reported straight away. The
+  rest are grouped by the dmaster our local copy points at (the lmaster
+  if we have no copy) and each group goes out as a single
+  CTDB_REQ_MIGRATE. Every key still gets its own call state and reqid,
+  so the records come back one by one through the usual dmaster
+  exchange and are reported to the client's srvid as they arrive, and
+  anything still outstanding at a recovery is resent as a plain call.
+ */
+int32_t ctdb_control_migrate_records(struct ctdb_context *ctdb,
+				     struct ctdb_req_control *c,
+				     TDB_DATA indata, bool *async_reply)
+{
+	struct ctdb_marshall_buffer *m = (struct ctdb_marshall_buffer *)indata.dptr;
+	uint8_t *end = indata.dptr + indata.dsize;
+	struct ctdb_db_context *ctdb_db;
+	struct ctdb_migrate_records_state *state;
+	struct ctdb_marshall_buffer **batch;
+	struct ctdb_rec_data *r = NULL;
+	TALLOC_CTX *tmp_ctx;
+	int32_t status;
+	uint32_t i;
+
+	if (ctdb->methods == NULL) {
+		DEBUG(DEBUG_INFO,(__location__ " Failed to migrate records. Transport is DOWN\n"));
+		return -1;
+	}
+
+	ctdb_db = find_ctdb_db(ctdb, m->db_id);
+	if (ctdb_db == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Unknown db 0x%08x in migrate records\n",
+				 m->db_id));
+		return -1;
+	}
+
+	if (ctdb_db->persistent) {
+		DEBUG(DEBUG_ERR,(__location__ " Can not migrate records of persistent db %s\n",
+				 ctdb_db->db_name));
+		return -1;
+	}
+
+	state = talloc_zero(ctdb_db, struct ctdb_migrate_records_state);
+	CTDB_NO_MEMORY(ctdb, state);
+	state->ctdb  = ctdb;
+	state->c     = c;
+	state->srvid = c->srvid;
+
+	/* batch hangs off tmp_ctx, which hangs off state */
+	tmp_ctx = talloc_new(state);
+	batch = NULL;
+	if (tmp_ctx != NULL) {
+		batch = talloc_zero_array(tmp_ctx, struct ctdb_marshall_buffer *,
+					  ctdb->num_nodes);
+	}
+	if (batch == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Out of memory in migrate records\n"));
+		talloc_free(state);
+		return -1;
+	}
+
+	for (i=0; i<m->count; i++) {
+		struct ctdb_ltdb_header header;
+		struct ctdb_call_state *call_state;
+		struct ctdb_call call;
+		uint32_t destnode;
+		TDB_DATA key;
+
+		r = migrate_rec_next(m->data, end, r);
+		if (r == NULL) {
+			DEBUG(DEBUG_ERR,(__location__ " Truncated key list in migrate records\n"));
+			state->failed++;
+			break;
+		}
+		key.dptr  = &r->data[0];
+		key.dsize = r->keylen;
+
+		/* an unlocked look at the header is only a hint, the
+		   redirect logic copes if the record moves under us */
+		if (ctdb_ltdb_fetch(ctdb_db, key, &header, tmp_ctx, NULL) != 0) {
+			state->failed++;
+			continue;
+		}
+
+		if (header.dmaster == ctdb->pnn) {
+			migrate_records_notify(state, key);
+			continue;
+		}
+
+		ZERO_STRUCT(call);
+		call.call_id = CTDB_NULL_FUNC;
+		call.key     = key;
+		call.flags   = CTDB_IMMEDIATE_MIGRATION;
+
+		destnode = ctdb_call_dmaster_dest(ctdb_db, key, header.dmaster,
+						  &call.flags);
+
+		call_state = ctdb_call_state_new(ctdb_db, state, &call, destnode);
+		if (call_state == NULL) {
+			state->failed++;
+			continue;
+		}
+		call_state->async.fn           = migrate_record_done;
+		call_state->async.private_data = state;
+
+		batch[destnode] = ctdb_marshall_add(tmp_ctx, batch[destnode],
+						    ctdb_db->db_id,
+						    call_state->reqid,
+						    key, NULL, tdb_null);
+		CTDB_NO_MEMORY_FATAL(ctdb, batch[destnode]);
+		state->pending++;
+	}
+
+	for (i=0; i<ctdb->num_nodes; i++) {
+		struct ctdb_req_migrate *req;
+		size_t size;
+
+		if (batch[i] == NULL) {
+			continue;
+		}
+
+		size = talloc_get_size(batch[i]) -
+			offsetof(struct ctdb_marshall_buffer, data);
+		req = ctdb_transport_allocate(ctdb, tmp_ctx, CTDB_REQ_MIGRATE,
+					      offsetof(struct ctdb_req_migrate, data) + size,
+					      struct ctdb_req_migrate);
+		CTDB_NO_MEMORY_FATAL(ctdb, req);
+
+		req->hdr.destnode = i;
+		req->db_id        = ctdb_db->db_id;
+		req->count        = batch[i]->count;
+		memcpy(&req->data[0], &batch[i]->data[0], size);
+
+		DEBUG(DEBUG_DEBUG,("pnn %u asking node %u to migrate %u records of %s\n",
+				   ctdb->pnn, i, req->count, ctdb_db->db_name));
+		ctdb_queue_packet(ctdb, &req->hdr);
+	}
+
+	talloc_free(tmp_ctx);
+
+	if (state->pending == 0) {
+		status = state->failed == 0 ? 0 : -1;
+		talloc_free(state);
+		return status;
+	}
+
+	/* the reply goes out once the last record has arrived */
+	*async_reply = true;
+	talloc_steal(state, c);
+
+	return 0;
+}
+
+
 /* 
    send a keepalive packet to the other node
 */
@@ -1736,3 +2673,167 @@ int ctdb_add_revoke_deferred_call(struct ctdb_context *ctdb, struct ctdb_db_cont
 
 	return 0;
 }
+
+/*
+  run the record work of a call shard request. This runs in the shard
+  process. It only tries the chain lock and leaves any record that is
+  not in one of the common states to the daemon
+ */
+struct ctdb_call_shard_reply *ctdb_call_shard_run(struct ctdb_context *ctdb,
+						  TALLOC_CTX *mem_ctx,
+						  struct ctdb_call_shard_request *req)
+{
+	struct ctdb_call_shard_reply *reply, *r;
+	struct ctdb_db_context *ctdb_db;
+	struct ctdb_ltdb_header header;
+	struct ctdb_call *call;
+	TDB_DATA key, data, reply_data;
+	size_t len;
+	int ret;
+
+	reply = talloc_zero(mem_ctx, struct ctdb_call_shard_reply);
+	call = talloc_zero(reply, struct ctdb_call);
+	if (reply == NULL || call == NULL) {
+		talloc_free(reply);
+		return NULL;
+	}
+	reply->result = CTDB_CALL_SHARD_FALLBACK;
+	reply_data = tdb_null;
+
+	key.dptr  = &req->data[0];
+	key.dsize = req->keylen;
+	data.dptr  = &req->data[req->keylen + req->calldatalen];
+	data.dsize = req->datalen;
+
+	call->call_id         = req->callid;
+	call->key             = key;
+	call->call_data.dptr  = &req->data[req->keylen];
+	call->call_data.dsize = req->calldatalen;
+	call->flags           = req->flags;
+
+	ctdb_db = find_ctdb_db(ctdb, req->db_id);
+	if (ctdb_db == NULL) {
+		goto done;
+	}
+
+	if (tdb_chainlock_nonblock(ctdb_db->ltdb->tdb, key) != 0) {
+		goto done;
+	}
+
+	if (!ctdb_call_shard_current(ctdb, req->generation)) {
+		goto unlock;
+	}
+
+	ctdb->call_shard_reply = reply;
+
+	switch (req->op) {
+	case CTDB_CALL_SHARD_CALL:
+	case CTDB_CALL_SHARD_MIGRATE:
+		ret = ctdb_ltdb_fetch_with_header(ctdb_db, key, &header, reply, &data);
+		if (ret != 0 || (header.flags & CTDB_REC_RO_FLAGS)) {
+			break;
+		}
+
+		if (header.dmaster != ctdb->pnn) {
+			reply->result = CTDB_CALL_SHARD_REMOTE;
+			reply->header = header;
+			break;
+		}
+
+		if (req->op == CTDB_CALL_SHARD_CALL) {
+			reply->ret = ctdb_call_local(ctdb_db, call, &header, reply,
+						     &data, true);
+			reply->status = call->status;
+			reply->result = CTDB_CALL_SHARD_ANSWERED;
+			reply_data = call->reply_data;
+			break;
+		}
+
+		/* as in ctdb_call_send_dmaster() */
+		if (data.dsize != 0) {
+			header.flags |= CTDB_REC_FLAG_MIGRATED_WITH_DATA;
+		}
+		reply->header = header;
+		header.dmaster = req->dmaster;
+		if (ctdb_ltdb_store(ctdb_db, key, &header, data) != 0) {
+			reply->result = CTDB_CALL_SHARD_FAILED;
+			break;
+		}
+		/* the lmaster replies with the header it stored */
+		if (req->lmaster == ctdb->pnn) {
+			reply->header = header;
+		}
+		reply->result = CTDB_CALL_SHARD_MIGRATED;
+		reply_data = data;
+		break;
+
+	case CTDB_CALL_SHARD_DMASTER: {
+		TDB_DATA old_data;
+
+		/* as in ctdb_request_dmaster() */
+		ret = ctdb_ltdb_fetch_with_header(ctdb_db, key, &header, reply,
+						  &old_data);
+		if (ret != 0 || header.dmaster != req->srcnode) {
+			break;
+		}
+
+		if (header.rsn > req->rsn) {
+			DEBUG(DEBUG_ALERT,("pnn %u dmaster request with older RSN new-dmaster %u from %u key %08x dbid 0x%08x c->rsn=%llu header.rsn=%llu\n",
+				 ctdb->pnn, req->dmaster, req->srcnode,
+				 ctdb_hash(&key), ctdb_db->db_id,
+				 (unsigned long long)req->rsn,
+				 (unsigned long long)header.rsn));
+		}
+
+		header.rsn     = req->rsn;
+		header.flags   = req->record_flags;
+		header.dmaster = req->dmaster;
+		if (ctdb_ltdb_store(ctdb_db, key, &header, data) != 0) {
+			reply->result = CTDB_CALL_SHARD_FAILED;
+			break;
+		}
+		reply->result = CTDB_CALL_SHARD_MIGRATED;
+		reply->header = header;
+		break;
+	}
+
+	case CTDB_CALL_SHARD_BECOME_DMASTER:
+		/* as in ctdb_become_dmaster() */
+		ZERO_STRUCT(header);
+		header.rsn     = req->rsn;
+		header.dmaster = ctdb->pnn;
+		header.flags   = req->record_flags;
+		if (ctdb_ltdb_store(ctdb_db, key, &header, data) != 0) {
+			reply->result = CTDB_CALL_SHARD_FAILED;
+			break;
+		}
+
+		reply->ret = ctdb_call_local(ctdb_db, call, &header, reply,
+					     &data, true);
+		reply->status = call->status;
+		reply->result = CTDB_CALL_SHARD_ANSWERED;
+		reply_data = call->reply_data;
+		break;
+	}
+
+	ctdb->call_shard_reply = NULL;
+
+unlock:
+	tdb_chainunlock(ctdb_db->ltdb->tdb, key);
+
+done:
+	len = offsetof(struct ctdb_call_shard_reply, data) + reply_data.dsize;
+	r = (struct ctdb_call_shard_reply *)talloc_size(mem_ctx, len);
+	if (r == NULL) {
+		talloc_free(reply);
+		return NULL;
+	}
+	memcpy(r, reply, offsetof(struct ctdb_call_shard_reply, data));
+	r->length  = len;
+	r->datalen = reply_data.dsize;
+	memcpy(&r->data[0], reply_data.dptr, reply_data.dsize);
+
+	talloc_free(reply);
+
+	return r;
+}
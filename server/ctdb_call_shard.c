@@ -0,0 +1,620 @@
+/*
+   call shards: processes running the record work of calls and migrations
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "system/network.h"
+#include "system/shmem.h"
+#include "../include/ctdb_private.h"
+#include "lib/util/dlinklist.h"
+
+/*
+ * The daemon handles every packet in its one event loop, so a busy
+ * node is limited to what a single core can do.  With CallShards set,
+ * the record work of calls and migrations is run by that many long
+ * lived shard processes instead: taking the chain lock, fetching and
+ * storing the record and running the call function.  The daemon keeps
+ * everything else, from the checks it can make without the record to
+ * building and sending the packets.
+ *
+ * A request goes to the shard picked by the hash of its key, so the
+ * requests for one record are run in the order they were sent.  A
+ * shard runs its requests one at a time and answers them in order.
+ * It only ever tries the chain lock.  If the record is locked, or is
+ * in anything but the common states, the shard leaves the request to
+ * the daemon, which then handles it the usual way.
+ *
+ * Shards follow the recovery mode and the vnn map generation of the
+ * daemon through a page of shared memory, so they leave a record alone
+ * once a recovery has started or when a request belongs to an earlier
+ * generation.  Like the workers, shards only know the databases and
+ * the vnn map they were forked with.  A new generation of shards is
+ * started when those change, and the old shards exit once they have
+ * answered everything they were sent.
+ */
+
+struct ctdb_call_shard_shared {
+	uint32_t recovery_mode;
+	uint32_t generation;
+};
+
+struct ctdb_call_shards {
+	struct ctdb_context *ctdb;
+	volatile struct ctdb_call_shard_shared *shared;
+	struct ctdb_call_shard **shards;
+	uint32_t num_shards;
+	struct ctdb_call_shard *retired;
+};
+
+struct ctdb_call_shard {
+	struct ctdb_call_shard *next, *prev;
+	struct ctdb_call_shards *pool;
+	pid_t pid;
+	int fd;
+	struct ctdb_queue *queue;
+	struct ctdb_call_shard_pending *ops;
+	bool retired;
+};
+
+struct ctdb_call_shard_pending {
+	struct ctdb_call_shard_pending *next, *prev;
+	struct ctdb_db_context *ctdb_db;
+	struct timeval start_time;
+	ctdb_call_shard_fn_t fn;
+	void *private_data;
+};
+
+static int ctdb_call_shard_read(int fd, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int ctdb_call_shard_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static struct ctdb_call_shard_request *ctdb_call_shard_read_request(int fd)
+{
+	struct ctdb_call_shard_request *req;
+	uint32_t length;
+
+	if (ctdb_call_shard_read(fd, &length, sizeof(length)) != 0) {
+		return NULL;
+	}
+	if (length < offsetof(struct ctdb_call_shard_request, data)) {
+		DEBUG(DEBUG_ERR, ("Invalid call shard request of %u bytes\n",
+				  length));
+		return NULL;
+	}
+
+	req = (struct ctdb_call_shard_request *)talloc_size(NULL, length);
+	if (req == NULL) {
+		return NULL;
+	}
+	req->length = length;
+	if (ctdb_call_shard_read(fd, (uint8_t *)req + sizeof(length),
+				 length - sizeof(length)) != 0) {
+		talloc_free(req);
+		return NULL;
+	}
+
+	if (offsetof(struct ctdb_call_shard_request, data) + req->keylen +
+	    req->calldatalen + req->datalen > length) {
+		DEBUG(DEBUG_ERR, ("Truncated call shard request\n"));
+		talloc_free(req);
+		return NULL;
+	}
+
+	return req;
+}
+
+/*
+  the shard process. It runs requests until the daemon closes its end
+  of the socket
+ */
+static void ctdb_call_shard_main(struct ctdb_context *ctdb, int fd)
+{
+	ctdb_set_process_name("ctdb_shard");
+	if (switch_from_server_to_client(ctdb, "call-shard") != 0) {
+		DEBUG(DEBUG_CRIT, ("Failed to switch call shard into client mode\n"));
+		_exit(1);
+	}
+
+	if (ctdb_worker_reopen_dbs(ctdb) != 0) {
+		_exit(1);
+	}
+
+	while (1) {
+		struct ctdb_call_shard_request *req;
+		struct ctdb_call_shard_reply *reply;
+
+		req = ctdb_call_shard_read_request(fd);
+		if (req == NULL) {
+			_exit(0);
+		}
+
+		reply = ctdb_call_shard_run(ctdb, req, req);
+		if (reply == NULL) {
+			_exit(1);
+		}
+
+		if (ctdb_call_shard_write(fd, reply, reply->length) != 0) {
+			_exit(1);
+		}
+		talloc_free(req);
+	}
+}
+
+/*
+  true if a shard may still change records for a request sent in the
+  given generation. Called with the chain lock held, which a recovery
+  has to wait for before it can freeze the database
+ */
+bool ctdb_call_shard_current(struct ctdb_context *ctdb, uint32_t generation)
+{
+	volatile struct ctdb_call_shard_shared *shared = ctdb->call_shards->shared;
+
+	return shared->recovery_mode == CTDB_RECOVERY_NORMAL &&
+	       shared->generation == generation;
+}
+
+/*
+  the recovery mode or the generation of the daemon may have changed
+ */
+void ctdb_call_shards_update(struct ctdb_context *ctdb)
+{
+	struct ctdb_call_shards *pool = ctdb->call_shards;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	pool->shared->recovery_mode = ctdb->recovery_mode;
+	if (ctdb->vnn_map != NULL) {
+		pool->shared->generation = ctdb->vnn_map->generation;
+	} else {
+		pool->shared->generation = INVALID_GENERATION;
+	}
+}
+
+static int ctdb_call_shard_destructor(struct ctdb_call_shard *shard)
+{
+	struct ctdb_call_shards *pool = shard->pool;
+	uint32_t i;
+
+	if (shard->retired) {
+		DLIST_REMOVE(pool->retired, shard);
+	} else {
+		for (i = 0; i < pool->num_shards; i++) {
+			if (pool->shards[i] == shard) {
+				pool->shards[i] = NULL;
+			}
+		}
+	}
+
+	/* an idle shard exits once it sees the socket close */
+	if (shard->ops != NULL) {
+		ctdb_kill(pool->ctdb, shard->pid, SIGKILL);
+	}
+
+	TALLOC_FREE(shard->queue);
+	close(shard->fd);
+
+	return 0;
+}
+
+/*
+  a shard exited with requests outstanding. It may have changed a record
+  without the daemon sending the packets that go with the change, which
+  only a recovery can sort out
+ */
+static void ctdb_call_shard_died(struct ctdb_call_shard *shard)
+{
+	struct ctdb_context *ctdb = shard->pool->ctdb;
+	struct ctdb_call_shard_pending *ops = shard->ops;
+	struct ctdb_call_shard_pending *op;
+
+	DEBUG(DEBUG_ERR, ("Call shard %d exited\n", (int)shard->pid));
+
+	for (op = ops; op != NULL; op = op->next) {
+		talloc_steal(ctdb, op);
+	}
+	shard->ops = NULL;
+	talloc_free(shard);
+
+	if (ops == NULL) {
+		return;
+	}
+
+	DEBUG(DEBUG_ERR, ("Call shard requests were lost. Force a recovery.\n"));
+	ctdb->recovery_mode = CTDB_RECOVERY_ACTIVE;
+	ctdb_state_changed(ctdb);
+
+	while ((op = ops) != NULL) {
+		DLIST_REMOVE(ops, op);
+		CTDB_DECREMENT_STAT(ctdb, call_shards.num_current);
+		op->fn(NULL, op->private_data);
+		talloc_free(op);
+	}
+}
+
+static void ctdb_call_shard_read_cb(uint8_t *data, size_t cnt, void *args)
+{
+	struct ctdb_call_shard *shard = talloc_get_type(args, struct ctdb_call_shard);
+	struct ctdb_context *ctdb = shard->pool->ctdb;
+	struct ctdb_call_shard_reply *reply = (struct ctdb_call_shard_reply *)data;
+	struct ctdb_call_shard_pending *op = shard->ops;
+
+	/* the queue goes when the shard is freed */
+	talloc_steal(ctdb, data);
+
+	if (cnt == 0 || op == NULL ||
+	    cnt < offsetof(struct ctdb_call_shard_reply, data) ||
+	    cnt < offsetof(struct ctdb_call_shard_reply, data) + reply->datalen) {
+		if (cnt != 0) {
+			DEBUG(DEBUG_ERR, ("Call shard %d sent an invalid reply\n",
+					  (int)shard->pid));
+		}
+		talloc_free(data);
+		ctdb_call_shard_died(shard);
+		return;
+	}
+
+	DLIST_REMOVE(shard->ops, op);
+	talloc_steal(ctdb, op);
+	CTDB_DECREMENT_STAT(ctdb, call_shards.num_current);
+	CTDB_UPDATE_LATENCY(ctdb, op->ctdb_db, "call shard",
+			    call_shards.latency, op->start_time);
+	if (reply->result == CTDB_CALL_SHARD_FALLBACK) {
+		CTDB_INCREMENT_STAT(ctdb, call_shards.num_fallbacks);
+	}
+
+	if (shard->retired && shard->ops == NULL) {
+		talloc_free(shard);
+	}
+
+	op->fn(reply, op->private_data);
+	talloc_free(op);
+	talloc_free(data);
+}
+
+static struct ctdb_call_shard *ctdb_call_shard_spawn(struct ctdb_call_shards *pool)
+{
+	struct ctdb_context *ctdb = pool->ctdb;
+	struct ctdb_call_shard *shard;
+	int fd[2];
+
+	/* a shard can not drop the recovery transactions it would
+	   inherit */
+	if (ctdb->freeze_transaction_started) {
+		return NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) != 0) {
+		DEBUG(DEBUG_ERR, ("Failed to create socketpair for call shard\n"));
+		return NULL;
+	}
+
+	shard = talloc_zero(pool, struct ctdb_call_shard);
+	if (shard == NULL) {
+		close(fd[0]);
+		close(fd[1]);
+		return NULL;
+	}
+
+	shard->pid = ctdb_fork(ctdb);
+	if (shard->pid == -1) {
+		DEBUG(DEBUG_ERR, ("Failed to fork call shard\n"));
+		close(fd[0]);
+		close(fd[1]);
+		talloc_free(shard);
+		return NULL;
+	}
+
+	if (shard->pid == 0) {
+		struct ctdb_call_shard *o;
+		uint32_t i;
+
+		close(fd[0]);
+		for (i = 0; i < pool->num_shards; i++) {
+			if (pool->shards[i] != NULL) {
+				close(pool->shards[i]->fd);
+			}
+		}
+		for (o = pool->retired; o != NULL; o = o->next) {
+			close(o->fd);
+		}
+		ctdb_call_shard_main(ctdb, fd[1]);
+	}
+
+	close(fd[1]);
+	set_nonblocking(fd[0]);
+	set_close_on_exec(fd[0]);
+
+	shard->pool = pool;
+	shard->fd = fd[0];
+	talloc_set_destructor(shard, ctdb_call_shard_destructor);
+
+	shard->queue = ctdb_queue_setup(ctdb, shard, shard->fd, 0,
+					ctdb_call_shard_read_cb, shard,
+					"call-shard-%d", (int)shard->pid);
+	if (shard->queue == NULL) {
+		ctdb_kill(ctdb, shard->pid, SIGKILL);
+		talloc_free(shard);
+		return NULL;
+	}
+
+	CTDB_INCREMENT_STAT(ctdb, call_shards.num_spawned);
+	DEBUG(DEBUG_INFO, ("Started call shard %d\n", (int)shard->pid));
+
+	return shard;
+}
+
+/*
+  retire the shards of the current generation. Idle ones exit at once,
+  busy ones when they have answered everything
+ */
+static void ctdb_call_shards_retire(struct ctdb_call_shards *pool)
+{
+	struct ctdb_call_shard *shard;
+	uint32_t i;
+
+	for (i = 0; i < pool->num_shards; i++) {
+		shard = pool->shards[i];
+		if (shard == NULL) {
+			continue;
+		}
+		pool->shards[i] = NULL;
+		if (shard->ops == NULL) {
+			talloc_free(shard);
+			continue;
+		}
+		shard->retired = true;
+		DLIST_ADD(pool->retired, shard);
+	}
+
+	TALLOC_FREE(pool->shards);
+	pool->num_shards = 0;
+}
+
+/*
+  the databases or the vnn map known to the daemon have changed, so
+  shards forked before now are out of date
+ */
+void ctdb_call_shards_restart(struct ctdb_context *ctdb)
+{
+	struct ctdb_call_shards *pool = ctdb->call_shards;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	ctdb_call_shards_retire(pool);
+}
+
+static struct ctdb_call_shards *ctdb_call_shards_get(struct ctdb_context *ctdb)
+{
+	struct ctdb_call_shards *pool = ctdb->call_shards;
+	uint32_t num = ctdb->tunable.call_shards;
+
+	if (pool == NULL) {
+		void *p;
+
+		pool = talloc_zero(ctdb, struct ctdb_call_shards);
+		if (pool == NULL) {
+			return NULL;
+		}
+
+		/* the page is inherited by every shard forked later */
+		p = mmap(NULL, sizeof(struct ctdb_call_shard_shared),
+			 PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+		if (p == MAP_FAILED) {
+			DEBUG(DEBUG_ERR, ("Failed to map call shard state\n"));
+			talloc_free(pool);
+			return NULL;
+		}
+
+		pool->ctdb = ctdb;
+		pool->shared = (struct ctdb_call_shard_shared *)p;
+		ctdb->call_shards = pool;
+	}
+
+	/* CallShards was changed */
+	if (pool->num_shards != num) {
+		ctdb_call_shards_retire(pool);
+		if (num == 0) {
+			return NULL;
+		}
+		pool->shards = talloc_zero_array(pool, struct ctdb_call_shard *, num);
+		if (pool->shards == NULL) {
+			return NULL;
+		}
+		pool->num_shards = num;
+	}
+
+	ctdb_call_shards_update(ctdb);
+
+	return pool;
+}
+
+/*
+  true if calls should go to call shards
+ */
+bool ctdb_call_shards_enabled(struct ctdb_context *ctdb)
+{
+	struct ctdb_call_shards *pool = ctdb->call_shards;
+
+	if (ctdb->tunable.call_shards != 0) {
+		return true;
+	}
+
+	/* CallShards was turned off */
+	if (pool != NULL && pool->num_shards != 0) {
+		ctdb_call_shards_retire(pool);
+	}
+
+	return false;
+}
+
+/*
+  allocate a request for a call shard
+ */
+struct ctdb_call_shard_request *ctdb_call_shard_request(TALLOC_CTX *mem_ctx,
+							struct ctdb_db_context *ctdb_db,
+							enum ctdb_call_shard_op op,
+							TDB_DATA key,
+							TDB_DATA call_data,
+							TDB_DATA data)
+{
+	struct ctdb_call_shard_request *req;
+	size_t length;
+
+	length = offsetof(struct ctdb_call_shard_request, data) +
+		key.dsize + call_data.dsize + data.dsize;
+	req = (struct ctdb_call_shard_request *)talloc_zero_size(mem_ctx, length);
+	if (req == NULL) {
+		return NULL;
+	}
+	talloc_set_name_const(req, "struct ctdb_call_shard_request");
+
+	req->length      = length;
+	req->op          = op;
+	req->db_id       = ctdb_db->db_id;
+	req->keylen      = key.dsize;
+	req->calldatalen = call_data.dsize;
+	req->datalen     = data.dsize;
+	memcpy(&req->data[0], key.dptr, key.dsize);
+	memcpy(&req->data[key.dsize], call_data.dptr, call_data.dsize);
+	memcpy(&req->data[key.dsize + call_data.dsize], data.dptr, data.dsize);
+
+	return req;
+}
+
+/*
+  send a request to the call shard for its key. fn is called with the
+  reply, or with NULL if the shard died first. private_data is stolen
+  and freed once fn has returned.
+
+  Returns -1 if call shards are disabled or none could be started, in
+  which case the caller should handle the request itself
+ */
+int ctdb_call_shard_send(struct ctdb_db_context *ctdb_db,
+			 struct ctdb_call_shard_request *req,
+			 ctdb_call_shard_fn_t fn, void *private_data)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_call_shards *pool;
+	struct ctdb_call_shard *shard;
+	struct ctdb_call_shard_pending *op;
+	TDB_DATA key;
+	uint32_t i;
+
+	pool = ctdb_call_shards_get(ctdb);
+	if (pool == NULL) {
+		return -1;
+	}
+
+	key.dptr  = &req->data[0];
+	key.dsize = req->keylen;
+	i = ctdb_hash(&key) % pool->num_shards;
+
+	shard = pool->shards[i];
+	if (shard == NULL) {
+		shard = ctdb_call_shard_spawn(pool);
+		if (shard == NULL) {
+			return -1;
+		}
+		pool->shards[i] = shard;
+	}
+
+	op = talloc_zero(shard, struct ctdb_call_shard_pending);
+	if (op == NULL) {
+		return -1;
+	}
+
+	req->generation = pool->shared->generation;
+	if (ctdb_queue_send(shard->queue, (uint8_t *)req, req->length) != 0) {
+		DEBUG(DEBUG_ERR, ("Failed to send request to call shard %d\n",
+				  (int)shard->pid));
+		talloc_free(op);
+		return -1;
+	}
+
+	op->ctdb_db      = ctdb_db;
+	op->start_time   = timeval_current();
+	op->fn           = fn;
+	op->private_data = talloc_steal(op, private_data);
+	DLIST_ADD_END(shard->ops, op, NULL);
+
+	CTDB_INCREMENT_STAT(ctdb, call_shards.num_requests);
+	CTDB_INCREMENT_STAT(ctdb, call_shards.num_current);
+
+	return 0;
+}
+
+/*
+  do what ctdb_ltdb_store() would have done to the delete queue in the
+  daemon when the shard stored the record
+ */
+void ctdb_call_shard_delete_queue(struct ctdb_db_context *ctdb_db,
+				  struct ctdb_call_shard_reply *reply,
+				  TDB_DATA key)
+{
+	switch (reply->delete_queue) {
+	case CTDB_CALL_SHARD_SCHEDULE_FOR_DELETION:
+		if (ctdb_local_schedule_for_deletion(ctdb_db, &reply->delete_header,
+						     key) != 0) {
+			DEBUG(DEBUG_ERR, (__location__ " ctdb_local_schedule_for_deletion failed.\n"));
+		}
+		break;
+	case CTDB_CALL_SHARD_REMOVE_FROM_DELETE_QUEUE:
+		ctdb_local_remove_from_delete_queue(ctdb_db, &reply->delete_header,
+						    key);
+		break;
+	}
+}
@@ -0,0 +1,325 @@
+/*
+   cluster wide mutexes, held by a helper process
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "system/wait.h"
+#include "popt.h"
+#include "../include/ctdb_private.h"
+
+/*
+  A cluster mutex is taken by running a helper process. If the mutex
+  string starts with '!' the rest of it is the helper command line,
+  otherwise it is the name of a lock file in the cluster filesystem
+  that is locked by ctdb_mutex_fcntl_helper.
+
+  The helper writes a single status character to its stdout:
+
+    '0' - the mutex was taken and is held until the helper exits
+    '1' - the mutex is held by someone else
+    '2' - timed out trying to take the mutex
+    '3' - some other error
+
+  After '0' the helper renews its hold on the mutex and writes another
+  '0' each time the renewal succeeds. The environment variable
+  CTDB_RECLOCK_LEASE_TIME tells it how many seconds it may take between
+  renewals. If no renewal arrives in time the lease is considered lost,
+  the helper is killed and the lost handler is called.
+
+  Freeing the handle kills the helper, which releases the mutex.
+ */
+struct ctdb_cluster_mutex_handle {
+	struct ctdb_context *ctdb;
+	cluster_mutex_handler_t handler;
+	void *private_data;
+	cluster_mutex_lost_handler_t lost_handler;
+	void *lost_data;
+	int fd;
+	struct tevent_timer *te;
+	struct tevent_fd *fde;
+	pid_t child;
+	struct timeval start_time;
+	bool have_response;
+};
+
+static int cluster_mutex_destructor(struct ctdb_cluster_mutex_handle *h)
+{
+	if (h->child > 0) {
+		ctdb_kill(h->ctdb, h->child, SIGTERM);
+	}
+	return 0;
+}
+
+static void cluster_mutex_lost(struct ctdb_cluster_mutex_handle *h)
+{
+	TALLOC_FREE(h->te);
+	TALLOC_FREE(h->fde);
+	if (h->child > 0) {
+		ctdb_kill(h->ctdb, h->child, SIGKILL);
+		h->child = -1;
+	}
+
+	/* the lost handler is likely to free the handle */
+	if (h->lost_handler != NULL) {
+		h->lost_handler(h->lost_data);
+	}
+}
+
+static void cluster_mutex_lease_expired(struct tevent_context *ev,
+					struct tevent_timer *te,
+					struct timeval t, void *private_data)
+{
+	struct ctdb_cluster_mutex_handle *h =
+		talloc_get_type_abort(private_data, struct ctdb_cluster_mutex_handle);
+
+	h->te = NULL;
+	DEBUG(DEBUG_ERR,("Cluster mutex helper did not renew its lease in %u seconds\n",
+			 h->ctdb->tunable.reclock_lease_time));
+	cluster_mutex_lost(h);
+}
+
+static void cluster_mutex_renew_lease(struct ctdb_cluster_mutex_handle *h)
+{
+	TALLOC_FREE(h->te);
+
+	if (h->lost_handler == NULL || h->ctdb->tunable.reclock_lease_time == 0) {
+		return;
+	}
+
+	h->te = tevent_add_timer(h->ctdb->ev, h,
+				 timeval_current_ofs(h->ctdb->tunable.reclock_lease_time, 0),
+				 cluster_mutex_lease_expired, h);
+	if (h->te == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to set up lease timer\n"));
+	}
+}
+
+static void cluster_mutex_response(struct ctdb_cluster_mutex_handle *h,
+				   char status)
+{
+	double latency = timeval_elapsed(&h->start_time);
+
+	h->have_response = true;
+	TALLOC_FREE(h->te);
+
+	if (status == '0') {
+		cluster_mutex_renew_lease(h);
+	} else {
+		TALLOC_FREE(h->fde);
+	}
+
+	/* the handler may free the handle */
+	h->handler(status, latency, h->private_data);
+}
+
+static void cluster_mutex_timeout(struct tevent_context *ev,
+				  struct tevent_timer *te,
+				  struct timeval t, void *private_data)
+{
+	struct ctdb_cluster_mutex_handle *h =
+		talloc_get_type_abort(private_data, struct ctdb_cluster_mutex_handle);
+
+	h->te = NULL;
+	cluster_mutex_response(h, '2');
+}
+
+static void cluster_mutex_handler(struct tevent_context *ev,
+				  struct tevent_fd *fde,
+				  uint16_t flags, void *private_data)
+{
+	struct ctdb_cluster_mutex_handle *h =
+		talloc_get_type_abort(private_data, struct ctdb_cluster_mutex_handle);
+	char c = '3';
+	int ret;
+
+	ret = read(h->fd, &c, 1);
+
+	if (!h->have_response) {
+		cluster_mutex_response(h, ret == 1 ? c : '3');
+		return;
+	}
+
+	if (ret != 1 || c != '0') {
+		DEBUG(DEBUG_ERR,("Cluster mutex helper exited or lost the mutex\n"));
+		cluster_mutex_lost(h);
+		return;
+	}
+
+	cluster_mutex_renew_lease(h);
+}
+
+static char **cluster_mutex_helper_args(TALLOC_CTX *mem_ctx,
+					const char *argstring)
+{
+	static const char *helper = NULL;
+	const char **argv;
+	char **args;
+	int argc, ret, i;
+
+	if (argstring[0] == '!') {
+		ret = poptParseArgvString(argstring + 1, &argc, &argv);
+		if (ret != 0) {
+			DEBUG(DEBUG_ERR,("Unable to parse cluster mutex helper \"%s\" (%s)\n",
+					 argstring + 1, poptStrerror(ret)));
+			return NULL;
+		}
+		args = talloc_array(mem_ctx, char *, argc + 1);
+		if (args == NULL) {
+			free(argv);
+			return NULL;
+		}
+		for (i=0; i<argc; i++) {
+			args[i] = talloc_strdup(args, argv[i]);
+		}
+		args[argc] = NULL;
+		free(argv);
+		return args;
+	}
+
+	if (helper == NULL) {
+		helper = getenv("CTDB_MUTEX_FCNTL_HELPER");
+		if (helper == NULL) {
+			helper = BINDIR "/ctdb_mutex_fcntl_helper";
+		}
+	}
+
+	args = talloc_array(mem_ctx, char *, 3);
+	if (args == NULL) {
+		return NULL;
+	}
+	args[0] = talloc_strdup(args, helper);
+	args[1] = talloc_strdup(args, argstring);
+	args[2] = NULL;
+
+	return args;
+}
+
+/*
+  start a helper to take a cluster mutex. handler is called with the
+  status once the helper responds, or with '2' if it does not respond
+  within timeout seconds (0 waits forever).
+
+  lost_handler is called if a mutex that was taken is lost later on,
+  either because the helper exited or because it did not renew its
+  lease in time. A NULL lost_handler disables the lease checks.
+ */
+struct ctdb_cluster_mutex_handle *
+ctdb_cluster_mutex(TALLOC_CTX *mem_ctx,
+		   struct ctdb_context *ctdb,
+		   const char *argstring,
+		   int timeout,
+		   cluster_mutex_handler_t handler,
+		   void *private_data,
+		   cluster_mutex_lost_handler_t lost_handler,
+		   void *lost_data)
+{
+	struct ctdb_cluster_mutex_handle *h;
+	char **args;
+	int fd[2];
+	int ret;
+
+	if (argstring == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " No cluster mutex given\n"));
+		return NULL;
+	}
+
+	h = talloc_zero(mem_ctx, struct ctdb_cluster_mutex_handle);
+	if (h == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " out of memory\n"));
+		return NULL;
+	}
+
+	h->ctdb         = ctdb;
+	h->handler      = handler;
+	h->private_data = private_data;
+	h->lost_handler = lost_handler;
+	h->lost_data    = lost_data;
+	h->start_time   = timeval_current();
+	h->child        = -1;
+
+	args = cluster_mutex_helper_args(h, argstring);
+	if (args == NULL || args[0] == NULL) {
+		talloc_free(h);
+		return NULL;
+	}
+
+	ret = pipe(fd);
+	if (ret != 0) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to open pipe for cluster mutex helper\n"));
+		talloc_free(h);
+		return NULL;
+	}
+
+	h->child = ctdb_fork(ctdb);
+	if (h->child == (pid_t)-1) {
+		close(fd[0]);
+		close(fd[1]);
+		talloc_free(h);
+		return NULL;
+	}
+
+	if (h->child == 0) {
+		char lease[16];
+
+		close(fd[0]);
+		if (fd[1] != STDOUT_FILENO) {
+			dup2(fd[1], STDOUT_FILENO);
+			close(fd[1]);
+		}
+
+		snprintf(lease, sizeof(lease), "%u",
+			 ctdb->tunable.reclock_lease_time);
+		setenv("CTDB_RECLOCK_LEASE_TIME", lease, 1);
+
+		execv(args[0], args);
+
+		/* nothing else we can do */
+		_exit(1);
+	}
+
+	close(fd[1]);
+	h->fd = fd[0];
+	set_close_on_exec(h->fd);
+	talloc_free(args);
+
+	talloc_set_destructor(h, cluster_mutex_destructor);
+
+	if (timeout != 0) {
+		h->te = tevent_add_timer(ctdb->ev, h,
+					 timeval_current_ofs(timeout, 0),
+					 cluster_mutex_timeout, h);
+		if (h->te == NULL) {
+			close(h->fd);
+			talloc_free(h);
+			return NULL;
+		}
+	}
+
+	h->fde = tevent_add_fd(ctdb->ev, h, h->fd, EVENT_FD_READ,
+			       cluster_mutex_handler, h);
+	if (h->fde == NULL) {
+		close(h->fd);
+		talloc_free(h);
+		return NULL;
+	}
+	tevent_fd_set_auto_close(h->fde);
+
+	DEBUG(DEBUG_DEBUG,("Started cluster mutex helper for %s with pid %d\n",
+			   argstring, (int)h->child));
+
+	return h;
+}
@@ -103,6 +103,7 @@ static int32_t ctdb_control_dispatch(struct ctdb_context *ctdb,
 	case CTDB_CONTROL_SET_DEBUG: {
 		CHECK_CONTROL_DATA_SIZE(sizeof(int32_t));
 		LogLevel = *(int32_t *)indata.dptr;
+		ctdb_state_changed(ctdb);
 		return 0;
 	}
 
@@ -531,6 +532,7 @@ static int32_t ctdb_control_dispatch(struct ctdb_context *ctdb,
 			ctdb->recovery_lock_file = talloc_strdup(ctdb, discard_const(indata.dptr));
 			ctdb->tunable.verify_recovery_lock = 1;
 		}
+		ctdb_state_changed(ctdb);
 		return 0;
 
 	case CTDB_CONTROL_STOP_NODE:
@@ -551,6 +553,7 @@ static int32_t ctdb_control_dispatch(struct ctdb_context *ctdb,
 		} else {
 			ctdb->capabilities |= CTDB_CAP_NATGW;
 		}
+		ctdb_state_changed(ctdb);
 		return 0;
 	}
 
@@ -564,6 +567,7 @@ static int32_t ctdb_control_dispatch(struct ctdb_context *ctdb,
 		} else {
 			ctdb->capabilities |= CTDB_CAP_LMASTER;
 		}
+		ctdb_state_changed(ctdb);
 		return 0;
 	}
 
@@ -577,6 +581,7 @@ static int32_t ctdb_control_dispatch(struct ctdb_context *ctdb,
 		} else {
 			ctdb->capabilities |= CTDB_CAP_RECMASTER;
 		}
+		ctdb_state_changed(ctdb);
 		return 0;
 	}
 
@@ -655,6 +660,10 @@ static int32_t ctdb_control_dispatch(struct ctdb_context *ctdb,
 		CHECK_CONTROL_DATA_SIZE(0);
 		return ctdb_control_get_stat_history(ctdb, c, outdata);
 
+	case CTDB_CONTROL_GET_STAT_HISTORY_RANGE:
+		CHECK_CONTROL_DATA_SIZE(sizeof(struct ctdb_statistics_range));
+		return ctdb_control_get_stat_history_range(ctdb, c, indata, outdata);
+
 	case CTDB_CONTROL_SCHEDULE_FOR_DELETION: {
 		struct ctdb_control_schedule_for_deletion *d;
 		size_t size = offsetof(struct ctdb_control_schedule_for_deletion, key);
@@ -675,6 +684,22 @@ static int32_t ctdb_control_dispatch(struct ctdb_context *ctdb,
 	case CTDB_CONTROL_RECEIVE_RECORDS:
 		return ctdb_control_receive_records(ctdb, indata, outdata);
 
+	case CTDB_CONTROL_MIGRATE_RECORDS:
+		CHECK_CONTROL_MIN_DATA_SIZE(offsetof(struct ctdb_marshall_buffer, data));
+		return ctdb_control_migrate_records(ctdb, c, indata, async_reply);
+
+	case CTDB_CONTROL_GET_CLIENT_STATISTICS:
+		CHECK_CONTROL_DATA_SIZE(0);
+		return ctdb_control_get_client_statistics(ctdb, outdata);
+
+	case CTDB_CONTROL_SET_DB_SHIP_CALL:
+		CHECK_CONTROL_DATA_SIZE(sizeof(struct ctdb_db_ship_call));
+		return ctdb_control_set_db_ship_call(ctdb, indata);
+
+	case CTDB_CONTROL_GET_STREAM_STATISTICS:
+		CHECK_CONTROL_DATA_SIZE(0);
+		return ctdb_control_get_stream_statistics(ctdb, outdata);
+
 	default:
 		DEBUG(DEBUG_CRIT,(__location__ " Unknown CTDB control opcode %u\n", opcode));
 		return -1;
@@ -689,7 +714,7 @@ void ctdb_request_control_reply(struct ctdb_context *ctdb, struct ctdb_req_contr
 {
 	struct ctdb_reply_control *r;
 	size_t len;
-	
+
 	/* some controls send no reply */
 	if (c->flags & CTDB_CTRL_FLAG_NOREPLY) {
 		return;
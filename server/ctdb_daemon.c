@@ -27,7 +27,7 @@
 #include "../include/ctdb_version.h"
 #include "../include/ctdb_client.h"
 #include "../include/ctdb_private.h"
-#include "../common/rb_tree.h"
+#include "../common/key_index.h"
 #include <sys/socket.h>
 
 struct ctdb_client_pid_list {
@@ -126,6 +126,88 @@ static int daemon_queue_send(struct ctdb_client *client, struct ctdb_req_header
 	return ctdb_queue_send(client->queue, (uint8_t *)hdr, hdr->length);
 }
 
+/*
+  Requests from a client are processed straight away as long as the
+  client has fewer than ClientMaxInflight calls and controls being
+  processed. Beyond that they are queued on the client, and once
+  ClientMaxQueued requests are waiting the daemon stops reading the
+  client's socket until the backlog drains, so a busy client blocks in
+  its own writes instead of growing the daemon's memory. Clients whose
+  queued requests may go ahead are served round robin, ClientQuantum
+  requests at a time.
+ */
+struct ctdb_client_request {
+	struct ctdb_client_request *next, *prev;
+	struct ctdb_req_header *hdr;
+	struct timeval queued_time;
+};
+
+static void daemon_client_schedule(struct tevent_context *ev,
+				   struct tevent_immediate *im,
+				   void *private_data);
+
+static bool daemon_client_may_dispatch(struct ctdb_client *client)
+{
+	uint32_t max_inflight = client->ctdb->tunable.client_max_inflight;
+
+	return max_inflight == 0 || client->num_inflight < max_inflight;
+}
+
+/*
+  put a client with queued requests on the ready list if it is allowed
+  to process more of them
+ */
+static void daemon_client_make_ready(struct ctdb_client *client)
+{
+	struct ctdb_context *ctdb = client->ctdb;
+
+	if (client->ready || client->requests == NULL ||
+	    !daemon_client_may_dispatch(client)) {
+		return;
+	}
+
+	if (ctdb->client_sched_im == NULL) {
+		ctdb->client_sched_im = tevent_create_immediate(ctdb);
+		if (ctdb->client_sched_im == NULL) {
+			DEBUG(DEBUG_ERR,(__location__ " Failed to allocate client scheduler\n"));
+			return;
+		}
+	}
+
+	DLIST_ADD_END(ctdb->ready_clients, client, NULL);
+	client->ready = true;
+	tevent_schedule_immediate(ctdb->client_sched_im, ctdb->ev,
+				  daemon_client_schedule, ctdb);
+}
+
+static void daemon_client_request_started(struct ctdb_client *client)
+{
+	client->num_inflight++;
+	if (client->num_inflight > client->statistics.max_inflight) {
+		client->statistics.max_inflight = client->num_inflight;
+	}
+}
+
+static void daemon_client_request_done(struct ctdb_client *client)
+{
+	client->num_inflight--;
+	daemon_client_make_ready(client);
+}
+
+static void daemon_client_update_latency(struct ctdb_client *client, double l)
+{
+	struct latency_counter *counter = &client->statistics.queue_latency;
+
+	if (counter->num == 0 || l < counter->min) {
+		counter->min = l;
+	}
+	if (l > counter->max) {
+		counter->max = l;
+	}
+	counter->total += l;
+	counter->num++;
+}
+
 /*
   message handler for when we are in daemon mode. This redirects the message
   to the right client
@@ -229,20 +311,33 @@ int daemon_check_srvids(struct ctdb_context *ctdb, TDB_DATA indata,
 static int ctdb_client_destructor(struct ctdb_client *client)
 {
 	struct ctdb_db_context *ctdb_db;
+	struct ctdb_client_request *req;
 
 	ctdb_takeover_client_destructor_hook(client);
 	ctdb_reqid_remove(client->ctdb, client->client_id);
 	client->ctdb->num_clients--;
 
+	/* drop requests that were never processed */
+	if (client->ready) {
+		DLIST_REMOVE(client->ctdb->ready_clients, client);
+		client->ready = false;
+	}
+	while ((req = client->requests) != NULL) {
+		DLIST_REMOVE(client->requests, req);
+		talloc_free(req);
+	}
+
 	if (client->num_persistent_updates != 0) {
 		DEBUG(DEBUG_ERR,(__location__ " Client disconnecting with %u persistent updates in flight. Starting recovery\n", client->num_persistent_updates));
 		client->ctdb->recovery_mode = CTDB_RECOVERY_ACTIVE;
+		ctdb_state_changed(client->ctdb);
 	}
 	ctdb_db = find_ctdb_db(client->ctdb, client->db_id);
 	if (ctdb_db) {
 		DEBUG(DEBUG_ERR, (__location__ " client exit while transaction "
 				  "commit active. Forcing recovery.\n"));
 		client->ctdb->recovery_mode = CTDB_RECOVERY_ACTIVE;
+		ctdb_state_changed(client->ctdb);
 
 		/*
 		 * trans3 transaction state:
@@ -299,6 +394,15 @@ struct daemon_call_state {
 	uint32_t client_callid;
 };
 
+static int daemon_call_state_destructor(struct daemon_call_state *dstate)
+{
+	daemon_client_request_done(dstate->client);
+	return 0;
+}
+
+static void daemon_call_from_client_reply(struct daemon_call_state *dstate,
+					  struct ctdb_db_context *ctdb_db);
+
 /* 
    complete a call from a client 
 */
@@ -306,9 +410,7 @@ static void daemon_call_from_client_callback(struct ctdb_call_state *state)
 {
 	struct daemon_call_state *dstate = talloc_get_type(state->async.private_data, 
 							   struct daemon_call_state);
-	struct ctdb_reply_call *r;
 	int res;
-	uint32_t length;
 	struct ctdb_client *client = dstate->client;
 	struct ctdb_db_context *ctdb_db = state->ctdb_db;
 
@@ -321,9 +423,24 @@ static void daemon_call_from_client_callback(struct ctdb_call_state *state)
 		CTDB_DECREMENT_STAT(client->ctdb, pending_calls);
 
 		CTDB_UPDATE_LATENCY(client->ctdb, ctdb_db, "call_from_client_cb 1", call_latency, dstate->start_time);
+		talloc_free(dstate);
 		return;
 	}
 
+	daemon_call_from_client_reply(dstate, ctdb_db);
+}
+
+/*
+  send the reply to a call from a client and free dstate
+ */
+static void daemon_call_from_client_reply(struct daemon_call_state *dstate,
+					  struct ctdb_db_context *ctdb_db)
+{
+	struct ctdb_reply_call *r;
+	int res;
+	uint32_t length;
+	struct ctdb_client *client = dstate->client;
+
 	length = offsetof(struct ctdb_reply_call, data) + dstate->call->reply_data.dsize;
 	/* If the client asked for readonly FETCH, we remapped this to 
 	   FETCH_WITH_HEADER when calling the daemon. So we must
@@ -341,6 +458,7 @@ static void daemon_call_from_client_callback(struct ctdb_call_state *state)
 		DEBUG(DEBUG_ERR, (__location__ " Failed to allocate reply_call in ctdb daemon\n"));
 		CTDB_DECREMENT_STAT(client->ctdb, pending_calls);
 		CTDB_UPDATE_LATENCY(client->ctdb, ctdb_db, "call_from_client_cb 2", call_latency, dstate->start_time);
+		talloc_free(dstate);
 		return;
 	}
 	r->hdr.reqid        = dstate->reqid;
@@ -410,6 +528,8 @@ struct ctdb_deferred_fetch_call {
 
 struct ctdb_deferred_fetch_queue {
 	struct ctdb_deferred_fetch_call *deferred_calls;
+	struct ctdb_db_context *ctdb_db;
+	TDB_DATA key;
 };
 
 struct ctdb_deferred_requeue {
@@ -438,6 +558,10 @@ static void reprocess_deferred_call(struct event_context *ev, struct timed_event
 */
 static int deferred_fetch_queue_destructor(struct ctdb_deferred_fetch_queue *dfq)
 {
+	/* a newer context may have replaced us in the index */
+	if (key_index_lookup(dfq->ctdb_db->deferred_fetch, dfq->key) == dfq) {
+		key_index_remove(dfq->ctdb_db->deferred_fetch, dfq->key);
+	}
 
 	/* need to reprocess the packets from the queue explicitely instead of
 	   just using a normal destructor since we want, need, to
@@ -473,20 +597,6 @@ static int deferred_fetch_queue_destructor(struct ctdb_deferred_fetch_queue *dfq
 	return 0;
 }
 
-/* insert the new deferral context into the rb tree.
-   there should never be a pre-existing context here, but check for it
-   warn and destroy the previous context if there is already a deferral context
-   for this key.
-*/
-static void *insert_dfq_callback(void *parm, void *data)
-{
-        if (data) {
-		DEBUG(DEBUG_ERR,("Already have DFQ registered. Free old %p and create new %p\n", data, parm));
-                talloc_free(data);
-        }
-        return parm;
-}
-
 /* if the original fetch-lock did not complete within a reasonable time,
    free the context and context for all deferred requests to cause them to be
    re-inserted into the event system.
@@ -504,27 +614,38 @@ static void dfq_timeout(struct event_context *ev, struct timed_event *te,
 */
 static int setup_deferred_fetch_locks(struct ctdb_db_context *ctdb_db, struct ctdb_call *call)
 {
-	uint32_t *k;
-	struct ctdb_deferred_fetch_queue *dfq;
-
-	k = talloc_zero_size(call, ((call->key.dsize + 3) & 0xfffffffc) + 4);
-	if (k == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to allocate key for deferred fetch\n"));
-		return -1;
-	}
-
-	k[0] = (call->key.dsize + 3) / 4 + 1;
-	memcpy(&k[1], call->key.dptr, call->key.dsize);
+	struct ctdb_deferred_fetch_queue *dfq, *old_dfq;
 
 	dfq  = talloc(call, struct ctdb_deferred_fetch_queue);
 	if (dfq == NULL) {
 		DEBUG(DEBUG_ERR,("Failed to allocate key for deferred fetch queue structure\n"));
-		talloc_free(k);
 		return -1;
 	}
 	dfq->deferred_calls = NULL;
+	dfq->ctdb_db        = ctdb_db;
+	dfq->key.dsize      = call->key.dsize;
+	dfq->key.dptr       = talloc_memdup(dfq, call->key.dptr, call->key.dsize);
+	if (dfq->key.dptr == NULL && call->key.dsize != 0) {
+		DEBUG(DEBUG_ERR,("Failed to allocate key for deferred fetch\n"));
+		talloc_free(dfq);
+		return -1;
+	}
 
-	trbt_insertarray32_callback(ctdb_db->deferred_fetch, k[0], &k[0], insert_dfq_callback, dfq);
+	/* there should never be a pre-existing context here, but check for
+	   it, warn and destroy the previous context if there is already a
+	   deferral context for this key.
+	*/
+	old_dfq = key_index_lookup(ctdb_db->deferred_fetch, call->key);
+	if (old_dfq != NULL) {
+		DEBUG(DEBUG_ERR,("Already have DFQ registered. Free old %p and create new %p\n", old_dfq, dfq));
+		talloc_free(old_dfq);
+	}
+
+	if (key_index_insert(ctdb_db->deferred_fetch, call->key, dfq) != 0) {
+		DEBUG(DEBUG_ERR,("Failed to insert deferred fetch queue\n"));
+		talloc_free(dfq);
+		return -1;
+	}
 
 	talloc_set_destructor(dfq, deferred_fetch_queue_destructor);
 
@@ -532,7 +653,6 @@ static int setup_deferred_fetch_locks(struct ctdb_db_context *ctdb_db, struct ct
 	   and let it try again as the events are reissued */
 	event_add_timed(ctdb_db->ctdb->ev, dfq, timeval_current_ofs(30, 0), dfq_timeout, dfq);
 
-	talloc_free(k);
 	return 0;
 }
 
@@ -542,28 +662,14 @@ static int setup_deferred_fetch_locks(struct ctdb_db_context *ctdb_db, struct ct
 */
 static int requeue_duplicate_fetch(struct ctdb_db_context *ctdb_db, struct ctdb_client *client, TDB_DATA key, struct ctdb_req_call *c)
 {
-	uint32_t *k;
 	struct ctdb_deferred_fetch_queue *dfq;
 	struct ctdb_deferred_fetch_call *dfc;
 
-	k = talloc_zero_size(c, ((key.dsize + 3) & 0xfffffffc) + 4);
-	if (k == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to allocate key for deferred fetch\n"));
-		return -1;
-	}
-
-	k[0] = (key.dsize + 3) / 4 + 1;
-	memcpy(&k[1], key.dptr, key.dsize);
-
-	dfq = trbt_lookuparray32(ctdb_db->deferred_fetch, k[0], &k[0]);
+	dfq = key_index_lookup(ctdb_db->deferred_fetch, key);
 	if (dfq == NULL) {
-		talloc_free(k);
 		return -1;
 	}
 
-
-	talloc_free(k);
-
 	dfc = talloc(dfq, struct ctdb_deferred_fetch_call);
 	if (dfc == NULL) {
 		DEBUG(DEBUG_ERR, ("Failed to allocate deferred fetch call structure\n"));
@@ -588,43 +694,115 @@ static int requeue_duplicate_fetch(struct ctdb_db_context *ctdb_db, struct ctdb_
 
 
 /*
-  this is called when the ctdb daemon received a ctdb request call
-  from a local client over the unix domain socket
+  set up the state for a call from a client
  */
-static void daemon_request_call_from_client(struct ctdb_client *client, 
-					    struct ctdb_req_call *c)
+static struct daemon_call_state *daemon_call_state_new(struct ctdb_client *client,
+						       struct ctdb_db_context *ctdb_db,
+						       struct ctdb_req_call *c)
 {
-	struct ctdb_call_state *state;
-	struct ctdb_db_context *ctdb_db;
+	struct ctdb_context *ctdb = client->ctdb;
 	struct daemon_call_state *dstate;
 	struct ctdb_call *call;
-	struct ctdb_ltdb_header header;
-	TDB_DATA key, data;
-	int ret;
-	struct ctdb_context *ctdb = client->ctdb;
-	struct ctdb_daemon_packet_wrap *w;
 
-	CTDB_INCREMENT_STAT(ctdb, total_calls);
-	CTDB_DECREMENT_STAT(ctdb, pending_calls);
+	dstate = talloc(client, struct daemon_call_state);
+	if (dstate == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Unable to allocate dstate\n"));
+		CTDB_DECREMENT_STAT(ctdb, pending_calls);
+		return NULL;
+	}
+	dstate->start_time = timeval_current();
+	dstate->client = client;
+	dstate->reqid  = c->hdr.reqid;
 
-	ctdb_db = find_ctdb_db(client->ctdb, c->db_id);
-	if (!ctdb_db) {
-		DEBUG(DEBUG_ERR, (__location__ " Unknown database in request. db_id==0x%08x",
-			  c->db_id));
+	daemon_client_request_started(client);
+	talloc_set_destructor(dstate, daemon_call_state_destructor);
+
+	call = dstate->call = talloc_zero(dstate, struct ctdb_call);
+	if (call == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Unable to allocate call\n"));
 		CTDB_DECREMENT_STAT(ctdb, pending_calls);
-		return;
+		CTDB_UPDATE_LATENCY(ctdb, ctdb_db, "call_from_client 1", call_latency, dstate->start_time);
+		talloc_free(dstate);
+		return NULL;
 	}
 
-	if (ctdb_db->unhealthy_reason) {
-		/*
-		 * this is just a warning, as the tdb should be empty anyway,
-		 * and only persistent databases can be unhealthy, which doesn't
-		 * use this code patch
+	dstate->readonly_fetch = 0;
+	call->call_id = c->callid;
+	call->key.dptr = c->data;
+	call->key.dsize = c->keylen;
+	call->call_data.dptr = c->data + c->keylen;
+	call->call_data.dsize = c->calldatalen;
+	call->flags = c->flags;
+
+	if (c->flags & CTDB_WANT_READONLY) {
+		/* client wants readonly record, so translate this into a 
+		   fetch with header. remember what the client asked for
+		   so we can remap the reply back to the proper format for
+		   the client in the reply
 		 */
-		DEBUG(DEBUG_WARNING,("warn: db(%s) unhealty in daemon_request_call_from_client(): %s\n",
-				     ctdb_db->db_name, ctdb_db->unhealthy_reason));
+		dstate->client_callid = call->call_id;
+		call->call_id = CTDB_FETCH_WITH_HEADER_FUNC;
+		dstate->readonly_fetch = 1;
 	}
 
+	return dstate;
+}
+
+/*
+  run a call from a client here or send it to the dmaster
+ */
+static void daemon_call_from_client_send(struct daemon_call_state *dstate,
+					 struct ctdb_db_context *ctdb_db,
+					 struct ctdb_ltdb_header *header,
+					 TDB_DATA *data)
+{
+	struct ctdb_client *client = dstate->client;
+	struct ctdb_context *ctdb = client->ctdb;
+	struct ctdb_call *call = dstate->call;
+	struct ctdb_call_state *state;
+
+	if (header->dmaster == ctdb->pnn) {
+		state = ctdb_call_local_send(ctdb_db, call, header, data);
+	} else {
+		state = ctdb_daemon_call_send_remote(ctdb_db, call, header);
+		if (ctdb->tunable.fetch_collapse == 1) {
+			/* This request triggered a remote fetch-lock.
+			   set up a deferral for this key so any additional
+			   fetch-locks are deferred until the current one
+			   finishes.
+			 */
+			setup_deferred_fetch_locks(ctdb_db, call);
+		}
+	}
+
+	if (state == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Unable to setup call send\n"));
+		CTDB_DECREMENT_STAT(ctdb, pending_calls);
+		CTDB_UPDATE_LATENCY(ctdb, ctdb_db, "call_from_client 2", call_latency, dstate->start_time);
+		talloc_free(dstate);
+		return;
+	}
+	talloc_steal(state, dstate);
+	talloc_steal(client, state);
+
+	state->async.fn = daemon_call_from_client_callback;
+	state->async.private_data = dstate;
+}
+
+/*
+  handle a call from a client with the record locked in the daemon
+ */
+static void daemon_request_call_locked(struct ctdb_client *client,
+				       struct ctdb_db_context *ctdb_db,
+				       struct ctdb_req_call *c)
+{
+	struct daemon_call_state *dstate;
+	struct ctdb_ltdb_header header;
+	TDB_DATA key, data;
+	int ret;
+	struct ctdb_context *ctdb = client->ctdb;
+	struct ctdb_daemon_packet_wrap *w;
+
 	key.dptr = c->data;
 	key.dsize = c->keylen;
 
@@ -651,7 +829,6 @@ static void daemon_request_call_from_client(struct ctdb_client *client,
 		return;
 	}
 
-
 	/* check if this fetch request is a duplicate for a
 	   request we already have in flight. If so defer it until
 	   the first request completes.
@@ -718,83 +895,202 @@ static void daemon_request_call_from_client(struct ctdb_client *client,
 		return;
 	}		
 
-	dstate = talloc(client, struct daemon_call_state);
+	dstate = daemon_call_state_new(client, ctdb_db, c);
 	if (dstate == NULL) {
 		ret = ctdb_ltdb_unlock(ctdb_db, key);
 		if (ret != 0) {
 			DEBUG(DEBUG_ERR,(__location__ " ctdb_ltdb_unlock() failed with error %d\n", ret));
 		}
-
-		DEBUG(DEBUG_ERR,(__location__ " Unable to allocate dstate\n"));
-		CTDB_DECREMENT_STAT(ctdb, pending_calls);
 		return;
 	}
-	dstate->start_time = timeval_current();
-	dstate->client = client;
-	dstate->reqid  = c->hdr.reqid;
 	talloc_steal(dstate, data.dptr);
 
-	call = dstate->call = talloc_zero(dstate, struct ctdb_call);
-	if (call == NULL) {
-		ret = ctdb_ltdb_unlock(ctdb_db, key);
-		if (ret != 0) {
-			DEBUG(DEBUG_ERR,(__location__ " ctdb_ltdb_unlock() failed with error %d\n", ret));
+	daemon_call_from_client_send(dstate, ctdb_db, &header, &data);
+
+	ret = ctdb_ltdb_unlock(ctdb_db, key);
+	if (ret != 0) {
+		DEBUG(DEBUG_ERR,(__location__ " ctdb_ltdb_unlock() failed with error %d\n", ret));
+	}
+}
+
+/*
+  a call from a client whose record work was done by a call shard
+ */
+struct daemon_call_shard_state {
+	struct ctdb_context *ctdb;
+	struct ctdb_db_context *ctdb_db;
+	uint32_t client_id;
+	struct ctdb_req_call *c;
+};
+
+static void daemon_call_shard_done(struct ctdb_call_shard_reply *reply,
+				   void *private_data)
+{
+	struct daemon_call_shard_state *sstate = talloc_get_type(private_data,
+						struct daemon_call_shard_state);
+	struct ctdb_context *ctdb = sstate->ctdb;
+	struct ctdb_db_context *ctdb_db = sstate->ctdb_db;
+	struct ctdb_req_call *c = sstate->c;
+	struct daemon_call_state *dstate;
+	struct ctdb_client *client;
+	TDB_DATA key, data;
+
+	key.dptr = c->data;
+	key.dsize = c->keylen;
+
+	if (reply != NULL) {
+		ctdb_call_shard_delete_queue(ctdb_db, reply, key);
+	}
+
+	client = ctdb_reqid_find(ctdb, sstate->client_id, struct ctdb_client);
+	if (client == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Call shard reply for disconnected client %u\n",
+			 sstate->client_id));
+		return;
+	}
+	daemon_client_request_done(client);
+
+	/* a lost reply is only lost work, the record is read again */
+	if (reply == NULL ||
+	    (reply->result != CTDB_CALL_SHARD_ANSWERED &&
+	     reply->result != CTDB_CALL_SHARD_REMOTE)) {
+		daemon_request_call_locked(client, ctdb_db, c);
+		return;
+	}
+
+	if (reply->result == CTDB_CALL_SHARD_REMOTE) {
+		if (ctdb->tunable.fetch_collapse == 1 &&
+		    requeue_duplicate_fetch(ctdb_db, client, key, c) == 0) {
+			return;
 		}
 
-		DEBUG(DEBUG_ERR,(__location__ " Unable to allocate call\n"));
+		dstate = daemon_call_state_new(client, ctdb_db, c);
+		if (dstate == NULL) {
+			return;
+		}
+		talloc_steal(dstate, c);
+
+		data = tdb_null;
+		daemon_call_from_client_send(dstate, ctdb_db, &reply->header, &data);
+		return;
+	}
+
+	dstate = daemon_call_state_new(client, ctdb_db, c);
+	if (dstate == NULL) {
+		return;
+	}
+
+	dstate->call->status = reply->status;
+	dstate->call->reply_data.dsize = reply->datalen;
+	dstate->call->reply_data.dptr = talloc_memdup(dstate, &reply->data[0],
+						      reply->datalen);
+	if (dstate->call->reply_data.dptr == NULL && reply->datalen != 0) {
+		DEBUG(DEBUG_ERR,(__location__ " Unable to allocate reply data\n"));
 		CTDB_DECREMENT_STAT(ctdb, pending_calls);
-		CTDB_UPDATE_LATENCY(ctdb, ctdb_db, "call_from_client 1", call_latency, dstate->start_time);
+		talloc_free(dstate);
 		return;
 	}
 
-	dstate->readonly_fetch = 0;
-	call->call_id = c->callid;
-	call->key = key;
-	call->call_data.dptr = c->data + c->keylen;
-	call->call_data.dsize = c->calldatalen;
-	call->flags = c->flags;
+	daemon_call_from_client_reply(dstate, ctdb_db);
+}
 
-	if (c->flags & CTDB_WANT_READONLY) {
-		/* client wants readonly record, so translate this into a 
-		   fetch with header. remember what the client asked for
-		   so we can remap the reply back to the proper format for
-		   the client in the reply
-		 */
-		dstate->client_callid = call->call_id;
-		call->call_id = CTDB_FETCH_WITH_HEADER_FUNC;
-		dstate->readonly_fetch = 1;
+/*
+  hand the record work of a call from a client to a call shard. Returns
+  -1 if the daemon has to handle the call itself
+ */
+static int daemon_call_shard_send(struct ctdb_client *client,
+				  struct ctdb_db_context *ctdb_db,
+				  struct ctdb_req_call *c)
+{
+	struct ctdb_context *ctdb = client->ctdb;
+	struct daemon_call_shard_state *sstate;
+	struct ctdb_call_shard_request *req;
+	TDB_DATA key, call_data;
+	int ret;
+
+	if (!ctdb_call_shards_enabled(ctdb) || ctdb_db->persistent ||
+	    (c->flags & CTDB_WANT_READONLY)) {
+		return -1;
 	}
 
-	if (header.dmaster == ctdb->pnn) {
-		state = ctdb_call_local_send(ctdb_db, call, &header, &data);
-	} else {
-		state = ctdb_daemon_call_send_remote(ctdb_db, call, &header);
-		if (ctdb->tunable.fetch_collapse == 1) {
-			/* This request triggered a remote fetch-lock.
-			   set up a deferral for this key so any additional
-			   fetch-locks are deferred until the current one
-			   finishes.
-			 */
-			setup_deferred_fetch_locks(ctdb_db, call);
-		}
+	key.dptr = c->data;
+	key.dsize = c->keylen;
+	call_data.dptr = c->data + c->keylen;
+	call_data.dsize = c->calldatalen;
+
+	/* duplicate fetches are collapsed in the daemon */
+	if (key_index_lookup(ctdb_db->deferred_fetch, key) != NULL) {
+		return -1;
 	}
 
-	ret = ctdb_ltdb_unlock(ctdb_db, key);
+	req = ctdb_call_shard_request(client, ctdb_db, CTDB_CALL_SHARD_CALL,
+				      key, call_data, tdb_null);
+	if (req == NULL) {
+		return -1;
+	}
+	req->callid  = c->callid;
+	req->flags   = c->flags;
+	req->srcnode = ctdb->pnn;
+
+	sstate = talloc(client, struct daemon_call_shard_state);
+	if (sstate == NULL) {
+		talloc_free(req);
+		return -1;
+	}
+	sstate->ctdb      = ctdb;
+	sstate->ctdb_db   = ctdb_db;
+	sstate->client_id = client->client_id;
+	sstate->c         = c;
+
+	ret = ctdb_call_shard_send(ctdb_db, req, daemon_call_shard_done, sstate);
+	talloc_free(req);
 	if (ret != 0) {
-		DEBUG(DEBUG_ERR,(__location__ " ctdb_ltdb_unlock() failed with error %d\n", ret));
+		talloc_free(sstate);
+		return -1;
 	}
 
-	if (state == NULL) {
-		DEBUG(DEBUG_ERR,(__location__ " Unable to setup call send\n"));
+	talloc_steal(sstate, c);
+	daemon_client_request_started(client);
+
+	return 0;
+}
+
+/*
+  this is called when the ctdb daemon received a ctdb request call
+  from a local client over the unix domain socket
+ */
+static void daemon_request_call_from_client(struct ctdb_client *client, 
+					    struct ctdb_req_call *c)
+{
+	struct ctdb_db_context *ctdb_db;
+	struct ctdb_context *ctdb = client->ctdb;
+
+	CTDB_INCREMENT_STAT(ctdb, total_calls);
+	CTDB_DECREMENT_STAT(ctdb, pending_calls);
+
+	ctdb_db = find_ctdb_db(client->ctdb, c->db_id);
+	if (!ctdb_db) {
+		DEBUG(DEBUG_ERR, (__location__ " Unknown database in request. db_id==0x%08x",
+			  c->db_id));
 		CTDB_DECREMENT_STAT(ctdb, pending_calls);
-		CTDB_UPDATE_LATENCY(ctdb, ctdb_db, "call_from_client 2", call_latency, dstate->start_time);
 		return;
 	}
-	talloc_steal(state, dstate);
-	talloc_steal(client, state);
 
-	state->async.fn = daemon_call_from_client_callback;
-	state->async.private_data = dstate;
+	if (ctdb_db->unhealthy_reason) {
+		/*
+		 * this is just a warning, as the tdb should be empty anyway,
+		 * and only persistent databases can be unhealthy, which doesn't
+		 * use this code patch
+		 */
+		DEBUG(DEBUG_WARNING,("warn: db(%s) unhealty in daemon_request_call_from_client(): %s\n",
+				     ctdb_db->db_name, ctdb_db->unhealthy_reason));
+	}
+
+	if (daemon_call_shard_send(client, ctdb_db, c) == 0) {
+		return;
+	}
+
+	daemon_request_call_locked(client, ctdb_db, c);
 }
 
 
@@ -850,6 +1146,129 @@ done:
 	talloc_free(tmp_ctx);
 }
 
+/*
+  process up to ClientQuantum queued requests of the first ready client,
+  then move it to the back of the ready list
+ */
+static void daemon_client_schedule(struct tevent_context *ev,
+				   struct tevent_immediate *im,
+				   void *private_data)
+{
+	struct ctdb_context *ctdb = talloc_get_type(private_data, struct ctdb_context);
+	struct ctdb_client *client = ctdb->ready_clients;
+	uint32_t client_id, quantum, max_queued, i;
+
+	/* hold back requests while a node is not keeping up, see
+	   ctdb_daemon_queues_drained() */
+	if (client == NULL || ctdb->num_congested_queues != 0) {
+		return;
+	}
+	DLIST_REMOVE(ctdb->ready_clients, client);
+	client->ready = false;
+
+	client_id = client->client_id;
+	quantum = MAX(ctdb->tunable.client_quantum, 1);
+
+	for (i = 0; i < quantum; i++) {
+		struct ctdb_client_request *req = client->requests;
+		struct ctdb_req_header *hdr;
+
+		if (req == NULL || !daemon_client_may_dispatch(client)) {
+			break;
+		}
+
+		DLIST_REMOVE(client->requests, req);
+		client->statistics.queued--;
+		daemon_client_update_latency(client, timeval_elapsed(&req->queued_time));
+
+		hdr = talloc_steal(client, req->hdr);
+		talloc_free(req);
+
+		daemon_incoming_packet(client, hdr);
+
+		/* the client may have gone away while processing it */
+		client = ctdb_reqid_find(ctdb, client_id, struct ctdb_client);
+		if (client == NULL) {
+			break;
+		}
+	}
+
+	if (client != NULL) {
+		max_queued = ctdb->tunable.client_max_queued;
+		if (client->statistics.read_paused &&
+		    (max_queued == 0 || client->statistics.queued <= max_queued / 2)) {
+			client->statistics.read_paused = 0;
+			ctdb_queue_pause_read(client->queue, false);
+		}
+		daemon_client_make_ready(client);
+	}
+
+	if (ctdb->ready_clients != NULL) {
+		tevent_schedule_immediate(ctdb->client_sched_im, ctdb->ev,
+					  daemon_client_schedule, ctdb);
+	}
+}
+
+/*
+  the queues to other nodes have drained, so go on with the requests
+  held back from the clients
+ */
+void ctdb_daemon_queues_drained(struct ctdb_context *ctdb)
+{
+	if (ctdb->ready_clients != NULL) {
+		tevent_schedule_immediate(ctdb->client_sched_im, ctdb->ev,
+					  daemon_client_schedule, ctdb);
+	}
+}
+
+/*
+  process a request from a client now, or queue it behind the ones that
+  are waiting
+ */
+static void daemon_client_queue_request(struct ctdb_client *client,
+					struct ctdb_req_header *hdr)
+{
+	struct ctdb_client_request *req;
+	uint32_t max_queued = client->ctdb->tunable.client_max_queued;
+
+	client->statistics.num_requests++;
+
+	if (client->requests == NULL && daemon_client_may_dispatch(client) &&
+	    client->ctdb->num_congested_queues == 0) {
+		daemon_client_update_latency(client, 0.0);
+		daemon_incoming_packet(client, hdr);
+		return;
+	}
+
+	req = talloc(client, struct ctdb_client_request);
+	if (req == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to queue client request\n"));
+		daemon_incoming_packet(client, hdr);
+		return;
+	}
+	req->hdr = talloc_steal(req, hdr);
+	req->queued_time = timeval_current();
+	DLIST_ADD_END(client->requests, req, NULL);
+
+	client->statistics.num_queued++;
+	client->statistics.queued++;
+	if (client->statistics.queued > client->statistics.max_queued) {
+		client->statistics.max_queued = client->statistics.queued;
+	}
+
+	if (max_queued != 0 && client->statistics.queued >= max_queued &&
+	    !client->statistics.read_paused) {
+		DEBUG(DEBUG_INFO,("Client pid:%u has %u requests queued, "
+				  "pausing reads\n", (unsigned)client->pid,
+				  client->statistics.queued));
+		client->statistics.read_paused = 1;
+		client->statistics.num_read_pauses++;
+		ctdb_queue_pause_read(client->queue, true);
+	}
+
+	daemon_client_make_ready(client);
+}
+
 /*
   called when the daemon gets a incoming packet
  */
@@ -892,7 +1311,7 @@ static void ctdb_daemon_read_cb(uint8_t *data, size_t cnt, void *args)
 		 hdr->srcnode, hdr->destnode));
 
 	/* it is the responsibility of the incoming packet function to free 'data' */
-	daemon_incoming_packet(client, hdr);
+	daemon_client_queue_request(client, hdr);
 }
 
 
@@ -1351,7 +1770,7 @@ struct ctdb_req_header *_ctdb_transport_allocate(struct ctdb_context *ctdb,
 		return NULL;
 	}
 
-	hdr = (struct ctdb_req_header *)ctdb->methods->allocate_pkt(mem_ctx, size);
+	hdr = (struct ctdb_req_header *)ctdb->methods->allocate_pkt(ctdb, mem_ctx, size);
 	if (hdr == NULL) {
 		DEBUG(DEBUG_ERR,("Unable to allocate transport packet for operation %u of length %u\n",
 			 operation, (unsigned)length));
@@ -1438,6 +1857,7 @@ static int daemon_control_destructor(struct daemon_control_state *state)
 	if (state->node) {
 		DLIST_REMOVE(state->node->pending_controls, state);
 	}
+	daemon_client_request_done(state->client);
 	return 0;
 }
 
@@ -1470,6 +1890,7 @@ static void daemon_request_control_from_client(struct ctdb_client *client,
 		state->node = NULL;
 	}
 
+	daemon_client_request_started(client);
 	talloc_set_destructor(state, daemon_control_destructor);
 
 	if (c->flags & CTDB_CTRL_FLAG_NOREPLY) {
@@ -1508,6 +1929,7 @@ int ctdb_daemon_set_call(struct ctdb_context *ctdb, uint32_t db_id,
 	call = talloc(ctdb_db, struct ctdb_registered_call);
 	call->fn = fn;
 	call->id = id;
+	call->ship = false;
 
 	DLIST_ADD(ctdb_db->calls, call);	
 	return 0;
@@ -1738,6 +2160,45 @@ int32_t ctdb_control_process_exists(struct ctdb_context *ctdb, pid_t pid)
 	return kill(pid, 0);
 }
 
+/*
+  return the request queue statistics of all connected clients
+ */
+int32_t ctdb_control_get_client_statistics(struct ctdb_context *ctdb,
+					   TDB_DATA *outdata)
+{
+	struct ctdb_client_pid_list *client_pid;
+	struct ctdb_client_statistics_wire *wire;
+	uint32_t num = 0;
+	size_t len;
+
+	for (client_pid = ctdb->client_pids; client_pid; client_pid=client_pid->next) {
+		num++;
+	}
+
+	len = offsetof(struct ctdb_client_statistics_wire, stats) +
+		num * sizeof(struct ctdb_client_statistics);
+	wire = talloc_zero_size(outdata, len);
+	if (wire == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to allocate client statistics\n"));
+		return -1;
+	}
+
+	for (client_pid = ctdb->client_pids; client_pid; client_pid=client_pid->next) {
+		struct ctdb_client *client = client_pid->client;
+		struct ctdb_client_statistics *s = &wire->stats[wire->num++];
+
+		*s = client->statistics;
+		s->client_id = client->client_id;
+		s->pid       = client->pid;
+		s->inflight  = client->num_inflight;
+	}
+
+	outdata->dptr  = (uint8_t *)wire;
+	outdata->dsize = len;
+
+	return 0;
+}
+
 void ctdb_shutdown_sequence(struct ctdb_context *ctdb, int exit_code)
 {
 	if (ctdb->runstate == CTDB_RUNSTATE_SHUTDOWN) {
@@ -0,0 +1,240 @@
+/*
+   per database cache of where records were last seen to be dmaster
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "lib/util/dlinklist.h"
+#include "../include/ctdb_private.h"
+
+/*
+  A call for a record we are not dmaster for normally goes to the
+  dmaster in our stale copy of the record header, which bounces it to
+  the lmaster, which bounces it to the real dmaster. The hints remember
+  which node we last saw become dmaster of a record, so that the call
+  can go there directly.
+
+  Hints are keyed by the hash of the record key only. A collision just
+  gives a wrong hint, which costs the same hop as a stale one: the node
+  that gets the call is not the dmaster and redirects it the usual way.
+  Hints are only good for one generation of the vnn map, as a recovery
+  moves all records to new dmasters.
+
+  The DmasterHintCacheSize most recently used hints are kept per
+  database. The entries are allocated once and chained into a hash
+  table and an LRU list, so updates and lookups never allocate.
+ */
+struct ctdb_dmaster_hint {
+	struct ctdb_dmaster_hint *next, *prev;	/* LRU list, most recent first */
+	struct ctdb_dmaster_hint *chain;	/* hash bucket */
+	uint32_t hash;
+	uint32_t dmaster;
+};
+
+struct ctdb_dmaster_hints {
+	uint32_t generation;
+	uint32_t size;
+	uint32_t num;		/* entries handed out so far */
+	uint32_t mask;
+	struct ctdb_dmaster_hint **buckets;
+	struct ctdb_dmaster_hint *lru;
+	struct ctdb_dmaster_hint *unused;	/* forgotten entries, chained */
+	struct ctdb_dmaster_hint *entries;
+};
+
+static struct ctdb_dmaster_hints *dmaster_hints_create(struct ctdb_db_context *ctdb_db,
+						       uint32_t size)
+{
+	struct ctdb_dmaster_hints *dh;
+	uint32_t nbuckets = 16;
+
+	dh = talloc_zero(ctdb_db, struct ctdb_dmaster_hints);
+	if (dh == NULL) {
+		return NULL;
+	}
+
+	while (nbuckets < size && nbuckets < 0x80000000) {
+		nbuckets <<= 1;
+	}
+
+	dh->buckets = talloc_zero_array(dh, struct ctdb_dmaster_hint *, nbuckets);
+	dh->entries = talloc_zero_array(dh, struct ctdb_dmaster_hint, size);
+	if (dh->buckets == NULL || dh->entries == NULL) {
+		talloc_free(dh);
+		return NULL;
+	}
+
+	dh->size = size;
+	dh->mask = nbuckets - 1;
+	dh->generation = ctdb_db->ctdb->vnn_map->generation;
+
+	return dh;
+}
+
+/*
+  drop all hints, they describe an older generation
+ */
+static void dmaster_hints_clear(struct ctdb_dmaster_hints *dh,
+				uint32_t generation)
+{
+	memset(dh->buckets, 0, (dh->mask + 1) * sizeof(dh->buckets[0]));
+	dh->lru = NULL;
+	dh->unused = NULL;
+	dh->num = 0;
+	dh->generation = generation;
+}
+
+/*
+  return the hints of a database that are valid for the current
+  generation, creating or resizing them if needed
+ */
+static struct ctdb_dmaster_hints *dmaster_hints_get(struct ctdb_db_context *ctdb_db,
+						    bool create)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_dmaster_hints *dh = ctdb_db->dmaster_hints;
+	uint32_t size = ctdb->tunable.dmaster_hint_cache_size;
+
+	if (dh != NULL && dh->size != size) {
+		talloc_free(dh);
+		ctdb_db->dmaster_hints = dh = NULL;
+	}
+
+	if (size == 0 || ctdb->vnn_map == NULL) {
+		return NULL;
+	}
+
+	if (dh == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		dh = dmaster_hints_create(ctdb_db, size);
+		if (dh == NULL) {
+			DEBUG(DEBUG_ERR,("Failed to allocate dmaster hints for db %s\n",
+					 ctdb_db->db_name));
+			return NULL;
+		}
+		ctdb_db->dmaster_hints = dh;
+	}
+
+	if (dh->generation != ctdb->vnn_map->generation) {
+		dmaster_hints_clear(dh, ctdb->vnn_map->generation);
+	}
+
+	return dh;
+}
+
+static struct ctdb_dmaster_hint **dmaster_hints_find(struct ctdb_dmaster_hints *dh,
+						     uint32_t hash)
+{
+	struct ctdb_dmaster_hint **hp;
+
+	for (hp = &dh->buckets[hash & dh->mask]; *hp != NULL; hp = &(*hp)->chain) {
+		if ((*hp)->hash == hash) {
+			break;
+		}
+	}
+	return hp;
+}
+
+/*
+  remember that dmaster is (or is about to be) the dmaster of key. Passing
+  our own pnn forgets the hint, we will find ourselves in the record header
+ */
+void ctdb_dmaster_hint_update(struct ctdb_db_context *ctdb_db, TDB_DATA key,
+			      uint32_t dmaster)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_dmaster_hints *dh;
+	struct ctdb_dmaster_hint **hp, *h;
+	uint32_t hash;
+
+	dh = dmaster_hints_get(ctdb_db, dmaster != ctdb->pnn);
+	if (dh == NULL) {
+		return;
+	}
+
+	hash = ctdb_hash(&key);
+	hp = dmaster_hints_find(dh, hash);
+	h = *hp;
+
+	if (dmaster == ctdb->pnn) {
+		if (h != NULL) {
+			*hp = h->chain;
+			DLIST_REMOVE(dh->lru, h);
+			h->chain = dh->unused;
+			dh->unused = h;
+		}
+		return;
+	}
+
+	if (h != NULL) {
+		h->dmaster = dmaster;
+		DLIST_PROMOTE(dh->lru, h);
+		return;
+	}
+
+	if (dh->unused != NULL) {
+		h = dh->unused;
+		dh->unused = h->chain;
+	} else if (dh->num < dh->size) {
+		h = &dh->entries[dh->num];
+		dh->num++;
+	} else {
+		/* reuse the least recently used hint */
+		h = DLIST_TAIL(dh->lru);
+		DLIST_REMOVE(dh->lru, h);
+		*dmaster_hints_find(dh, h->hash) = h->chain;
+		hp = dmaster_hints_find(dh, hash);
+	}
+
+	h->hash = hash;
+	h->dmaster = dmaster;
+	h->chain = NULL;
+	*hp = h;
+	DLIST_ADD(dh->lru, h);
+}
+
+/*
+  look up the hinted dmaster of key. Hints pointing at ourselves or at
+  nodes that are not connected are not returned
+ */
+bool ctdb_dmaster_hint_lookup(struct ctdb_db_context *ctdb_db, TDB_DATA key,
+			      uint32_t *dmaster)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_dmaster_hints *dh;
+	struct ctdb_dmaster_hint *h;
+
+	dh = dmaster_hints_get(ctdb_db, false);
+	if (dh == NULL) {
+		return false;
+	}
+
+	h = *dmaster_hints_find(dh, ctdb_hash(&key));
+	if (h == NULL) {
+		return false;
+	}
+
+	if (h->dmaster == ctdb->pnn ||
+	    !ctdb_validate_pnn(ctdb, h->dmaster) ||
+	    (ctdb->nodes[h->dmaster]->flags & NODE_FLAGS_DISCONNECTED)) {
+		return false;
+	}
+
+	DLIST_PROMOTE(dh->lru, h);
+	*dmaster = h->dmaster;
+	return true;
+}
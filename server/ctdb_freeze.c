@@ -24,7 +24,7 @@
 #include "../include/ctdb_private.h"
 #include "lib/util/dlinklist.h"
 #include "db_wrap.h"
-#include "../common/rb_tree.h"
+#include "../common/key_index.h"
 
 /*
   a list of control requests waiting for a freeze lock child to get
@@ -473,10 +473,10 @@ int32_t ctdb_control_wipe_database(struct ctdb_context *ctdb, TDB_DATA indata)
 
 	if (!ctdb_db->persistent) {
 		talloc_free(ctdb_db->delete_queue);
-		ctdb_db->delete_queue = trbt_create(ctdb_db, 0);
+		ctdb_db->delete_queue = key_index_create(ctdb_db);
 		if (ctdb_db->delete_queue == NULL) {
 			DEBUG(DEBUG_ERR, (__location__ " Failed to re-create "
-					  "the vacuum tree.\n"));
+					  "the delete queue.\n"));
 			return -1;
 		}
 	}
@@ -0,0 +1,364 @@
+/*
+   per database hot key tracking
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "../include/ctdb_private.h"
+#include "../common/key_index.h"
+
+/*
+  Calls and migrations are counted in two count-min sketches. Each event
+  bumps one counter per row and the estimate for a key is the smallest
+  of its counters, which can only overestimate. The HotKeys keys with
+  the highest estimate (calls + migrations) are kept in a min-heap so a
+  new key only has to beat the coldest one to get in. All counters are
+  halved every HotKeysHalfLife seconds so that keys which have cooled
+  down drop out again.
+ */
+#define HOT_KEYS_DEPTH	4
+#define HOT_KEYS_WIDTH	1024
+
+struct ctdb_hot_key {
+	uint32_t calls;
+	uint32_t migrations;
+	uint32_t pos;		/* index into heap */
+	TDB_DATA key;
+	size_t keysize;		/* allocated size of key.dptr */
+};
+
+struct ctdb_hot_keys {
+	uint32_t calls[HOT_KEYS_DEPTH][HOT_KEYS_WIDTH];
+	uint32_t migrations[HOT_KEYS_DEPTH][HOT_KEYS_WIDTH];
+	struct timeval last_decay;
+
+	/* heap[0 .. num-1] is a min-heap, the rest are unused entries */
+	uint32_t num;
+	struct ctdb_hot_key *heap[MAX_HOT_KEYS];
+	struct ctdb_hot_key entries[MAX_HOT_KEYS];
+	struct key_index *index;
+};
+
+static inline uint32_t hot_key_score(const struct ctdb_hot_key *h)
+{
+	return h->calls + h->migrations;
+}
+
+static void hot_keys_swap(struct ctdb_hot_keys *hk, uint32_t i, uint32_t j)
+{
+	struct ctdb_hot_key *tmp = hk->heap[i];
+
+	hk->heap[i] = hk->heap[j];
+	hk->heap[j] = tmp;
+	hk->heap[i]->pos = i;
+	hk->heap[j]->pos = j;
+}
+
+static void hot_keys_sift_up(struct ctdb_hot_keys *hk, uint32_t i)
+{
+	while (i > 0) {
+		uint32_t parent = (i - 1) / 2;
+
+		if (hot_key_score(hk->heap[parent]) <= hot_key_score(hk->heap[i])) {
+			break;
+		}
+		hot_keys_swap(hk, i, parent);
+		i = parent;
+	}
+}
+
+static void hot_keys_sift_down(struct ctdb_hot_keys *hk, uint32_t i)
+{
+	while (1) {
+		uint32_t l = 2 * i + 1;
+		uint32_t r = l + 1;
+		uint32_t min = i;
+
+		if (l < hk->num &&
+		    hot_key_score(hk->heap[l]) < hot_key_score(hk->heap[min])) {
+			min = l;
+		}
+		if (r < hk->num &&
+		    hot_key_score(hk->heap[r]) < hot_key_score(hk->heap[min])) {
+			min = r;
+		}
+		if (min == i) {
+			break;
+		}
+		hot_keys_swap(hk, i, min);
+		i = min;
+	}
+}
+
+/*
+  drop the coldest key. It stays in the unused part of the heap array
+ */
+static void hot_keys_pop(struct ctdb_hot_keys *hk)
+{
+	struct ctdb_hot_key *h = hk->heap[0];
+
+	key_index_remove(hk->index, h->key);
+	hk->num--;
+	hot_keys_swap(hk, 0, hk->num);
+	hot_keys_sift_down(hk, 0);
+}
+
+static struct ctdb_hot_keys *hot_keys_create(struct ctdb_db_context *ctdb_db)
+{
+	struct ctdb_hot_keys *hk;
+	uint32_t i;
+
+	hk = talloc_zero(ctdb_db, struct ctdb_hot_keys);
+	if (hk == NULL) {
+		return NULL;
+	}
+
+	hk->index = key_index_create(hk);
+	if (hk->index == NULL) {
+		talloc_free(hk);
+		return NULL;
+	}
+
+	for (i = 0; i < MAX_HOT_KEYS; i++) {
+		hk->heap[i] = &hk->entries[i];
+		hk->entries[i].pos = i;
+	}
+	hk->last_decay = timeval_current();
+
+	return hk;
+}
+
+/*
+  halve everything once for every half-life that has passed
+ */
+static void hot_keys_decay(struct ctdb_context *ctdb, struct ctdb_hot_keys *hk)
+{
+	uint32_t half_life = ctdb->tunable.hot_keys_half_life;
+	struct timeval now;
+	uint32_t elapsed, shift;
+	uint32_t i, j;
+
+	if (half_life == 0) {
+		return;
+	}
+
+	now = timeval_current();
+	elapsed = now.tv_sec - hk->last_decay.tv_sec;
+	if (elapsed < half_life) {
+		return;
+	}
+	shift = elapsed / half_life;
+	hk->last_decay.tv_sec += shift * half_life;
+	if (shift > 31) {
+		shift = 31;
+	}
+
+	for (i = 0; i < HOT_KEYS_DEPTH; i++) {
+		for (j = 0; j < HOT_KEYS_WIDTH; j++) {
+			hk->calls[i][j]      >>= shift;
+			hk->migrations[i][j] >>= shift;
+		}
+	}
+
+	/* halving keeps the heap order, so only the values change */
+	for (i = 0; i < hk->num; i++) {
+		hk->heap[i]->calls      >>= shift;
+		hk->heap[i]->migrations >>= shift;
+	}
+}
+
+/*
+  bump the counters for key in one sketch using conservative update,
+  which only raises the counters that hold the current estimate.
+  Returns the new estimate
+ */
+static uint32_t hot_keys_sketch_add(uint32_t sketch[HOT_KEYS_DEPTH][HOT_KEYS_WIDTH],
+				    const uint32_t *cols)
+{
+	uint32_t est = UINT32_MAX;
+	uint32_t i;
+
+	for (i = 0; i < HOT_KEYS_DEPTH; i++) {
+		est = MIN(est, sketch[i][cols[i]]);
+	}
+	if (est != UINT32_MAX) {
+		est++;
+	}
+	for (i = 0; i < HOT_KEYS_DEPTH; i++) {
+		if (sketch[i][cols[i]] < est) {
+			sketch[i][cols[i]] = est;
+		}
+	}
+	return est;
+}
+
+static uint32_t hot_keys_sketch_get(uint32_t sketch[HOT_KEYS_DEPTH][HOT_KEYS_WIDTH],
+				    const uint32_t *cols)
+{
+	uint32_t est = UINT32_MAX;
+	uint32_t i;
+
+	for (i = 0; i < HOT_KEYS_DEPTH; i++) {
+		est = MIN(est, sketch[i][cols[i]]);
+	}
+	return est;
+}
+
+/*
+  record a call for key on this node, or a migration of key away from
+  this node, and update the list of hot keys
+ */
+void ctdb_db_hot_keys_update(struct ctdb_db_context *ctdb_db, TDB_DATA key,
+			     bool migrated)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_hot_keys *hk = ctdb_db->hot_keys;
+	struct ctdb_hot_key *h;
+	uint32_t cols[HOT_KEYS_DEPTH];
+	uint32_t hash, step, calls, migrations, max_keys;
+	bool new_entry;
+	uint32_t i;
+
+	max_keys = MIN(ctdb->tunable.hot_keys, MAX_HOT_KEYS);
+	if (max_keys == 0) {
+		return;
+	}
+
+	if (hk == NULL) {
+		hk = hot_keys_create(ctdb_db);
+		if (hk == NULL) {
+			DEBUG(DEBUG_ERR,("Failed to allocate hot keys for db %s\n",
+					 ctdb_db->db_name));
+			return;
+		}
+		ctdb_db->hot_keys = hk;
+	}
+
+	hot_keys_decay(ctdb, hk);
+
+	/* the tunable may have been lowered */
+	while (hk->num > max_keys) {
+		hot_keys_pop(hk);
+	}
+
+	/* derive the row hashes from one key hash */
+	hash = ctdb_hash(&key);
+	step = ((hash >> 16) | (hash << 16)) * 0x9e3779b1 | 1;
+	for (i = 0; i < HOT_KEYS_DEPTH; i++) {
+		cols[i] = (hash + i * step) % HOT_KEYS_WIDTH;
+	}
+
+	if (migrated) {
+		migrations = hot_keys_sketch_add(hk->migrations, cols);
+		calls      = hot_keys_sketch_get(hk->calls, cols);
+	} else {
+		calls      = hot_keys_sketch_add(hk->calls, cols);
+		migrations = hot_keys_sketch_get(hk->migrations, cols);
+	}
+
+	h = key_index_lookup_hash(hk->index, hash, key);
+	if (h != NULL) {
+		/* the score only grows, which moves it away from the root */
+		h->calls      = calls;
+		h->migrations = migrations;
+		hot_keys_sift_down(hk, h->pos);
+		return;
+	}
+
+	if (hk->num < max_keys) {
+		h = hk->heap[hk->num];
+		new_entry = true;
+	} else if (calls + migrations > hot_key_score(hk->heap[0])) {
+		h = hk->heap[0];
+		new_entry = false;
+	} else {
+		return;
+	}
+
+	if (key.dsize > h->keysize) {
+		uint8_t *p = talloc_realloc_size(hk, h->key.dptr, key.dsize);
+		if (p == NULL) {
+			DEBUG(DEBUG_ERR,("Failed to allocate hot key\n"));
+			return;
+		}
+		h->key.dptr = p;
+		h->keysize = key.dsize;
+	}
+
+	if (!new_entry) {
+		key_index_remove(hk->index, h->key);
+	}
+	memcpy(h->key.dptr, key.dptr, key.dsize);
+	h->key.dsize  = key.dsize;
+	h->calls      = calls;
+	h->migrations = migrations;
+
+	if (key_index_insert_hash(hk->index, hash, h->key, h) != 0) {
+		DEBUG(DEBUG_ERR,("Failed to index hot key\n"));
+		if (!new_entry) {
+			hot_keys_pop(hk);
+		}
+		return;
+	}
+
+	if (new_entry) {
+		hk->num++;
+		hot_keys_sift_up(hk, h->pos);
+	} else {
+		hot_keys_sift_down(hk, 0);
+	}
+}
+
+/*
+  fill in the hot keys of a db statistics structure, hottest first.
+  The keys point into the hot key list and are only valid until it
+  is next updated
+ */
+void ctdb_db_hot_keys_get(struct ctdb_db_context *ctdb_db,
+			  struct ctdb_db_statistics *stats)
+{
+	struct ctdb_hot_keys *hk = ctdb_db->hot_keys;
+	struct ctdb_hot_key *sorted[MAX_HOT_KEYS];
+	uint32_t i, j, num = 0;
+
+	memset(stats->hot_keys, 0, sizeof(stats->hot_keys));
+	stats->num_hot_keys = 0;
+
+	if (hk == NULL) {
+		return;
+	}
+
+	hot_keys_decay(ctdb_db->ctdb, hk);
+
+	for (i = 0; i < hk->num; i++) {
+		struct ctdb_hot_key *h = hk->heap[i];
+
+		if (hot_key_score(h) == 0) {
+			continue;
+		}
+		for (j = num; j > 0 && hot_key_score(sorted[j-1]) < hot_key_score(h); j--) {
+			sorted[j] = sorted[j-1];
+		}
+		sorted[j] = h;
+		num++;
+	}
+
+	for (i = 0; i < num; i++) {
+		stats->hot_keys[i].count      = sorted[i]->calls;
+		stats->hot_keys[i].migrations = sorted[i]->migrations;
+		stats->hot_keys[i].key        = sorted[i]->key;
+	}
+	stats->num_hot_keys = num;
+}
@@ -25,12 +25,179 @@
 
 
 /*
-  see if any nodes are dead
+  Unless DeadNodePhi is 0, dead nodes are found with an accrual failure
+  detector. Each node keeps a window of the times between packets from
+  every other node and turns the time since the last packet into a
+  suspicion level, phi, which is about -log10 of the chance that a live
+  node would have stayed quiet for that long. A node is declared dead
+  once phi reaches DeadNodePhi.
+
+  Keepalives are only sent to nodes that nothing has been sent to for
+  half a HeartbeatInterval, so live nodes are never quiet for much
+  longer than that. The mean of the window is raised to at least
+  HeartbeatInterval and its standard deviation to HeartbeatMinStdDev,
+  so the silence after a burst of traffic does not look suspicious.
+
+  phi only ever makes detection faster: a node has to be quiet for at
+  least KeepaliveInterval seconds before phi can mark it dead, and a
+  node quiet for KeepaliveInterval*KeepaliveLimit seconds is dead
+  whatever phi says. While a recovery is running or our databases are
+  frozen, only the latter applies. Pulling and pushing databases runs
+  in the main loop, so a node with a large database can be quiet for
+  seconds during a recovery without anything being wrong with it.
  */
-static void ctdb_check_for_dead_nodes(struct event_context *ev, struct timed_event *te, 
-				      struct timeval t, void *private_data)
+#define ARRIVAL_WINDOW_SIZE 64
+
+struct ctdb_arrival_window {
+	uint32_t num;
+	uint32_t next;
+	double sum;
+	double sumsq;
+	double samples[ARRIVAL_WINDOW_SIZE];	/* milliseconds */
+};
+
+static void arrival_window_add(struct ctdb_arrival_window *w, double ms)
+{
+	uint32_t i;
+
+	if (w->num == ARRIVAL_WINDOW_SIZE) {
+		double old = w->samples[w->next];
+		w->sum   -= old;
+		w->sumsq -= old * old;
+	} else {
+		w->num++;
+	}
+
+	w->samples[w->next] = ms;
+	w->sum   += ms;
+	w->sumsq += ms * ms;
+
+	w->next = (w->next + 1) % ARRIVAL_WINDOW_SIZE;
+	if (w->next == 0) {
+		/* do not let rounding errors pile up */
+		w->sum = w->sumsq = 0;
+		for (i = 0; i < w->num; i++) {
+			w->sum   += w->samples[i];
+			w->sumsq += w->samples[i] * w->samples[i];
+		}
+	}
+}
+
+/* Cheaper than pulling in libm */
+static double arrival_sqrt(double x)
+{
+	double r = x;
+	int i;
+
+	if (x <= 0) {
+		return 0;
+	}
+	for (i = 0; i < 64; i++) {
+		double next = (r + x / r) / 2;
+		if (next >= r) {
+			break;
+		}
+		r = next;
+	}
+	return r;
+}
+
+/*
+  phi uses the logistic approximation of the normal distribution tail,
+  e/(1+e) with e = exp(-z). Leaving out the log(1+e) term makes phi
+  just z/ln(10), which is never more than 0.3 too low and needs no libm
+ */
+static double ctdb_node_phi(struct ctdb_node *node, struct timeval *now)
+{
+	struct ctdb_context *ctdb = node->ctdb;
+	struct ctdb_arrival_window *w = node->arrivals;
+	double mean = ctdb->tunable.heartbeat_interval;
+	double stddev = 0;
+	double t, y, z;
+
+	if (timeval_is_zero(&node->last_rx)) {
+		return 0;
+	}
+
+	if (w != NULL && w->num > 0) {
+		double m = w->sum / w->num;
+
+		stddev = arrival_sqrt(w->sumsq / w->num - m * m);
+		mean = MAX(mean, m);
+	}
+	stddev = MAX(stddev, ctdb->tunable.heartbeat_min_stddev);
+	stddev = MAX(stddev, 1);
+
+	t = timeval_delta(now, &node->last_rx) * 1000;
+	y = (t - mean) / stddev;
+	if (y <= 0) {
+		return 0;
+	}
+
+	z = y * (1.5976 + 0.070566 * y * y);
+	return z / 2.302585;
+}
+
+/*
+  called for every packet from another node
+ */
+void ctdb_node_packet_received(struct ctdb_node *node)
+{
+	struct timeval now = timeval_current();
+
+	node->rx_cnt++;
+
+	if (node->arrivals == NULL) {
+		node->arrivals = talloc_zero(node, struct ctdb_arrival_window);
+	}
+	if (node->arrivals != NULL && !timeval_is_zero(&node->last_rx)) {
+		arrival_window_add(node->arrivals,
+				   timeval_delta(&now, &node->last_rx) * 1000);
+	}
+	node->last_rx = now;
+}
+
+static void ctdb_node_set_suspect(struct ctdb_node *node, bool suspect,
+				  double phi)
+{
+	struct ctdb_context *ctdb = node->ctdb;
+	struct ctdb_node_suspicion s;
+	TDB_DATA data;
+
+	if (node->suspect == suspect) {
+		return;
+	}
+	node->suspect = suspect;
+
+	DEBUG(DEBUG_INFO,("Node %u is %s suspected of being dead (phi %.1f)\n",
+			  node->pnn, suspect ? "now" : "no longer", phi));
+
+	/* let the recovery daemon know */
+	s.pnn = node->pnn;
+	s.suspect = suspect;
+	data.dptr = (uint8_t *)&s;
+	data.dsize = sizeof(s);
+	ctdb_daemon_send_message(ctdb, ctdb->pnn, CTDB_SRVID_NODE_SUSPICION, data);
+}
+
+/*
+  forget the packet history of a node when it connects or dies
+ */
+void ctdb_node_reset_arrivals(struct ctdb_node *node)
+{
+	node->last_rx = timeval_current();
+	if (node->arrivals != NULL) {
+		ZERO_STRUCTP(node->arrivals);
+	}
+	ctdb_node_set_suspect(node, false, 0);
+}
+
+/*
+  see if any nodes are dead, counting KeepaliveIntervals without
+  any packets
+ */
+static void ctdb_count_dead_nodes(struct ctdb_context *ctdb)
 {
-	struct ctdb_context *ctdb = talloc_get_type(private_data, struct ctdb_context);
 	int i;
 
 	/* send a keepalive to all other nodes, unless */
@@ -77,9 +244,108 @@ static void ctdb_check_for_dead_nodes(struct event_context *ev, struct timed_eve
 
 		node->tx_cnt = 0;
 	}
-	
-	event_add_timed(ctdb->ev, ctdb->keepalive_ctx,
-			timeval_current_ofs(ctdb->tunable.keepalive_interval, 0), 
+}
+
+/*
+  see if any nodes are dead using their suspicion level, and send
+  keepalives on idle links
+ */
+static void ctdb_accrue_dead_nodes(struct ctdb_context *ctdb, uint32_t tick)
+{
+	struct timeval now = timeval_current();
+	double dead_limit = ctdb->tunable.keepalive_interval *
+		ctdb->tunable.keepalive_limit;
+	bool stalled = false;
+	bool recovering;
+	int i;
+
+	recovering = (ctdb->recovery_mode == CTDB_RECOVERY_ACTIVE);
+	for (i=1; i<=NUM_DB_PRIORITIES; i++) {
+		if (ctdb->freeze_mode[i] != CTDB_FREEZE_NONE) {
+			recovering = true;
+		}
+	}
+
+	/* If this daemon did not run for a while then packets from the
+	   other nodes may still be waiting to be read. Give them a
+	   fresh start rather than declaring them all dead */
+	if (!timeval_is_zero(&ctdb->keepalive_tick) &&
+	    timeval_delta(&now, &ctdb->keepalive_tick) * 1000 >
+	    tick + ctdb->tunable.heartbeat_interval) {
+		DEBUG(DEBUG_NOTICE,("Dead node check delayed by %.3f seconds, "
+				    "not checking for dead nodes\n",
+				    timeval_delta(&now, &ctdb->keepalive_tick)));
+		stalled = true;
+	}
+	ctdb->keepalive_tick = now;
+
+	for (i=0;i<ctdb->num_nodes;i++) {
+		struct ctdb_node *node = ctdb->nodes[i];
+		double phi, quiet;
+
+		if (node->flags & NODE_FLAGS_DELETED) {
+			continue;
+		}
+
+		if (node->pnn == ctdb->pnn) {
+			continue;
+		}
+
+		if (node->flags & NODE_FLAGS_DISCONNECTED) {
+			/* it might have come alive again */
+			if (node->rx_cnt != 0) {
+				ctdb_node_connected(node);
+			}
+			continue;
+		}
+
+		node->rx_cnt = 0;
+
+		if (stalled) {
+			node->last_rx = now;
+		}
+
+		phi = ctdb_node_phi(node, &now);
+		quiet = timeval_is_zero(&node->last_rx) ? 0 :
+			timeval_delta(&now, &node->last_rx);
+		if (quiet >= dead_limit ||
+		    (!recovering && phi >= ctdb->tunable.dead_node_phi)) {
+			DEBUG(DEBUG_NOTICE,("Node %u has been quiet for %.3f seconds "
+					    "(phi %.1f), marking it dead\n",
+					    node->pnn, quiet, phi));
+			ctdb_node_dead(node);
+			ctdb_send_keepalive(ctdb, node->pnn);
+			continue;
+		}
+
+		ctdb_node_set_suspect(node, phi >= ctdb->tunable.dead_node_phi / 2.0,
+				      phi);
+
+		if (timeval_delta(&now, &node->last_tx) * 1000 >= tick) {
+			DEBUG(DEBUG_DEBUG,("sending keepalive to %u\n", node->pnn));
+			ctdb_send_keepalive(ctdb, node->pnn);
+		}
+	}
+}
+
+static void ctdb_check_for_dead_nodes(struct event_context *ev, struct timed_event *te, 
+				      struct timeval t, void *private_data)
+{
+	struct ctdb_context *ctdb = talloc_get_type(private_data, struct ctdb_context);
+	struct timeval next;
+
+	if (ctdb->tunable.dead_node_phi == 0) {
+		ctdb_count_dead_nodes(ctdb);
+		ctdb->keepalive_tick = timeval_zero();
+		next = timeval_current_ofs(ctdb->tunable.keepalive_interval, 0);
+	} else {
+		uint32_t tick = MAX(ctdb->tunable.heartbeat_interval / 2, 10);
+
+		ctdb_accrue_dead_nodes(ctdb, tick);
+		next = timeval_current_ofs(tick / 1000, (tick % 1000) * 1000);
+	}
+
+	event_add_timed(ctdb->ev, ctdb->keepalive_ctx, next,
 			ctdb_check_for_dead_nodes, ctdb);
 }
 
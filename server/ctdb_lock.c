@@ -41,10 +41,16 @@
  * ctdb_lock_alldb()       - get a lock on all DBs
  *
  *  auto_mark              - whether to mark/unmark DBs in before/after callback
+ *
+ * Record and DB locks are queued per database and indexed by key hash.
+ * The total number of lock processes is limited by the tunable
+ * LockProcessesMax and the share of a single database by the tunable
+ * LockProcessesPerDB.  Databases are scheduled in round-robin order,
+ * so a lock storm on one database does not starve the others.
  */
 
-/* FIXME: Add a tunable max_lock_processes_per_db */
-#define MAX_LOCK_PROCESSES_PER_DB		(100)
+/* Number of hash buckets in the per database lock index */
+#define LOCK_INDEX_SIZE		(256)
 
 enum lock_type {
 	LOCK_RECORD,
@@ -69,6 +75,8 @@ struct lock_context {
 	struct ctdb_context *ctdb;
 	struct ctdb_db_context *ctdb_db;
 	TDB_DATA key;
+	uint32_t key_hash;
+	struct lock_context *hash_next;
 	uint32_t priority;
 	bool auto_mark;
 	struct lock_request *req_queue;
@@ -272,27 +280,123 @@ static int ctdb_lockall_unmark(struct ctdb_context *ctdb)
 static void ctdb_lock_schedule(struct ctdb_context *ctdb);
 
 /*
- * Destructor to kill the child locking process
+ * Per database lock queues
+ *
+ * Record and DB locks live on the pending/current lists of their database,
+ * ALLDB locks live on the lists in ctdb_context.
  */
-static int ctdb_lock_context_destructor(struct lock_context *lock_ctx)
+static struct lock_context **lock_pending_list(struct lock_context *lock_ctx)
+{
+	if (lock_ctx->ctdb_db != NULL) {
+		return &lock_ctx->ctdb_db->lock_pending;
+	}
+	return &lock_ctx->ctdb->lock_pending;
+}
+
+static struct lock_context **lock_current_list(struct lock_context *lock_ctx)
+{
+	if (lock_ctx->ctdb_db != NULL) {
+		return &lock_ctx->ctdb_db->lock_current;
+	}
+	return &lock_ctx->ctdb->lock_current;
+}
+
+static void lock_index_add(struct lock_context *lock_ctx)
 {
+	struct lock_context **bucket;
+
+	bucket = &lock_ctx->ctdb_db->lock_index[lock_ctx->key_hash % LOCK_INDEX_SIZE];
+	lock_ctx->hash_next = *bucket;
+	*bucket = lock_ctx;
+}
+
+static void lock_index_remove(struct lock_context *lock_ctx)
+{
+	struct lock_context **p;
+
+	p = &lock_ctx->ctdb_db->lock_index[lock_ctx->key_hash % LOCK_INDEX_SIZE];
+	while (*p != NULL) {
+		if (*p == lock_ctx) {
+			*p = lock_ctx->hash_next;
+			break;
+		}
+		p = &(*p)->hash_next;
+	}
+	lock_ctx->hash_next = NULL;
+}
+
+/*
+ * Find a record/db lock context in the database index
+ *
+ * If active is true, return the context which has a child process
+ * waiting for (or holding) the lock, otherwise return the pending one.
+ */
+static struct lock_context *lock_index_find(struct ctdb_db_context *ctdb_db,
+					    enum lock_type type,
+					    TDB_DATA key, uint32_t key_hash,
+					    bool active)
+{
+	struct lock_context *lock_ctx;
+
+	if (ctdb_db->lock_index == NULL) {
+		return NULL;
+	}
+
+	lock_ctx = ctdb_db->lock_index[key_hash % LOCK_INDEX_SIZE];
+	for (; lock_ctx != NULL; lock_ctx = lock_ctx->hash_next) {
+		if (lock_ctx->type != type ||
+		    lock_ctx->key_hash != key_hash ||
+		    (lock_ctx->child > 0) != active) {
+			continue;
+		}
+		if (key.dsize == lock_ctx->key.dsize &&
+		    memcmp(key.dptr, lock_ctx->key.dptr, key.dsize) == 0) {
+			return lock_ctx;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Remove a lock context from the queues and the index
+ */
+static void lock_context_unlink(struct lock_context *lock_ctx)
+{
+	struct ctdb_context *ctdb = lock_ctx->ctdb;
+
 	if (lock_ctx->child > 0) {
-		ctdb_kill(lock_ctx->ctdb, lock_ctx->child, SIGKILL);
-		DLIST_REMOVE(lock_ctx->ctdb->lock_current, lock_ctx);
-		lock_ctx->ctdb->lock_num_current--;
-		CTDB_DECREMENT_STAT(lock_ctx->ctdb, locks.num_current);
-		if (lock_ctx->type == LOCK_RECORD || lock_ctx->type == LOCK_DB) {
+		DLIST_REMOVE(*lock_current_list(lock_ctx), lock_ctx);
+		ctdb->lock_num_current--;
+		CTDB_DECREMENT_STAT(ctdb, locks.num_current);
+		if (lock_ctx->ctdb_db != NULL) {
+			lock_ctx->ctdb_db->lock_num_current--;
 			CTDB_DECREMENT_DB_STAT(lock_ctx->ctdb_db, locks.num_current);
 		}
 	} else {
-		DLIST_REMOVE(lock_ctx->ctdb->lock_pending, lock_ctx);
-		lock_ctx->ctdb->lock_num_pending--;
-		CTDB_DECREMENT_STAT(lock_ctx->ctdb, locks.num_pending);
-		if (lock_ctx->type == LOCK_RECORD || lock_ctx->type == LOCK_DB) {
+		DLIST_REMOVE(*lock_pending_list(lock_ctx), lock_ctx);
+		ctdb->lock_num_pending--;
+		CTDB_DECREMENT_STAT(ctdb, locks.num_pending);
+		if (lock_ctx->ctdb_db != NULL) {
 			CTDB_DECREMENT_DB_STAT(lock_ctx->ctdb_db, locks.num_pending);
 		}
 	}
 
+	if (lock_ctx->ctdb_db != NULL) {
+		lock_index_remove(lock_ctx);
+	}
+}
+
+/*
+ * Destructor to kill the child locking process
+ */
+static int ctdb_lock_context_destructor(struct lock_context *lock_ctx)
+{
+	if (lock_ctx->child > 0) {
+		ctdb_kill(lock_ctx->ctdb, lock_ctx->child, SIGKILL);
+	}
+	lock_context_unlink(lock_ctx);
+
 	ctdb_lock_schedule(lock_ctx->ctdb);
 
 	return 0;
@@ -661,55 +765,97 @@ static char **lock_helper_args(TALLOC_CTX *mem_ctx, struct lock_context *lock_ct
 
 
 /*
- * Find the lock context of a given type
+ * Find the alldb lock context of a given type
  */
 static struct lock_context *find_lock_context(struct lock_context *lock_list,
-					      struct ctdb_db_context *ctdb_db,
-					      TDB_DATA key,
 					      uint32_t priority,
 					      enum lock_type type)
 {
 	struct lock_context *lock_ctx;
 
-	/* Search active locks */
 	for (lock_ctx=lock_list; lock_ctx; lock_ctx=lock_ctx->next) {
 		if (lock_ctx->type != type) {
 			continue;
 		}
+		if (type == LOCK_ALLDB_PRIO && priority != lock_ctx->priority) {
+			continue;
+		}
+		return lock_ctx;
+	}
 
-		switch (lock_ctx->type) {
-		case LOCK_RECORD:
-			if (ctdb_db == lock_ctx->ctdb_db &&
-			    key.dsize == lock_ctx->key.dsize &&
-			    memcmp(key.dptr, lock_ctx->key.dptr, key.dsize) == 0) {
-				goto done;
-			}
-			break;
+	return NULL;
+}
 
-		case LOCK_DB:
-			if (ctdb_db == lock_ctx->ctdb_db) {
-				goto done;
-			}
-			break;
 
-		case LOCK_ALLDB_PRIO:
-			if (priority == lock_ctx->priority) {
-				goto done;
-			}
-			break;
+/*
+ * Drop a pending lock context which has no lock requests left
+ */
+static void ctdb_lock_drop_pending(struct lock_context *lock_ctx)
+{
+	DEBUG(DEBUG_INFO, ("Removing lock context without lock requests\n"));
+	lock_context_unlink(lock_ctx);
+	talloc_free(lock_ctx);
+}
 
-		case LOCK_ALLDB:
-			goto done;
-			break;
+
+/*
+ * Find a pending alldb lock context which can be scheduled
+ */
+static struct lock_context *ctdb_find_runnable_alldb(struct ctdb_context *ctdb)
+{
+	struct lock_context *lock_ctx, *next_ctx;
+
+	lock_ctx = ctdb->lock_pending;
+	while (lock_ctx != NULL) {
+		next_ctx = lock_ctx->next;
+		if (! lock_ctx->req_queue) {
+			ctdb_lock_drop_pending(lock_ctx);
+		} else if (find_lock_context(ctdb->lock_current,
+					     lock_ctx->priority,
+					     lock_ctx->type) == NULL) {
+			return lock_ctx;
 		}
+		lock_ctx = next_ctx;
 	}
 
-	/* Did not find the lock context we are searching for */
-	lock_ctx = NULL;
+	return NULL;
+}
+
 
-done:
-	return lock_ctx;
+/*
+ * Find a pending record/db lock context in a database which can be
+ * scheduled without exceeding the database budget
+ */
+static struct lock_context *ctdb_find_runnable_db(struct ctdb_db_context *ctdb_db)
+{
+	struct lock_context *lock_ctx, *next_ctx, *active_ctx;
+
+	if (ctdb_db->lock_num_current >= ctdb_db->ctdb->tunable.lock_processes_per_db) {
+		return NULL;
+	}
 
+	lock_ctx = ctdb_db->lock_pending;
+	while (lock_ctx != NULL) {
+		next_ctx = lock_ctx->next;
+		if (! lock_ctx->req_queue) {
+			ctdb_lock_drop_pending(lock_ctx);
+		} else {
+			active_ctx = lock_index_find(ctdb_db, lock_ctx->type,
+						     lock_ctx->key,
+						     lock_ctx->key_hash, true);
+			if (active_ctx == NULL) {
+				return lock_ctx;
+			}
+
+			/* There is already a child waiting for the
+			 * same key.  So don't schedule another child
+			 * just yet.
+			 */
+		}
+		lock_ctx = next_ctx;
+	}
+
+	return NULL;
 }
 
 
@@ -719,8 +865,9 @@ done:
  */
 static void ctdb_lock_schedule(struct ctdb_context *ctdb)
 {
-	struct lock_context *lock_ctx, *next_ctx, *active_ctx;
-	int ret;
+	struct lock_context *lock_ctx;
+	struct ctdb_db_context *ctdb_db, *start_db;
+	int ret, id;
 	TALLOC_CTX *tmp_ctx;
 	const char *helper = BINDIR "/ctdb_lock_helper";
 	static const char *prog = NULL;
@@ -738,42 +885,37 @@ static void ctdb_lock_schedule(struct ctdb_context *ctdb)
 		CTDB_NO_MEMORY_VOID(ctdb, prog);
 	}
 
-	if (ctdb->lock_num_current >= MAX_LOCK_PROCESSES_PER_DB) {
+	if (ctdb->lock_num_pending == 0) {
 		return;
 	}
 
-	if (ctdb->lock_pending == NULL) {
+	if (ctdb->lock_num_current >= ctdb->tunable.lock_processes_max) {
 		return;
 	}
 
-	/* Find a lock context with requests */
-	lock_ctx = ctdb->lock_pending;
-	while (lock_ctx != NULL) {
-		next_ctx = lock_ctx->next;
-		if (! lock_ctx->req_queue) {
-			DEBUG(DEBUG_INFO, ("Removing lock context without lock requests\n"));
-			DLIST_REMOVE(ctdb->lock_pending, lock_ctx);
-			ctdb->lock_num_pending--;
-			CTDB_DECREMENT_STAT(ctdb, locks.num_pending);
-			if (lock_ctx->ctdb_db) {
-				CTDB_DECREMENT_DB_STAT(lock_ctx->ctdb_db, locks.num_pending);
+	/* Locks on all databases take precedence */
+	lock_ctx = ctdb_find_runnable_alldb(ctdb);
+
+	/* Otherwise, visit databases in round-robin order */
+	if (lock_ctx == NULL && ctdb->db_list != NULL) {
+		start_db = ctdb->lock_next_db;
+		if (start_db == NULL) {
+			start_db = ctdb->db_list;
+		}
+
+		ctdb_db = start_db;
+		do {
+			lock_ctx = ctdb_find_runnable_db(ctdb_db);
+
+			ctdb_db = ctdb_db->next;
+			if (ctdb_db == NULL) {
+				ctdb_db = ctdb->db_list;
 			}
-			talloc_free(lock_ctx);
-		} else {
-			active_ctx = find_lock_context(ctdb->lock_current, lock_ctx->ctdb_db,
-						       lock_ctx->key, lock_ctx->priority,
-						       lock_ctx->type);
-			if (active_ctx == NULL) {
-				/* Found a lock context with lock requests */
+			if (lock_ctx != NULL) {
+				ctdb->lock_next_db = ctdb_db;
 				break;
 			}
-
-			/* There is already a child waiting for the
-			 * same key.  So don't schedule another child
-			 * just yet.
-			 */
-		}
-		lock_ctx = next_ctx;
+		} while (ctdb_db != start_db);
 	}
 
 	if (lock_ctx == NULL) {
@@ -868,10 +1010,17 @@ static void ctdb_lock_schedule(struct ctdb_context *ctdb)
 	tevent_fd_set_auto_close(lock_ctx->tfd);
 
 	/* Move the context from pending to current */
-	DLIST_REMOVE(ctdb->lock_pending, lock_ctx);
+	DLIST_REMOVE(*lock_pending_list(lock_ctx), lock_ctx);
 	ctdb->lock_num_pending--;
-	DLIST_ADD_END(ctdb->lock_current, lock_ctx, NULL);
+	DLIST_ADD_END(*lock_current_list(lock_ctx), lock_ctx, NULL);
 	ctdb->lock_num_current++;
+
+	if (lock_ctx->ctdb_db != NULL) {
+		/* Time spent waiting in the queue for a lock process */
+		id = lock_bucket_id(timeval_elapsed(&lock_ctx->start_time));
+		lock_ctx->ctdb_db->lock_num_current++;
+		CTDB_INCREMENT_DB_STAT(lock_ctx->ctdb_db, locks.queue_buckets[id]);
+	}
 }
 
 
@@ -889,6 +1038,7 @@ static struct lock_request *ctdb_lock_internal(struct ctdb_context *ctdb,
 {
 	struct lock_context *lock_ctx;
 	struct lock_request *request;
+	uint32_t key_hash;
 
 	if (callback == NULL) {
 		DEBUG(DEBUG_WARNING, ("No callback function specified, not locking\n"));
@@ -897,7 +1047,22 @@ static struct lock_request *ctdb_lock_internal(struct ctdb_context *ctdb,
 
 	/* get a context for this key - search only the pending contexts,
 	 * current contexts might in the middle of processing callbacks */
-	lock_ctx = find_lock_context(ctdb->lock_pending, ctdb_db, key, priority, type);
+	if (ctdb_db != NULL) {
+		if (ctdb_db->lock_index == NULL) {
+			ctdb_db->lock_index = talloc_zero_array(ctdb_db,
+								struct lock_context *,
+								LOCK_INDEX_SIZE);
+			if (ctdb_db->lock_index == NULL) {
+				DEBUG(DEBUG_ERR, ("Failed to create lock index\n"));
+				return NULL;
+			}
+		}
+		key_hash = ctdb_hash(&key);
+		lock_ctx = lock_index_find(ctdb_db, type, key, key_hash, false);
+	} else {
+		key_hash = 0;
+		lock_ctx = find_lock_context(ctdb->lock_pending, priority, type);
+	}
 
 	/* No existing context, create one */
 	if (lock_ctx == NULL) {
@@ -916,13 +1081,17 @@ static struct lock_request *ctdb_lock_internal(struct ctdb_context *ctdb,
 		} else {
 			lock_ctx->key.dptr = NULL;
 		}
+		lock_ctx->key_hash = key_hash;
 		lock_ctx->priority = priority;
 		lock_ctx->auto_mark = auto_mark;
 
 		lock_ctx->child = -1;
 		lock_ctx->block_child = -1;
 
-		DLIST_ADD_END(ctdb->lock_pending, lock_ctx, NULL);
+		DLIST_ADD_END(*lock_pending_list(lock_ctx), lock_ctx, NULL);
+		if (ctdb_db != NULL) {
+			lock_index_add(lock_ctx);
+		}
 		ctdb->lock_num_pending++;
 		CTDB_INCREMENT_STAT(ctdb, locks.num_pending);
 		if (ctdb_db) {
@@ -933,7 +1102,8 @@ static struct lock_request *ctdb_lock_internal(struct ctdb_context *ctdb,
 		lock_ctx->start_time = timeval_current();
 	}
 
-	if ((request = talloc_zero(lock_ctx, struct lock_request)) == NULL) {
+	request = ctdb_mem_pool_zero(ctdb, lock_ctx, struct lock_request);
+	if (request == NULL) {
 		return NULL;
 	}
 
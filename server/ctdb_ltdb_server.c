@@ -24,12 +24,16 @@
 #include "system/dir.h"
 #include "system/time.h"
 #include "../include/ctdb_private.h"
-#include "../common/rb_tree.h"
+#include "../common/key_index.h"
 #include "db_wrap.h"
 #include "lib/util/dlinklist.h"
 #include <ctype.h>
 
 #define PERSISTENT_HEALTH_TDB "persistent_health.tdb"
+#define DB_HASH_SIZES_TDB "db_hash_sizes.tdb"
+
+/* average number of records per hash chain before the chains are doubled */
+#define DB_HASH_CHAIN_TARGET 4
 
 /**
  * write a record to a normal database
@@ -342,7 +346,9 @@ int ctdb_ltdb_lock_requeue(struct ctdb_db_context *ctdb_db,
 }
 
 /*
-  a varient of ctdb_ltdb_lock_requeue that also fetches the record
+  a varient of ctdb_ltdb_lock_requeue that also fetches the record.
+  The data of records held by other nodes is not returned, the header
+  is all that is needed to redirect the call
  */
 int ctdb_ltdb_lock_fetch_requeue(struct ctdb_db_context *ctdb_db, 
 				 TDB_DATA key, struct ctdb_ltdb_header *header, 
@@ -355,7 +361,7 @@ int ctdb_ltdb_lock_fetch_requeue(struct ctdb_db_context *ctdb_db,
 	ret = ctdb_ltdb_lock_requeue(ctdb_db, key, hdr, recv_pkt, 
 				     recv_context, ignore_generation);
 	if (ret == 0) {
-		ret = ctdb_ltdb_fetch(ctdb_db, key, header, hdr, data);
+		ret = ctdb_ltdb_fetch_local(ctdb_db, key, header, hdr, data);
 		if (ret != 0) {
 			int uret;
 			uret = ctdb_ltdb_unlock(ctdb_db, key);
@@ -660,6 +666,7 @@ int32_t ctdb_control_db_set_healthy(struct ctdb_context *ctdb, TDB_DATA indata)
 		DEBUG(DEBUG_ERR, (__location__ " db %s become healthy  - force recovery for startup\n",
 				  ctdb_db->db_name));
 		ctdb->recovery_mode = CTDB_RECOVERY_ACTIVE;
+		ctdb_state_changed(ctdb);
 	}
 
 	return 0;
@@ -735,18 +742,126 @@ int ctdb_set_db_readonly(struct ctdb_context *ctdb, struct ctdb_db_context *ctdb
 	return 0;
 }
 
+/*
+  the number of hash chains a volatile database was last seen to need,
+  0 if nothing is known about it
+ */
+static uint32_t ctdb_db_load_hash_size(struct ctdb_context *ctdb,
+				       const char *db_name)
+{
+	TDB_DATA key, val;
+	uint32_t hash_size = 0;
+
+	if (ctdb->db_hash_sizes == NULL) {
+		return 0;
+	}
+
+	key.dptr = discard_const_p(uint8_t, db_name);
+	key.dsize = strlen(db_name);
+
+	val = tdb_fetch(ctdb->db_hash_sizes->tdb, key);
+	if (val.dsize == sizeof(uint32_t)) {
+		memcpy(&hash_size, val.dptr, sizeof(uint32_t));
+	}
+	if (val.dptr) {
+		free(val.dptr);
+	}
+
+	return hash_size;
+}
+
+/*
+  choose the number of hash chains for a new volatile database
+ */
+static uint32_t ctdb_db_hash_size(struct ctdb_context *ctdb,
+				  const char *db_name)
+{
+	uint32_t hash_size = ctdb->tunable.database_hash_size;
+	uint32_t hint;
+
+	if (ctdb->tunable.database_hash_size_max <= hash_size) {
+		return hash_size;
+	}
+
+	hint = ctdb_db_load_hash_size(ctdb, db_name);
+	if (hint > ctdb->tunable.database_hash_size_max) {
+		hint = ctdb->tunable.database_hash_size_max;
+	}
+	if (hint > hash_size) {
+		DEBUG(DEBUG_NOTICE,("Using %u hash chains for database %s\n",
+				    hint, db_name));
+		hash_size = hint;
+	}
+
+	return hash_size;
+}
+
+/*
+  record how many records a volatile database holds.  tdb can not
+  grow the hash table of a database other processes have open, so if
+  the chains get too long the number of chains is doubled the next
+  time the database is created.
+ */
+void ctdb_db_note_record_count(struct ctdb_db_context *ctdb_db,
+			       uint32_t count)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	uint32_t hash_size_max = ctdb->tunable.database_hash_size_max;
+	uint32_t hash_size, old_size;
+	TDB_DATA key, val;
+
+	if (ctdb_db->persistent || ctdb->db_hash_sizes == NULL) {
+		return;
+	}
+
+	old_size = ctdb_db_load_hash_size(ctdb, ctdb_db->db_name);
+	hash_size = tdb_hash_size(ctdb_db->ltdb->tdb);
+	if (old_size > hash_size) {
+		hash_size = old_size;
+	}
+
+	while (count / DB_HASH_CHAIN_TARGET > hash_size &&
+	       hash_size < hash_size_max) {
+		hash_size = hash_size * 2 + 1;
+	}
+	if (hash_size > hash_size_max) {
+		hash_size = hash_size_max;
+	}
+	if (hash_size <= old_size ||
+	    hash_size <= tdb_hash_size(ctdb_db->ltdb->tdb)) {
+		return;
+	}
+
+	key.dptr = discard_const_p(uint8_t, ctdb_db->db_name);
+	key.dsize = strlen(ctdb_db->db_name);
+	val.dptr = (uint8_t *)&hash_size;
+	val.dsize = sizeof(hash_size);
+
+	if (tdb_store(ctdb->db_hash_sizes->tdb, key, val, TDB_REPLACE) != 0) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to store hash size "
+				 "for database %s\n", ctdb_db->db_name));
+		return;
+	}
+
+	DEBUG(DEBUG_NOTICE,("Database %s holds %u records in %u hash chains. "
+			    "Using %u hash chains when it is next created\n",
+			    ctdb_db->db_name, count,
+			    tdb_hash_size(ctdb_db->ltdb->tdb), hash_size));
+}
+
 /*
   attach to a database, handling both persistent and non-persistent databases
   return 0 on success, -1 on failure
  */
 static int ctdb_local_attach(struct ctdb_context *ctdb, const char *db_name,
 			     bool persistent, const char *unhealthy_reason,
-			     bool jenkinshash)
+			     bool jenkinshash, bool mutexes)
 {
 	struct ctdb_db_context *ctdb_db, *tmp_db;
 	int ret;
 	struct TDB_DATA key;
 	unsigned tdb_flags;
+	uint32_t hash_size;
 	int mode = 0600;
 	int remaining_tries = 0;
 
@@ -764,7 +879,7 @@ static int ctdb_local_attach(struct ctdb_context *ctdb, const char *db_name,
 	ctdb_db->persistent = persistent;
 
 	if (!ctdb_db->persistent) {
-		ctdb_db->delete_queue = trbt_create(ctdb_db, 0);
+		ctdb_db->delete_queue = key_index_create(ctdb_db);
 		if (ctdb_db->delete_queue == NULL) {
 			CTDB_NO_MEMORY(ctdb, ctdb_db->delete_queue);
 		}
@@ -836,10 +951,22 @@ static int ctdb_local_attach(struct ctdb_context *ctdb, const char *db_name,
 	if (jenkinshash) {
 		tdb_flags |= TDB_INCOMPATIBLE_HASH;
 	}
+	if (!persistent && mutexes) {
+		if (tdb_runtime_check_for_robust_mutexes()) {
+			tdb_flags |= TDB_MUTEX_LOCKING;
+		} else {
+			DEBUG(DEBUG_WARNING,("No robust mutexes, using fcntl "
+					     "locks for database %s\n",
+					     db_name));
+		}
+	}
+
+	hash_size = persistent ? ctdb->tunable.database_hash_size :
+			ctdb_db_hash_size(ctdb, db_name);
 
 again:
 	ctdb_db->ltdb = tdb_wrap_open(ctdb, ctdb_db->db_path, 
-				      ctdb->tunable.database_hash_size, 
+				      hash_size, 
 				      tdb_flags, 
 				      O_CREAT|O_RDWR, mode);
 	if (ctdb_db->ltdb == NULL) {
@@ -942,9 +1069,9 @@ again:
 	   fetch-lock in-flight for so we can defer any additional calls
 	   for the same record.
 	 */
-	ctdb_db->deferred_fetch = trbt_create(ctdb_db, 0);
+	ctdb_db->deferred_fetch = key_index_create(ctdb_db);
 	if (ctdb_db->deferred_fetch == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to create deferred fetch rb tree for ctdb database\n"));
+		DEBUG(DEBUG_ERR,("Failed to create deferred fetch index for ctdb database\n"));
 		talloc_free(ctdb_db);
 		return -1;
 	}
@@ -996,6 +1123,10 @@ again:
 	}
 
 
+	/* running workers and call shards do not have this database */
+	ctdb_workers_restart(ctdb);
+	ctdb_call_shards_restart(ctdb);
+
 	DEBUG(DEBUG_NOTICE,("Attached to database '%s' with flags 0x%x\n",
 			    ctdb_db->db_path, tdb_flags));
 
@@ -1117,7 +1248,7 @@ int32_t ctdb_control_db_attach(struct ctdb_context *ctdb, TDB_DATA indata,
 	   only allow a subset of those on the database in ctdb. Note
 	   that tdb_flags is passed in via the (otherwise unused)
 	   srvid to the attach control */
-	tdb_flags &= (TDB_NOSYNC|TDB_INCOMPATIBLE_HASH);
+	tdb_flags &= (TDB_NOSYNC|TDB_INCOMPATIBLE_HASH|TDB_MUTEX_LOCKING);
 
 	/* see if we already have this name */
 	db = ctdb_db_handle(ctdb, db_name);
@@ -1130,11 +1261,15 @@ int32_t ctdb_control_db_attach(struct ctdb_context *ctdb, TDB_DATA indata,
 		}
 		outdata->dptr  = (uint8_t *)&db->db_id;
 		outdata->dsize = sizeof(db->db_id);
-		tdb_add_flags(db->ltdb->tdb, tdb_flags);
+		tdb_add_flags(db->ltdb->tdb, tdb_flags & ~TDB_MUTEX_LOCKING);
 		return 0;
 	}
 
-	if (ctdb_local_attach(ctdb, db_name, persistent, NULL, (tdb_flags&TDB_INCOMPATIBLE_HASH)?true:false) != 0) {
+	/* mutex locking is only decided when the database is created */
+	if (ctdb_local_attach(ctdb, db_name, persistent, NULL,
+			      (tdb_flags&TDB_INCOMPATIBLE_HASH)?true:false,
+			      (tdb_flags&TDB_MUTEX_LOCKING) ||
+			      ctdb->tunable.mutex_enabled) != 0) {
 		return -1;
 	}
 
@@ -1145,7 +1280,7 @@ int32_t ctdb_control_db_attach(struct ctdb_context *ctdb, TDB_DATA indata,
 	}
 
 	/* remember the flags the client has specified */
-	tdb_add_flags(db->ltdb->tdb, tdb_flags);
+	tdb_add_flags(db->ltdb->tdb, tdb_flags & ~TDB_MUTEX_LOCKING);
 
 	outdata->dptr  = (uint8_t *)&db->db_id;
 	outdata->dsize = sizeof(db->db_id);
@@ -1213,7 +1348,7 @@ static int ctdb_attach_persistent(struct ctdb_context *ctdb,
 		}
 		p[4] = 0;
 
-		if (ctdb_local_attach(ctdb, s, true, unhealthy_reason, 0) != 0) {
+		if (ctdb_local_attach(ctdb, s, true, unhealthy_reason, 0, false) != 0) {
 			DEBUG(DEBUG_ERR,("Failed to attach to persistent database '%s'\n", de->d_name));
 			closedir(d);
 			talloc_free(s);
@@ -1228,6 +1363,49 @@ static int ctdb_attach_persistent(struct ctdb_context *ctdb,
 	return 0;
 }
 
+/*
+  open the database that remembers the hash sizes of volatile
+  databases.  It only holds hints, so it is recreated if it is broken
+ */
+static int ctdb_attach_db_hash_sizes(struct ctdb_context *ctdb)
+{
+	char *path;
+	int tdb_flags = TDB_DISALLOW_NESTING;
+
+	path = talloc_asprintf(ctdb, "%s/%s.%u",
+			       ctdb->db_directory_state,
+			       DB_HASH_SIZES_TDB,
+			       ctdb->pnn);
+	if (path == NULL) {
+		DEBUG(DEBUG_CRIT,(__location__ " talloc_asprintf() failed\n"));
+		return -1;
+	}
+
+again:
+	ctdb->db_hash_sizes = tdb_wrap_open(ctdb, path, 0, tdb_flags,
+					    O_CREAT | O_RDWR, 0600);
+	if (ctdb->db_hash_sizes != NULL &&
+	    tdb_check(ctdb->db_hash_sizes->tdb, NULL, NULL) != 0) {
+		talloc_free(ctdb->db_hash_sizes);
+		ctdb->db_hash_sizes = NULL;
+	}
+	if (ctdb->db_hash_sizes == NULL) {
+		if (tdb_flags & TDB_CLEAR_IF_FIRST) {
+			DEBUG(DEBUG_CRIT,("Failed to open tdb '%s': %d - %s\n",
+					  path, errno, strerror(errno)));
+			talloc_free(path);
+			return -1;
+		}
+		DEBUG(DEBUG_ERR,("Failed to open tdb '%s' - retrying after "
+				 "CLEAR_IF_FIRST\n", path));
+		tdb_flags |= TDB_CLEAR_IF_FIRST;
+		goto again;
+	}
+
+	talloc_free(path);
+	return 0;
+}
+
 int ctdb_attach_databases(struct ctdb_context *ctdb)
 {
 	int ret;
@@ -1337,6 +1515,12 @@ again:
 	}
 	talloc_free(persistent_health_path);
 
+	ret = ctdb_attach_db_hash_sizes(ctdb);
+	if (ret != 0) {
+		talloc_free(unhealthy_reason);
+		return ret;
+	}
+
 	ret = ctdb_attach_persistent(ctdb, unhealthy_reason);
 	talloc_free(unhealthy_reason);
 	if (ret != 0) {
@@ -1447,6 +1631,49 @@ int32_t ctdb_control_set_db_priority(struct ctdb_context *ctdb, TDB_DATA indata)
 	return 0;
 }
 
+/*
+  choose whether calls with a given id are run at the dmaster of a
+  record instead of migrating the record to the caller. Only functions
+  that the daemon itself has registered can be run there
+ */
+int32_t ctdb_control_set_db_ship_call(struct ctdb_context *ctdb, TDB_DATA indata)
+{
+	struct ctdb_db_ship_call *ship_call = (struct ctdb_db_ship_call *)indata.dptr;
+	struct ctdb_db_context *ctdb_db;
+	struct ctdb_registered_call *fn;
+
+	ctdb_db = find_ctdb_db(ctdb, ship_call->db_id);
+	if (!ctdb_db) {
+		DEBUG(DEBUG_ERR,("Unknown db_id 0x%x in ctdb_set_db_ship_call\n", ship_call->db_id));
+		return -1;
+	}
+
+	if (ctdb_db->persistent) {
+		DEBUG(DEBUG_ERR,("Trying to ship calls for persistent database %s\n",
+				 ctdb_db->db_name));
+		return -1;
+	}
+
+	for (fn=ctdb_db->calls; fn; fn=fn->next) {
+		if (fn->id == ship_call->call_id) {
+			break;
+		}
+	}
+	if (fn == NULL) {
+		DEBUG(DEBUG_ERR,("Call id 0x%08x is not registered for db %s\n",
+				 ship_call->call_id, ctdb_db->db_name));
+		return -1;
+	}
+
+	fn->ship = (ship_call->ship != 0);
+
+	DEBUG(DEBUG_NOTICE,("%s shipping of call 0x%08x for db %s\n",
+			    fn->ship ? "Enabled" : "Disabled",
+			    fn->id, ctdb_db->db_name));
+
+	return 0;
+}
+
 
 int ctdb_set_db_sticky(struct ctdb_context *ctdb, struct ctdb_db_context *ctdb_db)
 {
@@ -1459,7 +1686,8 @@ int ctdb_set_db_sticky(struct ctdb_context *ctdb, struct ctdb_db_context *ctdb_d
 		return -1;
 	}
 
-	ctdb_db->sticky_records = trbt_create(ctdb_db, 0);
+	ctdb_db->sticky_records = key_index_create(ctdb_db);
+	CTDB_NO_MEMORY(ctdb, ctdb_db->sticky_records);
 
 	ctdb_db->sticky = true;
 
@@ -1474,6 +1702,7 @@ int32_t ctdb_control_get_db_statistics(struct ctdb_context *ctdb,
 {
 	struct ctdb_db_context *ctdb_db;
 	struct ctdb_db_statistics *stats;
+	struct ctdb_db_statistics current;
 	int i;
 	int len;
 	char *ptr;
@@ -1484,9 +1713,12 @@ int32_t ctdb_control_get_db_statistics(struct ctdb_context *ctdb,
 		return -1;
 	}
 
+	current = ctdb_db->statistics;
+	ctdb_db_hot_keys_get(ctdb_db, &current);
+
 	len = offsetof(struct ctdb_db_statistics, hot_keys_wire);
-	for (i = 0; i < MAX_HOT_KEYS; i++) {
-		len += ctdb_db->statistics.hot_keys[i].key.dsize;
+	for (i = 0; i < current.num_hot_keys; i++) {
+		len += current.hot_keys[i].key.dsize;
 	}
 
 	stats = talloc_size(outdata, len);
@@ -1495,15 +1727,13 @@ int32_t ctdb_control_get_db_statistics(struct ctdb_context *ctdb,
 		return -1;
 	}
 
-	*stats = ctdb_db->statistics;
-
-	stats->num_hot_keys = MAX_HOT_KEYS;
+	memcpy(stats, &current, offsetof(struct ctdb_db_statistics, hot_keys_wire));
 
 	ptr = &stats->hot_keys_wire[0];
-	for (i = 0; i < MAX_HOT_KEYS; i++) {
-		memcpy(ptr, ctdb_db->statistics.hot_keys[i].key.dptr,
-		       ctdb_db->statistics.hot_keys[i].key.dsize);
-		ptr += ctdb_db->statistics.hot_keys[i].key.dsize;
+	for (i = 0; i < current.num_hot_keys; i++) {
+		memcpy(ptr, current.hot_keys[i].key.dptr,
+		       current.hot_keys[i].key.dsize);
+		ptr += current.hot_keys[i].key.dsize;
 	}
 
 	outdata->dptr  = (uint8_t *)stats;
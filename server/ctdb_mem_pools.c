@@ -0,0 +1,149 @@
+/*
+   size classed talloc pools for short lived objects
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "../include/ctdb_private.h"
+
+/*
+  Transport packets, call state and lock requests are allocated and
+  freed for every call. They have to stay ordinary talloc chunks, as
+  their users hang other memory off them, steal them and free them, so
+  they cannot come from a free list of our own. Instead they are carved
+  out of talloc pools, one pool per size class, which is little more
+  than bumping a pointer. Children allocated off such an object come
+  from the same pool.
+
+  talloc reuses the memory of a pool once everything allocated from it
+  has been freed, which is what request/reply traffic mostly does, and
+  reuses the last object in a pool as soon as it is freed. When a pool
+  has no room left we let go of it and start a new one. talloc frees a
+  released pool when the last object allocated from it is freed.
+
+  Objects larger than the largest class are allocated as usual.
+ */
+
+#define CTDB_MEM_POOL_CLASSES 3
+
+static const struct {
+	size_t max_size;
+	size_t pool_size;
+} mem_pool_sizes[CTDB_MEM_POOL_CLASSES] = {
+	{   512,   64*1024 },
+	{  4096,  256*1024 },
+	{ 32768, 1024*1024 },
+};
+
+struct ctdb_mem_pools {
+	void *pools[CTDB_MEM_POOL_CLASSES];
+};
+
+/*
+  let go of the current pool of a class and start a new one
+ */
+static void *mem_pool_renew(struct ctdb_context *ctdb,
+			    struct ctdb_mem_pools *mp, int i)
+{
+	talloc_free(mp->pools[i]);
+
+	mp->pools[i] = talloc_pool(mp, mem_pool_sizes[i].pool_size);
+	if (mp->pools[i] != NULL) {
+		CTDB_INCREMENT_STAT(ctdb, mem_pools.pools);
+	}
+
+	return mp->pools[i];
+}
+
+static bool mem_pool_contains(void *pool, int i, void *ptr)
+{
+	return (char *)ptr > (char *)pool &&
+	       (char *)ptr < (char *)pool + mem_pool_sizes[i].pool_size;
+}
+
+/*
+  allocate size bytes on mem_ctx, from a pool if the object is small
+  enough
+ */
+void *_ctdb_mem_pool_alloc(struct ctdb_context *ctdb, TALLOC_CTX *mem_ctx,
+			   size_t size, const char *name)
+{
+	struct ctdb_mem_pools *mp;
+	void *ptr;
+	int i;
+
+	CTDB_INCREMENT_STAT(ctdb, mem_pools.allocs);
+
+	for (i=0; i<CTDB_MEM_POOL_CLASSES; i++) {
+		if (size <= mem_pool_sizes[i].max_size) {
+			break;
+		}
+	}
+
+	if (i == CTDB_MEM_POOL_CLASSES || ctdb->tunable.mem_pools == 0) {
+		goto plain;
+	}
+
+	if (ctdb->mem_pools == NULL) {
+		ctdb->mem_pools = talloc_zero(ctdb, struct ctdb_mem_pools);
+		if (ctdb->mem_pools == NULL) {
+			goto plain;
+		}
+	}
+	mp = ctdb->mem_pools;
+
+	if (mp->pools[i] == NULL && mem_pool_renew(ctdb, mp, i) == NULL) {
+		goto plain;
+	}
+
+	ptr = talloc_size(mp->pools[i], size);
+	if (ptr != NULL && !mem_pool_contains(mp->pools[i], i, ptr)) {
+		/* talloc fell back to malloc, the pool is full */
+		talloc_free(ptr);
+		if (mem_pool_renew(ctdb, mp, i) == NULL) {
+			goto plain;
+		}
+		ptr = talloc_size(mp->pools[i], size);
+	}
+	if (ptr == NULL) {
+		return NULL;
+	}
+
+	if (mem_pool_contains(mp->pools[i], i, ptr)) {
+		CTDB_INCREMENT_STAT(ctdb, mem_pools.hits);
+	}
+
+	talloc_steal(mem_ctx, ptr);
+	talloc_set_name_const(ptr, name);
+	return ptr;
+
+plain:
+	ptr = talloc_size(mem_ctx, size);
+	if (ptr != NULL) {
+		talloc_set_name_const(ptr, name);
+	}
+	return ptr;
+}
+
+void *_ctdb_mem_pool_zero(struct ctdb_context *ctdb, TALLOC_CTX *mem_ctx,
+			  size_t size, const char *name)
+{
+	void *ptr = _ctdb_mem_pool_alloc(ctdb, mem_ctx, size, name);
+
+	if (ptr != NULL) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
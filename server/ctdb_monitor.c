@@ -21,6 +21,7 @@
 #include "includes.h"
 #include "system/filesys.h"
 #include "system/wait.h"
+#include "system/time.h"
 #include "../include/ctdb_private.h"
 
 struct ctdb_monitor_state {
@@ -171,6 +172,8 @@ after_change_status:
 		return;
 	}
 
+	ctdb_state_changed(ctdb);
+
 	c.new_flags = node->flags;
 
 	data.dptr = (uint8_t *)&c;
@@ -486,6 +489,8 @@ int32_t ctdb_control_modflags(struct ctdb_context *ctdb, TDB_DATA indata)
 		ctdb->recovery_mode = CTDB_RECOVERY_ACTIVE;
 	}
 
+	ctdb_state_changed(ctdb);
+
 	/* tell the recovery daemon something has changed */
 	ctdb_daemon_send_message(ctdb, ctdb->pnn,
 				 CTDB_SRVID_SET_NODE_FLAGS, indata);
@@ -516,3 +521,54 @@ bool ctdb_stopped_monitoring(struct ctdb_context *ctdb)
 {
 	return (ctdb->monitor->monitor_context == NULL ? true : false);
 }
+
+static void ctdb_state_changed_announce(struct tevent_context *ev,
+					struct tevent_immediate *im,
+					void *private_data)
+{
+	struct ctdb_context *ctdb = talloc_get_type(private_data, struct ctdb_context);
+	struct ctdb_state_change c;
+	TDB_DATA data;
+
+	c.pnn        = ctdb->pnn;
+	c.generation = ctdb->state_generation;
+
+	data.dptr  = (uint8_t *)&c;
+	data.dsize = sizeof(c);
+
+	ctdb_daemon_send_message(ctdb, CTDB_BROADCAST_CONNECTED,
+				 CTDB_SRVID_STATE_CHANGED, data);
+}
+
+/*
+  something the recovery daemons check on every pass of their main
+  loop has changed on this node: the node flags, the vnnmap, the
+  recovery mode or master, the capabilities, the tunables, the debug
+  level or the recovery lock file. Bump the state generation and tell
+  all connected recovery daemons, so that they only fetch the state of
+  nodes that announced a change. The announcement is sent once the
+  current event has been handled, so a burst of changes is announced
+  only once.
+ */
+void ctdb_state_changed(struct ctdb_context *ctdb)
+{
+	/* start from the clock so that a restarted daemon does not
+	   announce a generation the recovery daemons already have */
+	if (ctdb->state_generation == 0) {
+		ctdb->state_generation = (uint32_t)time(NULL);
+	}
+	ctdb->state_generation++;
+
+	ctdb_call_shards_update(ctdb);
+
+	if (ctdb->state_change_im == NULL) {
+		ctdb->state_change_im = tevent_create_immediate(ctdb);
+		if (ctdb->state_change_im == NULL) {
+			DEBUG(DEBUG_ERR,(__location__ " Failed to allocate state change announcement\n"));
+			return;
+		}
+	}
+
+	tevent_schedule_immediate(ctdb->state_change_im, ctdb->ev,
+				  ctdb_state_changed_announce, ctdb);
+}
@@ -0,0 +1,132 @@
+/*
+   ctdb cluster mutex helper using fcntl locks on a cluster filesystem
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "system/select.h"
+
+static char *progname = NULL;
+
+static void send_result(char result)
+{
+	if (write(STDOUT_FILENO, &result, 1) != 1) {
+		exit(1);
+	}
+}
+
+static char fcntl_mutex_lock(const char *file, int *outfd)
+{
+	int fd;
+	struct flock lock;
+
+	fd = open(file, O_RDWR|O_CREAT, 0600);
+	if (fd == -1) {
+		fprintf(stderr, "%s: Unable to open %s - (%s)\n",
+			progname, file, strerror(errno));
+		return '3';
+	}
+
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 1;
+	lock.l_pid = 0;
+
+	if (fcntl(fd, F_SETLK, &lock) != 0) {
+		int saved_errno = errno;
+		close(fd);
+		if (saved_errno == EACCES || saved_errno == EAGAIN) {
+			/* Lock contention, fail silently */
+			return '1';
+		}
+
+		fprintf(stderr, "%s: Failed to get lock on '%s' - (%s)\n",
+			progname, file, strerror(saved_errno));
+		return '3';
+	}
+
+	*outfd = fd;
+
+	return '0';
+}
+
+int main(int argc, char *argv[])
+{
+	const char *file;
+	const char *lease;
+	unsigned int interval = 5;
+	pid_t ppid;
+	char result;
+	int fd = -1;
+
+	progname = argv[0];
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <file>\n", progname);
+		exit(1);
+	}
+
+	file = argv[1];
+
+	/* renew often enough that a single slow renewal does not
+	   lose the lease */
+	lease = getenv("CTDB_RECLOCK_LEASE_TIME");
+	if (lease != NULL && atoi(lease) > 0) {
+		interval = MAX(atoi(lease) / 3, 1);
+	}
+
+	ppid = getppid();
+
+	result = fcntl_mutex_lock(file, &fd);
+	send_result(result);
+	if (result != '0') {
+		return 0;
+	}
+
+	/* The lock is released when we exit. Renew the lease as long
+	   as the lock file is still readable and our parent is alive.
+	   Our stdout reports an error as soon as the parent closes the
+	   other end of the pipe, so we do not hang on to the lock */
+	while (getppid() == ppid) {
+		struct pollfd pfd;
+		char c;
+		int ret;
+
+		pfd.fd = STDOUT_FILENO;
+		pfd.events = 0;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, interval * 1000);
+		if (ret == -1 && errno != EINTR) {
+			exit(1);
+		}
+		if (ret > 0) {
+			/* parent has gone away */
+			break;
+		}
+
+		if (pread(fd, &c, 1, 0) == -1) {
+			fprintf(stderr, "%s: Failed to read '%s' - (%s)\n",
+				progname, file, strerror(errno));
+			exit(1);
+		}
+
+		send_result('0');
+	}
+
+	return 0;
+}
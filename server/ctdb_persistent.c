@@ -75,6 +75,7 @@ static void ctdb_persistent_callback(struct ctdb_context *ctdb,
 		 * for the trans3_commit control to the client.
 		 */
 		ctdb->recovery_mode = CTDB_RECOVERY_ACTIVE;
+		ctdb_state_changed(ctdb);
 		return;
 	}
 
@@ -73,6 +73,10 @@ ctdb_control_setvnnmap(struct ctdb_context *ctdb, uint32_t opcode, TDB_DATA inda
 	CTDB_NO_MEMORY(ctdb, ctdb->vnn_map->map);
 
 	memcpy(ctdb->vnn_map->map, map->map, sizeof(uint32_t)*map->size);
+	ctdb_state_changed(ctdb);
+
+	/* call shards find the lmaster in the old map */
+	ctdb_call_shards_restart(ctdb);
 
 	return 0;
 }
@@ -231,6 +235,10 @@ ctdb_reload_nodes_event(struct event_context *ev, struct timed_event *te,
 		}
 	}
 
+	/* workers and call shards still use the old node list */
+	ctdb_workers_restart(ctdb);
+	ctdb_call_shards_restart(ctdb);
+
 	/* tell the recovery daemon to reaload the nodes file too */
 	ctdb_daemon_send_message(ctdb, ctdb->pnn, CTDB_SRVID_RELOAD_NODES, tdb_null);
 
@@ -262,19 +270,13 @@ struct pulldb_data {
 	bool failed;
 };
 
-static int traverse_pulldb(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data, void *p)
+static int traverse_pulldb(struct ctdb_rec_data *rec, void *p)
 {
 	struct pulldb_data *params = (struct pulldb_data *)p;
-	struct ctdb_rec_data *rec;
 	struct ctdb_context *ctdb = params->ctdb;
 	struct ctdb_db_context *ctdb_db = params->ctdb_db;
 
 	/* add the record to the blob */
-	rec = ctdb_marshall_record(params->pulldata, 0, key, NULL, data);
-	if (rec == NULL) {
-		params->failed = true;
-		return -1;
-	}
 	if (params->len + rec->length >= params->allocated_len) {
 		params->allocated_len = rec->length + params->len + ctdb->tunable.pulldb_preallocation_size;
 		params->pulldata = talloc_realloc_size(NULL, params->pulldata, params->allocated_len);
@@ -291,8 +293,6 @@ static int traverse_pulldb(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data,
 		DEBUG(DEBUG_ERR,("Data record in %s is big. Record size is %d bytes\n", ctdb_db->db_name, (int)rec->length));
 	}
 
-	talloc_free(rec);
-
 	return 0;
 }
 
@@ -342,7 +342,8 @@ int32_t ctdb_control_pull_db(struct ctdb_context *ctdb, TDB_DATA indata, TDB_DAT
 		return -1;
 	}
 
-	if (tdb_traverse_read(ctdb_db->ltdb->tdb, traverse_pulldb, &params) == -1) {
+	if (ctdb_traverse_parallel(ctdb, ctdb_db->ltdb->tdb, NULL,
+				   traverse_pulldb, &params) == -1) {
 		DEBUG(DEBUG_ERR,(__location__ " Failed to get traverse db '%s'\n", ctdb_db->db_name));
 		ctdb_lockall_unmark_prio(ctdb, ctdb_db->priority);
 		talloc_free(params.pulldata);
@@ -354,6 +355,8 @@ int32_t ctdb_control_pull_db(struct ctdb_context *ctdb, TDB_DATA indata, TDB_DAT
 	outdata->dptr = (uint8_t *)params.pulldata;
 	outdata->dsize = params.len;
 
+	ctdb_db_note_record_count(ctdb_db, params.pulldata->count);
+
 	if (ctdb->tunable.db_record_count_warn != 0 && params.pulldata->count > ctdb->tunable.db_record_count_warn) {
 		DEBUG(DEBUG_ERR,("Database %s is big. Contains %d records\n", ctdb_db->db_name, params.pulldata->count));
 	}
@@ -462,95 +465,60 @@ struct ctdb_set_recmode_state {
 	struct ctdb_context *ctdb;
 	struct ctdb_req_control *c;
 	uint32_t recmode;
-	int fd[2];
-	struct timed_event *te;
-	struct fd_event *fde;
-	pid_t child;
-	struct timeval start_time;
 };
 
-/*
-  called if our set_recmode child times out. this would happen if
-  ctdb_recovery_lock() would block.
- */
-static void ctdb_set_recmode_timeout(struct event_context *ev, struct timed_event *te, 
-					 struct timeval t, void *private_data)
-{
-	struct ctdb_set_recmode_state *state = talloc_get_type(private_data, 
-					   struct ctdb_set_recmode_state);
-
-	/* we consider this a success, not a failure, as we failed to
-	   set the recovery lock which is what we wanted.  This can be
-	   caused by the cluster filesystem being very slow to
-	   arbitrate locks immediately after a node failure.	   
-	 */
-	DEBUG(DEBUG_ERR,(__location__ " set_recmode child process hung/timedout CFS slow to grant locks? (allowing recmode set anyway)\n"));
-	state->ctdb->recovery_mode = state->recmode;
-	ctdb_request_control_reply(state->ctdb, state->c, NULL, 0, NULL);
-	talloc_free(state);
-}
-
-
-/* when we free the recmode state we must kill any child process.
+/* this is called when the cluster mutex helper has tried to take the
+   recovery lock. We should not be able to get it, as it should be held
+   by the recovery daemon on the recovery master
 */
-static int set_recmode_destructor(struct ctdb_set_recmode_state *state)
+static void set_recmode_handler(char status, double latency,
+				void *private_data)
 {
-	double l = timeval_elapsed(&state->start_time);
+	struct ctdb_set_recmode_state *state = talloc_get_type_abort(
+		private_data, struct ctdb_set_recmode_state);
+	struct ctdb_context *ctdb = state->ctdb;
+
+	CTDB_UPDATE_RECLOCK_LATENCY(ctdb, "daemon reclock", reclock.ctdbd, latency);
+
+	switch (status) {
+	case '0':
+		DEBUG(DEBUG_CRIT,("ERROR: recovery lock %s not locked when recovering!\n",
+				  ctdb->recovery_lock_file));
+		ctdb_request_control_reply(ctdb, state->c, NULL, -1,
+					   "managed to lock reclock file from inside daemon");
+		talloc_free(state);
+		return;
 
-	CTDB_UPDATE_RECLOCK_LATENCY(state->ctdb, "daemon reclock", reclock.ctdbd, l);
+	case '1':
+		/* held by the recovery master, as it should be */
+		break;
 
-	if (state->fd[0] != -1) {
-		state->fd[0] = -1;
-	}
-	if (state->fd[1] != -1) {
-		state->fd[1] = -1;
-	}
-	ctdb_kill(state->ctdb, state->child, SIGKILL);
-	return 0;
-}
-
-/* this is called when the client process has completed ctdb_recovery_lock()
-   and has written data back to us through the pipe.
-*/
-static void set_recmode_handler(struct event_context *ev, struct fd_event *fde, 
-			     uint16_t flags, void *private_data)
-{
-	struct ctdb_set_recmode_state *state= talloc_get_type(private_data, 
-					     struct ctdb_set_recmode_state);
-	char c = 0;
-	int ret;
+	case '2':
+		/* we consider this a success, not a failure, as we failed to
+		   set the recovery lock which is what we wanted.  This can be
+		   caused by the cluster filesystem being very slow to
+		   arbitrate locks immediately after a node failure.
+		 */
+		DEBUG(DEBUG_ERR,(__location__ " set_recmode lock helper timed out, CFS slow to grant locks? (allowing recmode set anyway)\n"));
+		break;
 
-	/* we got a response from our child process so we can abort the
-	   timeout.
-	*/
-	talloc_free(state->te);
-	state->te = NULL;
-
-
-	/* read the childs status when trying to lock the reclock file.
-	   child wrote 0 if everything is fine and 1 if it did manage
-	   to lock the file, which would be a problem since that means
-	   we got a request to exit from recovery but we could still lock
-	   the file   which at this time SHOULD be locked by the recovery
-	   daemon on the recmaster
-	*/		
-	ret = read(state->fd[0], &c, 1);
-	if (ret != 1 || c != 0) {
-		ctdb_request_control_reply(state->ctdb, state->c, NULL, -1, "managed to lock reclock file from inside daemon");
-		talloc_free(state);
-		return;
+	default:
+		DEBUG(DEBUG_ERR,(__location__ " set_recmode unable to check the recovery lock (allowing recmode set anyway)\n"));
+		break;
 	}
 
-	state->ctdb->recovery_mode = state->recmode;
+	ctdb->recovery_mode = state->recmode;
+	ctdb_state_changed(ctdb);
 
 	/* release any deferred attach calls from clients */
 	if (state->recmode == CTDB_RECOVERY_NORMAL) {
-		ctdb_process_deferred_attach(state->ctdb);
+		ctdb_process_deferred_attach(ctdb);
 	}
 
-	ctdb_request_control_reply(state->ctdb, state->c, NULL, 0, NULL);
+	ctdb_request_control_reply(ctdb, state->c, NULL, 0, NULL);
+
+	/* this also kills the helper, releasing the lock if it got it */
 	talloc_free(state);
-	return;
 }
 
 static void
@@ -591,9 +559,8 @@ int32_t ctdb_control_set_recmode(struct ctdb_context *ctdb,
 				 const char **errormsg)
 {
 	uint32_t recmode = *(uint32_t *)indata.dptr;
-	int i, ret;
+	int i;
 	struct ctdb_set_recmode_state *state;
-	pid_t parent = getpid();
 
 	/* if we enter recovery but stay in recovery for too long
 	   we will eventually drop all our ip addresses
@@ -615,6 +582,7 @@ int32_t ctdb_control_set_recmode(struct ctdb_context *ctdb,
 	if (recmode != CTDB_RECOVERY_NORMAL ||
 	    ctdb->recovery_mode != CTDB_RECOVERY_ACTIVE) {
 		ctdb->recovery_mode = recmode;
+		ctdb_state_changed(ctdb);
 		return 0;
 	}
 
@@ -627,153 +595,45 @@ int32_t ctdb_control_set_recmode(struct ctdb_context *ctdb,
 		}
 	}
 
-	state = talloc(ctdb, struct ctdb_set_recmode_state);
-	CTDB_NO_MEMORY(ctdb, state);
-
-	state->start_time = timeval_current();
-	state->fd[0] = -1;
-	state->fd[1] = -1;
-
 	/* release any deferred attach calls from clients */
 	if (recmode == CTDB_RECOVERY_NORMAL) {
 		ctdb_process_deferred_attach(ctdb);
 	}
 
-	if (ctdb->tunable.verify_recovery_lock == 0) {
+	if (ctdb->tunable.verify_recovery_lock == 0 ||
+	    ctdb->recovery_lock_file == NULL) {
 		/* dont need to verify the reclock file */
 		ctdb->recovery_mode = recmode;
+		ctdb_state_changed(ctdb);
 		return 0;
 	}
 
-	/* For the rest of what needs to be done, we need to do this in
-	   a child process since 
-	   1, the call to ctdb_recovery_lock() can block if the cluster
-	      filesystem is in the process of recovery.
-	*/
-	ret = pipe(state->fd);
-	if (ret != 0) {
-		talloc_free(state);
-		DEBUG(DEBUG_CRIT,(__location__ " Failed to open pipe for set_recmode child\n"));
-		return -1;
-	}
-
-	state->child = ctdb_fork(ctdb);
-	if (state->child == (pid_t)-1) {
-		close(state->fd[0]);
-		close(state->fd[1]);
-		talloc_free(state);
-		return -1;
-	}
-
-	if (state->child == 0) {
-		char cc = 0;
-		close(state->fd[0]);
-
-		ctdb_set_process_name("ctdb_recmode");
-		debug_extra = talloc_asprintf(NULL, "set_recmode:");
-		/* we should not be able to get the lock on the reclock file, 
-		  as it should  be held by the recovery master 
-		*/
-		if (ctdb_recovery_lock(ctdb, false)) {
-			DEBUG(DEBUG_CRIT,("ERROR: recovery lock file %s not locked when recovering!\n", ctdb->recovery_lock_file));
-			cc = 1;
-		}
-
-		write(state->fd[1], &cc, 1);
-		/* make sure we die when our parent dies */
-		while (ctdb_kill(ctdb, parent, 0) == 0 || errno != ESRCH) {
-			sleep(5);
-			write(state->fd[1], &cc, 1);
-		}
-		_exit(0);
-	}
-	close(state->fd[1]);
-	set_close_on_exec(state->fd[0]);
-
-	state->fd[1] = -1;
-
-	talloc_set_destructor(state, set_recmode_destructor);
-
-	DEBUG(DEBUG_DEBUG, (__location__ " Created PIPE FD:%d for setrecmode\n", state->fd[0]));
-
-	state->te = event_add_timed(ctdb->ev, state, timeval_current_ofs(5, 0),
-				    ctdb_set_recmode_timeout, state);
+	state = talloc(ctdb, struct ctdb_set_recmode_state);
+	CTDB_NO_MEMORY(ctdb, state);
 
-	state->fde = event_add_fd(ctdb->ev, state, state->fd[0],
-				EVENT_FD_READ,
-				set_recmode_handler,
-				(void *)state);
+	state->ctdb    = ctdb;
+	state->recmode = recmode;
+	state->c       = NULL;
 
-	if (state->fde == NULL) {
+	/* The lock helper runs in its own process since taking the
+	   lock can block if the cluster filesystem is in the process
+	   of recovery.
+	*/
+	if (ctdb_cluster_mutex(state, ctdb, ctdb->recovery_lock_file, 5,
+			       set_recmode_handler, state,
+			       NULL, NULL) == NULL) {
+		DEBUG(DEBUG_CRIT,(__location__ " Failed to start recovery lock helper for set_recmode\n"));
 		talloc_free(state);
 		return -1;
 	}
-	tevent_fd_set_auto_close(state->fde);
 
-	state->ctdb    = ctdb;
-	state->recmode = recmode;
-	state->c       = talloc_steal(state, c);
+	state->c = talloc_steal(state, c);
 
 	*async_reply = true;
 
 	return 0;
 }
 
-
-/*
-  try and get the recovery lock in shared storage - should only work
-  on the recovery master recovery daemon. Anywhere else is a bug
- */
-bool ctdb_recovery_lock(struct ctdb_context *ctdb, bool keep)
-{
-	struct flock lock;
-
-	if (keep) {
-		DEBUG(DEBUG_ERR, ("Take the recovery lock\n"));
-	}
-	if (ctdb->recovery_lock_fd != -1) {
-		close(ctdb->recovery_lock_fd);
-		ctdb->recovery_lock_fd = -1;
-	}
-
-	ctdb->recovery_lock_fd = open(ctdb->recovery_lock_file, O_RDWR|O_CREAT, 0600);
-	if (ctdb->recovery_lock_fd == -1) {
-		DEBUG(DEBUG_ERR,("ctdb_recovery_lock: Unable to open %s - (%s)\n", 
-			 ctdb->recovery_lock_file, strerror(errno)));
-		return false;
-	}
-
-	set_close_on_exec(ctdb->recovery_lock_fd);
-
-	lock.l_type = F_WRLCK;
-	lock.l_whence = SEEK_SET;
-	lock.l_start = 0;
-	lock.l_len = 1;
-	lock.l_pid = 0;
-
-	if (fcntl(ctdb->recovery_lock_fd, F_SETLK, &lock) != 0) {
-		close(ctdb->recovery_lock_fd);
-		ctdb->recovery_lock_fd = -1;
-		if (keep) {
-			DEBUG(DEBUG_CRIT,("ctdb_recovery_lock: Failed to get recovery lock on '%s'\n", ctdb->recovery_lock_file));
-		}
-		return false;
-	}
-
-	if (!keep) {
-		close(ctdb->recovery_lock_fd);
-		ctdb->recovery_lock_fd = -1;
-	}
-
-	if (keep) {
-		DEBUG(DEBUG_NOTICE, ("Recovery lock taken successfully\n"));
-	}
-
-	DEBUG(DEBUG_NOTICE,("ctdb_recovery_lock: Got recovery lock on '%s'\n", ctdb->recovery_lock_file));
-
-	return true;
-}
-
 /*
   delete a record as part of the vacuum process
   only delete if we are not lmaster or dmaster, and our rsn is <= the provided rsn
@@ -1373,6 +1233,7 @@ int32_t ctdb_control_set_recmaster(struct ctdb_context *ctdb, uint32_t opcode, T
 	}
 
 	ctdb->recovery_master = new_recmaster;
+	ctdb_state_changed(ctdb);
 	return 0;
 }
 
@@ -1382,6 +1243,7 @@ int32_t ctdb_control_stop_node(struct ctdb_context *ctdb)
 	DEBUG(DEBUG_NOTICE, ("Stopping node\n"));
 	ctdb_disable_monitoring(ctdb);
 	ctdb->nodes[ctdb->pnn]->flags |= NODE_FLAGS_STOPPED;
+	ctdb_state_changed(ctdb);
 
 	return 0;
 }
@@ -1390,6 +1252,7 @@ int32_t ctdb_control_continue_node(struct ctdb_context *ctdb)
 {
 	DEBUG(DEBUG_NOTICE, ("Continue node\n"));
 	ctdb->nodes[ctdb->pnn]->flags &= ~NODE_FLAGS_STOPPED;
+	ctdb_state_changed(ctdb);
 
 	return 0;
 }
@@ -145,6 +145,12 @@ struct ctdb_recoverd {
 	TALLOC_CTX *takeover_runs_disable_ctx;
 	struct ctdb_control_get_ifaces *ifaces;
 	uint32_t *force_rebalance_nodes;
+	struct recd_node_state *node_state;
+	uint32_t num_node_state;
+	uint32_t state_seqnum;
+	uint32_t state_verified;
+	struct timeval last_full_check;
+	struct ctdb_cluster_mutex_handle *recovery_lock_handle;
 };
 
 #define CONTROL_TIMEOUT() timeval_current_ofs(ctdb->tunable.recover_timeout, 0)
@@ -201,6 +207,14 @@ static void ctdb_set_culprit_count(struct ctdb_recoverd *rec, uint32_t culprit,
 		return;
 	}
 
+	/* A node that has gone quiet is probably about to be marked
+	   dead, which causes a recovery anyway. Do not let it collect
+	   banning credits for that */
+	if (ctdb->nodes[culprit]->suspect) {
+		DEBUG(DEBUG_NOTICE, ("Node %d is suspected of being dead, not setting it as culprit\n", culprit));
+		return;
+	}
+
 	if (ctdb->nodes[culprit]->ban_state == NULL) {
 		ctdb->nodes[culprit]->ban_state = talloc_zero(ctdb->nodes[culprit], struct ctdb_banning_state);
 		CTDB_NO_MEMORY_VOID(ctdb, ctdb->nodes[culprit]->ban_state);
@@ -1149,6 +1163,348 @@ static void ctdb_wait_election(struct ctdb_recoverd *rec)
 	}
 }
 
+/*
+  The recovery daemon caches the nodemap and vnnmap of every node along
+  with the state generation the node had announced when they were
+  fetched. Nodes broadcast a new generation whenever their state
+  changes, so the main loop only fetches the maps of nodes that have
+  announced a change since. Everything is fetched again every
+  RecoverFullCheckInterval seconds.
+ */
+struct recd_node_state {
+	uint32_t generation;		/* last generation announced */
+	uint32_t nodemap_generation;
+	uint32_t vnnmap_generation;
+	struct ctdb_node_map *nodemap;
+	struct ctdb_vnn_map_wire *vnnmap;
+};
+
+static struct recd_node_state *recd_node_state(struct ctdb_recoverd *rec,
+					       uint32_t pnn)
+{
+	struct recd_node_state *node_state;
+	uint32_t i;
+
+	if (pnn < rec->num_node_state) {
+		return &rec->node_state[pnn];
+	}
+
+	node_state = talloc_realloc(rec, rec->node_state,
+				    struct recd_node_state, pnn + 1);
+	if (node_state == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to grow node state array\n"));
+		return NULL;
+	}
+	for (i = rec->num_node_state; i <= pnn; i++) {
+		ZERO_STRUCT(node_state[i]);
+	}
+	rec->node_state     = node_state;
+	rec->num_node_state = pnn + 1;
+
+	return &rec->node_state[pnn];
+}
+
+static bool recd_map_fresh(struct recd_node_state *state,
+			   enum ctdb_controls opcode)
+{
+	if (opcode == CTDB_CONTROL_GET_NODEMAP) {
+		return state->nodemap != NULL &&
+			state->nodemap_generation == state->generation;
+	}
+	return state->vnnmap != NULL &&
+		state->vnnmap_generation == state->generation;
+}
+
+/*
+  true if both maps of a node are cached and it has not announced a
+  change since they were fetched
+ */
+static bool recd_node_state_fresh(struct ctdb_recoverd *rec, uint32_t pnn)
+{
+	struct recd_node_state *state;
+
+	if (pnn >= rec->num_node_state) {
+		return false;
+	}
+	state = &rec->node_state[pnn];
+
+	return recd_map_fresh(state, CTDB_CONTROL_GET_NODEMAP) &&
+		recd_map_fresh(state, CTDB_CONTROL_GETVNNMAP);
+}
+
+static void recd_forget_node(struct ctdb_recoverd *rec, uint32_t pnn)
+{
+	if (pnn >= rec->num_node_state) {
+		return;
+	}
+	TALLOC_FREE(rec->node_state[pnn].nodemap);
+	TALLOC_FREE(rec->node_state[pnn].vnnmap);
+}
+
+/*
+  drop all cached maps and verify the cluster state again
+ */
+static void recd_invalidate_state(struct ctdb_recoverd *rec)
+{
+	uint32_t i;
+
+	for (i = 0; i < rec->num_node_state; i++) {
+		recd_forget_node(rec, i);
+	}
+	rec->state_seqnum++;
+}
+
+/*
+  called when a node announces that its state has changed
+ */
+static void state_changed_handler(struct ctdb_context *ctdb, uint64_t srvid,
+				  TDB_DATA data, void *private_data)
+{
+	struct ctdb_recoverd *rec = talloc_get_type(private_data, struct ctdb_recoverd);
+	struct ctdb_state_change *c = (struct ctdb_state_change *)data.dptr;
+	struct recd_node_state *state;
+
+	if (data.dsize != sizeof(struct ctdb_state_change)) {
+		DEBUG(DEBUG_ERR,(__location__ " Wrong size of state change message. Was %u but expected %u bytes\n",
+				 (unsigned)data.dsize,
+				 (unsigned)sizeof(struct ctdb_state_change)));
+		return;
+	}
+
+	if (c->pnn >= ctdb->num_nodes) {
+		DEBUG(DEBUG_ERR,(__location__ " State change from invalid node %u\n", c->pnn));
+		return;
+	}
+
+	state = recd_node_state(rec, c->pnn);
+	if (state == NULL) {
+		return;
+	}
+
+	DEBUG(DEBUG_DEBUG,("Node %u announced state generation %u\n",
+			   c->pnn, c->generation));
+
+	state->generation = c->generation;
+	rec->state_seqnum++;
+}
+
+/*
+  handler for the local daemon telling us that it suspects a node of
+  being dead, or no longer does
+ */
+static void node_suspicion_handler(struct ctdb_context *ctdb, uint64_t srvid,
+				   TDB_DATA data, void *private_data)
+{
+	struct ctdb_node_suspicion *s = (struct ctdb_node_suspicion *)data.dptr;
+
+	if (data.dsize != sizeof(struct ctdb_node_suspicion)) {
+		DEBUG(DEBUG_ERR,(__location__ " Wrong size of node suspicion message. Was %u but expected %u bytes\n",
+				 (unsigned)data.dsize,
+				 (unsigned)sizeof(struct ctdb_node_suspicion)));
+		return;
+	}
+
+	if (s->pnn >= ctdb->num_nodes) {
+		DEBUG(DEBUG_ERR,(__location__ " Suspicion for invalid node %u\n", s->pnn));
+		return;
+	}
+
+	ctdb->nodes[s->pnn]->suspect = (s->suspect != 0);
+}
+
+struct recd_fetch_state {
+	struct ctdb_recoverd *rec;
+	enum ctdb_controls opcode;
+	uint32_t *generations;	/* indexed by pnn */
+};
+
+static void recd_fetch_callback(struct ctdb_context *ctdb, uint32_t node_pnn,
+				int32_t res, TDB_DATA outdata,
+				void *callback_data)
+{
+	struct recd_fetch_state *fetch = talloc_get_type(callback_data, struct recd_fetch_state);
+	struct recd_node_state *state;
+
+	if (res != 0 || node_pnn >= talloc_array_length(fetch->generations)) {
+		return;
+	}
+
+	state = recd_node_state(fetch->rec, node_pnn);
+	if (state == NULL) {
+		return;
+	}
+
+	if (fetch->opcode == CTDB_CONTROL_GET_NODEMAP) {
+		struct ctdb_node_map *map = (struct ctdb_node_map *)outdata.dptr;
+
+		if (outdata.dsize < offsetof(struct ctdb_node_map, nodes) ||
+		    outdata.dsize != offsetof(struct ctdb_node_map, nodes) +
+		    map->num * sizeof(struct ctdb_node_and_flags)) {
+			DEBUG(DEBUG_ERR,("Bad nodemap size received from node %u\n", node_pnn));
+			return;
+		}
+		talloc_free(state->nodemap);
+		state->nodemap = talloc_steal(fetch->rec->node_state, map);
+		state->nodemap_generation = fetch->generations[node_pnn];
+	} else {
+		struct ctdb_vnn_map_wire *map = (struct ctdb_vnn_map_wire *)outdata.dptr;
+
+		if (outdata.dsize < offsetof(struct ctdb_vnn_map_wire, map) ||
+		    outdata.dsize != offsetof(struct ctdb_vnn_map_wire, map) +
+		    map->size * sizeof(uint32_t)) {
+			DEBUG(DEBUG_ERR,("Bad vnnmap size received from node %u\n", node_pnn));
+			return;
+		}
+		talloc_free(state->vnnmap);
+		state->vnnmap = talloc_steal(fetch->rec->node_state, map);
+		state->vnnmap_generation = fetch->generations[node_pnn];
+	}
+}
+
+static void recd_fetch_fail_callback(struct ctdb_context *ctdb, uint32_t node_pnn,
+				     int32_t res, TDB_DATA outdata,
+				     void *callback_data)
+{
+	struct recd_fetch_state *fetch = talloc_get_type(callback_data, struct recd_fetch_state);
+
+	DEBUG(DEBUG_ERR,("Unable to get %s from node %u\n",
+			 fetch->opcode == CTDB_CONTROL_GET_NODEMAP ? "nodemap" : "vnnmap",
+			 node_pnn));
+	if (node_pnn != ctdb->pnn) {
+		ctdb_set_culprit(fetch->rec, node_pnn);
+	}
+}
+
+/*
+  fetch the nodemap (CTDB_CONTROL_GET_NODEMAP) or the vnnmap
+  (CTDB_CONTROL_GETVNNMAP) of those of the listed nodes that have
+  announced a change since it was last fetched
+ */
+static int recd_refresh_maps(struct ctdb_recoverd *rec, uint32_t *nodes,
+			     enum ctdb_controls opcode)
+{
+	struct ctdb_context *ctdb = rec->ctdb;
+	struct recd_fetch_state *fetch;
+	uint32_t *stale;
+	uint32_t i, num_stale = 0;
+	int ret;
+
+	fetch = talloc_zero(rec, struct recd_fetch_state);
+	CTDB_NO_MEMORY(ctdb, fetch);
+	fetch->rec    = rec;
+	fetch->opcode = opcode;
+	fetch->generations = talloc_zero_array(fetch, uint32_t, ctdb->num_nodes);
+	stale = talloc_array(fetch, uint32_t, talloc_array_length(nodes));
+	if (fetch->generations == NULL || stale == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Out of memory\n"));
+		talloc_free(fetch);
+		return -1;
+	}
+
+	for (i = 0; i < talloc_array_length(nodes); i++) {
+		struct recd_node_state *state;
+
+		if (nodes[i] >= ctdb->num_nodes) {
+			continue;
+		}
+		state = recd_node_state(rec, nodes[i]);
+		if (state == NULL) {
+			talloc_free(fetch);
+			return -1;
+		}
+		if (recd_map_fresh(state, opcode)) {
+			continue;
+		}
+		/* a change announced while the control is in flight
+		   leaves the map stale */
+		fetch->generations[nodes[i]] = state->generation;
+		stale[num_stale++] = nodes[i];
+	}
+
+	if (num_stale == 0) {
+		talloc_free(fetch);
+		return 0;
+	}
+
+	stale = talloc_realloc(fetch, stale, uint32_t, num_stale);
+
+	ret = ctdb_client_async_control(ctdb, opcode, stale, 0,
+					CONTROL_TIMEOUT(), false, tdb_null,
+					recd_fetch_callback,
+					recd_fetch_fail_callback,
+					fetch);
+	talloc_free(fetch);
+
+	return ret;
+}
+
+/*
+  get a copy of the nodemap of a node, fetching it if it has changed
+ */
+static int recd_get_nodemap(struct ctdb_recoverd *rec, uint32_t pnn,
+			    TALLOC_CTX *mem_ctx, struct ctdb_node_map **nodemap)
+{
+	struct ctdb_node_map *map;
+	uint32_t *nodes;
+
+	nodes = talloc_array(mem_ctx, uint32_t, 1);
+	CTDB_NO_MEMORY(rec->ctdb, nodes);
+	nodes[0] = pnn;
+
+	if (recd_refresh_maps(rec, nodes, CTDB_CONTROL_GET_NODEMAP) != 0) {
+		talloc_free(nodes);
+		return -1;
+	}
+	talloc_free(nodes);
+
+	if (pnn >= rec->num_node_state || rec->node_state[pnn].nodemap == NULL) {
+		return -1;
+	}
+	map = rec->node_state[pnn].nodemap;
+
+	*nodemap = talloc_memdup(mem_ctx, map, talloc_get_size(map));
+	CTDB_NO_MEMORY(rec->ctdb, *nodemap);
+
+	return 0;
+}
+
+/*
+  get a copy of the vnnmap of a node, fetching it if it has changed
+ */
+static int recd_get_vnnmap(struct ctdb_recoverd *rec, uint32_t pnn,
+			   TALLOC_CTX *mem_ctx, struct ctdb_vnn_map **vnnmap)
+{
+	struct ctdb_vnn_map_wire *map;
+	uint32_t *nodes;
+
+	nodes = talloc_array(mem_ctx, uint32_t, 1);
+	CTDB_NO_MEMORY(rec->ctdb, nodes);
+	nodes[0] = pnn;
+
+	if (recd_refresh_maps(rec, nodes, CTDB_CONTROL_GETVNNMAP) != 0) {
+		talloc_free(nodes);
+		return -1;
+	}
+	talloc_free(nodes);
+
+	if (pnn >= rec->num_node_state || rec->node_state[pnn].vnnmap == NULL) {
+		return -1;
+	}
+	map = rec->node_state[pnn].vnnmap;
+
+	*vnnmap = talloc(mem_ctx, struct ctdb_vnn_map);
+	CTDB_NO_MEMORY(rec->ctdb, *vnnmap);
+	(*vnnmap)->generation = map->generation;
+	(*vnnmap)->size       = map->size;
+	(*vnnmap)->map        = talloc_memdup(*vnnmap, map->map,
+					      map->size * sizeof(uint32_t));
+	if (map->size != 0) {
+		CTDB_NO_MEMORY(rec->ctdb, (*vnnmap)->map);
+	}
+
+	return 0;
+}
+
 /*
   Update our local flags from all remote connected nodes. 
   This is only run when we are or we belive we are the recovery master
@@ -1158,6 +1514,16 @@ static int update_local_flags(struct ctdb_recoverd *rec, struct ctdb_node_map *n
 	int j;
 	struct ctdb_context *ctdb = rec->ctdb;
 	TALLOC_CTX *mem_ctx = talloc_new(ctdb);
+	uint32_t *nodes;
+
+	/* only the nodes that announced a change since we last looked
+	   are asked for their nodemap */
+	nodes = list_of_connected_nodes(ctdb, nodemap, mem_ctx, false);
+	if (recd_refresh_maps(rec, nodes, CTDB_CONTROL_GET_NODEMAP) != 0) {
+		DEBUG(DEBUG_ERR, (__location__ " Unable to get nodemaps from remote nodes\n"));
+		talloc_free(mem_ctx);
+		return MONITOR_FAILED;
+	}
 
 	/* get the nodemap for all active remote nodes and verify
 	   they are the same as for this node
@@ -1173,8 +1539,8 @@ static int update_local_flags(struct ctdb_recoverd *rec, struct ctdb_node_map *n
 			continue;
 		}
 
-		ret = ctdb_ctrl_getnodemap(ctdb, CONTROL_TIMEOUT(), nodemap->nodes[j].pnn, 
-					   mem_ctx, &remote_nodemap);
+		ret = recd_get_nodemap(rec, nodemap->nodes[j].pnn,
+				       mem_ctx, &remote_nodemap);
 		if (ret != 0) {
 			DEBUG(DEBUG_ERR, (__location__ " Unable to get nodemap from remote node %u\n", 
 				  nodemap->nodes[j].pnn));
@@ -1277,10 +1643,9 @@ struct recdb_data {
 	bool persistent;
 };
 
-static int traverse_recdb(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data, void *p)
+static int traverse_recdb_filter(TDB_DATA key, TDB_DATA data, void *p)
 {
 	struct recdb_data *params = (struct recdb_data *)p;
-	struct ctdb_rec_data *rec;
 	struct ctdb_ltdb_header *hdr;
 
 	/*
@@ -1324,12 +1689,14 @@ static int traverse_recdb(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data,
 		hdr->flags |= CTDB_REC_FLAG_MIGRATED_WITH_DATA;
 	}
 
+	return 1;
+}
+
+static int traverse_recdb(struct ctdb_rec_data *rec, void *p)
+{
+	struct recdb_data *params = (struct recdb_data *)p;
+
 	/* add the record to the blob ready to send to the nodes */
-	rec = ctdb_marshall_record(params->recdata, 0, key, NULL, data);
-	if (rec == NULL) {
-		params->failed = true;
-		return -1;
-	}
 	if (params->len + rec->length >= params->allocated_len) {
 		params->allocated_len = rec->length + params->len + params->ctdb->tunable.pulldb_preallocation_size;
 		params->recdata = talloc_realloc_size(NULL, params->recdata, params->allocated_len);
@@ -1343,7 +1710,6 @@ static int traverse_recdb(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data,
 	params->recdata->count++;
 	memcpy(params->len+(uint8_t *)params->recdata, rec, rec->length);
 	params->len += rec->length;
-	talloc_free(rec);
 
 	return 0;
 }
@@ -1376,7 +1742,8 @@ static int push_recdb_database(struct ctdb_context *ctdb, uint32_t dbid,
 	params.failed = false;
 	params.persistent = persistent;
 
-	if (tdb_traverse_read(recdb->tdb, traverse_recdb, &params) == -1) {
+	if (ctdb_traverse_parallel(ctdb, recdb->tdb, traverse_recdb_filter,
+				   traverse_recdb, &params) == -1) {
 		DEBUG(DEBUG_ERR,(__location__ " Failed to traverse recdb database\n"));
 		talloc_free(params.recdata);
 		talloc_free(tmp_ctx);
@@ -1742,6 +2109,103 @@ done:
 }
 
 
+/*
+  The recovery lock is held by a cluster mutex helper for as long as
+  this node is the recovery master. The helper renews a lease on it
+  and if it fails to do so the lock is dropped, which makes the main
+  loop force a recovery to take it again
+ */
+struct take_reclock_state {
+	bool done;
+	bool locked;
+	double latency;
+};
+
+static void take_reclock_handler(char status, double latency,
+				 void *private_data)
+{
+	struct take_reclock_state *s = (struct take_reclock_state *)private_data;
+
+	switch (status) {
+	case '0':
+		s->locked = true;
+		s->latency = latency;
+		break;
+
+	case '1':
+		DEBUG(DEBUG_ERR,("Unable to take recovery lock - contention\n"));
+		break;
+
+	case '2':
+		DEBUG(DEBUG_ERR,("Unable to take recovery lock - timeout\n"));
+		break;
+
+	default:
+		DEBUG(DEBUG_ERR,("Unable to take recovery lock - unknown error\n"));
+	}
+
+	s->done = true;
+}
+
+static void lost_reclock_handler(void *private_data)
+{
+	struct ctdb_recoverd *rec = talloc_get_type_abort(
+		private_data, struct ctdb_recoverd);
+
+	DEBUG(DEBUG_ERR,("Recovery lock helper terminated or lease expired\n"));
+	TALLOC_FREE(rec->recovery_lock_handle);
+}
+
+static bool ctdb_recovery_have_lock(struct ctdb_recoverd *rec)
+{
+	return (rec->recovery_lock_handle != NULL);
+}
+
+static bool ctdb_recovery_lock(struct ctdb_recoverd *rec)
+{
+	struct ctdb_context *ctdb = rec->ctdb;
+	struct ctdb_cluster_mutex_handle *h;
+	struct take_reclock_state s = {
+		.done = false,
+		.locked = false,
+		.latency = 0,
+	};
+
+	if (ctdb_recovery_have_lock(rec)) {
+		return true;
+	}
+
+	h = ctdb_cluster_mutex(rec, ctdb, ctdb->recovery_lock_file,
+			       ctdb->tunable.recover_timeout,
+			       take_reclock_handler, &s,
+			       lost_reclock_handler, rec);
+	if (h == NULL) {
+		return false;
+	}
+
+	while (!s.done) {
+		event_loop_once(ctdb->ev);
+	}
+
+	if (!s.locked) {
+		talloc_free(h);
+		return false;
+	}
+
+	rec->recovery_lock_handle = h;
+	ctdb_ctrl_report_recd_lock_latency(ctdb, CONTROL_TIMEOUT(), s.latency);
+
+	return true;
+}
+
+static void ctdb_recovery_unlock(struct ctdb_recoverd *rec)
+{
+	if (rec->recovery_lock_handle != NULL) {
+		DEBUG(DEBUG_NOTICE, ("Releasing recovery lock\n"));
+		TALLOC_FREE(rec->recovery_lock_handle);
+	}
+}
+
 /*
   we are the recmaster, and recovery is needed - start a recovery run
  */
@@ -1755,7 +2219,6 @@ static int do_recovery(struct ctdb_recoverd *rec,
 	struct ctdb_dbid_map *dbmap;
 	TDB_DATA data;
 	uint32_t *nodes;
-	struct timeval start_time;
 	uint32_t culprit = (uint32_t)-1;
 	bool self_ban;
 
@@ -1764,6 +2227,9 @@ static int do_recovery(struct ctdb_recoverd *rec,
 	/* if recovery fails, force it again */
 	rec->need_recovery = true;
 
+	/* the recovery changes the state of every node */
+	recd_invalidate_state(rec);
+
 	ban_misbehaving_nodes(rec, &self_ban);
 	if (self_ban) {
 		DEBUG(DEBUG_NOTICE, ("This node was banned, aborting recovery\n"));
@@ -1772,15 +2238,13 @@ static int do_recovery(struct ctdb_recoverd *rec,
 
         if (ctdb->tunable.verify_recovery_lock != 0) {
 		DEBUG(DEBUG_ERR,("Taking out recovery lock from recovery daemon\n"));
-		start_time = timeval_current();
-		if (!ctdb_recovery_lock(ctdb, true)) {
+		if (!ctdb_recovery_lock(rec)) {
 			DEBUG(DEBUG_ERR,("Unable to get recovery lock - aborting recovery "
 					 "and ban ourself for %u seconds\n",
 					 ctdb->tunable.recovery_ban_period));
 			ctdb_ban_node(rec, pnn, ctdb->tunable.recovery_ban_period);
 			return -1;
 		}
-		ctdb_ctrl_report_recd_lock_latency(ctdb, CONTROL_TIMEOUT(), timeval_elapsed(&start_time));
 		DEBUG(DEBUG_NOTICE,("Recovery lock taken successfully by recovery daemon\n"));
 	}
 
@@ -2660,6 +3124,9 @@ static void election_handler(struct ctdb_context *ctdb, uint64_t srvid,
 						timeval_current_ofs(ctdb->tunable.election_timeout, 0), 
 						ctdb_election_timeout, rec);
 
+	/* the recovery master may be about to change */
+	recd_invalidate_state(rec);
+
 	mem_ctx = talloc_new(ctdb);
 
 	/* someone called an election. check their election data
@@ -2684,9 +3151,8 @@ static void election_handler(struct ctdb_context *ctdb, uint64_t srvid,
         if (ctdb->tunable.verify_recovery_lock != 0) {
 		/* release the recmaster lock */
 		if (em->pnn != ctdb->pnn &&
-		    ctdb->recovery_lock_fd != -1) {
-			close(ctdb->recovery_lock_fd);
-			ctdb->recovery_lock_fd = -1;
+		    ctdb_recovery_have_lock(rec)) {
+			ctdb_recovery_unlock(rec);
 			unban_all_nodes(ctdb);
 		}
 	}
@@ -2715,6 +3181,8 @@ static void force_election(struct ctdb_recoverd *rec, uint32_t pnn,
 
 	DEBUG(DEBUG_INFO,(__location__ " Force an election\n"));
 
+	recd_invalidate_state(rec);
+
 	/* set all nodes to recovery mode to stop all internode traffic */
 	ret = set_recovery_mode(ctdb, rec, nodemap, CTDB_RECOVERY_ACTIVE);
 	if (ret != 0) {
@@ -3249,217 +3717,38 @@ static int verify_local_ip_allocation(struct ctdb_context *ctdb, struct ctdb_rec
 }
 
 
-static void async_getnodemap_callback(struct ctdb_context *ctdb, uint32_t node_pnn, int32_t res, TDB_DATA outdata, void *callback_data)
-{
-	struct ctdb_node_map **remote_nodemaps = callback_data;
-
-	if (node_pnn >= ctdb->num_nodes) {
-		DEBUG(DEBUG_ERR,(__location__ " pnn from invalid node\n"));
-		return;
-	}
-
-	remote_nodemaps[node_pnn] = (struct ctdb_node_map *)talloc_steal(remote_nodemaps, outdata.dptr);
-
-}
-
-static int get_remote_nodemaps(struct ctdb_context *ctdb, TALLOC_CTX *mem_ctx,
+static int get_remote_nodemaps(struct ctdb_recoverd *rec, TALLOC_CTX *mem_ctx,
 	struct ctdb_node_map *nodemap,
 	struct ctdb_node_map **remote_nodemaps)
 {
+	struct ctdb_context *ctdb = rec->ctdb;
 	uint32_t *nodes;
+	uint32_t i;
 
 	nodes = list_of_active_nodes(ctdb, nodemap, mem_ctx, true);
-	if (ctdb_client_async_control(ctdb, CTDB_CONTROL_GET_NODEMAP,
-					nodes, 0,
-					CONTROL_TIMEOUT(), false, tdb_null,
-					async_getnodemap_callback,
-					NULL,
-					remote_nodemaps) != 0) {
+	if (recd_refresh_maps(rec, nodes, CTDB_CONTROL_GET_NODEMAP) != 0) {
 		DEBUG(DEBUG_ERR, (__location__ " Unable to pull all remote nodemaps\n"));
 
 		return -1;
 	}
 
-	return 0;
-}
-
-enum reclock_child_status { RECLOCK_CHECKING, RECLOCK_OK, RECLOCK_FAILED, RECLOCK_TIMEOUT};
-struct ctdb_check_reclock_state {
-	struct ctdb_context *ctdb;
-	struct timeval start_time;
-	int fd[2];
-	pid_t child;
-	struct timed_event *te;
-	struct fd_event *fde;
-	enum reclock_child_status status;
-};
-
-/* when we free the reclock state we must kill any child process.
-*/
-static int check_reclock_destructor(struct ctdb_check_reclock_state *state)
-{
-	struct ctdb_context *ctdb = state->ctdb;
-
-	ctdb_ctrl_report_recd_lock_latency(ctdb, CONTROL_TIMEOUT(), timeval_elapsed(&state->start_time));
-
-	if (state->fd[0] != -1) {
-		close(state->fd[0]);
-		state->fd[0] = -1;
-	}
-	if (state->fd[1] != -1) {
-		close(state->fd[1]);
-		state->fd[1] = -1;
-	}
-	ctdb_kill(ctdb, state->child, SIGKILL);
-	return 0;
-}
-
-/*
-  called if our check_reclock child times out. this would happen if
-  i/o to the reclock file blocks.
- */
-static void ctdb_check_reclock_timeout(struct event_context *ev, struct timed_event *te, 
-					 struct timeval t, void *private_data)
-{
-	struct ctdb_check_reclock_state *state = talloc_get_type(private_data, 
-					   struct ctdb_check_reclock_state);
-
-	DEBUG(DEBUG_ERR,(__location__ " check_reclock child process hung/timedout CFS slow to grant locks?\n"));
-	state->status = RECLOCK_TIMEOUT;
-}
-
-/* this is called when the child process has completed checking the reclock
-   file and has written data back to us through the pipe.
-*/
-static void reclock_child_handler(struct event_context *ev, struct fd_event *fde, 
-			     uint16_t flags, void *private_data)
-{
-	struct ctdb_check_reclock_state *state= talloc_get_type(private_data, 
-					     struct ctdb_check_reclock_state);
-	char c = 0;
-	int ret;
-
-	/* we got a response from our child process so we can abort the
-	   timeout.
-	*/
-	talloc_free(state->te);
-	state->te = NULL;
-
-	ret = read(state->fd[0], &c, 1);
-	if (ret != 1 || c != RECLOCK_OK) {
-		DEBUG(DEBUG_ERR,(__location__ " reclock child process returned error %d\n", c));
-		state->status = RECLOCK_FAILED;
-
-		return;
-	}
-
-	state->status = RECLOCK_OK;
-	return;
-}
-
-static int check_recovery_lock(struct ctdb_context *ctdb)
-{
-	int ret;
-	struct ctdb_check_reclock_state *state;
-	pid_t parent = getpid();
-
-	if (ctdb->recovery_lock_fd == -1) {
-		DEBUG(DEBUG_CRIT,("recovery master doesn't have the recovery lock\n"));
-		return -1;
-	}
-
-	state = talloc(ctdb, struct ctdb_check_reclock_state);
-	CTDB_NO_MEMORY(ctdb, state);
-
-	state->ctdb = ctdb;
-	state->start_time = timeval_current();
-	state->status = RECLOCK_CHECKING;
-	state->fd[0] = -1;
-	state->fd[1] = -1;
-
-	ret = pipe(state->fd);
-	if (ret != 0) {
-		talloc_free(state);
-		DEBUG(DEBUG_CRIT,(__location__ " Failed to open pipe for check_reclock child\n"));
-		return -1;
-	}
-
-	state->child = ctdb_fork(ctdb);
-	if (state->child == (pid_t)-1) {
-		DEBUG(DEBUG_CRIT,(__location__ " fork() failed in check_reclock child\n"));
-		close(state->fd[0]);
-		state->fd[0] = -1;
-		close(state->fd[1]);
-		state->fd[1] = -1;
-		talloc_free(state);
-		return -1;
-	}
-
-	if (state->child == 0) {
-		char cc = RECLOCK_OK;
-		close(state->fd[0]);
-		state->fd[0] = -1;
-
-		ctdb_set_process_name("ctdb_rec_reclock");
-		debug_extra = talloc_asprintf(NULL, "recovery-lock:");
-		if (pread(ctdb->recovery_lock_fd, &cc, 1, 0) == -1) {
-			DEBUG(DEBUG_CRIT,("failed read from recovery_lock_fd - %s\n", strerror(errno)));
-			cc = RECLOCK_FAILED;
+	for (i=0; i<talloc_array_length(nodes); i++) {
+		if (nodes[i] >= nodemap->num) {
+			DEBUG(DEBUG_ERR,(__location__ " pnn from invalid node\n"));
+			continue;
 		}
-
-		write(state->fd[1], &cc, 1);
-		/* make sure we die when our parent dies */
-		while (ctdb_kill(ctdb, parent, 0) == 0 || errno != ESRCH) {
-			sleep(5);
+		if (recd_get_nodemap(rec, nodes[i], remote_nodemaps,
+				     &remote_nodemaps[nodes[i]]) != 0) {
+			remote_nodemaps[nodes[i]] = NULL;
 		}
-		_exit(0);
 	}
-	close(state->fd[1]);
-	state->fd[1] = -1;
-	set_close_on_exec(state->fd[0]);
-
-	DEBUG(DEBUG_DEBUG, (__location__ " Created PIPE FD:%d for check_recovery_lock\n", state->fd[0]));
 
-	talloc_set_destructor(state, check_reclock_destructor);
-
-	state->te = event_add_timed(ctdb->ev, state, timeval_current_ofs(15, 0),
-				    ctdb_check_reclock_timeout, state);
-	if (state->te == NULL) {
-		DEBUG(DEBUG_CRIT,(__location__ " Failed to create a timed event for reclock child\n"));
-		talloc_free(state);
-		return -1;
-	}
-
-	state->fde = event_add_fd(ctdb->ev, state, state->fd[0],
-				EVENT_FD_READ,
-				reclock_child_handler,
-				(void *)state);
-
-	if (state->fde == NULL) {
-		DEBUG(DEBUG_CRIT,(__location__ " Failed to create an fd event for reclock child\n"));
-		talloc_free(state);
-		return -1;
-	}
-	tevent_fd_set_auto_close(state->fde);
-
-	while (state->status == RECLOCK_CHECKING) {
-		event_loop_once(ctdb->ev);
-	}
-
-	if (state->status == RECLOCK_FAILED) {
-		DEBUG(DEBUG_ERR,(__location__ " reclock child failed when checking file\n"));
-		close(ctdb->recovery_lock_fd);
-		ctdb->recovery_lock_fd = -1;
-		talloc_free(state);
-		return -1;
-	}
-
-	talloc_free(state);
 	return 0;
 }
 
-static int update_recovery_lock_file(struct ctdb_context *ctdb)
+static int update_recovery_lock_file(struct ctdb_recoverd *rec)
 {
+	struct ctdb_context *ctdb = rec->ctdb;
 	TALLOC_CTX *tmp_ctx = talloc_new(NULL);
 	const char *reclockfile;
 
@@ -3474,10 +3763,7 @@ static int update_recovery_lock_file(struct ctdb_context *ctdb)
 			DEBUG(DEBUG_ERR,("Reclock file disabled\n"));
 			talloc_free(ctdb->recovery_lock_file);
 			ctdb->recovery_lock_file = NULL;
-			if (ctdb->recovery_lock_fd != -1) {
-				close(ctdb->recovery_lock_fd);
-				ctdb->recovery_lock_fd = -1;
-			}
+			ctdb_recovery_unlock(rec);
 		}
 		ctdb->tunable.verify_recovery_lock = 0;
 		talloc_free(tmp_ctx);
@@ -3486,10 +3772,7 @@ static int update_recovery_lock_file(struct ctdb_context *ctdb)
 
 	if (ctdb->recovery_lock_file == NULL) {
 		ctdb->recovery_lock_file = talloc_strdup(ctdb, reclockfile);
-		if (ctdb->recovery_lock_fd != -1) {
-			close(ctdb->recovery_lock_fd);
-			ctdb->recovery_lock_fd = -1;
-		}
+		ctdb_recovery_unlock(rec);
 		talloc_free(tmp_ctx);
 		return 0;
 	}
@@ -3503,10 +3786,7 @@ static int update_recovery_lock_file(struct ctdb_context *ctdb)
 	talloc_free(ctdb->recovery_lock_file);
 	ctdb->recovery_lock_file = talloc_strdup(ctdb, reclockfile);
 	ctdb->tunable.verify_recovery_lock = 0;
-	if (ctdb->recovery_lock_fd != -1) {
-		close(ctdb->recovery_lock_fd);
-		ctdb->recovery_lock_fd = -1;
-	}
+	ctdb_recovery_unlock(rec);
 
 	talloc_free(tmp_ctx);
 	return 0;
@@ -3521,9 +3801,12 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 	struct ctdb_node_map **remote_nodemaps=NULL;
 	struct ctdb_vnn_map *vnnmap=NULL;
 	struct ctdb_vnn_map *remote_vnnmap=NULL;
+	uint32_t *nodes;
 	int32_t debug_level;
 	int i, j, ret;
 	bool self_ban;
+	uint32_t state_seqnum;
+	bool state_changed;
 
 
 	/* verify that the main daemon is still running */
@@ -3540,41 +3823,61 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 		return;
 	}
 
-	/* read the debug level from the parent and update locally */
-	ret = ctdb_ctrl_get_debuglevel(ctdb, CTDB_CURRENT_NODE, &debug_level);
-	if (ret !=0) {
-		DEBUG(DEBUG_ERR, (__location__ " Failed to read debuglevel from parent\n"));
-		return;
+	/* fetch everything again once in a while, in case a state
+	   change announcement got lost */
+	if (ctdb->tunable.recover_full_check_interval == 0 ||
+	    timeval_elapsed(&rec->last_full_check) >=
+	    ctdb->tunable.recover_full_check_interval) {
+		recd_invalidate_state(rec);
+		rec->last_full_check = timeval_current();
 	}
-	LogLevel = debug_level;
 
-	/* get relevant tunables */
-	ret = ctdb_ctrl_get_all_tunables(ctdb, CONTROL_TIMEOUT(), CTDB_CURRENT_NODE, &ctdb->tunable);
-	if (ret != 0) {
-		DEBUG(DEBUG_ERR,("Failed to get tunables - retrying\n"));
-		return;
-	}
+	/* the checks of the cluster state only need to be repeated if
+	   some node announced a change since they last passed */
+	state_seqnum  = rec->state_seqnum;
+	state_changed = (state_seqnum != rec->state_verified);
 
-	/* get the current recovery lock file from the server */
-	if (update_recovery_lock_file(ctdb) != 0) {
-		DEBUG(DEBUG_ERR,("Failed to update the recovery lock file\n"));
-		return;
+	pnn = ctdb_get_pnn(ctdb);
+
+	if (!recd_node_state_fresh(rec, pnn)) {
+		/* read the debug level from the parent and update locally */
+		ret = ctdb_ctrl_get_debuglevel(ctdb, CTDB_CURRENT_NODE, &debug_level);
+		if (ret !=0) {
+			DEBUG(DEBUG_ERR, (__location__ " Failed to read debuglevel from parent\n"));
+			return;
+		}
+		LogLevel = debug_level;
+
+		/* get relevant tunables */
+		ret = ctdb_ctrl_get_all_tunables(ctdb, CONTROL_TIMEOUT(), CTDB_CURRENT_NODE, &ctdb->tunable);
+		if (ret != 0) {
+			DEBUG(DEBUG_ERR,("Failed to get tunables - retrying\n"));
+			return;
+		}
+
+		/* get the current recovery lock file from the server */
+		if (update_recovery_lock_file(rec) != 0) {
+			DEBUG(DEBUG_ERR,("Failed to update the recovery lock file\n"));
+			return;
+		}
+
+		/* check which node is the recovery master */
+		ret = ctdb_ctrl_getrecmaster(ctdb, mem_ctx, CONTROL_TIMEOUT(), pnn, &rec->recmaster);
+		if (ret != 0) {
+			DEBUG(DEBUG_ERR, (__location__ " Unable to get recmaster from node %u\n", pnn));
+			return;
+		}
 	}
 
 	/* Make sure that if recovery lock verification becomes disabled when
 	   we close the file
 	*/
         if (ctdb->tunable.verify_recovery_lock == 0) {
-		if (ctdb->recovery_lock_fd != -1) {
-			close(ctdb->recovery_lock_fd);
-			ctdb->recovery_lock_fd = -1;
-		}
+		ctdb_recovery_unlock(rec);
 	}
 
-	pnn = ctdb_get_pnn(ctdb);
-
 	/* get the vnnmap */
-	ret = ctdb_ctrl_getvnnmap(ctdb, CONTROL_TIMEOUT(), pnn, mem_ctx, &vnnmap);
+	ret = recd_get_vnnmap(rec, pnn, mem_ctx, &vnnmap);
 	if (ret != 0) {
 		DEBUG(DEBUG_ERR, (__location__ " Unable to get vnnmap from node %u\n", pnn));
 		return;
@@ -3587,13 +3890,20 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 		rec->nodemap = NULL;
 		nodemap=NULL;
 	}
-	ret = ctdb_ctrl_getnodemap(ctdb, CONTROL_TIMEOUT(), pnn, rec, &rec->nodemap);
+	ret = recd_get_nodemap(rec, pnn, rec, &rec->nodemap);
 	if (ret != 0) {
 		DEBUG(DEBUG_ERR, (__location__ " Unable to get nodemap from node %u\n", pnn));
 		return;
 	}
 	nodemap = rec->nodemap;
 
+	/* a node that went away may come back as a new daemon */
+	for (i=0; i<nodemap->num; i++) {
+		if (nodemap->nodes[i].flags & NODE_FLAGS_DISCONNECTED) {
+			recd_forget_node(rec, nodemap->nodes[i].pnn);
+		}
+	}
+
 	/* remember our own node flags */
 	rec->node_flags = nodemap->nodes[pnn].flags;
 
@@ -3642,13 +3952,6 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 		return;
 	}
 
-	/* check which node is the recovery master */
-	ret = ctdb_ctrl_getrecmaster(ctdb, mem_ctx, CONTROL_TIMEOUT(), pnn, &rec->recmaster);
-	if (ret != 0) {
-		DEBUG(DEBUG_ERR, (__location__ " Unable to get recmaster from node %u\n", pnn));
-		return;
-	}
-
 	/* If we are not the recmaster then do some housekeeping */
 	if (rec->recmaster != pnn) {
 		/* Ignore any IP reallocate requests - only recmaster
@@ -3674,10 +3977,12 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 	}
 
 	/* update the capabilities for all nodes */
-	ret = update_capabilities(ctdb, nodemap);
-	if (ret != 0) {
-		DEBUG(DEBUG_ERR, (__location__ " Unable to update node capabilities.\n"));
-		return;
+	if (state_changed) {
+		ret = update_capabilities(ctdb, nodemap);
+		if (ret != 0) {
+			DEBUG(DEBUG_ERR, (__location__ " Unable to update node capabilities.\n"));
+			return;
+		}
 	}
 
 	/*
@@ -3733,8 +4038,8 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 	}
 
 	/* get nodemap from the recovery master to check if it is inactive */
-	ret = ctdb_ctrl_getnodemap(ctdb, CONTROL_TIMEOUT(), nodemap->nodes[j].pnn, 
-				   mem_ctx, &recmaster_nodemap);
+	ret = recd_get_nodemap(rec, nodemap->nodes[j].pnn,
+			       mem_ctx, &recmaster_nodemap);
 	if (ret != 0) {
 		DEBUG(DEBUG_ERR, (__location__ " Unable to get nodemap from recovery master %u\n", 
 			  nodemap->nodes[j].pnn));
@@ -3770,6 +4075,9 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 	   if recovery is needed
 	 */
 	if (pnn != rec->recmaster) {
+		/* only the recovery master holds the recovery lock */
+		ctdb_recovery_unlock(rec);
+		rec->state_verified = state_seqnum;
 		return;
 	}
 
@@ -3789,11 +4097,12 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 	if (ctdb->num_nodes != nodemap->num) {
 		DEBUG(DEBUG_ERR, (__location__ " ctdb->num_nodes (%d) != nodemap->num (%d) reloading nodes file\n", ctdb->num_nodes, nodemap->num));
 		ctdb_load_nodes_file(ctdb);
+		recd_invalidate_state(rec);
 		return;
 	}
 
 	/* verify that all active nodes agree that we are the recmaster */
-	switch (verify_recmaster(rec, nodemap, pnn)) {
+	switch (state_changed ? verify_recmaster(rec, nodemap, pnn) : MONITOR_OK) {
 	case MONITOR_RECOVERY_NEEDED:
 		/* can not happen */
 		return;
@@ -3816,7 +4125,7 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 	/* verify that all active nodes are in normal mode 
 	   and not in recovery mode 
 	*/
-	switch (verify_recmode(ctdb, nodemap)) {
+	switch (state_changed ? verify_recmode(ctdb, nodemap) : MONITOR_OK) {
 	case MONITOR_RECOVERY_NEEDED:
 		do_recovery(rec, mem_ctx, pnn, nodemap, vnnmap);
 		return;
@@ -3830,10 +4139,10 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 
 
         if (ctdb->tunable.verify_recovery_lock != 0) {
-		/* we should have the reclock - check its not stale */
-		ret = check_recovery_lock(ctdb);
-		if (ret != 0) {
-			DEBUG(DEBUG_ERR,("Failed check_recovery_lock. Force a recovery\n"));
+		/* we should have the reclock - the helper drops it if
+		   it can not renew its lease */
+		if (!ctdb_recovery_have_lock(rec)) {
+			DEBUG(DEBUG_ERR,("Recovery lock not held. Force a recovery\n"));
 			ctdb_set_culprit(rec, ctdb->pnn);
 			do_recovery(rec, mem_ctx, pnn, nodemap, vnnmap);
 			return;
@@ -3857,7 +4166,7 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 	for(i=0; i<nodemap->num; i++) {
 		remote_nodemaps[i] = NULL;
 	}
-	if (get_remote_nodemaps(ctdb, mem_ctx, nodemap, remote_nodemaps) != 0) {
+	if (get_remote_nodemaps(rec, mem_ctx, nodemap, remote_nodemaps) != 0) {
 		DEBUG(DEBUG_ERR,(__location__ " Failed to read remote nodemaps\n"));
 		return;
 	} 
@@ -3993,6 +4302,12 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 	/* verify that all other nodes have the same vnnmap
 	   and are from the same generation
 	 */
+	nodes = list_of_active_nodes(ctdb, nodemap, mem_ctx, false);
+	if (recd_refresh_maps(rec, nodes, CTDB_CONTROL_GETVNNMAP) != 0) {
+		DEBUG(DEBUG_ERR, (__location__ " Unable to get vnnmaps from remote nodes\n"));
+		return;
+	}
+
 	for (j=0; j<nodemap->num; j++) {
 		if (nodemap->nodes[j].flags & NODE_FLAGS_INACTIVE) {
 			continue;
@@ -4001,8 +4316,8 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 			continue;
 		}
 
-		ret = ctdb_ctrl_getvnnmap(ctdb, CONTROL_TIMEOUT(), nodemap->nodes[j].pnn, 
-					  mem_ctx, &remote_vnnmap);
+		ret = recd_get_vnnmap(rec, nodemap->nodes[j].pnn,
+				      mem_ctx, &remote_vnnmap);
 		if (ret != 0) {
 			DEBUG(DEBUG_ERR, (__location__ " Unable to get vnnmap from remote node %u\n", 
 				  nodemap->nodes[j].pnn));
@@ -4040,6 +4355,10 @@ static void main_loop(struct ctdb_context *ctdb, struct ctdb_recoverd *rec,
 		}
 	}
 
+	/* the cluster state checked out, it only needs to be checked
+	   again once some node announces a change */
+	rec->state_verified = state_seqnum;
+
 	/* we might need to change who has what IP assigned */
 	if (rec->need_takeover_run) {
 		uint32_t culprit = (uint32_t)-1;
@@ -4128,6 +4447,12 @@ static void monitor_cluster(struct ctdb_context *ctdb)
 	/* when nodes are disabled/enabled */
 	ctdb_client_set_message_handler(ctdb, CTDB_SRVID_SET_NODE_FLAGS, monitor_handler, rec);
 
+	/* when the state of a node has changed */
+	ctdb_client_set_message_handler(ctdb, CTDB_SRVID_STATE_CHANGED, state_changed_handler, rec);
+
+	/* register a message port for node suspicion changes */
+	ctdb_client_set_message_handler(ctdb, CTDB_SRVID_NODE_SUSPICION, node_suspicion_handler, rec);
+
 	/* when we are asked to puch out a flag change */
 	ctdb_client_set_message_handler(ctdb, CTDB_SRVID_PUSH_NODE_FLAGS, push_flags_handler, rec);
 
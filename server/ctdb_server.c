@@ -296,6 +296,7 @@ void ctdb_input_pkt(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 	case CTDB_REPLY_CALL:
 	case CTDB_REQ_DMASTER:
 	case CTDB_REPLY_DMASTER:
+	case CTDB_REQ_MIGRATE:
 		/* we dont allow these calls when banned */
 		if (ctdb->nodes[ctdb->pnn]->flags & NODE_FLAGS_BANNED) {
 			DEBUG(DEBUG_DEBUG,(__location__ " ctdb operation %u"
@@ -371,6 +372,10 @@ void ctdb_input_pkt(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 		CTDB_INCREMENT_STAT(ctdb, keepalive_packets_recv);
 		break;
 
+	case CTDB_REQ_MIGRATE:
+		ctdb_request_migrate(ctdb, hdr);
+		break;
+
 	default:
 		DEBUG(DEBUG_CRIT,("%s: Packet with unknown operation %u\n", 
 			 __location__, hdr->operation));
@@ -397,10 +402,12 @@ void ctdb_node_dead(struct ctdb_node *node)
 	node->flags |= NODE_FLAGS_DISCONNECTED | NODE_FLAGS_UNHEALTHY;
 	node->rx_cnt = 0;
 	node->dead_count = 0;
+	ctdb_node_reset_arrivals(node);
 
 	DEBUG(DEBUG_NOTICE,("%s: node %s is dead: %u connected\n", 
 		 node->ctdb->name, node->name, node->ctdb->num_connected));
 	ctdb_daemon_cancel_controls(node->ctdb, node);
+	ctdb_state_changed(node->ctdb);
 
 	if (node->ctdb->methods == NULL) {
 		DEBUG(DEBUG_ERR,(__location__ " Can not restart transport while shutting down daemon.\n"));
@@ -423,11 +430,13 @@ void ctdb_node_connected(struct ctdb_node *node)
 	}
 	node->ctdb->num_connected++;
 	node->dead_count = 0;
+	ctdb_node_reset_arrivals(node);
 	node->flags &= ~NODE_FLAGS_DISCONNECTED;
 	node->flags |= NODE_FLAGS_UNHEALTHY;
 	DEBUG(DEBUG_NOTICE,
 	      ("%s: connected to %s - %u connected\n", 
 	       node->ctdb->name, node->name, node->ctdb->num_connected));
+	ctdb_state_changed(node->ctdb);
 }
 
 struct queue_next {
@@ -567,6 +576,7 @@ void ctdb_queue_packet(struct ctdb_context *ctdb, struct ctdb_req_header *hdr)
 	}
 
 	node->tx_cnt++;
+	node->last_tx = timeval_current();
 	if (ctdb->methods->queue_pkt(node, (uint8_t *)hdr, hdr->length) != 0) {
 		ctdb_fatal(ctdb, "Unable to queue packet\n");
 	}
@@ -688,3 +698,43 @@ void ctdb_queue_packet_opcode(struct ctdb_context *ctdb, struct ctdb_req_header
 		break;
 	}
 }
+
+/*
+  return the queue statistics of the transport streams to all nodes
+ */
+int32_t ctdb_control_get_stream_statistics(struct ctdb_context *ctdb,
+					   TDB_DATA *outdata)
+{
+	struct ctdb_stream_statistics_wire *wire;
+	size_t len;
+	int i;
+
+	len = offsetof(struct ctdb_stream_statistics_wire, stats) +
+		ctdb->num_nodes * CTDB_MAX_STREAMS * sizeof(struct ctdb_stream_statistics);
+	wire = talloc_zero_size(outdata, len);
+	if (wire == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to allocate stream statistics\n"));
+		return -1;
+	}
+
+	for (i=0; i<ctdb->num_nodes; i++) {
+		struct ctdb_node *node = ctdb->nodes[i];
+
+		if (ctdb->methods == NULL ||
+		    ctdb->methods->stream_statistics == NULL) {
+			break;
+		}
+		if (node->flags & NODE_FLAGS_DELETED ||
+		    node->pnn == ctdb->pnn) {
+			continue;
+		}
+		wire->num += ctdb->methods->stream_statistics(node,
+							&wire->stats[wire->num]);
+	}
+
+	outdata->dptr  = (uint8_t *)wire;
+	outdata->dsize = offsetof(struct ctdb_stream_statistics_wire, stats) +
+		wire->num * sizeof(struct ctdb_stream_statistics);
+
+	return 0;
+}
@@ -21,15 +21,187 @@
 #include <string.h>
 #include "../include/ctdb_private.h"
 
+/*
+  return the i-th newest entry of a statistics ring
+ */
+static struct ctdb_statistics *ctdb_statistics_ring_get(struct ctdb_statistics_ring *ring,
+							 uint32_t i)
+{
+	return &ring->stats[(ring->next + ring->size - 1 - i) % ring->size];
+}
+
+static void ctdb_statistics_ring_push(struct ctdb_statistics_ring *ring,
+				      struct ctdb_statistics *s)
+{
+	ring->stats[ring->next] = *s;
+	ring->next = (ring->next + 1) % ring->size;
+	if (ring->num < ring->size) {
+		ring->num++;
+	}
+}
+
+/*
+  (re)size a statistics ring, keeping the most recent entries
+ */
+static int ctdb_statistics_ring_resize(TALLOC_CTX *mem_ctx,
+				       struct ctdb_statistics_ring *ring,
+				       uint32_t size)
+{
+	struct ctdb_statistics *stats;
+	uint32_t i, num;
+
+	if (size == 0) {
+		size = 1;
+	}
+	if (size == ring->size) {
+		return 0;
+	}
+
+	stats = talloc_zero_array(mem_ctx, struct ctdb_statistics, size);
+	if (stats == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to allocate statistics history of %u entries\n", size));
+		return -1;
+	}
+
+	num = MIN(ring->num, size);
+	for (i=0; i<num; i++) {
+		stats[num-1-i] = *ctdb_statistics_ring_get(ring, i);
+	}
+
+	talloc_free(ring->stats);
+	ring->stats = stats;
+	ring->size = size;
+	ring->num  = num;
+	ring->next = num % size;
+
+	return 0;
+}
+
+static void ctdb_latency_merge(struct latency_counter *dst,
+			       struct latency_counter *src)
+{
+	if (src->num == 0) {
+		return;
+	}
+	if (dst->num == 0 || src->min < dst->min) {
+		dst->min = src->min;
+	}
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+	dst->total += src->total;
+	dst->num   += src->num;
+}
+
+/*
+  add one history interval to a rollup entry
+
+  History entries hold the counter deltas for one interval, so they are
+  summed.  Gauges keep the largest value seen during the rollup period.
+ */
+static void ctdb_statistics_merge(struct ctdb_statistics *dst,
+				  struct ctdb_statistics *src)
+{
+	int i;
+
+#define STAT_SUM(f) dst->f += src->f
+#define STAT_MAX(f) dst->f = MAX(dst->f, src->f)
+	STAT_MAX(num_clients);
+	STAT_MAX(frozen);
+	STAT_MAX(recovering);
+	STAT_SUM(client_packets_sent);
+	STAT_SUM(client_packets_recv);
+	STAT_SUM(node_packets_sent);
+	STAT_SUM(node_packets_recv);
+	STAT_SUM(keepalive_packets_sent);
+	STAT_SUM(keepalive_packets_recv);
+	STAT_SUM(node.req_call);
+	STAT_SUM(node.reply_call);
+	STAT_SUM(node.req_dmaster);
+	STAT_SUM(node.reply_dmaster);
+	STAT_SUM(node.reply_error);
+	STAT_SUM(node.req_message);
+	STAT_SUM(node.req_control);
+	STAT_SUM(node.reply_control);
+	STAT_SUM(client.req_call);
+	STAT_SUM(client.req_message);
+	STAT_SUM(client.req_control);
+	STAT_SUM(timeouts.call);
+	STAT_SUM(timeouts.control);
+	STAT_SUM(timeouts.traverse);
+	STAT_SUM(locks.num_calls);
+	STAT_MAX(locks.num_current);
+	STAT_MAX(locks.num_pending);
+	STAT_SUM(locks.num_failed);
+	STAT_SUM(workers.num_spawned);
+	STAT_SUM(workers.num_jobs);
+	STAT_MAX(workers.num_current);
+	STAT_MAX(workers.num_pending);
+	STAT_SUM(workers.num_failed);
+	STAT_SUM(dmaster_hints.hits);
+	STAT_SUM(dmaster_hints.misses);
+	STAT_SUM(dmaster_hints.stale);
+	STAT_SUM(dmaster_hints.hops_saved);
+	STAT_SUM(shipped.calls);
+	STAT_SUM(shipped.migrations);
+	STAT_SUM(mem_pools.allocs);
+	STAT_SUM(mem_pools.hits);
+	STAT_SUM(mem_pools.pools);
+	STAT_SUM(call_shards.num_spawned);
+	STAT_SUM(call_shards.num_requests);
+	STAT_SUM(call_shards.num_fallbacks);
+	STAT_MAX(call_shards.num_current);
+	STAT_SUM(total_calls);
+	STAT_MAX(pending_calls);
+	STAT_SUM(childwrite_calls);
+	STAT_MAX(pending_childwrite_calls);
+	STAT_MAX(memory_used);
+	STAT_MAX(max_hop_count);
+	STAT_SUM(num_recoveries);
+	STAT_SUM(total_ro_delegations);
+	STAT_SUM(total_ro_revokes);
+	for (i=0; i<MAX_COUNT_BUCKETS; i++) {
+		STAT_SUM(locks.buckets[i]);
+		STAT_SUM(hop_count_bucket[i]);
+	}
+#undef STAT_SUM
+#undef STAT_MAX
+
+	ctdb_latency_merge(&dst->reclock.ctdbd, &src->reclock.ctdbd);
+	ctdb_latency_merge(&dst->reclock.recd, &src->reclock.recd);
+	ctdb_latency_merge(&dst->locks.latency, &src->locks.latency);
+	ctdb_latency_merge(&dst->workers.queue_latency, &src->workers.queue_latency);
+	ctdb_latency_merge(&dst->workers.latency, &src->workers.latency);
+	ctdb_latency_merge(&dst->call_shards.latency, &src->call_shards.latency);
+	ctdb_latency_merge(&dst->call_latency, &src->call_latency);
+	ctdb_latency_merge(&dst->childwrite_latency, &src->childwrite_latency);
+
+	if (dst->statistics_start_time.tv_sec == 0) {
+		dst->statistics_start_time = src->statistics_start_time;
+	}
+	dst->statistics_current_time = src->statistics_current_time;
+}
+
 static void ctdb_statistics_update(struct event_context *ev, struct timed_event *te, 
 				   struct timeval t, void *p)
 {
 	struct ctdb_context *ctdb = talloc_get_type(p, struct ctdb_context);
+	struct ctdb_statistics *rollup = &ctdb->statistics_rollup_current;
 
-	memmove(&ctdb->statistics_history[1], &ctdb->statistics_history[0], (MAX_STAT_HISTORY-1)*sizeof(struct ctdb_statistics));
-	memcpy(&ctdb->statistics_history[0], &ctdb->statistics_current, sizeof(struct ctdb_statistics));
-	ctdb->statistics_history[0].statistics_current_time = timeval_current();
+	/* pick up changes to the history depth tunables */
+	ctdb_statistics_ring_resize(ctdb, &ctdb->statistics_history,
+				    ctdb->tunable.stat_history_depth);
+	ctdb_statistics_ring_resize(ctdb, &ctdb->statistics_rollup,
+				    ctdb->tunable.stat_rollup_depth);
 
+	ctdb->statistics_current.statistics_current_time = timeval_current();
+	ctdb_statistics_ring_push(&ctdb->statistics_history, &ctdb->statistics_current);
+
+	ctdb_statistics_merge(rollup, &ctdb->statistics_current);
+	if (rollup->statistics_current_time.tv_sec - rollup->statistics_start_time.tv_sec >= STAT_ROLLUP_INTERVAL) {
+		ctdb_statistics_ring_push(&ctdb->statistics_rollup, rollup);
+		bzero(rollup, sizeof(struct ctdb_statistics));
+	}
 
 	bzero(&ctdb->statistics_current, sizeof(struct ctdb_statistics));
 	ctdb->statistics_current.statistics_start_time = timeval_current();
@@ -46,7 +218,16 @@ int ctdb_statistics_init(struct ctdb_context *ctdb)
 	bzero(&ctdb->statistics_current, sizeof(struct ctdb_statistics));
 	ctdb->statistics_current.statistics_start_time = timeval_current();
 
-	bzero(ctdb->statistics_history, sizeof(ctdb->statistics_history));
+	bzero(&ctdb->statistics_rollup_current, sizeof(struct ctdb_statistics));
+
+	if (ctdb_statistics_ring_resize(ctdb, &ctdb->statistics_history,
+					ctdb->tunable.stat_history_depth) != 0) {
+		return -1;
+	}
+	if (ctdb_statistics_ring_resize(ctdb, &ctdb->statistics_rollup,
+					ctdb->tunable.stat_rollup_depth) != 0) {
+		return -1;
+	}
 
 	event_add_timed(ctdb->ev, ctdb, timeval_current_ofs(ctdb->tunable.stat_history_interval, 0), ctdb_statistics_update, ctdb);
 	return 0;
@@ -58,9 +239,11 @@ int32_t ctdb_control_get_stat_history(struct ctdb_context *ctdb,
 				      TDB_DATA *outdata)
 {
 	int len;
+	uint32_t i;
 	struct ctdb_statistics_wire *s;
+	struct ctdb_statistics_ring *ring = &ctdb->statistics_history;
 
-	len = offsetof(struct ctdb_statistics_wire, stats) + MAX_STAT_HISTORY*sizeof(struct ctdb_statistics);
+	len = offsetof(struct ctdb_statistics_wire, stats) + ring->num*sizeof(struct ctdb_statistics);
 
 	s = talloc_size(outdata, len);
 	if (s == NULL) {
@@ -68,8 +251,80 @@ int32_t ctdb_control_get_stat_history(struct ctdb_context *ctdb,
 		return -1;
 	}
 
-	s->num = MAX_STAT_HISTORY;
-	memcpy(&s->stats[0], &ctdb->statistics_history[0], sizeof(ctdb->statistics_history));
+	/* newest entry first */
+	s->num = ring->num;
+	for (i=0; i<ring->num; i++) {
+		s->stats[i] = *ctdb_statistics_ring_get(ring, i);
+	}
+
+	outdata->dsize = len;
+	outdata->dptr  = (uint8_t *)s;
+
+	return 0;
+}
+
+static bool ctdb_statistics_in_range(struct ctdb_statistics *s,
+				     struct ctdb_statistics_range *range)
+{
+	if (timeval_compare(&s->statistics_current_time, &range->start) < 0) {
+		return false;
+	}
+	if (timeval_compare(&s->statistics_start_time, &range->end) > 0) {
+		return false;
+	}
+	return true;
+}
+
+/*
+  return the statistics history overlapping a time range, newest first
+
+  The per interval history is used where it is available and the
+  rollup entries cover the time before the oldest history entry.
+ */
+int32_t ctdb_control_get_stat_history_range(struct ctdb_context *ctdb,
+					    struct ctdb_req_control *c,
+					    TDB_DATA indata,
+					    TDB_DATA *outdata)
+{
+	struct ctdb_statistics_range *range = (struct ctdb_statistics_range *)indata.dptr;
+	struct ctdb_statistics_ring *history = &ctdb->statistics_history;
+	struct ctdb_statistics_ring *rollup = &ctdb->statistics_rollup;
+	struct ctdb_statistics_wire *s;
+	struct ctdb_statistics *st;
+	struct timeval oldest;
+	uint32_t i, num;
+	int len;
+
+	s = talloc_size(outdata, offsetof(struct ctdb_statistics_wire, stats) +
+			(history->num + rollup->num)*sizeof(struct ctdb_statistics));
+	if (s == NULL) {
+		DEBUG(DEBUG_ERR,(__location__ " Failed to allocate statistics history structure\n"));
+		return -1;
+	}
+
+	num = 0;
+	oldest = timeval_current();
+
+	for (i=0; i<history->num; i++) {
+		st = ctdb_statistics_ring_get(history, i);
+		oldest = st->statistics_start_time;
+		if (ctdb_statistics_in_range(st, range)) {
+			s->stats[num++] = *st;
+		}
+	}
+
+	for (i=0; i<rollup->num; i++) {
+		st = ctdb_statistics_ring_get(rollup, i);
+		if (timeval_compare(&st->statistics_current_time, &oldest) > 0) {
+			continue;
+		}
+		if (ctdb_statistics_in_range(st, range)) {
+			s->stats[num++] = *st;
+		}
+	}
+
+	s->num = num;
+	len = offsetof(struct ctdb_statistics_wire, stats) + num*sizeof(struct ctdb_statistics);
 
 	outdata->dsize = len;
 	outdata->dptr  = (uint8_t *)s;
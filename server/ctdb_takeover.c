@@ -431,6 +431,7 @@ static void ctdb_do_takeip_callback(struct ctdb_context *ctdb, int status,
 		ctdb_request_control_reply(ctdb, state->c, NULL, status, NULL);
 
 		node->flags |= NODE_FLAGS_UNHEALTHY;
+		ctdb_state_changed(ctdb);
 		talloc_free(state);
 		return;
 	}
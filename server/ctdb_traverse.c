@@ -20,6 +20,7 @@
 #include "includes.h"
 #include "system/filesys.h"
 #include "system/wait.h"
+#include "system/select.h"
 #include "db_wrap.h"
 #include "tdb.h"
 #include "../include/ctdb_private.h"
@@ -27,15 +28,375 @@
 
 typedef void (*ctdb_traverse_fn_t)(void *private_data, TDB_DATA key, TDB_DATA data);
 
+/*
+ * Parallel traverse of a local tdb
+ *
+ * The hash chains of the database are split into ranges, one for each
+ * worker process.  Workers traverse their range, filter and marshall the
+ * records and stream them back over a pipe.  The records are merged in
+ * the calling process as they arrive.  A worker ends its stream with a
+ * zero length followed by the number of records it traversed.
+ *
+ * The workers inherit the lock state of the caller, so a caller holding
+ * (marked) locks on the whole database gets a traverse that does not
+ * take any locks itself.
+ */
+
+/* Databases smaller than this are traversed in the calling process */
+#define TRAVERSE_PARALLEL_MIN_SIZE	(1024*1024)
+
+#define TRAVERSE_WORKER_BUFSIZE		(64*1024)
+
+struct traverse_parallel_state {
+	ctdb_traverse_filter_fn filter;
+	ctdb_traverse_merge_fn merge;
+	void *private_data;
+	int fd;
+	uint8_t *buf;
+	uint32_t len;
+	bool failed;
+};
+
+static int traverse_worker_write(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int traverse_parallel_fn(struct tdb_context *tdb, TDB_DATA key,
+				TDB_DATA data, void *p)
+{
+	struct traverse_parallel_state *state =
+		(struct traverse_parallel_state *)p;
+	struct ctdb_rec_data *rec;
+	int ret;
+
+	if (state->filter != NULL) {
+		ret = state->filter(key, data, state->private_data);
+		if (ret <= 0) {
+			if (ret < 0) {
+				state->failed = true;
+			}
+			return ret;
+		}
+	}
+
+	rec = ctdb_marshall_record(NULL, 0, key, NULL, data);
+	if (rec == NULL) {
+		state->failed = true;
+		return -1;
+	}
+
+	if (state->fd == -1) {
+		/* traverse in this process */
+		ret = state->merge(rec, state->private_data);
+	} else if (state->len + rec->length > TRAVERSE_WORKER_BUFSIZE) {
+		ret = traverse_worker_write(state->fd, state->buf, state->len);
+		state->len = 0;
+		if (ret == 0) {
+			ret = traverse_worker_write(state->fd, (uint8_t *)rec,
+						    rec->length);
+		}
+	} else {
+		memcpy(state->buf + state->len, rec, rec->length);
+		state->len += rec->length;
+		ret = 0;
+	}
+	talloc_free(rec);
+
+	if (ret != 0) {
+		state->failed = true;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void traverse_parallel_worker(struct tdb_context *tdb,
+				     struct traverse_parallel_state *state,
+				     uint32_t start_chain, uint32_t end_chain)
+{
+	uint32_t trailer[2];
+	int count;
+
+	state->buf = talloc_size(NULL, TRAVERSE_WORKER_BUFSIZE);
+	if (state->buf == NULL) {
+		_exit(1);
+	}
+
+	count = tdb_traverse_read_range(tdb, start_chain, end_chain,
+					traverse_parallel_fn, state);
+	if (count == -1 || state->failed) {
+		_exit(1);
+	}
+
+	if (traverse_worker_write(state->fd, state->buf, state->len) != 0) {
+		_exit(1);
+	}
+
+	trailer[0] = 0;
+	trailer[1] = count;
+	if (traverse_worker_write(state->fd, (uint8_t *)trailer,
+				  sizeof(trailer)) != 0) {
+		_exit(1);
+	}
+
+	_exit(0);
+}
+
+struct traverse_parallel_worker {
+	pid_t pid;
+	int fd;
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t len;
+	bool done;
+	uint32_t count;
+};
+
+/*
+ * read from a worker and merge the complete records received
+ * returns 1 once the worker is done
+ */
+static int traverse_parallel_read(struct traverse_parallel_worker *w,
+				  struct traverse_parallel_state *state)
+{
+	struct ctdb_rec_data *rec;
+	uint32_t length, offset;
+	ssize_t n;
+
+	if (w->len == w->size) {
+		w->buf = talloc_realloc(w, w->buf, uint8_t, 2*w->size);
+		if (w->buf == NULL) {
+			return -1;
+		}
+		w->size *= 2;
+	}
+
+	n = read(w->fd, w->buf + w->len, w->size - w->len);
+	if (n == -1 && errno == EINTR) {
+		return 0;
+	}
+	if (n <= 0) {
+		/* worker exited without finishing its stream */
+		return -1;
+	}
+	w->len += n;
+
+	offset = 0;
+	while (w->len - offset >= sizeof(uint32_t)) {
+		memcpy(&length, w->buf + offset, sizeof(length));
+		if (length == 0) {
+			if (w->len - offset < 2*sizeof(uint32_t)) {
+				break;
+			}
+			memcpy(&w->count, w->buf + offset + sizeof(uint32_t),
+			       sizeof(uint32_t));
+			w->done = true;
+			return 1;
+		}
+		if (length < offsetof(struct ctdb_rec_data, data)) {
+			DEBUG(DEBUG_ERR, (__location__ " Invalid record from "
+					  "traverse worker\n"));
+			return -1;
+		}
+		if (w->len - offset < length) {
+			if (length > w->size) {
+				w->buf = talloc_realloc(w, w->buf, uint8_t,
+							length);
+				if (w->buf == NULL) {
+					return -1;
+				}
+				w->size = length;
+			}
+			break;
+		}
+
+		rec = (struct ctdb_rec_data *)(w->buf + offset);
+		if (state->merge(rec, state->private_data) != 0) {
+			return -1;
+		}
+		offset += length;
+	}
+
+	if (offset > 0) {
+		memmove(w->buf, w->buf + offset, w->len - offset);
+		w->len -= offset;
+	}
+
+	return 0;
+}
+
+int ctdb_traverse_parallel(struct ctdb_context *ctdb, struct tdb_context *tdb,
+			   ctdb_traverse_filter_fn filter,
+			   ctdb_traverse_merge_fn merge,
+			   void *private_data)
+{
+	struct traverse_parallel_state state;
+	struct traverse_parallel_worker *workers;
+	struct pollfd *pfd;
+	uint32_t num_workers, hash_size, num_done, i;
+	int fd[2], ret, status, count = 0;
+
+	state.filter = filter;
+	state.merge = merge;
+	state.private_data = private_data;
+	state.fd = -1;
+	state.buf = NULL;
+	state.len = 0;
+	state.failed = false;
+
+	hash_size = tdb_hash_size(tdb);
+	num_workers = MIN(ctdb->tunable.traverse_workers, hash_size);
+
+	if (num_workers <= 1 || tdb_map_size(tdb) < TRAVERSE_PARALLEL_MIN_SIZE) {
+		ret = tdb_traverse_read(tdb, traverse_parallel_fn, &state);
+		if (state.failed) {
+			return -1;
+		}
+		return ret;
+	}
+
+	workers = talloc_zero_array(ctdb, struct traverse_parallel_worker,
+				    num_workers);
+	pfd = talloc_zero_array(workers, struct pollfd, num_workers);
+	if (workers == NULL || pfd == NULL) {
+		talloc_free(workers);
+		return -1;
+	}
+
+	for (i=0; i<num_workers; i++) {
+		workers[i].fd = -1;
+	}
+
+	ret = 0;
+	for (i=0; i<num_workers; i++) {
+		struct traverse_parallel_worker *w = &workers[i];
+
+		w->size = TRAVERSE_WORKER_BUFSIZE;
+		w->buf = talloc_size(workers, w->size);
+		if (w->buf == NULL) {
+			ret = -1;
+			break;
+		}
+
+		if (pipe(fd) != 0) {
+			ret = -1;
+			break;
+		}
+
+		w->pid = ctdb_fork(ctdb);
+		if (w->pid == -1) {
+			close(fd[0]);
+			close(fd[1]);
+			ret = -1;
+			break;
+		}
+
+		if (w->pid == 0) {
+			uint32_t j;
+
+			close(fd[0]);
+			for (j=0; j<i; j++) {
+				close(workers[j].fd);
+			}
+			ctdb_set_process_name("ctdb_traverse_worker");
+
+			state.fd = fd[1];
+			traverse_parallel_worker(tdb, &state,
+						 i * hash_size / num_workers,
+						 (i+1) * hash_size / num_workers);
+		}
+
+		close(fd[1]);
+		w->fd = fd[0];
+	}
+
+	/* merge the records as they arrive from the workers */
+	num_done = 0;
+	while (ret == 0 && num_done < num_workers) {
+		for (i=0; i<num_workers; i++) {
+			pfd[i].fd = workers[i].done ? -1 : workers[i].fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+
+		if (poll(pfd, num_workers, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = -1;
+			break;
+		}
+
+		for (i=0; i<num_workers; i++) {
+			if (pfd[i].revents == 0) {
+				continue;
+			}
+			ret = traverse_parallel_read(&workers[i], &state);
+			if (ret == 1) {
+				count += workers[i].count;
+				num_done++;
+				ret = 0;
+			}
+			if (ret != 0) {
+				break;
+			}
+		}
+	}
+
+	for (i=0; i<num_workers; i++) {
+		struct traverse_parallel_worker *w = &workers[i];
+
+		if (w->fd != -1) {
+			close(w->fd);
+		}
+		if (w->pid <= 0) {
+			continue;
+		}
+		if (ret != 0) {
+			ctdb_kill(ctdb, w->pid, SIGKILL);
+		}
+		if (ctdb_waitpid(ctdb, w->pid, &status) == -1 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			ret = -1;
+		}
+	}
+
+	talloc_free(workers);
+
+	if (ret != 0) {
+		DEBUG(DEBUG_ERR, (__location__ " Parallel traverse failed\n"));
+		return -1;
+	}
+
+	return count;
+}
+
 /*
   handle returned to caller - freeing this handler will kill the child and 
-  terminate the traverse
+  terminate the traverse. The traverse runs either in a worker process
+  (job) or in a child forked for it
  */
 struct ctdb_traverse_local_handle {
 	struct ctdb_traverse_local_handle *next, *prev;
 	struct ctdb_db_context *ctdb_db;
 	int fd[2];
 	pid_t child;
+	struct ctdb_worker_job *job;
 	uint64_t srvid;
 	uint32_t client_reqid;
 	uint32_t reqid;
@@ -49,21 +410,15 @@ struct ctdb_traverse_local_handle {
 };
 
 /*
- * called when traverse is completed by child or on error
+ * called when traverse is completed by child or worker, or on error
  */
-static void ctdb_traverse_child_handler(struct tevent_context *ev, struct tevent_fd *fde,
-					uint16_t flags, void *private_data)
+static void ctdb_traverse_local_done(struct ctdb_traverse_local_handle *h,
+				     bool failed, int res)
 {
-	struct ctdb_traverse_local_handle *h = talloc_get_type(private_data,
-							struct ctdb_traverse_local_handle);
 	ctdb_traverse_fn_t callback = h->callback;
 	void *p = h->private_data;
-	int res;
-	ssize_t n;
 
-	/* Read the number of records sent by traverse child */
-	n = read(h->fd[0], &res, sizeof(res));
-	if (n < 0 || n != sizeof(res)) {
+	if (failed) {
 		/* Traverse child failed */
 		DEBUG(DEBUG_ERR, ("Local traverse failed db:%s reqid:%d\n",
 				  h->ctdb_db->db_name, h->reqid));
@@ -80,27 +435,48 @@ static void ctdb_traverse_child_handler(struct tevent_context *ev, struct tevent
 	callback(p, tdb_null, tdb_null);
 }
 
+static void ctdb_traverse_child_handler(struct tevent_context *ev, struct tevent_fd *fde,
+					uint16_t flags, void *private_data)
+{
+	struct ctdb_traverse_local_handle *h = talloc_get_type(private_data,
+							struct ctdb_traverse_local_handle);
+	int res = 0;
+	ssize_t n;
+
+	/* Read the number of records sent by traverse child */
+	n = read(h->fd[0], &res, sizeof(res));
+	ctdb_traverse_local_done(h, n != sizeof(res), res);
+}
+
+static void ctdb_traverse_job_done(int32_t status, void *private_data)
+{
+	struct ctdb_traverse_local_handle *h = talloc_get_type(private_data,
+							struct ctdb_traverse_local_handle);
+
+	h->job = NULL;
+	ctdb_traverse_local_done(h, false, status);
+}
+
 /*
   destroy a in-flight traverse operation
  */
 static int traverse_local_destructor(struct ctdb_traverse_local_handle *h)
 {
 	DLIST_REMOVE(h->ctdb_db->traverse, h);
-	ctdb_kill(h->ctdb_db->ctdb, h->child, SIGKILL);
+	if (h->child > 0) {
+		ctdb_kill(h->ctdb_db->ctdb, h->child, SIGKILL);
+	}
 	return 0;
 }
 
 /*
-  callback from tdb_traverse_read()
+  filter for the local traverse, called in the traverse workers
  */
-static int ctdb_traverse_local_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data, void *p)
+static int ctdb_traverse_local_filter(TDB_DATA key, TDB_DATA data, void *p)
 {
 	struct ctdb_traverse_local_handle *h = talloc_get_type(p,
 							       struct ctdb_traverse_local_handle);
-	struct ctdb_rec_data *d;
 	struct ctdb_ltdb_header *hdr;
-	int res, status;
-	TDB_DATA outdata;
 
 	hdr = (struct ctdb_ltdb_header *)data.dptr;
 
@@ -118,12 +494,20 @@ static int ctdb_traverse_local_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DAT
 		}
 	}
 
-	d = ctdb_marshall_record(h, h->reqid, key, NULL, data);
-	if (d == NULL) {
-		/* error handling is tricky in this child code .... */
-		h->records_failed++;
-		return -1;
-	}
+	return 1;
+}
+
+/*
+  send a record from the local traverse to the originator
+ */
+static int ctdb_traverse_local_fn(struct ctdb_rec_data *d, void *p)
+{
+	struct ctdb_traverse_local_handle *h = talloc_get_type(p,
+							       struct ctdb_traverse_local_handle);
+	int res, status;
+	TDB_DATA outdata;
+
+	d->reqid = h->reqid;
 
 	outdata.dptr = (uint8_t *)d;
 	outdata.dsize = d->length;
@@ -149,6 +533,96 @@ struct traverse_all_state {
 	bool withemptyrecords;
 };
 
+/*
+  run a local traverse, sending the records and finally an empty record
+  to the originator. This runs in a worker or a child process.
+
+  Returns the number of records sent, negated if the traverse failed
+ */
+static int ctdb_traverse_local_run(struct ctdb_traverse_local_handle *h)
+{
+	struct ctdb_db_context *ctdb_db = h->ctdb_db;
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_rec_data *d;
+	TDB_DATA outdata;
+	int res, ret, status;
+
+	d = ctdb_marshall_record(h, h->reqid, tdb_null, NULL, tdb_null);
+	if (d == NULL) {
+		return 0;
+	}
+
+	res = ctdb_traverse_parallel(ctdb, ctdb_db->ltdb->tdb,
+				     ctdb_traverse_local_filter,
+				     ctdb_traverse_local_fn, h);
+	if (res == -1 || h->records_failed > 0) {
+		/* traverse failed */
+		res = -(h->records_sent);
+	} else {
+		res = h->records_sent;
+	}
+
+	/* Wait till all the data is flushed from output queue */
+	while (ctdb_queue_length(ctdb->daemon.queue) > 0) {
+		tevent_loop_once(ctdb->ev);
+	}
+
+	/* End traverse by sending empty record */
+	outdata.dptr = (uint8_t *)d;
+	outdata.dsize = d->length;
+	ret = ctdb_control(ctdb, h->srcnode, 0,
+			   CTDB_CONTROL_TRAVERSE_DATA,
+			   CTDB_CTRL_FLAG_NOREPLY, outdata,
+			   NULL, NULL, &status, NULL, NULL);
+	if (ret == -1 || status == -1) {
+		if (res > 0) {
+			res = -res;
+		}
+	}
+
+	talloc_free(d);
+
+	return res;
+}
+
+/* what a worker needs to know to run a local traverse */
+struct traverse_local_job {
+	uint32_t reqid;
+	uint32_t srcnode;
+	uint32_t withemptyrecords;
+};
+
+/*
+  run a local traverse in a worker process
+ */
+int32_t ctdb_traverse_local_job(struct ctdb_db_context *ctdb_db, TDB_DATA data)
+{
+	struct traverse_local_job *job = (struct traverse_local_job *)data.dptr;
+	struct ctdb_traverse_local_handle *h;
+	int res;
+
+	if (data.dsize != sizeof(struct traverse_local_job)) {
+		DEBUG(DEBUG_ERR, (__location__ " Invalid traverse job\n"));
+		return -1;
+	}
+
+	h = talloc_zero(ctdb_db, struct ctdb_traverse_local_handle);
+	if (h == NULL) {
+		return -1;
+	}
+
+	h->ctdb_db = ctdb_db;
+	h->reqid = job->reqid;
+	h->srcnode = job->srcnode;
+	h->withemptyrecords = job->withemptyrecords;
+
+	res = ctdb_traverse_local_run(h);
+
+	talloc_free(h);
+
+	return res;
+}
+
 /*
   setup a non-blocking traverse of a local ltdb. The callback function
   will be called on every record in the local ltdb. To stop the
@@ -161,6 +635,8 @@ static struct ctdb_traverse_local_handle *ctdb_traverse_local(struct ctdb_db_con
 							      struct traverse_all_state *all_state)
 {
 	struct ctdb_traverse_local_handle *h;
+	struct traverse_local_job job;
+	TDB_DATA data;
 	int ret;
 
 	h = talloc_zero(all_state, struct ctdb_traverse_local_handle);
@@ -168,6 +644,30 @@ static struct ctdb_traverse_local_handle *ctdb_traverse_local(struct ctdb_db_con
 		return NULL;
 	}
 
+	h->callback = callback;
+	h->private_data = all_state;
+	h->ctdb_db = ctdb_db;
+	h->client_reqid = all_state->client_reqid;
+	h->reqid = all_state->reqid;
+	h->srvid = all_state->srvid;
+	h->srcnode = all_state->srcnode;
+	h->withemptyrecords = all_state->withemptyrecords;
+
+	job.reqid = h->reqid;
+	job.srcnode = h->srcnode;
+	job.withemptyrecords = h->withemptyrecords;
+	data.dptr = (uint8_t *)&job;
+	data.dsize = sizeof(job);
+
+	h->job = ctdb_worker_job_send(ctdb_db, h, CTDB_WORKER_JOB_TRAVERSE,
+				      data, ctdb_traverse_job_done, h);
+	if (h->job != NULL) {
+		talloc_set_destructor(h, traverse_local_destructor);
+		DLIST_ADD(ctdb_db->traverse, h);
+		return h;
+	}
+
+	/* no worker available, fork a child for this traverse */
 	ret = pipe(h->fd);
 
 	if (ret != 0) {
@@ -184,22 +684,11 @@ static struct ctdb_traverse_local_handle *ctdb_traverse_local(struct ctdb_db_con
 		return NULL;
 	}
 
-	h->callback = callback;
-	h->private_data = all_state;
-	h->ctdb_db = ctdb_db;
-	h->client_reqid = all_state->client_reqid;
-	h->reqid = all_state->reqid;
-	h->srvid = all_state->srvid;
-	h->srcnode = all_state->srcnode;
-	h->withemptyrecords = all_state->withemptyrecords;
-
 	if (h->child == 0) {
 		/* start the traverse in the child */
-		int res, status;
+		int res;
 		pid_t parent = getpid();
 		struct ctdb_context *ctdb = ctdb_db->ctdb;
-		struct ctdb_rec_data *d;
-		TDB_DATA outdata;
 
 		close(h->fd[0]);
 
@@ -210,38 +699,7 @@ static struct ctdb_traverse_local_handle *ctdb_traverse_local(struct ctdb_db_con
 			_exit(0);
 		}
 
-		d = ctdb_marshall_record(h, h->reqid, tdb_null, NULL, tdb_null);
-		if (d == NULL) {
-			res = 0;
-			write(h->fd[1], &res, sizeof(int));
-			_exit(0);
-		}
-
-		res = tdb_traverse_read(ctdb_db->ltdb->tdb, ctdb_traverse_local_fn, h);
-		if (res == -1 || h->records_failed > 0) {
-			/* traverse failed */
-			res = -(h->records_sent);
-		} else {
-			res = h->records_sent;
-		}
-
-		/* Wait till all the data is flushed from output queue */
-		while (ctdb_queue_length(ctdb->daemon.queue) > 0) {
-			tevent_loop_once(ctdb->ev);
-		}
-
-		/* End traverse by sending empty record */
-		outdata.dptr = (uint8_t *)d;
-		outdata.dsize = d->length;
-		ret = ctdb_control(ctdb, h->srcnode, 0,
-				   CTDB_CONTROL_TRAVERSE_DATA,
-				   CTDB_CTRL_FLAG_NOREPLY, outdata,
-				   NULL, NULL, &status, NULL, NULL);
-		if (ret == -1 || status == -1) {
-			if (res > 0) {
-				res = -res;
-			}
-		}
+		res = ctdb_traverse_local_run(h);
 
 		write(h->fd[1], &res, sizeof(res));
 
@@ -270,7 +728,6 @@ static struct ctdb_traverse_local_handle *ctdb_traverse_local(struct ctdb_db_con
 	return h;
 }
 
-
 struct ctdb_traverse_all_handle {
 	struct ctdb_context *ctdb;
 	struct ctdb_db_context *ctdb_db;
@@ -75,6 +75,8 @@ static const struct {
 	{ "HopcountMakeSticky",   50,  offsetof(struct ctdb_tunable, hopcount_make_sticky) },
 	{ "StickyDuration",      600,  offsetof(struct ctdb_tunable, sticky_duration) },
 	{ "StickyPindown",       200,  offsetof(struct ctdb_tunable, sticky_pindown) },
+	{ "StickyPindownMin",     25,  offsetof(struct ctdb_tunable, sticky_pindown_min), false },
+	{ "StickyPindownMax",   2000,  offsetof(struct ctdb_tunable, sticky_pindown_max), false },
 	{ "NoIPTakeover",         0,  offsetof(struct ctdb_tunable, no_ip_takeover), false },
 	{ "DBRecordCountWarn",    100000,  offsetof(struct ctdb_tunable, db_record_count_warn), false },
 	{ "DBRecordSizeWarn",   10000000,  offsetof(struct ctdb_tunable, db_record_size_warn), false },
@@ -82,6 +84,32 @@ static const struct {
 	{ "PullDBPreallocation", 10*1024*1024,  offsetof(struct ctdb_tunable, pulldb_preallocation_size), false },
 	{ "NoIPHostOnAllDisabled",    0,  offsetof(struct ctdb_tunable, no_ip_host_on_all_disabled), false },
 	{ "Samba3AvoidDeadlocks", 0, offsetof(struct ctdb_tunable, samba3_hack), false },
+	{ "LockProcessesPerDB",   50, offsetof(struct ctdb_tunable, lock_processes_per_db), false },
+	{ "StatHistoryDepth",    600, offsetof(struct ctdb_tunable, stat_history_depth), false },
+	{ "StatRollupDepth",    1440, offsetof(struct ctdb_tunable, stat_rollup_depth), false },
+	{ "TraverseWorkers",       4, offsetof(struct ctdb_tunable, traverse_workers), false },
+	{ "DatabaseHashSizeMax", 6400063, offsetof(struct ctdb_tunable, database_hash_size_max), false },
+	{ "TDBMutexEnabled", 0, offsetof(struct ctdb_tunable, mutex_enabled), false },
+	{ "HotKeys",            10, offsetof(struct ctdb_tunable, hot_keys), false },
+	{ "HotKeysHalfLife",    60, offsetof(struct ctdb_tunable, hot_keys_half_life), false },
+	{ "ClientMaxInflight", 256, offsetof(struct ctdb_tunable, client_max_inflight), false },
+	{ "ClientMaxQueued",    64, offsetof(struct ctdb_tunable, client_max_queued), false },
+	{ "ClientQuantum",       4, offsetof(struct ctdb_tunable, client_quantum), false },
+	{ "WorkerProcesses",     2, offsetof(struct ctdb_tunable, worker_processes), false },
+	{ "RecoverFullCheckInterval", 10, offsetof(struct ctdb_tunable, recover_full_check_interval), false },
+	{ "RecLockLeaseTime", 15, offsetof(struct ctdb_tunable, reclock_lease_time), false },
+	{ "HeartbeatInterval", 500, offsetof(struct ctdb_tunable, heartbeat_interval), false },
+	{ "DeadNodePhi",         8, offsetof(struct ctdb_tunable, dead_node_phi), false },
+	{ "HeartbeatMinStdDev", 100, offsetof(struct ctdb_tunable, heartbeat_min_stddev), false },
+	{ "DmasterHintCacheSize", 1024, offsetof(struct ctdb_tunable, dmaster_hint_cache_size), false },
+	{ "ShipCallMigrateCount",  4, offsetof(struct ctdb_tunable, ship_call_migrate_count), false },
+	{ "TcpStreams",            2, offsetof(struct ctdb_tunable, tcp_streams), false },
+	{ "QueueNormalWeight",     4, offsetof(struct ctdb_tunable, queue_normal_weight), false },
+	{ "QueueBulkWeight",       1, offsetof(struct ctdb_tunable, queue_bulk_weight), false },
+	{ "MaxQueueBytes",         0, offsetof(struct ctdb_tunable, max_queue_bytes), false },
+	{ "MemPools",              1, offsetof(struct ctdb_tunable, mem_pools), false },
+	{ "LockProcessesMax",    100, offsetof(struct ctdb_tunable, lock_processes_max), false },
+	{ "CallShards",            0, offsetof(struct ctdb_tunable, call_shards), false },
 };
 
 /*
@@ -175,6 +203,7 @@ int32_t ctdb_control_set_tunable(struct ctdb_context *ctdb, TDB_DATA indata)
 	}
 
 	*(uint32_t *)(tunable_map[i].offset + (uint8_t*)&ctdb->tunable) = t->value;
+	ctdb_state_changed(ctdb);
 
 	return 0;
 }
@@ -29,6 +29,7 @@
 #include "lib/util/dlinklist.h"
 #include "../include/ctdb_private.h"
 #include "../common/rb_tree.h"
+#include "../common/key_index.h"
 
 #define TIMELIMIT() timeval_current_ofs(10, 0)
 
@@ -40,6 +41,8 @@ struct ctdb_vacuum_child_context {
 	/* fd child writes status to */
 	int fd[2];
 	pid_t child_pid;
+	/* set instead of child_pid when vacuuming in a worker process */
+	struct ctdb_worker_job *job;
 	enum vacuum_child_status status;
 	struct timeval start_time;
 };
@@ -100,24 +103,23 @@ struct delete_records_list {
 };
 
 /**
- * Store key and header in a tree, indexed by the key hash.
+ * Allocate a delete_record_data holding a copy of key and header.
  */
-static int insert_delete_record_data_into_tree(struct ctdb_context *ctdb,
-					       struct ctdb_db_context *ctdb_db,
-					       trbt_tree_t *tree,
-					       const struct ctdb_ltdb_header *hdr,
-					       TDB_DATA key)
+static struct delete_record_data *new_delete_record_data(TALLOC_CTX *mem_ctx,
+					struct ctdb_context *ctdb,
+					struct ctdb_db_context *ctdb_db,
+					const struct ctdb_ltdb_header *hdr,
+					TDB_DATA key)
 {
 	struct delete_record_data *dd;
-	uint32_t hash;
 	size_t len;
 
 	len = offsetof(struct delete_record_data, keydata) + key.dsize;
 
-	dd = (struct delete_record_data *)talloc_size(tree, len);
+	dd = (struct delete_record_data *)talloc_size(mem_ctx, len);
 	if (dd == NULL) {
 		DEBUG(DEBUG_ERR,(__location__ " Out of memory\n"));
-		return -1;
+		return NULL;
 	}
 	talloc_set_name_const(dd, "struct delete_record_data");
 
@@ -129,6 +131,26 @@ static int insert_delete_record_data_into_tree(struct ctdb_context *ctdb,
 
 	dd->hdr = *hdr;
 
+	return dd;
+}
+
+/**
+ * Store key and header in a tree, indexed by the key hash.
+ */
+static int insert_delete_record_data_into_tree(struct ctdb_context *ctdb,
+					       struct ctdb_db_context *ctdb_db,
+					       trbt_tree_t *tree,
+					       const struct ctdb_ltdb_header *hdr,
+					       TDB_DATA key)
+{
+	struct delete_record_data *dd;
+	uint32_t hash;
+
+	dd = new_delete_record_data(tree, ctdb, ctdb_db, hdr, key);
+	if (dd == NULL) {
+		return -1;
+	}
+
 	hash = ctdb_hash(&key);
 
 	trbt_insert32(tree, hash, dd);
@@ -275,6 +297,49 @@ static int vacuum_traverse(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data,
 	return res;
 }
 
+/*
+ * filter for the parallel full vacuum traverse: only deleted records
+ * for which we are dmaster are merged into vacuum_traverse()
+ */
+static int vacuum_traverse_filter(TDB_DATA key, TDB_DATA data, void *private)
+{
+	struct vacuum_data *vdata = talloc_get_type(private, struct vacuum_data);
+	struct ctdb_context *ctdb = vdata->ctdb;
+	struct ctdb_ltdb_header *hdr;
+
+	if (ctdb_lmaster(ctdb, &key) >= ctdb->num_nodes) {
+		DEBUG(DEBUG_CRIT, (__location__
+				   " lmaster >= ctdb->num_nodes[%u] for key"
+				   " with hash[%u]!\n",
+				   (unsigned)ctdb->num_nodes,
+				   (unsigned)ctdb_hash(&key)));
+		return -1;
+	}
+
+	if (data.dsize != sizeof(struct ctdb_ltdb_header)) {
+		return 0;
+	}
+
+	hdr = (struct ctdb_ltdb_header *)data.dptr;
+	if (hdr->dmaster != ctdb->pnn) {
+		return 0;
+	}
+
+	return 1;
+}
+
+static int vacuum_traverse_merge(struct ctdb_rec_data *rec, void *private)
+{
+	TDB_DATA key, data;
+
+	key.dptr = &rec->data[0];
+	key.dsize = rec->keylen;
+	data.dptr = &rec->data[rec->keylen];
+	data.dsize = rec->datalen;
+
+	return vacuum_traverse(NULL, key, data, private);
+}
+
 /*
  * traverse the tree of records to delete and marshall them into
  * a blob
@@ -303,6 +368,20 @@ static int delete_marshall_traverse(void *param, void *data)
 	return 0;
 }
 
+/**
+ * Parser for the checks of records queued for deletion:
+ * copy out the header and return 1 if the record is not empty.
+ */
+static int vacuum_empty_record_parser(struct ctdb_ltdb_header *header,
+				      TDB_DATA data, void *private_data)
+{
+	struct ctdb_ltdb_header *hdr = private_data;
+
+	*hdr = *header;
+
+	return (data.dsize == 0) ? 0 : 1;
+}
+
 /**
  * Variant of delete_marshall_traverse() that bumps the
  * RSN of each traversed record in the database.
@@ -319,8 +398,8 @@ static int delete_marshall_traverse_first(void *param, void *data)
 	struct delete_records_list *recs = talloc_get_type(param, struct delete_records_list);
 	struct ctdb_db_context *ctdb_db = dd->ctdb_db;
 	struct ctdb_context *ctdb = ctdb_db->ctdb;
-	struct ctdb_ltdb_header *header;
-	TDB_DATA tdb_data, ctdb_data;
+	struct ctdb_ltdb_header header;
+	TDB_DATA ctdb_data;
 	uint32_t lmaster;
 	uint32_t hash = ctdb_hash(&(dd->key));
 	int res;
@@ -341,8 +420,9 @@ static int delete_marshall_traverse_first(void *param, void *data)
 	 * changed and that we are still its lmaster and dmaster.
 	 */
 
-	tdb_data = tdb_fetch(ctdb_db->ltdb->tdb, dd->key);
-	if (tdb_data.dsize < sizeof(struct ctdb_ltdb_header)) {
+	res = ctdb_ltdb_parse(ctdb_db, dd->key, vacuum_empty_record_parser,
+			      &header);
+	if (res == -1) {
 		DEBUG(DEBUG_INFO, (__location__ ": record with hash [0x%08x] "
 				   "on database db[%s] does not exist or is not"
 				   " a ctdb-record.  skipping.\n",
@@ -350,7 +430,7 @@ static int delete_marshall_traverse_first(void *param, void *data)
 		goto skip;
 	}
 
-	if (tdb_data.dsize > sizeof(struct ctdb_ltdb_header)) {
+	if (res != 0) {
 		DEBUG(DEBUG_INFO, (__location__ ": record with hash [0x%08x] "
 				   "on database db[%s] has been recycled. "
 				   "skipping.\n",
@@ -358,9 +438,7 @@ static int delete_marshall_traverse_first(void *param, void *data)
 		goto skip;
 	}
 
-	header = (struct ctdb_ltdb_header *)tdb_data.dptr;
-
-	if (header->flags & CTDB_REC_RO_FLAGS) {
+	if (header.flags & CTDB_REC_RO_FLAGS) {
 		DEBUG(DEBUG_INFO, (__location__ ": record with hash [0x%08x] "
 				   "on database db[%s] has read-only flags. "
 				   "skipping.\n",
@@ -368,7 +446,7 @@ static int delete_marshall_traverse_first(void *param, void *data)
 		goto skip;
 	}
 
-	if (header->dmaster != ctdb->pnn) {
+	if (header.dmaster != ctdb->pnn) {
 		DEBUG(DEBUG_INFO, (__location__ ": record with hash [0x%08x] "
 				   "on database db[%s] has been migrated away. "
 				   "skipping.\n",
@@ -376,7 +454,7 @@ static int delete_marshall_traverse_first(void *param, void *data)
 		goto skip;
 	}
 
-	if (header->rsn != dd->hdr.rsn) {
+	if (header.rsn != dd->hdr.rsn) {
 		DEBUG(DEBUG_INFO, (__location__ ": record with hash [0x%08x] "
 				   "on database db[%s] seems to have been "
 				   "migrated away and back again (with empty "
@@ -404,10 +482,9 @@ static int delete_marshall_traverse_first(void *param, void *data)
 	 * on the record's dmaster.
 	 */
 
-	ctdb_data.dptr = tdb_data.dptr + sizeof(struct ctdb_ltdb_header);
-	ctdb_data.dsize = tdb_data.dsize - sizeof(struct ctdb_ltdb_header);
+	ZERO_STRUCT(ctdb_data);
 
-	res = ctdb_ltdb_store(ctdb_db, dd->key, header, ctdb_data);
+	res = ctdb_ltdb_store(ctdb_db, dd->key, &header, ctdb_data);
 	if (res != 0) {
 		DEBUG(DEBUG_ERR, (__location__ ": Failed to store record with "
 				  "key hash [0x%08x] on database db[%s].\n",
@@ -427,10 +504,6 @@ skip:
 	dd = NULL;
 
 done:
-	if (tdb_data.dptr != NULL) {
-		free(tdb_data.dptr);
-	}
-
 	if (dd == NULL) {
 		return 0;
 	}
@@ -466,8 +539,7 @@ static int delete_queue_traverse(void *param, void *data)
 	struct ctdb_db_context *ctdb_db = dd->ctdb_db;
 	struct ctdb_context *ctdb = ctdb_db->ctdb; /* or dd->ctdb ??? */
 	int res;
-	struct ctdb_ltdb_header *header;
-	TDB_DATA tdb_data;
+	struct ctdb_ltdb_header header;
 	uint32_t lmaster;
 	uint32_t hash = ctdb_hash(&(dd->key));
 
@@ -483,25 +555,24 @@ static int delete_queue_traverse(void *param, void *data)
 		return 0;
 	}
 
-	tdb_data = tdb_fetch(ctdb_db->ltdb->tdb, dd->key);
-	if (tdb_data.dsize < sizeof(struct ctdb_ltdb_header)) {
+	res = ctdb_ltdb_parse(ctdb_db, dd->key, vacuum_empty_record_parser,
+			      &header);
+	if (res == -1) {
 		/* Does not exist or not a ctdb record. Skip. */
 		goto skipped;
 	}
 
-	if (tdb_data.dsize > sizeof(struct ctdb_ltdb_header)) {
+	if (res != 0) {
 		/* The record has been recycled (filled with data). Skip. */
 		goto skipped;
 	}
 
-	header = (struct ctdb_ltdb_header *)tdb_data.dptr;
-
-	if (header->dmaster != ctdb->pnn) {
+	if (header.dmaster != ctdb->pnn) {
 		/* The record has been migrated off the node. Skip. */
 		goto skipped;
 	}
 
-	if (header->rsn != dd->hdr.rsn) {
+	if (header.rsn != dd->hdr.rsn) {
 		/*
 		 * The record has been migrated off the node and back again.
 		 * But not requeued for deletion. Skip it.
@@ -534,7 +605,7 @@ static int delete_queue_traverse(void *param, void *data)
 		goto done;
 	}
 
-	/* use header->flags or dd->hdr.flags ?? */
+	/* use header.flags or dd->hdr.flags ?? */
 	if (dd->hdr.flags & CTDB_REC_FLAG_MIGRATED_WITH_DATA) {
 		res = add_record_to_delete_list(vdata, dd->key, &dd->hdr);
 
@@ -570,9 +641,6 @@ skipped:
 	vdata->fast_skipped++;
 
 done:
-	if (tdb_data.dptr != NULL) {
-		free(tdb_data.dptr);
-	}
 	tdb_chainunlock(ctdb_db->ltdb->tdb, dd->key);
 
 	return 0;
@@ -591,8 +659,7 @@ static int delete_record_traverse(void *param, void *data)
 	struct ctdb_db_context *ctdb_db = dd->ctdb_db;
 	struct ctdb_context *ctdb = ctdb_db->ctdb;
 	int res;
-	struct ctdb_ltdb_header *header;
-	TDB_DATA tdb_data;
+	struct ctdb_ltdb_header header;
 	uint32_t lmaster;
 	bool deleted = false;
 	uint32_t hash = ctdb_hash(&(dd->key));
@@ -612,8 +679,9 @@ static int delete_record_traverse(void *param, void *data)
 	 * changed and that we are still its lmaster and dmaster.
 	 */
 
-	tdb_data = tdb_fetch(ctdb_db->ltdb->tdb, dd->key);
-	if (tdb_data.dsize < sizeof(struct ctdb_ltdb_header)) {
+	res = ctdb_ltdb_parse(ctdb_db, dd->key, vacuum_empty_record_parser,
+			      &header);
+	if (res == -1) {
 		DEBUG(DEBUG_INFO, (__location__ ": record with hash [0x%08x] "
 				   "on database db[%s] does not exist or is not"
 				   " a ctdb-record.  skipping.\n",
@@ -622,7 +690,7 @@ static int delete_record_traverse(void *param, void *data)
 		goto done;
 	}
 
-	if (tdb_data.dsize > sizeof(struct ctdb_ltdb_header)) {
+	if (res != 0) {
 		DEBUG(DEBUG_INFO, (__location__ ": record with hash [0x%08x] "
 				   "on database db[%s] has been recycled. "
 				   "skipping.\n",
@@ -631,9 +699,7 @@ static int delete_record_traverse(void *param, void *data)
 		goto done;
 	}
 
-	header = (struct ctdb_ltdb_header *)tdb_data.dptr;
-
-	if (header->flags & CTDB_REC_RO_FLAGS) {
+	if (header.flags & CTDB_REC_RO_FLAGS) {
 		DEBUG(DEBUG_INFO, (__location__ ": record with hash [0x%08x] "
 				   "on database db[%s] has read-only flags. "
 				   "skipping.\n",
@@ -642,7 +708,7 @@ static int delete_record_traverse(void *param, void *data)
 		goto done;
 	}
 
-	if (header->dmaster != ctdb->pnn) {
+	if (header.dmaster != ctdb->pnn) {
 		DEBUG(DEBUG_INFO, (__location__ ": record with hash [0x%08x] "
 				   "on database db[%s] has been migrated away. "
 				   "skipping.\n",
@@ -651,7 +717,7 @@ static int delete_record_traverse(void *param, void *data)
 		goto done;
 	}
 
-	if (header->rsn != dd->hdr.rsn + 1) {
+	if (header.rsn != dd->hdr.rsn + 1) {
 		/*
 		 * The record has been migrated off the node and back again.
 		 * But not requeued for deletion. Skip it.
@@ -696,9 +762,6 @@ static int delete_record_traverse(void *param, void *data)
 	       "local data base db[%s].\n", hash, ctdb_db->db_name));
 
 done:
-	if (tdb_data.dptr != NULL) {
-		free(tdb_data.dptr);
-	}
 
 	tdb_chainunlock(ctdb_db->ltdb->tdb, dd->key);
 
@@ -723,7 +786,7 @@ done:
 static void ctdb_vacuum_db_fast(struct ctdb_db_context *ctdb_db,
 				struct vacuum_data *vdata)
 {
-	trbt_traversearray32(ctdb_db->delete_queue, 1, delete_queue_traverse, vdata);
+	key_index_traverse(ctdb_db->delete_queue, delete_queue_traverse, vdata);
 
 	if (vdata->fast_total > 0) {
 		DEBUG(DEBUG_INFO,
@@ -766,13 +829,23 @@ static int ctdb_vacuum_db_full(struct ctdb_db_context *ctdb_db,
 		return 0;
 	}
 
-	ret = tdb_traverse_read(ctdb_db->ltdb->tdb, vacuum_traverse, vdata);
+	ret = ctdb_traverse_parallel(ctdb_db->ctdb, ctdb_db->ltdb->tdb,
+				     vacuum_traverse_filter,
+				     vacuum_traverse_merge, vdata);
 	if (ret == -1 || vdata->traverse_error) {
 		DEBUG(DEBUG_ERR, (__location__ " Traverse error in vacuuming "
 				  "'%s'\n", ctdb_db->db_name));
 		return -1;
 	}
 
+	/* records filtered out by the traverse workers were skipped */
+	if (ret > vdata->full_total) {
+		vdata->full_skipped += ret - vdata->full_total;
+		vdata->full_total = ret;
+	}
+
+	ctdb_db_note_record_count(ctdb_db, vdata->full_total);
+
 	if (vdata->full_total > 0) {
 		DEBUG(DEBUG_INFO,
 		      (__location__
@@ -1242,6 +1315,7 @@ static int ctdb_vacuum_db(struct ctdb_db_context *ctdb_db,
 			  bool full_vacuum_run)
 {
 	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_vnn_map *vnn_map;
 	int ret, pnn;
 
 	DEBUG(DEBUG_INFO, (__location__ " Entering %s vacuum run for db "
@@ -1249,11 +1323,13 @@ static int ctdb_vacuum_db(struct ctdb_db_context *ctdb_db,
 			   full_vacuum_run ? "full" : "fast",
 			   ctdb_db->db_name, ctdb_db->db_id));
 
-	ret = ctdb_ctrl_getvnnmap(ctdb, TIMELIMIT(), CTDB_CURRENT_NODE, ctdb, &ctdb->vnn_map);
+	ret = ctdb_ctrl_getvnnmap(ctdb, TIMELIMIT(), CTDB_CURRENT_NODE, ctdb, &vnn_map);
 	if (ret != 0) {
 		DEBUG(DEBUG_ERR, ("Unable to get vnnmap from local node\n"));
 		return ret;
 	}
+	talloc_free(ctdb->vnn_map);
+	ctdb->vnn_map = vnn_map;
 
 	pnn = ctdb_ctrl_getpnn(ctdb, TIMELIMIT(), CTDB_CURRENT_NODE);
 	if (pnn == -1) {
@@ -1488,6 +1564,139 @@ static int ctdb_vacuum_and_repack_db(struct ctdb_db_context *ctdb_db,
 	return 0;
 }
 
+/* what a worker needs to know to vacuum a database */
+struct vacuum_job {
+	uint32_t full_vacuum_run;
+	/* the records queued for fast vacuuming, must be last */
+	struct ctdb_marshall_buffer delete_queue;
+};
+
+/*
+ * vacuum and repack a db in a worker process.
+ * The delete queue of the worker is stale, so it is replaced by the
+ * one sent by the daemon
+ */
+int32_t ctdb_vacuum_job(struct ctdb_db_context *ctdb_db, TDB_DATA data)
+{
+	struct vacuum_job *job = (struct vacuum_job *)data.dptr;
+	struct ctdb_rec_data *r = NULL;
+	TALLOC_CTX *tmp_ctx;
+	uint32_t i;
+	int ret;
+
+	if (data.dsize < offsetof(struct vacuum_job, delete_queue) +
+			 offsetof(struct ctdb_marshall_buffer, data)) {
+		DEBUG(DEBUG_ERR, (__location__ " Invalid vacuum job\n"));
+		return -1;
+	}
+
+	talloc_free(ctdb_db->delete_queue);
+	ctdb_db->delete_queue = key_index_create(ctdb_db);
+	if (ctdb_db->delete_queue == NULL) {
+		DEBUG(DEBUG_ERR, (__location__ " Out of memory\n"));
+		return -1;
+	}
+
+	for (i = 0; i < job->delete_queue.count; i++) {
+		struct delete_record_data *dd;
+		struct ctdb_ltdb_header hdr;
+		TDB_DATA key;
+
+		r = ctdb_marshall_loop_next(&job->delete_queue, r, NULL, &hdr,
+					    &key, NULL);
+		dd = new_delete_record_data(ctdb_db->delete_queue,
+					    ctdb_db->ctdb, ctdb_db, &hdr, key);
+		if (dd == NULL) {
+			return -1;
+		}
+		if (key_index_insert(ctdb_db->delete_queue, key, dd) != 0) {
+			talloc_free(dd);
+			return -1;
+		}
+	}
+
+	DEBUG(DEBUG_INFO, ("Vacuuming db %s in worker %d\n",
+			   ctdb_db->db_name, getpid()));
+
+	tmp_ctx = talloc_new(ctdb_db);
+	if (tmp_ctx == NULL) {
+		return -1;
+	}
+	ret = ctdb_vacuum_and_repack_db(ctdb_db, tmp_ctx,
+					job->full_vacuum_run);
+	talloc_free(tmp_ctx);
+
+	/* the next job brings its own records */
+	talloc_free(ctdb_db->delete_queue);
+	ctdb_db->delete_queue = key_index_create(ctdb_db);
+
+	return ret;
+}
+
+static int vacuum_job_marshall_traverse(void *param, void *data)
+{
+	struct delete_record_data *dd = talloc_get_type(data, struct delete_record_data);
+	struct ctdb_marshall_buffer **m = (struct ctdb_marshall_buffer **)param;
+
+	*m = ctdb_marshall_add(NULL, *m, dd->ctdb_db->db_id, 0, dd->key,
+			       &dd->hdr, tdb_null);
+	if (*m == NULL) {
+		DEBUG(DEBUG_ERR, (__location__ " Failed to marshall record\n"));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void vacuum_job_done(int32_t status, void *private_data);
+
+/*
+ * send the vacuuming of a db to a worker process, along with the
+ * records in the delete queue.
+ * Returns NULL if there is no worker to run it
+ */
+static struct ctdb_worker_job *vacuum_job_send(struct ctdb_vacuum_child_context *child_ctx,
+					       bool full_vacuum_run)
+{
+	struct ctdb_db_context *ctdb_db = child_ctx->vacuum_handle->ctdb_db;
+	struct ctdb_marshall_buffer *m;
+	struct ctdb_worker_job *job;
+	struct vacuum_job *job_data;
+	TDB_DATA data;
+
+	if (ctdb_db->ctdb->tunable.worker_processes == 0) {
+		return NULL;
+	}
+
+	m = talloc_zero_size(child_ctx, offsetof(struct ctdb_marshall_buffer, data));
+	if (m == NULL) {
+		return NULL;
+	}
+	m->db_id = ctdb_db->db_id;
+
+	if (key_index_traverse(ctdb_db->delete_queue,
+			       vacuum_job_marshall_traverse, &m) != 0) {
+		talloc_free(m);
+		return NULL;
+	}
+
+	data.dsize = offsetof(struct vacuum_job, delete_queue) + talloc_get_size(m);
+	data.dptr  = talloc_size(m, data.dsize);
+	if (data.dptr == NULL) {
+		talloc_free(m);
+		return NULL;
+	}
+	job_data = (struct vacuum_job *)data.dptr;
+	job_data->full_vacuum_run = full_vacuum_run;
+	memcpy(&job_data->delete_queue, m, talloc_get_size(m));
+
+	job = ctdb_worker_job_send(ctdb_db, child_ctx, CTDB_WORKER_JOB_VACUUM,
+				   data, vacuum_job_done, child_ctx);
+	talloc_free(m);
+
+	return job;
+}
+
 static uint32_t get_vacuum_interval(struct ctdb_db_context *ctdb_db)
 {
 	uint32_t interval = ctdb_db->ctdb->tunable.vacuum_interval;
@@ -1503,11 +1712,11 @@ static int vacuum_child_destructor(struct ctdb_vacuum_child_context *child_ctx)
 
 	DEBUG(DEBUG_INFO,("Vacuuming took %.3f seconds for database %s\n", l, ctdb_db->db_name));
 
-	if (child_ctx->child_pid != -1) {
-		ctdb_kill(ctdb, child_ctx->child_pid, SIGKILL);
-	} else {
+	if (child_ctx->status == VACUUM_OK || child_ctx->status == VACUUM_ERROR) {
 		/* Bump the number of successful fast-path runs. */
 		child_ctx->vacuum_handle->fast_path_count++;
+	} else if (child_ctx->child_pid != -1) {
+		ctdb_kill(ctdb, child_ctx->child_pid, SIGKILL);
 	}
 
 	DLIST_REMOVE(ctdb->vacuumers, child_ctx);
@@ -1560,70 +1769,54 @@ static void vacuum_child_handler(struct event_context *ev, struct fd_event *fde,
 }
 
 /*
- * this event is called every time we need to start a new vacuum process
+ * this is called when vacuuming in a worker process has completed
  */
-static void
-ctdb_vacuum_event(struct event_context *ev, struct timed_event *te,
-			       struct timeval t, void *private_data)
+static void vacuum_job_done(int32_t status, void *private_data)
 {
-	struct ctdb_vacuum_handle *vacuum_handle = talloc_get_type(private_data, struct ctdb_vacuum_handle);
-	struct ctdb_db_context *ctdb_db = vacuum_handle->ctdb_db;
-	struct ctdb_context *ctdb = ctdb_db->ctdb;
-	struct ctdb_vacuum_child_context *child_ctx;
-	struct tevent_fd *fde;
-	int ret;
+	struct ctdb_vacuum_child_context *child_ctx = talloc_get_type(private_data, struct ctdb_vacuum_child_context);
 
-	/* we dont vacuum if we are in recovery mode, or db frozen */
-	if (ctdb->recovery_mode == CTDB_RECOVERY_ACTIVE ||
-	    ctdb->freeze_mode[ctdb_db->priority] != CTDB_FREEZE_NONE) {
-		DEBUG(DEBUG_INFO, ("Not vacuuming %s (%s)\n", ctdb_db->db_name,
-				   ctdb->recovery_mode == CTDB_RECOVERY_ACTIVE ? "in recovery"
-				   : ctdb->freeze_mode[ctdb_db->priority] == CTDB_FREEZE_PENDING
-				   ? "freeze pending"
-				   : "frozen"));
-		event_add_timed(ctdb->ev, vacuum_handle,
-			timeval_current_ofs(get_vacuum_interval(ctdb_db), 0),
-			ctdb_vacuum_event, vacuum_handle);
-		return;
-	}
+	DEBUG(DEBUG_INFO,("Vacuuming job finished for db %s\n", child_ctx->vacuum_handle->ctdb_db->db_name));
+	child_ctx->job = NULL;
 
-	child_ctx = talloc(vacuum_handle, struct ctdb_vacuum_child_context);
-	if (child_ctx == NULL) {
-		DEBUG(DEBUG_CRIT, (__location__ " Failed to allocate child context for vacuuming of %s\n", ctdb_db->db_name));
-		ctdb_fatal(ctdb, "Out of memory when crating vacuum child context. Shutting down\n");
+	if (status != 0) {
+		child_ctx->status = VACUUM_ERROR;
+		DEBUG(DEBUG_ERR, ("A vacuum job failed with an error for database %s. status=%d\n", child_ctx->vacuum_handle->ctdb_db->db_name, status));
+	} else {
+		child_ctx->status = VACUUM_OK;
 	}
 
+	talloc_free(child_ctx);
+}
+
+/*
+ * fork a child process to vacuum the db, used when no worker
+ * process is available
+ */
+static int ctdb_vacuum_fork(struct ctdb_vacuum_child_context *child_ctx,
+			    bool full_vacuum_run)
+{
+	struct ctdb_db_context *ctdb_db = child_ctx->vacuum_handle->ctdb_db;
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct tevent_fd *fde;
+	int ret;
 
 	ret = pipe(child_ctx->fd);
 	if (ret != 0) {
-		talloc_free(child_ctx);
 		DEBUG(DEBUG_ERR, ("Failed to create pipe for vacuum child process.\n"));
-		event_add_timed(ctdb->ev, vacuum_handle,
-			timeval_current_ofs(get_vacuum_interval(ctdb_db), 0),
-			ctdb_vacuum_event, vacuum_handle);
-		return;
-	}
-
-	if (vacuum_handle->fast_path_count > ctdb->tunable.vacuum_fast_path_count) {
-		vacuum_handle->fast_path_count = 0;
+		return -1;
 	}
 
 	child_ctx->child_pid = ctdb_fork(ctdb);
 	if (child_ctx->child_pid == (pid_t)-1) {
 		close(child_ctx->fd[0]);
 		close(child_ctx->fd[1]);
-		talloc_free(child_ctx);
 		DEBUG(DEBUG_ERR, ("Failed to fork vacuum child process.\n"));
-		event_add_timed(ctdb->ev, vacuum_handle,
-			timeval_current_ofs(get_vacuum_interval(ctdb_db), 0),
-			ctdb_vacuum_event, vacuum_handle);
-		return;
+		return -1;
 	}
 
 
 	if (child_ctx->child_pid == 0) {
 		char cc = 0;
-		bool full_vacuum_run = false;
 		close(child_ctx->fd[0]);
 
 		DEBUG(DEBUG_INFO,("Vacuuming child process %d for db %s started\n", getpid(), ctdb_db->db_name));
@@ -1636,11 +1829,6 @@ ctdb_vacuum_event(struct event_context *ev, struct timed_event *te,
 		/* 
 		 * repack the db
 		 */
-		if ((ctdb->tunable.vacuum_fast_path_count > 0) &&
-		    (vacuum_handle->fast_path_count == 0))
-		{
-			full_vacuum_run = true;
-		}
 		cc = ctdb_vacuum_and_repack_db(ctdb_db, child_ctx,
 					       full_vacuum_run);
 
@@ -1651,6 +1839,73 @@ ctdb_vacuum_event(struct event_context *ev, struct timed_event *te,
 	set_close_on_exec(child_ctx->fd[0]);
 	close(child_ctx->fd[1]);
 
+	DEBUG(DEBUG_DEBUG, (__location__ " Created PIPE FD:%d to child vacuum process\n", child_ctx->fd[0]));
+
+	fde = event_add_fd(ctdb->ev, child_ctx, child_ctx->fd[0],
+			   EVENT_FD_READ, vacuum_child_handler, child_ctx);
+	tevent_fd_set_auto_close(fde);
+
+	return 0;
+}
+
+/*
+ * this event is called every time we need to start a new vacuum process
+ */
+static void
+ctdb_vacuum_event(struct event_context *ev, struct timed_event *te,
+			       struct timeval t, void *private_data)
+{
+	struct ctdb_vacuum_handle *vacuum_handle = talloc_get_type(private_data, struct ctdb_vacuum_handle);
+	struct ctdb_db_context *ctdb_db = vacuum_handle->ctdb_db;
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_vacuum_child_context *child_ctx;
+	bool full_vacuum_run = false;
+	int ret;
+
+	/* we dont vacuum if we are in recovery mode, or db frozen */
+	if (ctdb->recovery_mode == CTDB_RECOVERY_ACTIVE ||
+	    ctdb->freeze_mode[ctdb_db->priority] != CTDB_FREEZE_NONE) {
+		DEBUG(DEBUG_INFO, ("Not vacuuming %s (%s)\n", ctdb_db->db_name,
+				   ctdb->recovery_mode == CTDB_RECOVERY_ACTIVE ? "in recovery"
+				   : ctdb->freeze_mode[ctdb_db->priority] == CTDB_FREEZE_PENDING
+				   ? "freeze pending"
+				   : "frozen"));
+		event_add_timed(ctdb->ev, vacuum_handle,
+			timeval_current_ofs(get_vacuum_interval(ctdb_db), 0),
+			ctdb_vacuum_event, vacuum_handle);
+		return;
+	}
+
+	child_ctx = talloc(vacuum_handle, struct ctdb_vacuum_child_context);
+	if (child_ctx == NULL) {
+		DEBUG(DEBUG_CRIT, (__location__ " Failed to allocate child context for vacuuming of %s\n", ctdb_db->db_name));
+		ctdb_fatal(ctdb, "Out of memory when crating vacuum child context. Shutting down\n");
+	}
+	child_ctx->vacuum_handle = vacuum_handle;
+	child_ctx->child_pid = -1;
+
+	if (vacuum_handle->fast_path_count > ctdb->tunable.vacuum_fast_path_count) {
+		vacuum_handle->fast_path_count = 0;
+	}
+
+	if ((ctdb->tunable.vacuum_fast_path_count > 0) &&
+	    (vacuum_handle->fast_path_count == 0))
+	{
+		full_vacuum_run = true;
+	}
+
+	child_ctx->job = vacuum_job_send(child_ctx, full_vacuum_run);
+	if (child_ctx->job == NULL) {
+		ret = ctdb_vacuum_fork(child_ctx, full_vacuum_run);
+		if (ret != 0) {
+			talloc_free(child_ctx);
+			event_add_timed(ctdb->ev, vacuum_handle,
+				timeval_current_ofs(get_vacuum_interval(ctdb_db), 0),
+				ctdb_vacuum_event, vacuum_handle);
+			return;
+		}
+	}
+
 	child_ctx->status = VACUUM_RUNNING;
 	child_ctx->start_time = timeval_current();
 
@@ -1661,7 +1916,7 @@ ctdb_vacuum_event(struct event_context *ev, struct timed_event *te,
 	 * Clear the fastpath vacuuming list in the parent.
 	 */
 	talloc_free(ctdb_db->delete_queue);
-	ctdb_db->delete_queue = trbt_create(ctdb_db, 0);
+	ctdb_db->delete_queue = key_index_create(ctdb_db);
 	if (ctdb_db->delete_queue == NULL) {
 		/* fatal here? ... */
 		ctdb_fatal(ctdb, "Out of memory when re-creating vacuum tree "
@@ -1672,14 +1927,7 @@ ctdb_vacuum_event(struct event_context *ev, struct timed_event *te,
 		timeval_current_ofs(ctdb->tunable.vacuum_max_run_time, 0),
 		vacuum_child_timeout, child_ctx);
 
-	DEBUG(DEBUG_DEBUG, (__location__ " Created PIPE FD:%d to child vacuum process\n", child_ctx->fd[0]));
-
-	fde = event_add_fd(ctdb->ev, child_ctx, child_ctx->fd[0],
-			   EVENT_FD_READ, vacuum_child_handler, child_ctx);
-	tevent_fd_set_auto_close(fde);
-
 	vacuum_handle->child_ctx = child_ctx;
-	child_ctx->vacuum_handle = vacuum_handle;
 }
 
 void ctdb_stop_vacuuming(struct ctdb_context *ctdb)
@@ -1738,7 +1986,8 @@ static void remove_record_from_delete_queue(struct ctdb_db_context *ctdb_db,
 			     ctdb_lmaster(ctdb_db->ctdb, &key),
 			     hdr->flags & CTDB_REC_FLAG_MIGRATED_WITH_DATA ? "yes" : "no"));
 
-	kd = (struct delete_record_data *)trbt_lookup32(ctdb_db->delete_queue, hash);
+	kd = (struct delete_record_data *)key_index_remove_hash(
+		ctdb_db->delete_queue, hash, key);
 	if (kd == NULL) {
 		DEBUG(DEBUG_DEBUG, (__location__
 				    " remove_record_from_delete_queue: "
@@ -1747,17 +1996,6 @@ static void remove_record_from_delete_queue(struct ctdb_db_context *ctdb_db,
 		return;
 	}
 
-	if ((kd->key.dsize != key.dsize) ||
-	    (memcmp(kd->key.dptr, key.dptr, key.dsize) != 0))
-	{
-		DEBUG(DEBUG_DEBUG, (__location__
-				    " remove_record_from_delete_queue: "
-				    "hash collision for key with hash[0x%08x] "
-				    "in db[%s] - skipping\n",
-				    hash, ctdb_db->db_name));
-		return;
-	}
-
 	DEBUG(DEBUG_DEBUG, (__location__
 			    " remove_record_from_delete_queue: "
 			    "removing key with hash[0x%08x]\n",
@@ -1770,13 +2008,13 @@ static void remove_record_from_delete_queue(struct ctdb_db_context *ctdb_db,
 
 /**
  * Insert a record into the ctdb_db context's delete queue,
- * handling hash collisions.
+ * replacing any entry already queued for the same key.
  */
 static int insert_record_into_delete_queue(struct ctdb_db_context *ctdb_db,
 					   const struct ctdb_ltdb_header *hdr,
 					   TDB_DATA key)
 {
-	struct delete_record_data *kd;
+	struct delete_record_data *kd, *old_kd;
 	uint32_t hash;
 	int ret;
 
@@ -1792,35 +2030,33 @@ static int insert_record_into_delete_queue(struct ctdb_db_context *ctdb_db,
 			    ctdb_lmaster(ctdb_db->ctdb, &key),
 			    hdr->flags & CTDB_REC_FLAG_MIGRATED_WITH_DATA ? "yes" : "no"));
 
-	kd = (struct delete_record_data *)trbt_lookup32(ctdb_db->delete_queue, hash);
-	if (kd != NULL) {
-		if ((kd->key.dsize != key.dsize) ||
-		    (memcmp(kd->key.dptr, key.dptr, key.dsize) != 0))
-		{
-			DEBUG(DEBUG_INFO,
-			      (__location__ " schedule for deletion: "
-			       "hash collision for key hash [0x%08x]. "
-			       "Skipping the record.\n", hash));
-			return 0;
-		} else {
-			DEBUG(DEBUG_DEBUG,
-			      (__location__ " schedule for deletion: "
-			       "updating entry for key with hash [0x%08x].\n",
-			       hash));
-		}
+	old_kd = (struct delete_record_data *)key_index_lookup_hash(
+		ctdb_db->delete_queue, hash, key);
+	if (old_kd != NULL) {
+		DEBUG(DEBUG_DEBUG,
+		      (__location__ " schedule for deletion: "
+		       "updating entry for key with hash [0x%08x].\n",
+		       hash));
 	}
 
-	ret = insert_delete_record_data_into_tree(ctdb_db->ctdb, ctdb_db,
-						  ctdb_db->delete_queue,
-						  hdr, key);
+	kd = new_delete_record_data(ctdb_db->delete_queue, ctdb_db->ctdb,
+				    ctdb_db, hdr, key);
+	if (kd == NULL) {
+		return -1;
+	}
+
+	ret = key_index_insert_hash(ctdb_db->delete_queue, hash, key, kd);
 	if (ret != 0) {
 		DEBUG(DEBUG_INFO,
 		      (__location__ " schedule for deletion: error "
 		       "inserting key with hash [0x%08x] into delete queue\n",
 		       hash));
+		talloc_free(kd);
 		return -1;
 	}
 
+	talloc_free(old_kd);
+
 	return 0;
 }
 
@@ -1861,6 +2097,14 @@ int32_t ctdb_local_schedule_for_deletion(struct ctdb_db_context *ctdb_db,
 	struct ctdb_control_schedule_for_deletion *dd;
 	TDB_DATA indata;
 	int32_t status;
+	struct ctdb_call_shard_reply *shard_reply = ctdb_db->ctdb->call_shard_reply;
+
+	if (shard_reply != NULL) {
+		/* call shard - the daemon queues it with the reply */
+		shard_reply->delete_queue = CTDB_CALL_SHARD_SCHEDULE_FOR_DELETION;
+		shard_reply->delete_header = *hdr;
+		return 0;
+	}
 
 	if (ctdb_db->ctdb->ctdbd_pid == getpid()) {
 		/* main daemon - directly queue */
@@ -1921,6 +2165,24 @@ void ctdb_local_remove_from_delete_queue(struct ctdb_db_context *ctdb_db,
 					 const struct ctdb_ltdb_header *hdr,
 					 const TDB_DATA key)
 {
+	struct ctdb_call_shard_reply *shard_reply = ctdb_db->ctdb->call_shard_reply;
+
+	if (shard_reply != NULL) {
+		/* call shard - its copy of the queue is out of date */
+		shard_reply->delete_queue = CTDB_CALL_SHARD_REMOVE_FROM_DELETE_QUEUE;
+		shard_reply->delete_header = *hdr;
+		return;
+	}
+
+	/*
+	 * This runs for every record stored, and the queue is usually
+	 * empty: don't pay for a system call and a key hash then.
+	 */
+	if (ctdb_db->delete_queue == NULL ||
+	    key_index_count(ctdb_db->delete_queue) == 0) {
+		return;
+	}
+
 	if (ctdb_db->ctdb->ctdbd_pid != getpid()) {
 		/*
 		 * Only remove the record from the delete queue if called
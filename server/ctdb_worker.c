@@ -0,0 +1,550 @@
+/*
+   pre-forked worker processes for traverses and vacuuming
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "system/network.h"
+#include "../include/ctdb_private.h"
+#include "lib/util/dlinklist.h"
+#include "db_wrap.h"
+
+/*
+ * Local traverses and vacuuming used to fork a new child for every run,
+ * which then had to connect back to the daemon before it could start.
+ * Instead up to WorkerProcesses long lived workers are kept around,
+ * each with its own client connection and its own handles on the
+ * databases known to the daemon.  Jobs are sent to an idle worker over
+ * a socketpair.  Vacuuming jobs are queued while all workers are busy.
+ * A traverse has to finish within TraverseTimeout and must not wait
+ * behind a long vacuuming run, so it falls back to a child of its own
+ * when no worker is free.
+ *
+ * A worker only knows the databases and nodes that existed when it was
+ * forked, so attaching a database or reloading the nodes file starts a
+ * new generation.  Workers of an older generation are retired as soon
+ * as they are idle.  The tunables and the debug level are sent along
+ * with every job.
+ *
+ * Freeing a job cancels it.  A job that is still queued is simply
+ * dropped, a running one takes its worker with it.
+ */
+
+struct ctdb_worker_request {
+	uint32_t length;
+	uint32_t type;
+	uint32_t db_id;
+	int32_t log_level;
+	struct ctdb_tunable tunable;
+	uint8_t data[1];
+};
+
+struct ctdb_worker_reply {
+	uint32_t length;
+	int32_t status;
+};
+
+struct ctdb_worker_pool {
+	struct ctdb_context *ctdb;
+	struct ctdb_worker *workers;
+	struct ctdb_worker_job *queue;
+	uint32_t generation;
+};
+
+struct ctdb_worker {
+	struct ctdb_worker *next, *prev;
+	struct ctdb_worker_pool *pool;
+	pid_t pid;
+	int fd;
+	struct ctdb_queue *queue;
+	uint32_t generation;
+	struct ctdb_worker_job *job;
+};
+
+struct ctdb_worker_job {
+	struct ctdb_worker_job *next, *prev;
+	struct ctdb_worker_pool *pool;
+	struct ctdb_worker *worker;
+	struct ctdb_db_context *ctdb_db;
+	struct ctdb_worker_request *request;
+	struct timeval queued_time;
+	struct timeval start_time;
+	bool queued;
+	ctdb_worker_done_fn_t fn;
+	void *private_data;
+};
+
+/*
+  run one job in the worker process
+ */
+static int32_t ctdb_worker_run(struct ctdb_context *ctdb,
+			       struct ctdb_worker_request *req)
+{
+	struct ctdb_db_context *ctdb_db;
+	TDB_DATA data;
+
+	ctdb_db = find_ctdb_db(ctdb, req->db_id);
+	if (ctdb_db == NULL) {
+		DEBUG(DEBUG_ERR, ("Worker has no database 0x%08x\n",
+				  req->db_id));
+		return -1;
+	}
+
+	ctdb->tunable = req->tunable;
+	LogLevel = req->log_level;
+
+	data.dptr  = req->data;
+	data.dsize = req->length - offsetof(struct ctdb_worker_request, data);
+
+	switch (req->type) {
+	case CTDB_WORKER_JOB_TRAVERSE:
+		return ctdb_traverse_local_job(ctdb_db, data);
+	case CTDB_WORKER_JOB_VACUUM:
+		return ctdb_vacuum_job(ctdb_db, data);
+	}
+
+	DEBUG(DEBUG_ERR, ("Unknown worker job type %u\n", req->type));
+	return -1;
+}
+
+static int ctdb_worker_read(int fd, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static struct ctdb_worker_request *ctdb_worker_read_request(int fd)
+{
+	struct ctdb_worker_request *req;
+	uint32_t length;
+
+	if (ctdb_worker_read(fd, &length, sizeof(length)) != 0) {
+		return NULL;
+	}
+	if (length < offsetof(struct ctdb_worker_request, data)) {
+		DEBUG(DEBUG_ERR, ("Invalid worker request of %u bytes\n",
+				  length));
+		return NULL;
+	}
+
+	req = (struct ctdb_worker_request *)talloc_size(NULL, length);
+	if (req == NULL) {
+		return NULL;
+	}
+	req->length = length;
+
+	if (ctdb_worker_read(fd, (uint8_t *)req + sizeof(length),
+			     length - sizeof(length)) != 0) {
+		talloc_free(req);
+		return NULL;
+	}
+
+	return req;
+}
+
+/*
+  the tdb handles inherited from the daemon share its file offsets and
+  still carry the chain locks it had marked when the worker was forked,
+  so give the worker handles of its own
+ */
+int ctdb_worker_reopen_dbs(struct ctdb_context *ctdb)
+{
+	struct ctdb_db_context *ctdb_db;
+
+	for (ctdb_db = ctdb->db_list; ctdb_db != NULL; ctdb_db = ctdb_db->next) {
+		if (tdb_reopen(ctdb_db->ltdb->tdb) != 0) {
+			DEBUG(DEBUG_CRIT, ("Worker failed to reopen database %s\n",
+					   ctdb_db->db_name));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+  the worker process. It runs jobs until the daemon closes its end of
+  the socket
+ */
+static void ctdb_worker_main(struct ctdb_context *ctdb, int fd)
+{
+	ctdb_set_process_name("ctdb_worker");
+	if (switch_from_server_to_client(ctdb, "worker") != 0) {
+		DEBUG(DEBUG_CRIT, ("Failed to switch worker into client mode\n"));
+		_exit(1);
+	}
+
+	if (ctdb_worker_reopen_dbs(ctdb) != 0) {
+		_exit(1);
+	}
+
+	while (1) {
+		struct ctdb_worker_request *req;
+		struct ctdb_worker_reply reply;
+
+		req = ctdb_worker_read_request(fd);
+		if (req == NULL) {
+			_exit(0);
+		}
+
+		reply.length = sizeof(reply);
+		reply.status = ctdb_worker_run(ctdb, req);
+		talloc_free(req);
+
+		if (write(fd, &reply, sizeof(reply)) != sizeof(reply)) {
+			_exit(1);
+		}
+	}
+}
+
+static int ctdb_worker_destructor(struct ctdb_worker *w)
+{
+	DLIST_REMOVE(w->pool->workers, w);
+
+	/* an idle worker exits once it sees the socket close, a busy
+	   one has to be stopped */
+	if (w->job != NULL) {
+		w->job->worker = NULL;
+		ctdb_kill(w->pool->ctdb, w->pid, SIGKILL);
+	}
+
+	TALLOC_FREE(w->queue);
+	close(w->fd);
+
+	return 0;
+}
+
+static int ctdb_worker_job_destructor(struct ctdb_worker_job *job)
+{
+	struct ctdb_worker_pool *pool = job->pool;
+
+	if (job->worker != NULL) {
+		DEBUG(DEBUG_INFO, ("Cancelling job running in worker %d\n",
+				   (int)job->worker->pid));
+		CTDB_DECREMENT_STAT(pool->ctdb, workers.num_current);
+		talloc_free(job->worker);
+	} else if (job->queued) {
+		CTDB_DECREMENT_STAT(pool->ctdb, workers.num_pending);
+		DLIST_REMOVE(pool->queue, job);
+	}
+
+	return 0;
+}
+
+static void ctdb_worker_dispatch(struct ctdb_worker_pool *pool);
+
+/*
+  a job has finished or its worker died
+ */
+static void ctdb_worker_job_done(struct ctdb_worker_job *job, int32_t status)
+{
+	struct ctdb_context *ctdb = job->pool->ctdb;
+
+	CTDB_DECREMENT_STAT(ctdb, workers.num_current);
+	CTDB_UPDATE_LATENCY(ctdb, job->ctdb_db, "worker job",
+			    workers.latency, job->start_time);
+	if (status < 0) {
+		CTDB_INCREMENT_STAT(ctdb, workers.num_failed);
+	}
+
+	talloc_set_destructor(job, NULL);
+	job->fn(status, job->private_data);
+}
+
+static void ctdb_worker_read_cb(uint8_t *data, size_t cnt, void *args)
+{
+	struct ctdb_worker *w = talloc_get_type(args, struct ctdb_worker);
+	struct ctdb_worker_pool *pool = w->pool;
+	struct ctdb_worker_reply *reply = (struct ctdb_worker_reply *)data;
+	struct ctdb_worker_job *job = w->job;
+	int32_t status = -1;
+
+	/* the reply hangs off the worker's queue, so keep it if the
+	   worker goes away */
+	talloc_steal(pool->ctdb, data);
+
+	w->job = NULL;
+	if (job != NULL) {
+		job->worker = NULL;
+	}
+
+	if (cnt != sizeof(struct ctdb_worker_reply) || job == NULL) {
+		DEBUG(DEBUG_ERR, ("Worker process %d %s\n", (int)w->pid,
+				  cnt == 0 ? "exited" : "sent an invalid reply"));
+		talloc_free(w);
+	} else {
+		status = reply->status;
+		if (w->generation != pool->generation) {
+			talloc_free(w);
+		}
+	}
+	talloc_free(data);
+
+	if (job != NULL) {
+		ctdb_worker_job_done(job, status);
+	}
+
+	ctdb_worker_dispatch(pool);
+}
+
+static struct ctdb_worker *ctdb_worker_spawn(struct ctdb_worker_pool *pool)
+{
+	struct ctdb_context *ctdb = pool->ctdb;
+	struct ctdb_worker *w;
+	int fd[2];
+
+	/* a worker can not drop the recovery transactions it would
+	   inherit, so wait until they are committed */
+	if (ctdb->freeze_transaction_started) {
+		DEBUG(DEBUG_INFO, ("Not starting a worker during a recovery transaction\n"));
+		return NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) != 0) {
+		DEBUG(DEBUG_ERR, ("Failed to create socketpair for worker\n"));
+		return NULL;
+	}
+
+	w = talloc_zero(pool, struct ctdb_worker);
+	if (w == NULL) {
+		close(fd[0]);
+		close(fd[1]);
+		return NULL;
+	}
+
+	w->pid = ctdb_fork(ctdb);
+	if (w->pid == -1) {
+		DEBUG(DEBUG_ERR, ("Failed to fork worker process\n"));
+		close(fd[0]);
+		close(fd[1]);
+		talloc_free(w);
+		return NULL;
+	}
+
+	if (w->pid == 0) {
+		struct ctdb_worker *o;
+
+		close(fd[0]);
+		for (o = pool->workers; o != NULL; o = o->next) {
+			close(o->fd);
+		}
+		ctdb_worker_main(ctdb, fd[1]);
+	}
+
+	close(fd[1]);
+	set_nonblocking(fd[0]);
+	set_close_on_exec(fd[0]);
+
+	w->pool = pool;
+	w->fd = fd[0];
+	w->generation = pool->generation;
+	DLIST_ADD(pool->workers, w);
+	talloc_set_destructor(w, ctdb_worker_destructor);
+
+	w->queue = ctdb_queue_setup(ctdb, w, w->fd, 0, ctdb_worker_read_cb, w,
+				    "worker-%d", (int)w->pid);
+	if (w->queue == NULL) {
+		ctdb_kill(ctdb, w->pid, SIGKILL);
+		talloc_free(w);
+		return NULL;
+	}
+
+	CTDB_INCREMENT_STAT(ctdb, workers.num_spawned);
+	DEBUG(DEBUG_INFO, ("Started worker process %d\n", (int)w->pid));
+
+	return w;
+}
+
+/*
+  find an idle worker of the current generation, retiring idle workers
+  of older generations on the way. A new worker is started if there is
+  room for one
+ */
+static struct ctdb_worker *ctdb_worker_find_idle(struct ctdb_worker_pool *pool)
+{
+	struct ctdb_worker *w, *next;
+	uint32_t num = 0;
+
+	for (w = pool->workers; w != NULL; w = next) {
+		next = w->next;
+		if (w->generation != pool->generation) {
+			if (w->job == NULL) {
+				talloc_free(w);
+			}
+			continue;
+		}
+		if (w->job == NULL) {
+			return w;
+		}
+		num++;
+	}
+
+	if (num >= pool->ctdb->tunable.worker_processes) {
+		return NULL;
+	}
+
+	return ctdb_worker_spawn(pool);
+}
+
+/*
+  hand queued jobs to idle workers
+ */
+static void ctdb_worker_dispatch(struct ctdb_worker_pool *pool)
+{
+	struct ctdb_context *ctdb = pool->ctdb;
+	struct ctdb_worker_job *job;
+	struct ctdb_worker *w;
+
+	while ((job = pool->queue) != NULL) {
+		w = ctdb_worker_find_idle(pool);
+		if (w == NULL) {
+			return;
+		}
+
+		job->request->tunable   = ctdb->tunable;
+		job->request->log_level = LogLevel;
+		if (ctdb_queue_send(w->queue, (uint8_t *)job->request,
+				    job->request->length) != 0) {
+			DEBUG(DEBUG_ERR, ("Failed to send job to worker %d\n",
+					  (int)w->pid));
+			talloc_free(w);
+			return;
+		}
+		TALLOC_FREE(job->request);
+
+		DLIST_REMOVE(pool->queue, job);
+		job->queued = false;
+		CTDB_DECREMENT_STAT(ctdb, workers.num_pending);
+		CTDB_UPDATE_LATENCY(ctdb, job->ctdb_db, "worker queue",
+				    workers.queue_latency, job->queued_time);
+
+		w->job = job;
+		job->worker = w;
+		job->start_time = timeval_current();
+		CTDB_INCREMENT_STAT(ctdb, workers.num_jobs);
+		CTDB_INCREMENT_STAT(ctdb, workers.num_current);
+	}
+}
+
+/*
+  run a job in a worker process. fn is called with the status returned
+  by the job, or -1 if the worker died.
+
+  Returns NULL if workers are disabled or none could be started, or
+  for a traverse if no worker is free right now, in which case the
+  caller should run the job itself
+ */
+struct ctdb_worker_job *ctdb_worker_job_send(struct ctdb_db_context *ctdb_db,
+					     TALLOC_CTX *mem_ctx,
+					     enum ctdb_worker_job_type type,
+					     TDB_DATA data,
+					     ctdb_worker_done_fn_t fn,
+					     void *private_data)
+{
+	struct ctdb_context *ctdb = ctdb_db->ctdb;
+	struct ctdb_worker_pool *pool = ctdb->worker_pool;
+	struct ctdb_worker_job *job;
+	size_t length;
+
+	if (ctdb->tunable.worker_processes == 0) {
+		return NULL;
+	}
+
+	if (pool == NULL) {
+		pool = talloc_zero(ctdb, struct ctdb_worker_pool);
+		if (pool == NULL) {
+			return NULL;
+		}
+		pool->ctdb = ctdb;
+		ctdb->worker_pool = pool;
+	}
+
+	job = talloc_zero(mem_ctx, struct ctdb_worker_job);
+	if (job == NULL) {
+		return NULL;
+	}
+
+	length = offsetof(struct ctdb_worker_request, data) + data.dsize;
+	job->request = (struct ctdb_worker_request *)talloc_zero_size(job, length);
+	if (job->request == NULL) {
+		talloc_free(job);
+		return NULL;
+	}
+	job->request->length = length;
+	job->request->type   = type;
+	job->request->db_id  = ctdb_db->db_id;
+	memcpy(job->request->data, data.dptr, data.dsize);
+
+	job->pool         = pool;
+	job->ctdb_db      = ctdb_db;
+	job->fn           = fn;
+	job->private_data = private_data;
+	job->queued_time  = timeval_current();
+
+	DLIST_ADD_END(pool->queue, job, NULL);
+	job->queued = true;
+	CTDB_INCREMENT_STAT(ctdb, workers.num_pending);
+	talloc_set_destructor(job, ctdb_worker_job_destructor);
+
+	ctdb_worker_dispatch(pool);
+
+	if (job->worker == NULL &&
+	    (pool->workers == NULL || type == CTDB_WORKER_JOB_TRAVERSE)) {
+		/* no worker could be started, or a traverse would have
+		   to wait for one */
+		talloc_free(job);
+		return NULL;
+	}
+
+	return job;
+}
+
+/*
+  the databases or nodes known to the daemon have changed, so workers
+  forked before now are out of date
+ */
+void ctdb_workers_restart(struct ctdb_context *ctdb)
+{
+	struct ctdb_worker_pool *pool = ctdb->worker_pool;
+	struct ctdb_worker *w, *next;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	pool->generation++;
+
+	for (w = pool->workers; w != NULL; w = next) {
+		next = w->next;
+		if (w->job == NULL) {
+			talloc_free(w);
+		}
+	}
+}
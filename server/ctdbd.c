@@ -80,7 +80,7 @@ static void ctdb_recv_pkt(struct ctdb_context *ctdb, uint8_t *data, uint32_t len
 		/* as a special case, redirected calls don't increment the rx_cnt */
 		if (hdr->operation != CTDB_REQ_CALL ||
 		    ((struct ctdb_req_call *)hdr)->hopcount == 0) {
-			ctdb->nodes[hdr->srcnode]->rx_cnt++;
+			ctdb_node_packet_received(ctdb->nodes[hdr->srcnode]);
 		}
 	}
 
@@ -90,7 +90,8 @@ static void ctdb_recv_pkt(struct ctdb_context *ctdb, uint8_t *data, uint32_t len
 static const struct ctdb_upcalls ctdb_upcalls = {
 	.recv_pkt       = ctdb_recv_pkt,
 	.node_dead      = ctdb_node_dead,
-	.node_connected = ctdb_node_connected
+	.node_connected = ctdb_node_connected,
+	.queues_drained = ctdb_daemon_queues_drained
 };
 
 
@@ -192,8 +193,6 @@ int main(int argc, const char *argv[])
 	ctdb->recovery_mode    = CTDB_RECOVERY_NORMAL;
 	ctdb->recovery_master  = (uint32_t)-1;
 	ctdb->upcalls          = &ctdb_upcalls;
-	ctdb->idr              = idr_init(ctdb);
-	ctdb->recovery_lock_fd = -1;
 
 	ctdb_tunables_set_defaults(ctdb);
 
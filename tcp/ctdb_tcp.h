@@ -36,24 +36,40 @@ struct ctdb_incoming {
 };
 
 /*
-  state associated with one tcp node
+  state associated with one outgoing connection to a node
 */
-struct ctdb_tcp_node {
+struct ctdb_tcp_stream {
+	struct ctdb_node *node;
+	uint32_t index;
 	int fd;
 	struct ctdb_queue *out_queue;
 	struct fd_event *connect_fde;
 	struct timed_event *connect_te;
+	uint32_t num_packets;
+	uint32_t max_queued;
+	uint64_t num_bytes;
+};
+
+/*
+  state associated with one tcp node
+*/
+struct ctdb_tcp_node {
+	uint32_t num_streams;	/* streams in use, the last one is for bulk */
+	struct ctdb_tcp_stream *streams[CTDB_MAX_STREAMS];
 };
 
 
 /* prototypes internal to tcp transport */
 int ctdb_tcp_queue_pkt(struct ctdb_node *node, uint8_t *data, uint32_t length);
+uint32_t ctdb_tcp_stream_statistics(struct ctdb_node *node,
+				    struct ctdb_stream_statistics *stats);
 int ctdb_tcp_listen(struct ctdb_context *ctdb);
 void ctdb_tcp_node_connect(struct event_context *ev, struct timed_event *te, 
 			   struct timeval t, void *private_data);
 void ctdb_tcp_read_cb(uint8_t *data, size_t cnt, void *args);
 void ctdb_tcp_tnode_cb(uint8_t *data, size_t cnt, void *private_data);
-void ctdb_tcp_stop_connection(struct ctdb_node *node);
+void ctdb_tcp_stop_connection(struct ctdb_tcp_stream *stream);
+void ctdb_tcp_stop_node(struct ctdb_node *node);
 
 #define CTDB_TCP_ALIGNMENT 8
 
@@ -26,21 +26,34 @@
 #include "ctdb_tcp.h"
 
 /*
-  stop any connecting (established or pending) to a node
+  stop any connecting (established or pending) on a stream
  */
-void ctdb_tcp_stop_connection(struct ctdb_node *node)
+void ctdb_tcp_stop_connection(struct ctdb_tcp_stream *stream)
+{
+	ctdb_queue_set_fd(stream->out_queue, -1);
+	talloc_free(stream->connect_te);
+	talloc_free(stream->connect_fde);
+	stream->connect_fde = NULL;
+	stream->connect_te = NULL;
+	if (stream->fd != -1) {
+		close(stream->fd);
+		stream->fd = -1;
+	}
+}
+
+/*
+  stop all streams to a node
+ */
+void ctdb_tcp_stop_node(struct ctdb_node *node)
 {
 	struct ctdb_tcp_node *tnode = talloc_get_type(
 		node->private_data, struct ctdb_tcp_node);
-	
-	ctdb_queue_set_fd(tnode->out_queue, -1);
-	talloc_free(tnode->connect_te);
-	talloc_free(tnode->connect_fde);
-	tnode->connect_fde = NULL;
-	tnode->connect_te = NULL;
-	if (tnode->fd != -1) {
-		close(tnode->fd);
-		tnode->fd = -1;
+	uint32_t i;
+
+	for (i=0; i<CTDB_MAX_STREAMS; i++) {
+		if (tnode->streams[i] != NULL) {
+			ctdb_tcp_stop_connection(tnode->streams[i]);
+		}
 	}
 }
 
@@ -51,7 +64,9 @@ void ctdb_tcp_stop_connection(struct ctdb_node *node)
  */
 void ctdb_tcp_tnode_cb(uint8_t *data, size_t cnt, void *private_data)
 {
-	struct ctdb_node *node = talloc_get_type(private_data, struct ctdb_node);
+	struct ctdb_tcp_stream *stream = talloc_get_type(private_data,
+							 struct ctdb_tcp_stream);
+	struct ctdb_node *node = stream->node;
 	struct ctdb_tcp_node *tnode = talloc_get_type(
 		node->private_data, struct ctdb_tcp_node);
 
@@ -59,10 +74,13 @@ void ctdb_tcp_tnode_cb(uint8_t *data, size_t cnt, void *private_data)
 		node->ctdb->upcalls->node_dead(node);
 	}
 
-	ctdb_tcp_stop_connection(node);
-	tnode->connect_te = event_add_timed(node->ctdb->ev, tnode,
-					    timeval_current_ofs(3, 0),
-					    ctdb_tcp_node_connect, node);
+	ctdb_tcp_stop_connection(stream);
+	if (stream->index < tnode->num_streams) {
+		stream->connect_te = event_add_timed(node->ctdb->ev, stream,
+						     timeval_current_ofs(3, 0),
+						     ctdb_tcp_node_connect,
+						     stream);
+	}
 }
 
 /*
@@ -71,37 +89,35 @@ void ctdb_tcp_tnode_cb(uint8_t *data, size_t cnt, void *private_data)
 static void ctdb_node_connect_write(struct event_context *ev, struct fd_event *fde, 
 				    uint16_t flags, void *private_data)
 {
-	struct ctdb_node *node = talloc_get_type(private_data,
-						 struct ctdb_node);
-	struct ctdb_tcp_node *tnode = talloc_get_type(node->private_data,
-						      struct ctdb_tcp_node);
-	struct ctdb_context *ctdb = node->ctdb;
+	struct ctdb_tcp_stream *stream = talloc_get_type(private_data,
+							 struct ctdb_tcp_stream);
+	struct ctdb_context *ctdb = stream->node->ctdb;
 	int error = 0;
 	socklen_t len = sizeof(error);
 	int one = 1;
 
-	talloc_free(tnode->connect_te);
-	tnode->connect_te = NULL;
+	talloc_free(stream->connect_te);
+	stream->connect_te = NULL;
 
-	if (getsockopt(tnode->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 ||
+	if (getsockopt(stream->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 ||
 	    error != 0) {
-		ctdb_tcp_stop_connection(node);
-		tnode->connect_te = event_add_timed(ctdb->ev, tnode, 
-						    timeval_current_ofs(1, 0),
-						    ctdb_tcp_node_connect, node);
+		ctdb_tcp_stop_connection(stream);
+		stream->connect_te = event_add_timed(ctdb->ev, stream, 
+						     timeval_current_ofs(1, 0),
+						     ctdb_tcp_node_connect, stream);
 		return;
 	}
 
-	talloc_free(tnode->connect_fde);
-	tnode->connect_fde = NULL;
+	talloc_free(stream->connect_fde);
+	stream->connect_fde = NULL;
 
-        setsockopt(tnode->fd,IPPROTO_TCP,TCP_NODELAY,(char *)&one,sizeof(one));
-        setsockopt(tnode->fd,SOL_SOCKET,SO_KEEPALIVE,(char *)&one,sizeof(one));
+        setsockopt(stream->fd,IPPROTO_TCP,TCP_NODELAY,(char *)&one,sizeof(one));
+        setsockopt(stream->fd,SOL_SOCKET,SO_KEEPALIVE,(char *)&one,sizeof(one));
 
-	ctdb_queue_set_fd(tnode->out_queue, tnode->fd);
+	ctdb_queue_set_fd(stream->out_queue, stream->fd);
 
 	/* the queue subsystem now owns this fd */
-	tnode->fd = -1;
+	stream->fd = -1;
 }
 
 
@@ -117,21 +133,21 @@ static int ctdb_tcp_get_address(struct ctdb_context *ctdb,
 
 /*
   called when we should try and establish a tcp connection to a node
+  for one of its streams
 */
 void ctdb_tcp_node_connect(struct event_context *ev, struct timed_event *te, 
 			   struct timeval t, void *private_data)
 {
-	struct ctdb_node *node = talloc_get_type(private_data,
-						 struct ctdb_node);
-	struct ctdb_tcp_node *tnode = talloc_get_type(node->private_data, 
-						      struct ctdb_tcp_node);
+	struct ctdb_tcp_stream *stream = talloc_get_type(private_data,
+							 struct ctdb_tcp_stream);
+	struct ctdb_node *node = stream->node;
 	struct ctdb_context *ctdb = node->ctdb;
         ctdb_sock_addr sock_in;
 	int sockin_size;
 	int sockout_size;
         ctdb_sock_addr sock_out;
 
-	ctdb_tcp_stop_connection(node);
+	ctdb_tcp_stop_connection(stream);
 
 	ZERO_STRUCT(sock_out);
 #ifdef HAVE_SOCK_SIN_LEN
@@ -153,15 +169,15 @@ void ctdb_tcp_node_connect(struct event_context *ev, struct timed_event *te,
 		return;
 	}
 
-	tnode->fd = socket(sock_out.sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
-	if (tnode->fd == -1) {
+	stream->fd = socket(sock_out.sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
+	if (stream->fd == -1) {
 		DEBUG(DEBUG_ERR, (__location__ "Failed to create socket\n"));
 		return;
 	}
-	set_nonblocking(tnode->fd);
-	set_close_on_exec(tnode->fd);
+	set_nonblocking(stream->fd);
+	set_close_on_exec(stream->fd);
 
-	DEBUG(DEBUG_DEBUG, (__location__ " Created TCP SOCKET FD:%d\n", tnode->fd));
+	DEBUG(DEBUG_DEBUG, (__location__ " Created TCP SOCKET FD:%d\n", stream->fd));
 
 	/* Bind our side of the socketpair to the same address we use to listen
 	 * on incoming CTDB traffic.
@@ -172,7 +188,7 @@ void ctdb_tcp_node_connect(struct event_context *ev, struct timed_event *te,
 	ZERO_STRUCT(sock_in);
 	if (ctdb_tcp_get_address(ctdb, ctdb->address.address, &sock_in) != 0) {
 		DEBUG(DEBUG_ERR, (__location__ " Failed to find our address. Failing bind.\n"));
-		close(tnode->fd);
+		close(stream->fd);
 		return;
 	}
 
@@ -193,39 +209,39 @@ void ctdb_tcp_node_connect(struct event_context *ev, struct timed_event *te,
 	default:
 		DEBUG(DEBUG_ERR, (__location__ " unknown family %u\n",
 			sock_in.sa.sa_family));
-		close(tnode->fd);
+		close(stream->fd);
 		return;
 	}
 #ifdef HAVE_SOCK_SIN_LEN
 	sock_in.ip.sin_len = sockin_size;
 	sock_out.ip.sin_len = sockout_size;
 #endif
-	if (bind(tnode->fd, (struct sockaddr *)&sock_in, sockin_size) == -1) {
+	if (bind(stream->fd, (struct sockaddr *)&sock_in, sockin_size) == -1) {
 		DEBUG(DEBUG_ERR, (__location__ "Failed to bind socket %s(%d)\n",
 				  strerror(errno), errno));
-		close(tnode->fd);
+		close(stream->fd);
 		return;
 	}
 
-	if (connect(tnode->fd, (struct sockaddr *)&sock_out, sockout_size) != 0 &&
+	if (connect(stream->fd, (struct sockaddr *)&sock_out, sockout_size) != 0 &&
 	    errno != EINPROGRESS) {
-		ctdb_tcp_stop_connection(node);
-		tnode->connect_te = event_add_timed(ctdb->ev, tnode, 
-						    timeval_current_ofs(1, 0),
-						    ctdb_tcp_node_connect, node);
+		ctdb_tcp_stop_connection(stream);
+		stream->connect_te = event_add_timed(ctdb->ev, stream, 
+						     timeval_current_ofs(1, 0),
+						     ctdb_tcp_node_connect, stream);
 		return;
 	}
 
 	/* non-blocking connect - wait for write event */
-	tnode->connect_fde = event_add_fd(node->ctdb->ev, tnode, tnode->fd, 
-					  EVENT_FD_WRITE|EVENT_FD_READ, 
-					  ctdb_node_connect_write, node);
+	stream->connect_fde = event_add_fd(node->ctdb->ev, stream, stream->fd, 
+					   EVENT_FD_WRITE|EVENT_FD_READ, 
+					   ctdb_node_connect_write, stream);
 
 	/* don't give it long to connect - retry in one second. This ensures
 	   that we find a node is up quickly (tcp normally backs off a syn reply
 	   delay by quite a lot) */
-	tnode->connect_te = event_add_timed(ctdb->ev, tnode, timeval_current_ofs(1, 0), 
-					    ctdb_tcp_node_connect, node);
+	stream->connect_te = event_add_timed(ctdb->ev, stream, timeval_current_ofs(1, 0), 
+					     ctdb_tcp_node_connect, stream);
 }
 
 /*
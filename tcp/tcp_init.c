@@ -24,18 +24,110 @@
 #include "../include/ctdb_private.h"
 #include "ctdb_tcp.h"
 
-static int tnode_destructor(struct ctdb_tcp_node *tnode)
+static int stream_destructor(struct ctdb_tcp_stream *stream)
 {
-  //	struct ctdb_node *node = talloc_find_parent_bytype(tnode, struct ctdb_node);
+	if (stream->fd != -1) {
+		close(stream->fd);
+		stream->fd = -1;
+	}
+
+	return 0;
+}
+
+/*
+  give a stream an empty output queue, dropping anything still queued
+ */
+static int ctdb_tcp_stream_queue_setup(struct ctdb_tcp_stream *stream)
+{
+	struct ctdb_node *node = stream->node;
+
+	talloc_free(stream->out_queue);
+	stream->out_queue = ctdb_queue_setup(node->ctdb, stream, -1,
+					     CTDB_TCP_ALIGNMENT,
+					     ctdb_tcp_tnode_cb, stream,
+					     "to-node-%s-%u", node->name,
+					     stream->index);
+	CTDB_NO_MEMORY(node->ctdb, stream->out_queue);
+	ctdb_queue_set_limited(stream->out_queue);
+
+	return 0;
+}
+
+/*
+  set up the streams to a node according to the TcpStreams tunable.
+  Streams that are no longer used keep their state but lose any packets
+  still queued on them
+ */
+static int ctdb_tcp_setup_streams(struct ctdb_node *node)
+{
+	struct ctdb_tcp_node *tnode = talloc_get_type(
+		node->private_data, struct ctdb_tcp_node);
+	uint32_t num_streams = node->ctdb->tunable.tcp_streams;
+	uint32_t i;
 
-	if (tnode->fd != -1) {
-		close(tnode->fd);
-		tnode->fd = -1;
+	if (num_streams < 1) {
+		num_streams = 1;
+	}
+	if (num_streams > CTDB_MAX_STREAMS) {
+		num_streams = CTDB_MAX_STREAMS;
 	}
 
+	for (i=0; i<num_streams; i++) {
+		struct ctdb_tcp_stream *stream = tnode->streams[i];
+
+		if (stream != NULL) {
+			continue;
+		}
+
+		stream = talloc_zero(tnode, struct ctdb_tcp_stream);
+		CTDB_NO_MEMORY(node->ctdb, stream);
+
+		stream->node  = node;
+		stream->index = i;
+		stream->fd    = -1;
+		talloc_set_destructor(stream, stream_destructor);
+
+		if (ctdb_tcp_stream_queue_setup(stream) != 0) {
+			talloc_free(stream);
+			return -1;
+		}
+		tnode->streams[i] = stream;
+	}
+
+	for (i=num_streams; i<tnode->num_streams; i++) {
+		if (ctdb_tcp_stream_queue_setup(tnode->streams[i]) != 0) {
+			return -1;
+		}
+	}
+
+	if (num_streams != tnode->num_streams && tnode->num_streams != 0) {
+		DEBUG(DEBUG_NOTICE,("Using %u streams to node %u\n",
+				    num_streams, node->pnn));
+	}
+	tnode->num_streams = num_streams;
+
 	return 0;
 }
 
+/*
+  connect all streams to a node on the next event loop
+ */
+static void ctdb_tcp_connect_streams(struct ctdb_node *node)
+{
+	struct ctdb_tcp_node *tnode = talloc_get_type(
+		node->private_data, struct ctdb_tcp_node);
+	uint32_t i;
+
+	for (i=0; i<tnode->num_streams; i++) {
+		struct ctdb_tcp_stream *stream = tnode->streams[i];
+
+		stream->connect_te = event_add_timed(node->ctdb->ev, stream,
+						     timeval_zero(),
+						     ctdb_tcp_node_connect,
+						     stream);
+	}
+}
+
 /*
   initialise tcp portion of a ctdb node 
 */
@@ -45,14 +137,9 @@ static int ctdb_tcp_add_node(struct ctdb_node *node)
 	tnode = talloc_zero(node, struct ctdb_tcp_node);
 	CTDB_NO_MEMORY(node->ctdb, tnode);
 
-	tnode->fd = -1;
 	node->private_data = tnode;
-	talloc_set_destructor(tnode, tnode_destructor);
 
-	tnode->out_queue = ctdb_queue_setup(node->ctdb, node, tnode->fd, CTDB_TCP_ALIGNMENT,
-					    ctdb_tcp_tnode_cb, node, "to-node-%s", node->name);
-	
-	return 0;
+	return ctdb_tcp_setup_streams(node);
 }
 
 /*
@@ -87,15 +174,11 @@ static int ctdb_tcp_initialise(struct ctdb_context *ctdb)
 static int ctdb_tcp_connect_node(struct ctdb_node *node)
 {
 	struct ctdb_context *ctdb = node->ctdb;
-	struct ctdb_tcp_node *tnode = talloc_get_type(
-		node->private_data, struct ctdb_tcp_node);
 
 	/* startup connection to the other server - will happen on
 	   next event loop */
 	if (!ctdb_same_address(&ctdb->address, &node->address)) {
-		tnode->connect_te = event_add_timed(ctdb->ev, tnode, 
-						    timeval_zero(), 
-						    ctdb_tcp_node_connect, node);
+		ctdb_tcp_connect_streams(node);
 	}
 
 	return 0;
@@ -107,15 +190,15 @@ static int ctdb_tcp_connect_node(struct ctdb_node *node)
 */
 static void ctdb_tcp_restart(struct ctdb_node *node)
 {
-	struct ctdb_tcp_node *tnode = talloc_get_type(
-		node->private_data, struct ctdb_tcp_node);
-
 	DEBUG(DEBUG_NOTICE,("Tearing down connection to dead node :%d\n", node->pnn));
 
-	ctdb_tcp_stop_connection(node);
+	ctdb_tcp_stop_node(node);
+
+	if (ctdb_tcp_setup_streams(node) != 0) {
+		DEBUG(DEBUG_ERR,("Failed to set up streams to node %d\n", node->pnn));
+	}
 
-	tnode->connect_te = event_add_timed(node->ctdb->ev, tnode, timeval_zero(), 
-					    ctdb_tcp_node_connect, node);
+	ctdb_tcp_connect_streams(node);
 }
 
 
@@ -151,13 +234,14 @@ static int ctdb_tcp_start(struct ctdb_context *ctdb)
 /*
   transport packet allocator - allows transport to control memory for packets
 */
-static void *ctdb_tcp_allocate_pkt(TALLOC_CTX *mem_ctx, size_t size)
+static void *ctdb_tcp_allocate_pkt(struct ctdb_context *ctdb,
+				   TALLOC_CTX *mem_ctx, size_t size)
 {
 	/* tcp transport needs to round to 8 byte alignment to ensure
 	   that we can use a length header and 64 bit elements in
 	   structures */
 	size = (size+(CTDB_TCP_ALIGNMENT-1)) & ~(CTDB_TCP_ALIGNMENT-1);
-	return talloc_size(mem_ctx, size);
+	return _ctdb_mem_pool_alloc(ctdb, mem_ctx, size, "ctdb_tcp_packet");
 }
 
 
@@ -165,6 +249,7 @@ static const struct ctdb_methods ctdb_tcp_methods = {
 	.initialise   = ctdb_tcp_initialise,
 	.start        = ctdb_tcp_start,
 	.queue_pkt    = ctdb_tcp_queue_pkt,
+	.stream_statistics = ctdb_tcp_stream_statistics,
 	.add_node     = ctdb_tcp_add_node,
 	.connect_node = ctdb_tcp_connect_node,
 	.allocate_pkt = ctdb_tcp_allocate_pkt,
@@ -77,6 +77,70 @@ failed:
 	talloc_free(in);
 }
 
+/*
+  hash a packet to its flow. Packets for the same record, message
+  handler or request hash alike and so stay in order on one stream.
+  Controls and keepalives all share one flow, as they always did
+ */
+static uint32_t ctdb_tcp_pkt_flow(struct ctdb_req_header *hdr)
+{
+	TDB_DATA key;
+
+	switch (hdr->operation) {
+	case CTDB_REQ_CALL: {
+		struct ctdb_req_call *c = (struct ctdb_req_call *)hdr;
+		key.dptr  = c->data;
+		key.dsize = c->keylen;
+		return c->db_id ^ ctdb_hash(&key);
+	}
+	case CTDB_REQ_DMASTER: {
+		struct ctdb_req_dmaster *c = (struct ctdb_req_dmaster *)hdr;
+		key.dptr  = c->data;
+		key.dsize = c->keylen;
+		return c->db_id ^ ctdb_hash(&key);
+	}
+	case CTDB_REPLY_DMASTER: {
+		struct ctdb_reply_dmaster *c = (struct ctdb_reply_dmaster *)hdr;
+		key.dptr  = c->data;
+		key.dsize = c->keylen;
+		return c->db_id ^ ctdb_hash(&key);
+	}
+	case CTDB_REQ_MIGRATE: {
+		struct ctdb_req_migrate *c = (struct ctdb_req_migrate *)hdr;
+		return c->db_id;
+	}
+	case CTDB_REQ_MESSAGE: {
+		struct ctdb_req_message *c = (struct ctdb_req_message *)hdr;
+		return (uint32_t)(c->srvid ^ (c->srvid >> 32));
+	}
+	case CTDB_REPLY_CALL:
+	case CTDB_REPLY_ERROR:
+		return hdr->reqid;
+	}
+
+	return 0;
+}
+
+/*
+  choose the stream for a packet. With more than one stream the last one
+  carries bulk traffic and the others share the rest by flow
+ */
+static struct ctdb_tcp_stream *ctdb_tcp_pkt_stream(struct ctdb_tcp_node *tnode,
+						   struct ctdb_req_header *hdr,
+						   enum ctdb_queue_class cls)
+{
+	uint32_t num_interactive = tnode->num_streams;
+
+	if (num_interactive > 1) {
+		num_interactive--;
+		if (cls == CTDB_QUEUE_CLASS_BULK) {
+			return tnode->streams[num_interactive];
+		}
+	}
+
+	return tnode->streams[ctdb_tcp_pkt_flow(hdr) % num_interactive];
+}
+
 /*
   queue a packet for sending
 */
@@ -84,5 +148,55 @@ int ctdb_tcp_queue_pkt(struct ctdb_node *node, uint8_t *data, uint32_t length)
 {
 	struct ctdb_tcp_node *tnode = talloc_get_type(node->private_data,
 						      struct ctdb_tcp_node);
-	return ctdb_queue_send(tnode->out_queue, data, length);
+	struct ctdb_req_header *hdr = (struct ctdb_req_header *)data;
+	enum ctdb_queue_class cls = ctdb_queue_pkt_class(hdr);
+	struct ctdb_tcp_stream *stream;
+	uint32_t queued;
+	int ret;
+
+	stream = ctdb_tcp_pkt_stream(tnode, hdr, cls);
+
+	ret = ctdb_queue_send_class(stream->out_queue, data, length, cls);
+	if (ret != 0) {
+		return ret;
+	}
+
+	stream->num_packets++;
+	stream->num_bytes += length;
+	queued = ctdb_queue_length(stream->out_queue);
+	if (queued > stream->max_queued) {
+		stream->max_queued = queued;
+	}
+
+	return 0;
+}
+
+/*
+  fill in the queue statistics of the streams to a node
+*/
+uint32_t ctdb_tcp_stream_statistics(struct ctdb_node *node,
+				    struct ctdb_stream_statistics *stats)
+{
+	struct ctdb_tcp_node *tnode = talloc_get_type(node->private_data,
+						      struct ctdb_tcp_node);
+	uint32_t i;
+
+	for (i=0; i<tnode->num_streams; i++) {
+		struct ctdb_tcp_stream *stream = tnode->streams[i];
+		struct ctdb_stream_statistics *s = &stats[i];
+
+		ZERO_STRUCTP(s);
+		s->pnn         = node->pnn;
+		s->stream      = i;
+		s->bulk        = (tnode->num_streams > 1 &&
+				  i == tnode->num_streams - 1);
+		s->connected   = ctdb_queue_is_connected(stream->out_queue);
+		s->num_packets = stream->num_packets;
+		s->num_bytes   = stream->num_bytes;
+		s->queued      = ctdb_queue_length(stream->out_queue);
+		s->max_queued  = stream->max_queued;
+		ctdb_queue_statistics(stream->out_queue, s->classes);
+	}
+
+	return tnode->num_streams;
 }
@@ -15,6 +15,7 @@ if [ -n "$TEST_LOCAL_DAEMONS" ] ; then
     if [ -n "$ctdb_dir" -a -d "${ctdb_dir}/bin" ] ; then
 	PATH="${ctdb_dir}/bin:${PATH}"
         export CTDB_LOCK_HELPER="${ctdb_dir}/bin/ctdb_lock_helper"
+        export CTDB_MUTEX_FCNTL_HELPER="${ctdb_dir}/bin/ctdb_mutex_fcntl_helper"
     fi
 
     export CTDB_NODES="${TEST_VAR_DIR}/nodes.txt"
@@ -504,6 +505,25 @@ ip2ipmask ()
     ip addr show to "$_ip" | awk '$1 == "inet" { print $2 }'
 }
 
+# Print the sum of a field of "ctdb statistics -Y" over all nodes
+statistics_field_sum ()
+{
+    local field="$1"
+    local sum=0 n v
+
+    try_command_on_node 0 "$CTDB listnodes"
+    local num_nodes=$(echo "$out" | wc -l)
+
+    for n in $(seq 0 $(($num_nodes - 1))) ; do
+	try_command_on_node $n "$CTDB statistics -Y"
+	v=$(echo "$out" | awk -F: -v field="$field" '
+            NR == 1 { for (i = 1; i <= NF; i++) if ($i == field) col = i }
+            NR == 2 { print $col }')
+	sum=$(($sum + $v))
+    done
+    echo $sum
+}
+
 #######################################
 
 daemons_stop ()
@@ -0,0 +1,45 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Exercise the asynchronous libctdb client library.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Run libctdb_test on all nodes.  It pipelines a burst of controls
+   on a single connection, updates records (migrating them between
+   nodes), traverses them and sends itself a message.
+
+Expected results:
+
+* libctdb_test passes on all nodes.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+echo "Running libctdb_test on all $num_nodes nodes."
+try_command_on_node -v -pq all $CTDB_TEST_WRAPPER $VALGRIND libctdb_test
+
+num_passed=$(echo "$out" | grep -c "libctdb: all tests passed" || true)
+if [ $num_passed -eq $num_nodes ] ; then
+    echo "OK: libctdb_test passed on all $num_nodes nodes"
+else
+    echo "BAD: libctdb_test passed on $num_passed/$num_nodes nodes"
+    exit 1
+fi
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that a batch of records can be migrated with one request.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Run ctdb_migrate_records on each node in turn.  Each run pulls the
+   same records away from the node before it and increments them.
+
+Expected results:
+
+* Every run migrates all of the records and finds them one higher
+  than the previous run left them.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+prev=""
+for n in $(seq 0 $(($num_nodes - 1))) ; do
+    echo "Running ctdb_migrate_records on node $n"
+    try_command_on_node -v $n $CTDB_TEST_WRAPPER $VALGRIND ctdb_migrate_records
+
+    value=$(echo "$out" | sed -n -e 's/^Records at value //p')
+    if [ -z "$value" ] ; then
+	echo "BAD: no record value reported on node $n"
+	exit 1
+    fi
+    if [ -n "$prev" -a "$value" != "$(($prev + 1))" ] ; then
+	echo "BAD: records at value $value on node $n, expected $(($prev + 1))"
+	exit 1
+    fi
+    prev="$value"
+done
+
+echo "OK: records migrated through all $num_nodes nodes"
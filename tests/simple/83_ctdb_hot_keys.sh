@@ -0,0 +1,45 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that a record migrating between nodes shows up as a hot key.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Run ctdb_fetch on all nodes, which bounces one record between them.
+3. Run 'ctdb dbstatistics test.tdb' on all nodes.
+
+Expected results:
+
+* At least one node lists a hot key with a non-zero migration count.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+echo "Running ctdb_fetch on all $num_nodes nodes."
+try_command_on_node -pq all $CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch -n $num_nodes
+
+try_command_on_node -v all "$CTDB dbstatistics test.tdb"
+
+if echo "$out" | grep -Eq '^ +Count:[0-9]+ Migrations:[1-9][0-9]* Key:' ; then
+    echo "OK: migrating record reported as a hot key"
+else
+    echo "BAD: no hot key with migrations reported"
+    exit 1
+fi
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that a contended record in a sticky database gets pinned down.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Set test.tdb sticky and HopcountMakeSticky to 1 on all nodes.
+3. Run ctdb_fetch on all nodes, which bounces one record between them.
+4. Run 'ctdb dbstatistics test.tdb' on all nodes.
+
+Expected results:
+
+* The record was made sticky, pinned down and deferred requests.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+try_command_on_node 0 "$CTDB attach test.tdb"
+try_command_on_node all "$CTDB setdbsticky test.tdb"
+try_command_on_node all "$CTDB setvar HopcountMakeSticky 1"
+
+echo "Running ctdb_fetch on all $num_nodes nodes."
+try_command_on_node -pq all $CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch -n $num_nodes
+
+try_command_on_node -v all "$CTDB dbstatistics test.tdb"
+
+sum_counter ()
+{
+    echo "$out" | awk -v name="$1" '$1 == name { n += $2 } END { print n + 0 }'
+}
+
+made_sticky=$(sum_counter made_sticky)
+pindowns=$(sum_counter pindowns)
+deferred=$(sum_counter deferred)
+
+echo "made_sticky=$made_sticky pindowns=$pindowns deferred=$deferred"
+
+if [ $made_sticky -gt 0 -a $pindowns -gt 0 -a $deferred -gt 0 ] ; then
+    echo "OK: contended record was pinned down"
+else
+    echo "BAD: contended record was not pinned down"
+    exit 1
+fi
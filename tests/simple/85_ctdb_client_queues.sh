@@ -0,0 +1,69 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that client requests are queued and throttled by the daemon.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Set ClientMaxInflight and ClientMaxQueued to 1 on all nodes.
+3. Run ctdb_fetch on all nodes and force a recovery, which makes the
+   recovery daemon send many controls at once.
+4. Run 'ctdb clientstats' on all nodes.
+
+Expected results:
+
+* The cluster still works, and some requests were queued and reading
+  from a client was paused.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+try_command_on_node 0 "$CTDB attach test.tdb"
+try_command_on_node all "$CTDB setvar ClientMaxInflight 1"
+try_command_on_node all "$CTDB setvar ClientMaxQueued 1"
+
+echo "Running ctdb_fetch on all $num_nodes nodes."
+try_command_on_node -pq all $CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch -n $num_nodes
+
+echo "Forcing a recovery."
+try_command_on_node 0 "$CTDB recover"
+cluster_is_healthy
+
+try_command_on_node -v all "$CTDB clientstats"
+
+sum_column ()
+{
+    echo "$out" | awk -v col="$1" '$1 ~ /^[0-9]+$/ { n += $col } END { print n + 0 }'
+}
+
+waited=$(sum_column 8)
+pauses=$(sum_column 9)
+
+echo "waited=$waited pauses=$pauses"
+
+if [ $waited -gt 0 -a $pauses -gt 0 ] ; then
+    echo "OK: client requests were queued and throttled"
+else
+    echo "BAD: no client requests were queued"
+    exit 1
+fi
@@ -0,0 +1,115 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that traverses are run by the pre-forked worker processes.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Write some records to a test database.
+3. Traverse the database a few times with 'ctdb catdb'.
+4. Check the worker statistics with 'ctdb statistics'.
+5. Set WorkerProcesses to 0 and traverse the database again.
+
+Expected results:
+
+* All records are returned by every traverse.
+* The traverses were run as worker jobs, and the workers were reused
+  rather than started for every traverse.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+num_records=20
+num_traverses=4
+
+TESTDB="worker_test.tdb"
+
+try_command_on_node -q 0 $CTDB_TEST_WRAPPER ctdb attach $TESTDB
+try_command_on_node -q 0 $CTDB_TEST_WRAPPER ctdb wipedb $TESTDB
+
+echo "Add $num_records records to database"
+i=0
+while [ $i -lt $num_records ]; do
+	n=$[ $i % $num_nodes ]
+	try_command_on_node -q $n $CTDB_TEST_WRAPPER ctdb writekey $TESTDB "key-$i" "value-$i"
+	i=$[ $i + 1 ]
+done
+
+check_catdb ()
+{
+    try_command_on_node -q 0 $CTDB_TEST_WRAPPER ctdb catdb $TESTDB
+    num_read=$(echo "$out" | tail -n 1 | cut -d\  -f2)
+    if [ $num_read -ne $num_records ]; then
+	echo "BAD: Only $num_read/$num_records records retrieved"
+	exit 1
+    fi
+}
+
+# value of a statistics field in the machine readable output of node 1
+statistics_field ()
+{
+    try_command_on_node 1 "$CTDB statistics -Y"
+    echo "$out" | awk -F: -v field="$1" '
+        NR == 1 { for (i = 1; i <= NF; i++) if ($i == field) col = i }
+        NR == 2 { print $col }'
+}
+
+jobs_before=$(statistics_field "workers.num_jobs")
+
+echo "Traversing $TESTDB $num_traverses times"
+i=0
+while [ $i -lt $num_traverses ]; do
+	check_catdb
+	i=$[ $i + 1 ]
+done
+
+jobs=$(statistics_field "workers.num_jobs")
+spawned=$(statistics_field "workers.num_spawned")
+failed=$(statistics_field "workers.num_failed")
+
+echo "jobs=$jobs (before $jobs_before) spawned=$spawned failed=$failed"
+
+if [ $jobs -lt $[ $jobs_before + $num_traverses ] ] ; then
+    echo "BAD: traverses were not run by workers"
+    exit 1
+fi
+if [ $spawned -ge $jobs ] ; then
+    echo "BAD: workers were not reused"
+    exit 1
+fi
+if [ $failed -ne 0 ] ; then
+    echo "BAD: worker jobs failed"
+    exit 1
+fi
+
+echo "Disabling worker processes"
+try_command_on_node all "$CTDB setvar WorkerProcesses 0"
+jobs=$(statistics_field "workers.num_jobs")
+check_catdb
+
+if [ $(statistics_field "workers.num_jobs") -ne $jobs ] ; then
+    echo "BAD: worker jobs were run with WorkerProcesses=0"
+    exit 1
+fi
+
+echo "GOOD: traverses were run by reused worker processes"
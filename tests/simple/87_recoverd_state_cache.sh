@@ -0,0 +1,67 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that the recovery master notices state changes on other nodes
+without waiting for a full check of the cluster state.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Set RecoverFullCheckInterval to 3600 on all nodes.
+3. Disable and enable a node that is not the recovery master.
+4. Put a node that is not the recovery master into recovery mode
+   with 'ctdb recover'.
+
+Expected results:
+
+* The recovery master reacts to the changes within a few seconds, so
+  the node flags are updated everywhere and a recovery is run.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB recmaster"
+recmaster="$out"
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+test_node=$(( ($recmaster + 1) % $num_nodes ))
+
+echo "Recovery master is node $recmaster, testing with node $test_node"
+
+try_command_on_node all "$CTDB setvar RecoverFullCheckInterval 3600"
+
+# let the recovery daemons pick up the new value with their full check
+sleep_for 3
+
+echo "Disabling node $test_node"
+try_command_on_node 0 $CTDB disable -n $test_node
+wait_until_node_has_status $test_node disabled 30
+
+echo "Enabling node $test_node"
+try_command_on_node 0 $CTDB enable -n $test_node
+wait_until_node_has_status $test_node enabled 30
+
+echo "Setting recovery mode on node $test_node"
+try_command_on_node $test_node "timeout 60 $CTDB recover"
+
+wait_until 30 onnode 0 $CTDB_TEST_WRAPPER _cluster_is_healthy
+
+echo "GOOD: the recovery master noticed the changes"
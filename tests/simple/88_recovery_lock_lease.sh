@@ -0,0 +1,94 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that the recovery lock can be held by a lease based helper and
+that the recovery master takes the lock again when the lease expires.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes, running on the
+  local machine.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Set RecLockLeaseTime to 3 on all nodes.
+3. Use ctdb_mutex_lease_helper as the recovery lock on all nodes.
+4. Wait until the recovery master holds the lease.
+5. Stop the helper holding the lease with SIGSTOP.
+
+Expected results:
+
+* The recovery master notices that the lease was not renewed, runs a
+  recovery and takes the lease again with a new helper process.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+if [ -z "$TEST_LOCAL_DAEMONS" ] ; then
+    echo "SKIPPING this test - only runs against local daemons"
+    exit 0
+fi
+
+# Reset configuration
+ctdb_restart_when_done
+
+helper="$(cd "$TEST_SCRIPTS_DIR" && pwd)/ctdb_mutex_lease_helper"
+lease_dir="${TEST_VAR_DIR}/rec.lease"
+owner="${lease_dir}/owner"
+
+lease_cleanup ()
+{
+    if [ -n "$pid" ] ; then
+	kill -9 "$pid" 2>/dev/null || true
+    fi
+    rm -rf "$lease_dir"
+}
+
+ctdb_test_exit_hook_add lease_cleanup
+
+lease_owner_is_not ()
+{
+    local p=$(cat "$owner" 2>/dev/null)
+    [ -n "$p" -a "$p" != "$1" ] && kill -0 "$p" 2>/dev/null
+}
+
+helper_is_gone ()
+{
+    ! kill -0 "$1" 2>/dev/null
+}
+
+try_command_on_node all "$CTDB setvar RecLockLeaseTime 3"
+
+echo "Using \"$helper\" as the recovery lock"
+try_command_on_node all "$CTDB setreclock '!$helper $lease_dir'"
+
+try_command_on_node 0 "$CTDB getreclock"
+echo "$out"
+
+echo "Waiting for the recovery master to take the lease"
+wait_until 60 lease_owner_is_not ""
+pid=$(cat "$owner")
+wait_until 60 onnode 0 $CTDB_TEST_WRAPPER _cluster_is_healthy
+
+echo "Lease held by helper with pid $pid, stopping it"
+kill -STOP "$pid"
+
+wait_until 60 lease_owner_is_not "$pid"
+echo "Lease now held by helper with pid $(cat "$owner")"
+
+wait_until 60 onnode 0 $CTDB_TEST_WRAPPER _cluster_is_healthy
+
+echo "Waiting for the stopped helper to be killed"
+wait_until 30 helper_is_gone "$pid"
+
+echo "GOOD: the recovery master took the lease again"
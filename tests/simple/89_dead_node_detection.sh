@@ -0,0 +1,77 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that a hung node is marked DISCONNECTED within a few seconds and
+that it is not banned when it comes back.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Stop the ctdbd of a node that is not the recovery master with
+   SIGSTOP.
+3. Wait until the recovery master shows the node as disconnected.
+4. Continue the stopped ctdbd with SIGCONT.
+
+Expected results:
+
+* The node is marked DISCONNECTED well before KeepaliveInterval *
+  KeepaliveLimit seconds have passed.
+* Once continued, the node rejoins the cluster without being banned.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB recmaster"
+recmaster="$out"
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+test_node=$(( ($recmaster + 1) % $num_nodes ))
+
+try_command_on_node $test_node "$CTDB getpid"
+pid="${out#Pid:}"
+
+continue_node ()
+{
+    onnode $test_node kill -CONT "$pid" || true
+}
+
+ctdb_test_exit_hook_add continue_node
+
+echo "Stopping ctdbd on node $test_node (pid $pid)"
+try_command_on_node $test_node kill -STOP "$pid"
+
+# DeadNodePhi marks it after about a second by default, while
+# KeepaliveInterval * KeepaliveLimit is 25 seconds
+wait_until_node_has_status $test_node disconnected 5 $recmaster
+
+echo "Continuing ctdbd on node $test_node"
+try_command_on_node $test_node kill -CONT "$pid"
+
+wait_until_node_has_status $test_node connected 30 $recmaster
+wait_until 60 onnode $recmaster $CTDB_TEST_WRAPPER _cluster_is_healthy
+
+try_command_on_node -v $recmaster "$CTDB status"
+if echo "$out" | grep -q "BANNED" ; then
+    echo "BAD: a node was banned"
+    exit 1
+fi
+
+echo "GOOD: node $test_node was detected as dead and came back"
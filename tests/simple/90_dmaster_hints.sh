@@ -0,0 +1,75 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that calls for records held by other nodes use dmaster hints.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Run ctdb_fetch on all nodes, which migrates one record around the
+   cluster.
+3. Check the dmaster_hints statistics with 'ctdb statistics'.
+4. Set DmasterHintCacheSize to 0 and run ctdb_fetch again.
+
+Expected results:
+
+* ctdb_fetch runs without error.
+* Calls were sent on dmaster hints, and none were with
+  DmasterHintCacheSize=0.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+run_fetch ()
+{
+    echo "Running ctdb_fetch on all $num_nodes nodes."
+    try_command_on_node -pq all \
+	$CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch -n $num_nodes -t 5
+}
+
+hits_before=$(statistics_field_sum "dmaster_hints.hits")
+
+run_fetch
+
+hits=$(statistics_field_sum "dmaster_hints.hits")
+misses=$(statistics_field_sum "dmaster_hints.misses")
+stale=$(statistics_field_sum "dmaster_hints.stale")
+saved=$(statistics_field_sum "dmaster_hints.hops_saved")
+
+echo "hits=$hits (before $hits_before) misses=$misses stale=$stale hops_saved=$saved"
+
+if [ $hits -le $hits_before ] ; then
+    echo "BAD: no calls were sent on a dmaster hint"
+    exit 1
+fi
+
+echo "Disabling dmaster hints"
+try_command_on_node all "$CTDB setvar DmasterHintCacheSize 0"
+
+run_fetch
+
+if [ $(statistics_field_sum "dmaster_hints.hits") -ne $hits ] ; then
+    echo "BAD: dmaster hints were used with DmasterHintCacheSize=0"
+    exit 1
+fi
+
+echo "GOOD: calls were sent on dmaster hints"
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that shipped calls run at the dmaster without migrating records.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Turn on shipping of fetch calls for test.tdb on all nodes.
+3. Fetch one record with calls on all nodes at the same time.
+4. Check the shipped statistics with 'ctdb statistics'.
+5. Fetch the record with calls on node 0 only, then on node 1 only.
+
+Expected results:
+
+* Calls were shipped while all nodes fetched the record.
+* The record was migrated once a single node kept fetching it.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+try_command_on_node 0 "$CTDB attach test.tdb"
+
+echo "Turning on shipping of fetch calls for test.tdb"
+try_command_on_node all "$CTDB setdbshipcall test.tdb fetch on"
+
+calls_before=$(statistics_field_sum "shipped.calls")
+
+echo "Fetching the record on all $num_nodes nodes."
+try_command_on_node -pq all \
+    $CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch_one --call -t 3
+
+calls=$(statistics_field_sum "shipped.calls")
+migrations=$(statistics_field_sum "shipped.migrations")
+
+echo "shipped calls=$calls (before $calls_before) migrations=$migrations"
+
+if [ $calls -le $calls_before ] ; then
+    echo "BAD: no calls were shipped"
+    exit 1
+fi
+
+# The record ends up on node 0, so it has to move to node 1
+for n in 0 1 ; do
+    echo "Fetching the record on node $n only."
+    try_command_on_node -q $n \
+	$CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch_one --call -t 3
+done
+
+if [ $(statistics_field_sum "shipped.migrations") -le $migrations ] ; then
+    echo "BAD: the record was not migrated to the node using it"
+    exit 1
+fi
+
+echo "GOOD: calls were shipped and the record followed its only user"
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that recovery traffic uses its own stream to each node.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Run ctdb_fetch on all nodes and force a recovery.
+3. Run 'ctdb streamstats' on all nodes.
+
+Expected results:
+
+* Each node has TcpStreams connected streams to every other node.
+* Calls went over the interactive streams and the recovery master
+  sent recovery controls over its bulk streams.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+try_command_on_node 0 "$CTDB getvar TcpStreams"
+num_streams="${out#* = }"
+
+echo "Running ctdb_fetch on all $num_nodes nodes."
+try_command_on_node -pq all $CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch -n $num_nodes -t 5
+
+echo "Forcing a recovery."
+try_command_on_node 0 "$CTDB recover"
+cluster_is_healthy
+
+try_command_on_node -v all "$CTDB streamstats"
+
+# count the connected streams of a class, and those that carried packets
+count_streams ()
+{
+    echo "$out" | awk -v class="$1" -v used="$2" '
+        $1 ~ /^[0-9]+$/ && $3 == class && $4 == "yes" && $5 >= used { n++ }
+        END { print n + 0 }'
+}
+
+pairs=$(($num_nodes * ($num_nodes - 1)))
+
+if [ $num_streams -lt 2 ] ; then
+    echo "BAD: TcpStreams is $num_streams, expected the default of 2"
+    exit 1
+fi
+
+interactive=$(count_streams interactive 0)
+bulk=$(count_streams bulk 0)
+echo "connected streams: interactive=$interactive bulk=$bulk, $pairs node pairs"
+if [ $interactive -ne $(($pairs * ($num_streams - 1))) -o $bulk -ne $pairs ] ; then
+    echo "BAD: not all streams are connected"
+    exit 1
+fi
+
+interactive=$(count_streams interactive 1)
+bulk=$(count_streams bulk 1)
+echo "streams with traffic: interactive=$interactive bulk=$bulk"
+if [ $interactive -eq 0 -o $bulk -eq 0 ] ; then
+    echo "BAD: traffic did not use both classes of stream"
+    exit 1
+fi
+
+echo "GOOD: recovery traffic used the bulk streams"
@@ -0,0 +1,106 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that packets to other nodes are queued by priority class.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Run ctdb_fetch on all nodes and force a recovery.
+3. Run 'ctdb streamstats' on each node.
+4. Set MaxQueueBytes to 16kB, run ctdb_fetch and force a recovery
+   again.
+
+Expected results:
+
+* Every node sent control packets (keepalives and election messages)
+  and normal packets.
+* The recovery master sent bulk packets.
+* No packets were dropped.
+* With a small MaxQueueBytes client requests are held back instead,
+  so still no packets are dropped and the cluster stays healthy.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+echo "Running ctdb_fetch on all $num_nodes nodes."
+try_command_on_node -pq all $CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch -n $num_nodes -t 5
+
+echo "Forcing a recovery."
+try_command_on_node 0 "$CTDB recover"
+cluster_is_healthy
+
+# sum a column over the queue rows of one priority class
+sum_class ()
+{
+    echo "$out" | awk -v class="$1" -v col="$2" '
+        $1 == class { n += $col }
+        END { print n + 0 }'
+}
+
+check_streamstats ()
+{
+    local i
+    total_bulk=0
+    for i in $(seq 0 $(($num_nodes - 1))) ; do
+	try_command_on_node -v $i "$CTDB streamstats"
+
+	control=$(sum_class control 2)
+	normal=$(sum_class normal 2)
+	bulk=$(sum_class bulk 2)
+	dropped=$(( $(sum_class control 7) + $(sum_class normal 7) + $(sum_class bulk 7) ))
+	echo "node $i: control=$control normal=$normal bulk=$bulk dropped=$dropped"
+
+	if [ $control -eq 0 -o $normal -eq 0 ] ; then
+	    echo "BAD: node $i did not send both control and normal packets"
+	    exit 1
+	fi
+	if [ $dropped -ne 0 ] ; then
+	    echo "BAD: node $i dropped packets"
+	    exit 1
+	fi
+	total_bulk=$(($total_bulk + $bulk))
+    done
+}
+
+check_streamstats
+
+if [ $total_bulk -eq 0 ] ; then
+    echo "BAD: no bulk packets were sent during the recovery"
+    exit 1
+fi
+
+echo "GOOD: packets were queued in all priority classes"
+
+echo "Setting MaxQueueBytes to 16384 on all nodes."
+try_command_on_node all "$CTDB setvar MaxQueueBytes 16384"
+
+echo "Running ctdb_fetch on all $num_nodes nodes."
+try_command_on_node -pq all $CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch -n $num_nodes -t 5
+
+echo "Forcing a recovery."
+try_command_on_node 0 "$CTDB recover"
+cluster_is_healthy
+
+check_streamstats
+
+echo "GOOD: no packets were dropped with a small MaxQueueBytes"
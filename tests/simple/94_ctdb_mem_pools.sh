@@ -0,0 +1,80 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that packets and call state are allocated from memory pools.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Run ctdb_fetch on all nodes.
+3. Check the mem_pools statistics with 'ctdb statistics'.
+4. Set MemPools to 0 and run ctdb_fetch again.
+
+Expected results:
+
+* ctdb_fetch runs without error.
+* Most allocations were served from a pool, and none were with
+  MemPools=0.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+run_fetch ()
+{
+    echo "Running ctdb_fetch on all $num_nodes nodes."
+    try_command_on_node -pq all \
+	$CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch -n $num_nodes -t 5
+}
+
+try_command_on_node all "$CTDB statisticsreset"
+
+run_fetch
+
+allocs=$(statistics_field_sum "mem_pools.allocs")
+hits=$(statistics_field_sum "mem_pools.hits")
+pools=$(statistics_field_sum "mem_pools.pools")
+
+echo "allocs=$allocs hits=$hits pools=$pools"
+
+if [ $allocs -eq 0 -o $(($hits * 2)) -le $allocs ] ; then
+    echo "BAD: most allocations did not come from a pool"
+    exit 1
+fi
+
+echo "Disabling memory pools"
+try_command_on_node all "$CTDB setvar MemPools 0"
+hits=$(statistics_field_sum "mem_pools.hits")
+allocs=$(statistics_field_sum "mem_pools.allocs")
+
+run_fetch
+
+if [ $(statistics_field_sum "mem_pools.hits") -ne $hits ] ; then
+    echo "BAD: memory pools were used with MemPools=0"
+    exit 1
+fi
+
+if [ $(statistics_field_sum "mem_pools.allocs") -le $allocs ] ; then
+    echo "BAD: allocations were not counted with MemPools=0"
+    exit 1
+fi
+
+echo "GOOD: allocations were served from memory pools"
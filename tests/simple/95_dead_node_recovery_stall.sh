@@ -0,0 +1,132 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that a node that stops responding for a few seconds in the
+middle of a recovery is not marked DISCONNECTED.
+
+Pulling and pushing databases during a recovery runs in the main loop
+of ctdbd, so a node with a large database can be quiet for several
+seconds while the other nodes wait for it.  This is simulated with an
+eventscript that stops the ctdbd of one node with SIGSTOP from its
+startrecovery event and continues it 8 seconds later.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Install the stalling eventscript for a node that is not the
+   recovery master.
+3. Start a recovery.
+4. While the node is stopped, check that no other node shows it as
+   disconnected.
+5. Wait for the recovery to complete.
+
+Expected results:
+
+* The stopped node is not marked DISCONNECTED, although DeadNodePhi
+  alone would mark it after about a second.
+* The recovery completes and no node is banned.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB recmaster"
+recmaster="$out"
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+test_node=$(( ($recmaster + 1) % $num_nodes ))
+
+try_command_on_node $test_node "$CTDB getpid"
+pid="${out#Pid:}"
+
+stall_file="${TEST_VAR_DIR:-/tmp}/stall_during_recovery.$$"
+script_name="50.stall_during_recovery"
+
+continue_node ()
+{
+    uninstall_eventscript "$script_name"
+    rm -f "$stall_file"
+    onnode $test_node kill -CONT "$pid" || true
+}
+
+ctdb_test_exit_hook_add continue_node
+
+# The first node to run the script stops the test node, only once
+install_eventscript "$script_name" "#!/bin/sh
+[ \"\$1\" = startrecovery ] || exit 0
+rm \"$stall_file\" 2>/dev/null || exit 0
+kill -STOP $pid
+(sleep 8 ; kill -CONT $pid) >/dev/null 2>&1 </dev/null &
+exit 0"
+
+touch "$stall_file"
+
+echo "Starting a recovery on node $recmaster"
+onnode -q $recmaster "timeout 60 $CTDB recover" >/dev/null 2>&1 &
+recover_pid=$!
+
+is_stopped ()
+{
+    onnode -q $test_node "grep -q '^State:.*T' /proc/$pid/status"
+}
+
+echo "Waiting until ctdbd on node $test_node (pid $pid) is stopped"
+wait_until 30 is_stopped
+
+node_seen_disconnected ()
+{
+    local n="$1"
+
+    # Don't wait for the stopped node to list its interfaces
+    onnode -q $n "$CTDB -t 1 -Y status" 2>/dev/null |
+    grep -q "^:${test_node}:[^:]*:1:"
+}
+
+count=0
+while is_stopped ; do
+    for n in $(seq 0 $(($num_nodes - 1))) ; do
+	[ $n -eq $test_node ] && continue
+	if node_seen_disconnected $n ; then
+	    echo "BAD: node $n marked node $test_node as disconnected"
+	    exit 1
+	fi
+    done
+    count=$(($count + 1))
+    sleep 1
+done
+
+echo "ctdbd on node $test_node was continued, checked $count times"
+
+if [ $count -lt 3 ] ; then
+    echo "BAD: node $test_node was not stopped for long enough"
+    exit 1
+fi
+
+wait $recover_pid || true
+
+wait_until 60 onnode $recmaster $CTDB_TEST_WRAPPER _cluster_is_healthy
+
+try_command_on_node -v $recmaster "$CTDB status"
+if echo "$out" | grep -q "DISCONNECTED\|BANNED" ; then
+    echo "BAD: a node was disconnected or banned"
+    exit 1
+fi
+
+echo "GOOD: node $test_node survived a stall during recovery"
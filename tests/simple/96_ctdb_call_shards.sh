@@ -0,0 +1,132 @@
+#!/bin/bash
+
+test_info()
+{
+    cat <<EOF
+Verify that calls and record migrations are run by call shards.
+
+Prerequisites:
+
+* An active CTDB cluster with at least 2 active nodes.
+
+Steps:
+
+1. Verify that the status on all of the ctdb nodes is 'OK'.
+2. Set CallShards to 2 on all nodes.
+3. Write records to a test database from every node and read each of
+   them back on another node.
+4. Run ctdb_fetch on all nodes and force a recovery.
+5. Read the records back again.
+6. Set CallShards to 0 and run ctdb_fetch again.
+
+Expected results:
+
+* Every record reads back with the value last written to it.
+* The calls were sent to call shards, and ctdb_fetch runs without
+  error.
+* The cluster is healthy after the recovery.
+* With CallShards=0 no calls are sent to call shards.
+EOF
+}
+
+. "${TEST_SCRIPTS_DIR}/integration.bash"
+
+ctdb_test_init "$@"
+
+set -e
+
+cluster_is_healthy
+
+# Reset configuration
+ctdb_restart_when_done
+
+try_command_on_node 0 "$CTDB listnodes"
+num_nodes=$(echo "$out" | wc -l)
+
+num_records=10
+
+TESTDB="call_shard_test.tdb"
+
+try_command_on_node -q 0 $CTDB_TEST_WRAPPER ctdb attach $TESTDB
+try_command_on_node -q 0 $CTDB_TEST_WRAPPER ctdb wipedb $TESTDB
+
+echo "Enabling call shards"
+try_command_on_node all "$CTDB setvar CallShards 2"
+try_command_on_node all "$CTDB statisticsreset"
+
+run_fetch ()
+{
+    echo "Running ctdb_fetch on all $num_nodes nodes."
+    try_command_on_node -pq all \
+	$CTDB_TEST_WRAPPER $VALGRIND ctdb_fetch -n $num_nodes -t 5
+}
+
+# write the records, each from a different node than last time
+write_records ()
+{
+    local i=0 n
+    while [ $i -lt $num_records ]; do
+	n=$[ ($i + $1) % $num_nodes ]
+	try_command_on_node -q $n $CTDB_TEST_WRAPPER \
+	    ctdb writekey $TESTDB "key-$i" "value-$i-$1"
+	i=$[ $i + 1 ]
+    done
+}
+
+# read every record on the node after the one that wrote it
+check_records ()
+{
+    local i=0 n value
+    while [ $i -lt $num_records ]; do
+	n=$[ ($i + $1 + 1) % $num_nodes ]
+	value="value-$i-$1"
+	try_command_on_node -q $n $CTDB_TEST_WRAPPER \
+	    ctdb readkey $TESTDB "key-$i"
+	if [ "$out" != "Data: size:${#value} ptr:[$value]" ] ; then
+	    echo "BAD: node $n read \"$out\" for key-$i"
+	    exit 1
+	fi
+	i=$[ $i + 1 ]
+    done
+}
+
+write_records 0
+check_records 0
+write_records 1
+check_records 1
+
+run_fetch
+
+echo "Forcing a recovery."
+try_command_on_node 0 "$CTDB recover"
+cluster_is_healthy
+
+check_records 1
+
+requests=$(statistics_field_sum "call_shards.num_requests")
+spawned=$(statistics_field_sum "call_shards.num_spawned")
+fallbacks=$(statistics_field_sum "call_shards.num_fallbacks")
+
+echo "requests=$requests spawned=$spawned fallbacks=$fallbacks"
+
+if [ $requests -eq 0 -o $spawned -eq 0 ] ; then
+    echo "BAD: calls were not sent to call shards"
+    exit 1
+fi
+if [ $fallbacks -ge $requests ] ; then
+    echo "BAD: call shards left every call to the daemon"
+    exit 1
+fi
+
+echo "Disabling call shards"
+try_command_on_node all "$CTDB setvar CallShards 0"
+requests=$(statistics_field_sum "call_shards.num_requests")
+
+run_fetch
+
+if [ $(statistics_field_sum "call_shards.num_requests") -ne $requests ] ; then
+    echo "BAD: calls were sent to call shards with CallShards=0"
+    exit 1
+fi
+
+echo "GOOD: calls were run by call shards"
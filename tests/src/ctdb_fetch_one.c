@@ -1,6 +1,7 @@
 /* 
    simple ctdb benchmark
    This test just fetch_locks a record and releases it in a loop.
+   With --call it fetches the record with a call instead.
 
    Copyright (C) Ronnie Sahlberg 2009
 
@@ -28,6 +29,7 @@
 
 static int timelimit = 10;
 static int lock_count = 0;
+static int use_call = 0;
 
 static struct ctdb_db_context *ctdb_db;
 
@@ -61,6 +63,17 @@ static void bench_fetch_one_loop(struct ctdb_context *ctdb, struct event_context
 		TALLOC_CTX *tmp_ctx = talloc_new(ctdb);
 		struct ctdb_record_handle *h;
 
+		if (use_call) {
+			if (ctdb_fetch(ctdb_db, tmp_ctx, key, &data) != 0) {
+				printf("Failed to fetch record '%s' on node %d\n",
+				       (const char *)key.dptr, ctdb_get_pnn(ctdb));
+			} else {
+				lock_count++;
+			}
+			talloc_free(tmp_ctx);
+			continue;
+		}
+
 		h = ctdb_fetch_lock(ctdb_db, tmp_ctx, key, &data);
 		if (h == NULL) {
 			printf("Failed to fetch record '%s' on node %d\n", 
@@ -85,6 +98,7 @@ int main(int argc, const char *argv[])
 		POPT_AUTOHELP
 		POPT_CTDB_CMDLINE
 		{ "timelimit", 't', POPT_ARG_INT, &timelimit, 0, "timelimit", "integer" },
+		{ "call", 'c', POPT_ARG_NONE, &use_call, 0, "fetch with a call instead of fetch_lock", NULL },
 		POPT_TABLEEND
 	};
 	int opt;
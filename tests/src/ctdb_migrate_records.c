@@ -0,0 +1,169 @@
+/*
+   test batched record migration
+
+   Pull a set of records to this node with a single ctdb_migrate_records()
+   call, then lock and increment each one as it arrives.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "popt.h"
+#include "cmdline.h"
+
+static int num_records = 100;
+
+struct migrate_state {
+	uint32_t pnn;
+	int arrived;
+	int failed;
+	uint32_t min, max;
+};
+
+/*
+  called as each record becomes local: lock it and bump its counter
+ */
+static void record_arrived(struct ctdb_db_context *ctdb_db, TDB_DATA key,
+			   void *private_data)
+{
+	struct migrate_state *state = (struct migrate_state *)private_data;
+	TALLOC_CTX *tmp_ctx = talloc_new(ctdb_db);
+	struct ctdb_record_handle *h;
+	uint32_t value = 0;
+	TDB_DATA data;
+
+	state->arrived++;
+
+	h = ctdb_fetch_lock(ctdb_db, tmp_ctx, key, &data);
+	if (h == NULL) {
+		printf("Failed to lock record '%.*s' on node %u\n",
+		       (int)key.dsize, (const char *)key.dptr, state->pnn);
+		state->failed++;
+		talloc_free(tmp_ctx);
+		return;
+	}
+
+	if (data.dsize == sizeof(value)) {
+		memcpy(&value, data.dptr, sizeof(value));
+	}
+	value++;
+
+	data.dptr = (uint8_t *)&value;
+	data.dsize = sizeof(value);
+	if (ctdb_record_store(h, data) != 0) {
+		printf("Failed to store record '%.*s' on node %u\n",
+		       (int)key.dsize, (const char *)key.dptr, state->pnn);
+		state->failed++;
+	}
+
+	state->min = MIN(state->min, value);
+	state->max = MAX(state->max, value);
+
+	talloc_free(tmp_ctx);
+}
+
+/*
+  main program
+*/
+int main(int argc, const char *argv[])
+{
+	struct ctdb_context *ctdb;
+	struct ctdb_db_context *ctdb_db;
+	struct migrate_state state;
+	TDB_DATA *keys;
+
+	struct poptOption popt_options[] = {
+		POPT_AUTOHELP
+		POPT_CTDB_CMDLINE
+		{ "num-records", 'r', POPT_ARG_INT, &num_records, 0, "number of records to migrate", "integer" },
+		POPT_TABLEEND
+	};
+	int opt, i, ret;
+	poptContext pc;
+	struct event_context *ev;
+
+	pc = poptGetContext(argv[0], argc, argv, popt_options, POPT_CONTEXT_KEEP_FIRST);
+
+	while ((opt = poptGetNextOpt(pc)) != -1) {
+		switch (opt) {
+		default:
+			fprintf(stderr, "Invalid option %s: %s\n",
+				poptBadOption(pc, 0), poptStrerror(opt));
+			exit(1);
+		}
+	}
+
+	ev = event_context_init(NULL);
+
+	ctdb = ctdb_cmdline_client(ev, timeval_current_ofs(3, 0));
+	if (ctdb == NULL) {
+		printf("failed to connect to ctdb daemon.\n");
+		exit(1);
+	}
+
+	ctdb_db = ctdb_attach(ctdb, timeval_current_ofs(2, 0),
+			      "migrate_records.tdb", false, 0);
+	if (!ctdb_db) {
+		printf("ctdb_attach failed - %s\n", ctdb_errstr(ctdb));
+		exit(1);
+	}
+
+	printf("Waiting for cluster\n");
+	while (1) {
+		uint32_t recmode=1;
+		ctdb_ctrl_getrecmode(ctdb, ctdb, timeval_zero(), CTDB_CURRENT_NODE, &recmode);
+		if (recmode == 0) break;
+		event_loop_once(ev);
+	}
+
+	keys = talloc_array(ctdb, TDB_DATA, num_records);
+	if (keys == NULL) {
+		printf("Failed to allocate keys\n");
+		exit(1);
+	}
+	for (i=0; i<num_records; i++) {
+		char *keystr = talloc_asprintf(keys, "migrate-%d", i);
+
+		keys[i].dptr = (uint8_t *)keystr;
+		keys[i].dsize = strlen(keystr);
+	}
+
+	state.pnn = ctdb_get_pnn(ctdb);
+	state.arrived = 0;
+	state.failed = 0;
+	state.min = UINT32_MAX;
+	state.max = 0;
+
+	ret = ctdb_migrate_records(ctdb_db, num_records, keys,
+				   record_arrived, &state);
+	if (ret != num_records || state.arrived != num_records) {
+		printf("Migrated %d/%d records (%d arrived) to node %u\n",
+		       ret, num_records, state.arrived, state.pnn);
+		exit(1);
+	}
+	if (state.failed != 0) {
+		exit(1);
+	}
+	printf("Migrated %d records to node %u\n", ret, state.pnn);
+
+	if (state.min != state.max) {
+		printf("Inconsistent record values %u..%u\n",
+		       state.min, state.max);
+		exit(1);
+	}
+	printf("Records at value %u\n", state.min);
+
+	return 0;
+}
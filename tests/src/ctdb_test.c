@@ -91,6 +91,7 @@
 #include "common/ctdb_message.c"
 #include "lib/util/debug.c"
 #include "common/rb_tree.c"
+#include "common/key_index.c"
 #include "common/system_common.c"
 #include "common/ctdb_logging.c"
 #include "common/ctdb_fork.c"
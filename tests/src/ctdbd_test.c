@@ -50,6 +50,7 @@ bool fast_start;
 #include "common/cmdline.c"
 #include "lib/util/debug.c"
 #include "common/rb_tree.c"
+#include "common/key_index.c"
 #include "common/system_common.c"
 #include "common/ctdb_logging.c"
 #include "common/ctdb_fork.c"
@@ -78,6 +79,12 @@ bool fast_start;
 #include "server/ctdb_statistics.c"
 #include "server/ctdb_update_record.c"
 #include "server/ctdb_lock.c"
+#include "server/ctdb_hot_keys.c"
+#include "server/ctdb_worker.c"
+#include "server/ctdb_cluster_mutex.c"
+#include "server/ctdb_dmaster_hints.c"
+#include "server/ctdb_mem_pools.c"
+#include "server/ctdb_call_shard.c"
 
 /* CTDB_CLIENT_OBJ */
 #include "client/ctdb_client.c"
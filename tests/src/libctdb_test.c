@@ -0,0 +1,377 @@
+/*
+   exercise the asynchronous libctdb client library
+
+   Many requests are put on the socket at once and completed through
+   callbacks from a single poll() loop.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include "popt.h"
+#include <ctdb.h>
+
+static const char *dbname = NULL;
+static int num_requests = 1000;
+static int num_records = 100;
+
+static double timeval_elapsed(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) * 1.0e-6;
+}
+
+/* The one event loop: run until *pending drops to zero */
+static bool run_until(struct ctdb_connection *ctdb, int *pending)
+{
+	while (*pending > 0) {
+		struct pollfd pfd;
+
+		pfd.fd = ctdb_get_fd(ctdb);
+		pfd.events = ctdb_which_events(ctdb);
+		if (poll(&pfd, 1, 5000) != 1) {
+			fprintf(stderr, "timed out, %d pending\n", *pending);
+			return false;
+		}
+		if (!ctdb_service(ctdb, pfd.revents)) {
+			fprintf(stderr, "ctdb_service failed\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+struct pnn_state {
+	int pending;
+	int ok;
+	uint32_t pnn;
+};
+
+static void pnn_done(struct ctdb_connection *ctdb,
+		     struct ctdb_request *req, struct pnn_state *state)
+{
+	uint32_t pnn;
+
+	if (ctdb_getpnn_recv(ctdb, req, &pnn) && pnn == state->pnn) {
+		state->ok++;
+	}
+	ctdb_request_free(req);
+	state->pending--;
+}
+
+/* Pipeline a burst of controls on the one socket */
+static bool test_pipeline(struct ctdb_connection *ctdb, uint32_t pnn)
+{
+	struct pnn_state state;
+	struct timeval start;
+	int i;
+
+	state.pending = 0;
+	state.ok = 0;
+	state.pnn = pnn;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_requests; i++) {
+		if (!ctdb_getpnn_send(ctdb, CTDB_CURRENT_NODE,
+				      pnn_done, &state)) {
+			fprintf(stderr, "ctdb_getpnn_send failed\n");
+			return false;
+		}
+		state.pending++;
+	}
+	if (ctdb_num_out_queue(ctdb) != num_requests ||
+	    ctdb_num_active(ctdb) != num_requests) {
+		fprintf(stderr, "%d requests queued, expected %d\n",
+			ctdb_num_out_queue(ctdb), num_requests);
+		return false;
+	}
+	if (!run_until(ctdb, &state.pending)) {
+		return false;
+	}
+	if (state.ok != num_requests || ctdb_num_active(ctdb) != 0) {
+		fprintf(stderr, "%d/%d getpnn replies ok, %d still active\n",
+			state.ok, num_requests, ctdb_num_active(ctdb));
+		return false;
+	}
+	printf("Pipelined %d getpnn controls: %.0f/sec\n", num_requests,
+	       num_requests / timeval_elapsed(&start));
+	return true;
+}
+
+struct record_state {
+	int pending;
+	int written;
+};
+
+static void record_locked(struct ctdb_db *ctdb_db, struct ctdb_lock *lock,
+			  TDB_DATA data, struct record_state *state)
+{
+	uint32_t count = 0;
+	TDB_DATA newdata;
+
+	state->pending--;
+	if (lock == NULL) {
+		fprintf(stderr, "failed to lock record\n");
+		return;
+	}
+	if (data.dsize == sizeof(count)) {
+		memcpy(&count, data.dptr, sizeof(count));
+	}
+	count++;
+	newdata.dptr = (unsigned char *)&count;
+	newdata.dsize = sizeof(count);
+	if (ctdb_writerecord(ctdb_db, lock, newdata)) {
+		state->written++;
+	}
+	ctdb_release_lock(ctdb_db, lock);
+}
+
+/* Update records, some of which may need migrating here */
+static bool test_records(struct ctdb_connection *ctdb, struct ctdb_db *ctdb_db)
+{
+	struct record_state state;
+	char keystr[32];
+	TDB_DATA key;
+	int i;
+
+	state.pending = 0;
+	state.written = 0;
+	for (i = 0; i < num_records; i++) {
+		snprintf(keystr, sizeof(keystr), "libctdb-%d", i);
+		key.dptr = (unsigned char *)keystr;
+		key.dsize = strlen(keystr);
+		state.pending++;
+		if (!ctdb_readrecordlock_async(ctdb_db, key,
+					       record_locked, &state)) {
+			fprintf(stderr, "ctdb_readrecordlock_async failed\n");
+			return false;
+		}
+	}
+	if (!run_until(ctdb, &state.pending)) {
+		return false;
+	}
+	if (state.written != num_records) {
+		fprintf(stderr, "wrote %d/%d records\n",
+			state.written, num_records);
+		return false;
+	}
+	printf("Wrote %d records\n", num_records);
+	return true;
+}
+
+struct traverse_state {
+	int pending;
+	int count;
+	int status;
+	/* count each key once */
+	bool *seen;
+};
+
+static int traverse_cb(struct ctdb_connection *ctdb, struct ctdb_db *ctdb_db,
+		       int status, TDB_DATA key, TDB_DATA data,
+		       void *private_data)
+{
+	struct traverse_state *state = private_data;
+
+	if (status == TRAVERSE_STATUS_RECORD) {
+		char keystr[32];
+		int i;
+
+		if (key.dsize >= sizeof(keystr)) {
+			return 0;
+		}
+		memcpy(keystr, key.dptr, key.dsize);
+		keystr[key.dsize] = '\0';
+		if (sscanf(keystr, "libctdb-%d", &i) == 1 &&
+		    i >= 0 && i < num_records && !state->seen[i]) {
+			state->seen[i] = true;
+			state->count++;
+		}
+		return 0;
+	}
+	state->status = status;
+	state->pending = 0;
+	return 0;
+}
+
+static bool test_traverse(struct ctdb_connection *ctdb,
+			  struct ctdb_db *ctdb_db)
+{
+	struct traverse_state state;
+
+	state.pending = 1;
+	state.count = 0;
+	state.status = -1;
+	state.seen = calloc(num_records, sizeof(bool));
+	if (state.seen == NULL) {
+		return false;
+	}
+	if (!ctdb_traverse_async(ctdb_db, traverse_cb, &state)) {
+		fprintf(stderr, "ctdb_traverse_async failed\n");
+		return false;
+	}
+	if (!run_until(ctdb, &state.pending)) {
+		return false;
+	}
+	free(state.seen);
+	if (state.status != TRAVERSE_STATUS_FINISHED ||
+	    state.count != num_records) {
+		fprintf(stderr, "traverse status %d, %d/%d records\n",
+			state.status, state.count, num_records);
+		return false;
+	}
+	printf("Traversed %d records\n", state.count);
+	return true;
+}
+
+static void message_cb(struct ctdb_connection *ctdb, uint64_t srvid,
+		       TDB_DATA data, int *pending)
+{
+	if (data.dsize == 5 && memcmp(data.dptr, "hello", 5) == 0) {
+		(*pending)--;
+	}
+}
+
+static bool test_messages(struct ctdb_connection *ctdb, uint32_t pnn)
+{
+	uint64_t srvid = CTDB_SRVID_TEST_RANGE | getpid();
+	uint8_t registered = 0;
+	char hello[] = "hello";
+	TDB_DATA data;
+	int pending = 1;
+
+	if (!ctdb_set_message_handler(ctdb, srvid, message_cb, &pending)) {
+		fprintf(stderr, "ctdb_set_message_handler failed\n");
+		return false;
+	}
+	if (!ctdb_check_message_handlers(ctdb, CTDB_CURRENT_NODE, 1,
+					 &srvid, &registered) ||
+	    !registered) {
+		fprintf(stderr, "message handler not registered\n");
+		return false;
+	}
+
+	data.dptr = (unsigned char *)hello;
+	data.dsize = strlen(hello);
+	if (!ctdb_send_message(ctdb, pnn, srvid, data) ||
+	    !run_until(ctdb, &pending)) {
+		fprintf(stderr, "message not received\n");
+		return false;
+	}
+
+	if (!ctdb_remove_message_handler(ctdb, srvid, message_cb, &pending)) {
+		fprintf(stderr, "ctdb_remove_message_handler failed\n");
+		return false;
+	}
+	printf("Received message\n");
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	const char *socket_name = getenv("CTDB_SOCKET");
+	struct ctdb_connection *ctdb;
+	struct ctdb_db *ctdb_db;
+	struct ctdb_vnn_map *vnnmap;
+	uint32_t pnn, recmode;
+	char dbname_buf[64];
+
+	struct poptOption popt_options[] = {
+		POPT_AUTOHELP
+		{ "socket", 0, POPT_ARG_STRING, &socket_name, 0, "local socket name", "filename" },
+		{ "database", 0, POPT_ARG_STRING, &dbname, 0, "database to use", "name" },
+		{ "num-requests", 'n', POPT_ARG_INT, &num_requests, 0, "number of requests to pipeline", "integer" },
+		{ "num-records", 'r', POPT_ARG_INT, &num_records, 0, "number of records to write", "integer" },
+		POPT_TABLEEND
+	};
+	int opt;
+	poptContext pc;
+
+	pc = poptGetContext(argv[0], argc, argv, popt_options, POPT_CONTEXT_KEEP_FIRST);
+
+	while ((opt = poptGetNextOpt(pc)) != -1) {
+		switch (opt) {
+		default:
+			fprintf(stderr, "Invalid option %s: %s\n",
+				poptBadOption(pc, 0), poptStrerror(opt));
+			exit(1);
+		}
+	}
+
+	ctdb = ctdb_connect(socket_name, ctdb_log_file, stderr);
+	if (ctdb == NULL) {
+		fprintf(stderr, "Failed to connect to ctdb daemon\n");
+		exit(1);
+	}
+
+	if (!ctdb_getpnn(ctdb, CTDB_CURRENT_NODE, &pnn)) {
+		fprintf(stderr, "ctdb_getpnn failed\n");
+		exit(1);
+	}
+	printf("Connected to node %u\n", pnn);
+
+	printf("Waiting for cluster\n");
+	do {
+		if (!ctdb_getrecmode(ctdb, CTDB_CURRENT_NODE, &recmode)) {
+			fprintf(stderr, "ctdb_getrecmode failed\n");
+			exit(1);
+		}
+		/* 0 is CTDB_RECOVERY_NORMAL */
+		if (recmode != 0) {
+			sleep(1);
+		}
+	} while (recmode != 0);
+
+	if (!ctdb_getvnnmap(ctdb, CTDB_CURRENT_NODE, &vnnmap)) {
+		fprintf(stderr, "ctdb_getvnnmap failed\n");
+		exit(1);
+	}
+	printf("Generation %u, %u nodes in vnnmap\n",
+	       vnnmap->generation, vnnmap->size);
+	ctdb_free_vnnmap(vnnmap);
+
+	/* A traverse misses records migrating under it, so unless told
+	   otherwise each node gets a database of its own */
+	if (dbname == NULL) {
+		snprintf(dbname_buf, sizeof(dbname_buf),
+			 "libctdb_test_%u.tdb", pnn);
+		dbname = dbname_buf;
+	}
+	ctdb_db = ctdb_attachdb(ctdb, dbname, false, 0);
+	if (ctdb_db == NULL) {
+		fprintf(stderr, "ctdb_attachdb failed\n");
+		exit(1);
+	}
+
+	if (!test_pipeline(ctdb, pnn) ||
+	    !test_records(ctdb, ctdb_db) ||
+	    !test_traverse(ctdb, ctdb_db) ||
+	    !test_messages(ctdb, pnn)) {
+		exit(1);
+	}
+
+	ctdb_detachdb(ctdb, ctdb_db);
+	ctdb_disconnect(ctdb);
+	printf("libctdb: all tests passed\n");
+	return 0;
+}
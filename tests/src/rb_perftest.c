@@ -1,5 +1,5 @@
 /* 
-   simple rb vs dlist benchmark
+   simple rb vs dlist benchmark, and rb array32 vs key index
 
    Copyright (C) Ronnie Sahlberg 2007
 
@@ -18,7 +18,6 @@
 */
 
 #include "includes.h"
-#include "lib/events/events.h"
 #include "lib/util/dlinklist.h"
 #include "system/filesys.h"
 #include "popt.h"
@@ -27,6 +26,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include "common/rb_tree.h"
+#include "common/key_index.h"
 
 static struct timeval tp1,tp2;
 
@@ -50,6 +50,115 @@ struct list_node {
 	struct list_node *prev, *next;
 };
 
+/*
+  build the padded uint32 array key the array32 functions need, the way
+  the daemon used to for every deferred fetch and sticky record lookup
+ */
+static uint32_t *array32_key(TALLOC_CTX *mem_ctx, TDB_DATA key)
+{
+	uint32_t *k;
+
+	k = talloc_zero_size(mem_ctx, ((key.dsize + 3) & 0xfffffffc) + 4);
+	if (k == NULL) {
+		printf("Failed to allocate key\n");
+		exit(1);
+	}
+
+	k[0] = (key.dsize + 3) / 4 + 1;
+	memcpy(&k[1], key.dptr, key.dsize);
+
+	return k;
+}
+
+static void *array32_insert_callback(void *param, void *data)
+{
+	return param;
+}
+
+/*
+  compare the array32 tree with the key index for record keys
+ */
+static void test_keyed(void)
+{
+	TALLOC_CTX *tmp_ctx = talloc_new(NULL);
+	trbt_tree_t *tree;
+	struct key_index *index;
+	TDB_DATA *keys;
+	double elapsed;
+	int i, found;
+
+	keys = talloc_array(tmp_ctx, TDB_DATA, num_records);
+	if (keys == NULL) {
+		printf("Failed to allocate keys\n");
+		exit(1);
+	}
+	for (i=0;i<num_records;i++) {
+		char *keystr = talloc_asprintf(keys, "perftest-key-%d", i);
+
+		keys[i].dptr  = (uint8_t *)keystr;
+		keys[i].dsize = strlen(keystr);
+	}
+
+	printf("testing array32 tree insert for %d keys\n", num_records);
+	tree = trbt_create(tmp_ctx, 0);
+	start_timer();
+	for (i=0;i<num_records;i++) {
+		uint32_t *k = array32_key(tmp_ctx, keys[i]);
+
+		trbt_insertarray32_callback(tree, k[0], &k[0],
+					    array32_insert_callback,
+					    talloc_new(tree));
+		talloc_free(k);
+	}
+	elapsed=end_timer();
+	printf("%f seconds\n",(float)elapsed);
+
+	printf("testing array32 tree lookup for %d keys\n", num_records);
+	found = 0;
+	start_timer();
+	for (i=0;i<num_records;i++) {
+		uint32_t *k = array32_key(tmp_ctx, keys[i]);
+
+		if (trbt_lookuparray32(tree, k[0], &k[0]) != NULL) {
+			found++;
+		}
+		talloc_free(k);
+	}
+	elapsed=end_timer();
+	printf("%f seconds (%d found)\n",(float)elapsed, found);
+
+	printf("testing key index insert for %d keys\n", num_records);
+	index = key_index_create(tmp_ctx);
+	start_timer();
+	for (i=0;i<num_records;i++) {
+		key_index_insert(index, keys[i], talloc_new(index));
+	}
+	elapsed=end_timer();
+	printf("%f seconds\n",(float)elapsed);
+
+	printf("testing key index lookup for %d keys\n", num_records);
+	found = 0;
+	start_timer();
+	for (i=0;i<num_records;i++) {
+		if (key_index_lookup(index, keys[i]) != NULL) {
+			found++;
+		}
+	}
+	elapsed=end_timer();
+	printf("%f seconds (%d found)\n",(float)elapsed, found);
+
+	printf("testing key index remove for %d keys\n", num_records);
+	start_timer();
+	for (i=0;i<num_records;i++) {
+		talloc_free(key_index_remove(index, keys[i]));
+	}
+	elapsed=end_timer();
+	printf("%f seconds (%u left)\n",(float)elapsed,
+	       key_index_count(index));
+
+	talloc_free(tmp_ctx);
+}
+
 /*
   main program
 */
@@ -94,7 +203,7 @@ int main(int argc, const char *argv[])
 
 
 	printf("testing tree insert for %d records\n", num_records);
-	tree = trbt_create(NULL);
+	tree = trbt_create(NULL, 0);
 	start_timer();
 	for (i=0;i<num_records;i++) {
 		trbt_insert32(tree, i, NULL);
@@ -119,5 +228,7 @@ int main(int argc, const char *argv[])
 	elapsed=end_timer();
 	printf("%f seconds\n",(float)elapsed);
 
+	test_keyed();
+
 	return 0;
 }
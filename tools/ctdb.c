@@ -23,6 +23,7 @@
 #include "system/filesys.h"
 #include "system/network.h"
 #include "system/locale.h"
+#include "system/wait.h"
 #include "popt.h"
 #include "cmdline.h"
 #include "../include/ctdb_version.h"
@@ -30,6 +31,9 @@
 #include "../include/ctdb_private.h"
 #include "../common/rb_tree.h"
 #include "db_wrap.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #define ERR_TIMEOUT	20	/* timed out trying to reach node */
 #define ERR_NONODE	21	/* node does not exist */
@@ -49,6 +53,8 @@ static struct {
 	int printlmaster;
 	int printhash;
 	int printrecordflags;
+	int compress;
+	int workers;
 } options;
 
 #define LONGTIMEOUT options.timelimit*10
@@ -405,6 +411,24 @@ static void show_statistics(struct ctdb_statistics *s, int show_header)
 		STATISTICS_FIELD(locks.num_current),
 		STATISTICS_FIELD(locks.num_pending),
 		STATISTICS_FIELD(locks.num_failed),
+		STATISTICS_FIELD(workers.num_spawned),
+		STATISTICS_FIELD(workers.num_jobs),
+		STATISTICS_FIELD(workers.num_current),
+		STATISTICS_FIELD(workers.num_pending),
+		STATISTICS_FIELD(workers.num_failed),
+		STATISTICS_FIELD(dmaster_hints.hits),
+		STATISTICS_FIELD(dmaster_hints.misses),
+		STATISTICS_FIELD(dmaster_hints.stale),
+		STATISTICS_FIELD(dmaster_hints.hops_saved),
+		STATISTICS_FIELD(shipped.calls),
+		STATISTICS_FIELD(shipped.migrations),
+		STATISTICS_FIELD(mem_pools.allocs),
+		STATISTICS_FIELD(mem_pools.hits),
+		STATISTICS_FIELD(mem_pools.pools),
+		STATISTICS_FIELD(call_shards.num_spawned),
+		STATISTICS_FIELD(call_shards.num_requests),
+		STATISTICS_FIELD(call_shards.num_fallbacks),
+		STATISTICS_FIELD(call_shards.num_current),
 		STATISTICS_FIELD(total_calls),
 		STATISTICS_FIELD(pending_calls),
 		STATISTICS_FIELD(childwrite_calls),
@@ -516,6 +540,11 @@ static void show_statistics(struct ctdb_statistics *s, int show_header)
 		}
 		printf("\n");
 		printf(" %-30s     %.6f/%.6f/%.6f sec out of %d\n", "locks_latency      MIN/AVG/MAX", s->locks.latency.min, s->locks.latency.num?s->locks.latency.total/s->locks.latency.num:0.0, s->locks.latency.max, s->locks.latency.num);
+		printf(" %-30s     %.6f/%.6f/%.6f sec out of %d\n", "workers_queue      MIN/AVG/MAX", s->workers.queue_latency.min, s->workers.queue_latency.num?s->workers.queue_latency.total/s->workers.queue_latency.num:0.0, s->workers.queue_latency.max, s->workers.queue_latency.num);
+		printf(" %-30s     %.6f/%.6f/%.6f sec out of %d\n", "workers_latency    MIN/AVG/MAX", s->workers.latency.min, s->workers.latency.num?s->workers.latency.total/s->workers.latency.num:0.0, s->workers.latency.max, s->workers.latency.num);
+		printf(" %-30s     %.2f hops out of %d\n", "dmaster_hints      AVG saved", s->dmaster_hints.hits?(double)s->dmaster_hints.hops_saved/s->dmaster_hints.hits:0.0, s->dmaster_hints.hits);
+		printf(" %-30s     %.1f%% of %d allocations\n", "mem_pools          hit rate", s->mem_pools.allocs?100.0*s->mem_pools.hits/s->mem_pools.allocs:0.0, s->mem_pools.allocs);
+		printf(" %-30s     %.6f/%.6f/%.6f sec out of %d\n", "call_shards        MIN/AVG/MAX", s->call_shards.latency.min, s->call_shards.latency.num?s->call_shards.latency.total/s->call_shards.latency.num:0.0, s->call_shards.latency.max, s->call_shards.latency.num);
 
 		printf(" %-30s     %.6f/%.6f/%.6f sec out of %d\n", "reclock_ctdbd      MIN/AVG/MAX", s->reclock.ctdbd.min, s->reclock.ctdbd.num?s->reclock.ctdbd.total/s->reclock.ctdbd.num:0.0, s->reclock.ctdbd.max, s->reclock.ctdbd.num);
 
@@ -640,6 +669,138 @@ static int control_stats(struct ctdb_context *ctdb, int argc, const char **argv)
 }
 
 
+/*
+  display remote ctdb statistics history for a time range
+ */
+static int control_statsrange(struct ctdb_context *ctdb, int argc, const char **argv)
+{
+	int ret;
+	struct ctdb_statistics_wire *stats;
+	struct timeval start, end;
+	int i;
+
+	assert_single_node_only();
+
+	if (argc < 1) {
+		usage();
+	}
+
+	start = timeval_set(strtoul(argv[0], NULL, 0), 0);
+	if (argc > 1) {
+		end = timeval_set(strtoul(argv[1], NULL, 0), 0);
+	} else {
+		end = timeval_current();
+	}
+
+	ret = ctdb_ctrl_getstathistory_range(ctdb, TIMELIMIT(), options.pnn, ctdb,
+					     start, end, &stats);
+	if (ret != 0) {
+		DEBUG(DEBUG_ERR, ("Unable to get statistics history from node %u\n", options.pnn));
+		return ret;
+	}
+	for (i=0;i<stats->num;i++) {
+		show_statistics(&stats->stats[i], i==0);
+	}
+	return 0;
+}
+
+
+/*
+  display the request queues of the clients of a node
+ */
+static int control_clientstats(struct ctdb_context *ctdb, int argc, const char **argv)
+{
+	int ret;
+	struct ctdb_client_statistics_wire *stats;
+	uint32_t i;
+
+	assert_single_node_only();
+
+	ret = ctdb_ctrl_getclientstats(ctdb, TIMELIMIT(), options.pnn, ctdb, &stats);
+	if (ret != 0) {
+		DEBUG(DEBUG_ERR, ("Unable to get client statistics from node %u\n", options.pnn));
+		return ret;
+	}
+
+	printf("%-8s %8s %8s %8s %8s %6s %10s %10s %8s  %s\n",
+	       "pid", "inflight", "max", "queued", "max", "paused",
+	       "requests", "waited", "pauses",
+	       "queue_latency MIN/AVG/MAX");
+	for (i=0; i<stats->num; i++) {
+		struct ctdb_client_statistics *s = &stats->stats[i];
+
+		printf("%-8u %8u %8u %8u %8u %6s %10u %10u %8u  %.6f/%.6f/%.6f sec\n",
+		       s->pid, s->inflight, s->max_inflight,
+		       s->queued, s->max_queued,
+		       s->read_paused ? "yes" : "no",
+		       s->num_requests, s->num_queued, s->num_read_pauses,
+		       s->queue_latency.min,
+		       (s->queue_latency.num ?
+			s->queue_latency.total / s->queue_latency.num :
+			0.0),
+		       s->queue_latency.max);
+	}
+
+	talloc_free(stats);
+	return 0;
+}
+
+
+/*
+  display the queues of the transport streams of a node
+ */
+static int control_streamstats(struct ctdb_context *ctdb, int argc, const char **argv)
+{
+	const char *class_names[CTDB_QUEUE_NUM_CLASSES] = {
+		"control", "normal", "bulk"
+	};
+	int ret;
+	struct ctdb_stream_statistics_wire *stats;
+	uint32_t i, j;
+
+	assert_single_node_only();
+
+	ret = ctdb_ctrl_getstreamstats(ctdb, TIMELIMIT(), options.pnn, ctdb, &stats);
+	if (ret != 0) {
+		DEBUG(DEBUG_ERR, ("Unable to get stream statistics from node %u\n", options.pnn));
+		return ret;
+	}
+
+	printf("%-6s %6s %-11s %9s %10s %14s %8s %8s\n",
+	       "node", "stream", "class", "connected", "packets", "bytes",
+	       "queued", "max");
+	for (i=0; i<stats->num; i++) {
+		struct ctdb_stream_statistics *s = &stats->stats[i];
+
+		printf("%-6u %6u %-11s %9s %10u %14llu %8u %8u\n",
+		       s->pnn, s->stream,
+		       s->bulk ? "bulk" : "interactive",
+		       s->connected ? "yes" : "no",
+		       s->num_packets, (unsigned long long)s->num_bytes,
+		       s->queued, s->max_queued);
+
+		printf("  %-9s %10s %8s %8s %12s %12s %8s  %s\n",
+		       "queue", "packets", "queued", "max", "bytes",
+		       "max bytes", "dropped", "wait MIN/AVG/MAX");
+		for (j=0; j<CTDB_QUEUE_NUM_CLASSES; j++) {
+			struct ctdb_queue_class_statistics *c = &s->classes[j];
+
+			printf("  %-9s %10u %8u %8u %12llu %12llu %8u  %.6f/%.6f/%.6f sec\n",
+			       class_names[j], c->num_packets,
+			       c->queued, c->max_queued,
+			       (unsigned long long)c->queued_bytes,
+			       (unsigned long long)c->max_queued_bytes,
+			       c->num_dropped,
+			       c->wait.min,
+			       c->wait.num ? c->wait.total / c->wait.num : 0.0,
+			       c->wait.max);
+		}
+	}
+
+	talloc_free(stats);
+	return 0;
+}
+
 /*
   display remote ctdb db statistics
  */
@@ -681,6 +842,33 @@ static int control_dbstatistics(struct ctdb_context *ctdb, int argc, const char
 		dbstat->locks.num_current);
 	printf(" %*s%-22s%*s%10u\n", 4, "", "pending", 0, "",
 		dbstat->locks.num_pending);
+	printf(" %s\n", "sticky");
+	printf(" %*s%-22s%*s%10u\n", 4, "", "made_sticky", 0, "",
+		dbstat->sticky.made_sticky);
+	printf(" %*s%-22s%*s%10u\n", 4, "", "released", 0, "",
+		dbstat->sticky.released);
+	printf(" %*s%-22s%*s%10u\n", 4, "", "pindowns", 0, "",
+		dbstat->sticky.pindowns);
+	printf(" %*s%-22s%*s%10u\n", 4, "", "pindown_ms", 0, "",
+		dbstat->sticky.pindown_ms);
+	printf(" %*s%-22s%*s%10u\n", 4, "", "deferred", 0, "",
+		dbstat->sticky.deferred);
+	printf(" %*s%-22s%*s%10u\n", 4, "", "idle_pindowns", 0, "",
+		dbstat->sticky.idle_pindowns);
+	printf(" %s\n", "dmaster_hints");
+	printf(" %*s%-22s%*s%10u\n", 4, "", "hits", 0, "",
+		dbstat->dmaster_hints.hits);
+	printf(" %*s%-22s%*s%10u\n", 4, "", "misses", 0, "",
+		dbstat->dmaster_hints.misses);
+	printf(" %*s%-22s%*s%10u\n", 4, "", "stale", 0, "",
+		dbstat->dmaster_hints.stale);
+	printf(" %*s%-22s%*s%10u\n", 4, "", "hops_saved", 0, "",
+		dbstat->dmaster_hints.hops_saved);
+	printf(" %s\n", "shipped");
+	printf(" %*s%-22s%*s%10u\n", 4, "", "calls", 0, "",
+		dbstat->shipped.calls);
+	printf(" %*s%-22s%*s%10u\n", 4, "", "migrations", 0, "",
+		dbstat->shipped.migrations);
 	printf(" %s", "hop_count_buckets:");
 	for (i=0; i<MAX_COUNT_BUCKETS; i++) {
 		printf(" %d", dbstat->hop_count_bucket[i]);
@@ -691,6 +879,11 @@ static int control_dbstatistics(struct ctdb_context *ctdb, int argc, const char
 		printf(" %d", dbstat->locks.buckets[i]);
 	}
 	printf("\n");
+	printf(" %s", "lock_queue_buckets:");
+	for (i=0; i<MAX_COUNT_BUCKETS; i++) {
+		printf(" %d", dbstat->locks.queue_buckets[i]);
+	}
+	printf("\n");
 	printf(" %-30s     %.6f/%.6f/%.6f sec out of %d\n",
 		"locks_latency      MIN/AVG/MAX",
 		dbstat->locks.latency.min,
@@ -701,7 +894,8 @@ static int control_dbstatistics(struct ctdb_context *ctdb, int argc, const char
 		dbstat->locks.latency.num);
 	num_hot_keys = 0;
 	for (i=0; i<dbstat->num_hot_keys; i++) {
-		if (dbstat->hot_keys[i].count > 0) {
+		if (dbstat->hot_keys[i].count > 0 ||
+		    dbstat->hot_keys[i].migrations > 0) {
 			num_hot_keys++;
 		}
 	}
@@ -710,7 +904,9 @@ static int control_dbstatistics(struct ctdb_context *ctdb, int argc, const char
 	printf(" Num Hot Keys:     %d\n", dbstat->num_hot_keys);
 	for (i = 0; i < dbstat->num_hot_keys; i++) {
 		int j;
-		printf("     Count:%d Key:", dbstat->hot_keys[i].count);
+		printf("     Count:%d Migrations:%d Key:",
+		       dbstat->hot_keys[i].count,
+		       dbstat->hot_keys[i].migrations);
 		for (j = 0; j < dbstat->hot_keys[i].key.dsize; j++) {
 			printf("%02x", dbstat->hot_keys[i].key.dptr[j]&0xff);
 		}
@@ -4962,6 +5158,7 @@ static int control_attach(struct ctdb_context *ctdb, int argc, const char **argv
 	const char *db_name;
 	struct ctdb_db_context *ctdb_db;
 	bool persistent = false;
+	uint32_t tdb_flags = 0;
 
 	if (argc < 1) {
 		usage();
@@ -4971,13 +5168,16 @@ static int control_attach(struct ctdb_context *ctdb, int argc, const char **argv
 		usage();
 	}
 	if (argc == 2) {
-		if (strcmp(argv[1], "persistent") != 0) {
+		if (strcmp(argv[1], "persistent") == 0) {
+			persistent = true;
+		} else if (strcmp(argv[1], "mutex") == 0) {
+			tdb_flags = TDB_MUTEX_LOCKING;
+		} else {
 			usage();
 		}
-		persistent = true;
 	}
 
-	ctdb_db = ctdb_attach(ctdb, TIMELIMIT(), db_name, persistent, 0);
+	ctdb_db = ctdb_attach(ctdb, TIMELIMIT(), db_name, persistent, tdb_flags);
 	if (ctdb_db == NULL) {
 		DEBUG(DEBUG_ERR,("Unable to attach to database '%s'\n", db_name));
 		return -1;
@@ -5065,6 +5265,53 @@ static int control_setdbsticky(struct ctdb_context *ctdb, int argc, const char *
 	return 0;
 }
 
+/*
+  run calls with a given id at the dmaster instead of migrating records
+ */
+static int control_setdbshipcall(struct ctdb_context *ctdb, int argc, const char **argv)
+{
+	struct ctdb_db_ship_call ship_call;
+	uint32_t db_id;
+	int ret;
+
+	if (argc < 3) {
+		usage();
+	}
+
+	if (!db_exists(ctdb, argv[0], &db_id, NULL)) {
+		return -1;
+	}
+
+	if (!strcmp(argv[1], "null")) {
+		ship_call.call_id = CTDB_NULL_FUNC;
+	} else if (!strcmp(argv[1], "fetch")) {
+		ship_call.call_id = CTDB_FETCH_FUNC;
+	} else if (!strcmp(argv[1], "fetch_with_header")) {
+		ship_call.call_id = CTDB_FETCH_WITH_HEADER_FUNC;
+	} else {
+		ship_call.call_id = strtoul(argv[1], NULL, 0);
+	}
+
+	if (!strcmp(argv[2], "on")) {
+		ship_call.ship = 1;
+	} else if (!strcmp(argv[2], "off")) {
+		ship_call.ship = 0;
+	} else {
+		usage();
+	}
+
+	ship_call.db_id = db_id;
+
+	ret = ctdb_ctrl_set_db_ship_call(ctdb, TIMELIMIT(), options.pnn, &ship_call);
+	if (ret != 0) {
+		DEBUG(DEBUG_ERR,("Unable to set shipping of call %s for db %s\n",
+				 argv[1], argv[0]));
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
   set the readonly capability for a database
  */
@@ -5154,6 +5401,7 @@ static int control_eventscript(struct ctdb_context *ctdb, int argc, const char *
 }
 
 #define DB_VERSION 1
+#define DB_VERSION_STREAM 2
 #define MAX_DB_NAME 64
 struct db_file_header {
 	unsigned long version;
@@ -5163,30 +5411,125 @@ struct db_file_header {
 	const char name[MAX_DB_NAME];
 };
 
+/*
+ * A version 2 backup is a stream of chunks following the header.  Each
+ * chunk holds a marshall buffer of about DB_CHUNK_SIZE bytes, which may
+ * be compressed.  A chunk with zero length terminates the backup.
+ */
+#define DB_CHUNK_MAGIC 0x43686e6b
+#define DB_CHUNK_SIZE (1024*1024)
+
+/* commit a restore every this many bytes to bound transaction size */
+#define DB_RESTORE_TRANSACTION_SIZE (64*1024*1024)
+
+enum db_chunk_compression {
+	DB_COMPRESSION_NONE = 0,
+	DB_COMPRESSION_ZLIB = 1,
+};
+
+struct db_file_chunk {
+	uint32_t magic;
+	uint32_t compression;
+	uint32_t length;
+	uint32_t raw_length;
+};
+
 struct backup_data {
 	struct ctdb_marshall_buffer *records;
 	uint32_t len;
+	uint32_t size;
 	uint32_t total;
 	bool traverse_error;
+	int fh;
+	bool compress;
 };
 
+/*
+ * write the records collected so far as one chunk
+ */
+static int backup_write_chunk(struct backup_data *bd)
+{
+	struct db_file_chunk *chunk;
+	size_t len;
+	ssize_t ret;
+
+	if (bd->records->count == 0) {
+		return 0;
+	}
+
+	len = sizeof(*chunk) + bd->len;
+	chunk = talloc_size(bd, len);
+	if (chunk == NULL) {
+		DEBUG(DEBUG_ERR,("Failed to allocate backup chunk\n"));
+		return -1;
+	}
+
+	chunk->magic = DB_CHUNK_MAGIC;
+	chunk->compression = DB_COMPRESSION_NONE;
+	chunk->length = bd->len;
+	chunk->raw_length = bd->len;
+
+#ifdef HAVE_ZLIB
+	if (bd->compress) {
+		uLongf clen = compressBound(bd->len);
+
+		chunk = talloc_realloc_size(bd, chunk, sizeof(*chunk) + clen);
+		if (chunk == NULL) {
+			DEBUG(DEBUG_ERR,("Failed to allocate backup chunk\n"));
+			return -1;
+		}
+		if (compress2((Bytef *)(chunk+1), &clen,
+			      (Bytef *)bd->records, bd->len, Z_BEST_SPEED) != Z_OK) {
+			DEBUG(DEBUG_ERR,("Failed to compress backup chunk\n"));
+			talloc_free(chunk);
+			return -1;
+		}
+		chunk->compression = DB_COMPRESSION_ZLIB;
+		chunk->length = clen;
+		len = sizeof(*chunk) + clen;
+	} else
+#endif
+	{
+		memcpy(chunk+1, bd->records, bd->len);
+	}
+
+	/* A single write per chunk, so that chunks from parallel
+	 * workers appending to the same file do not interleave */
+	ret = write(bd->fh, chunk, len);
+	talloc_free(chunk);
+	if (ret != len) {
+		DEBUG(DEBUG_ERR,("write failed: %s\n",
+				 ret == -1 ? strerror(errno) : "short write"));
+		return -1;
+	}
+
+	bd->records->count = 0;
+	bd->len = offsetof(struct ctdb_marshall_buffer, data);
+	return 0;
+}
+
 static int backup_traverse(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data, void *private)
 {
 	struct backup_data *bd = talloc_get_type(private, struct backup_data);
 	struct ctdb_rec_data *rec;
 
 	/* add the record */
-	rec = ctdb_marshall_record(bd->records, 0, key, NULL, data);
+	rec = ctdb_marshall_record(bd, 0, key, NULL, data);
 	if (rec == NULL) {
 		bd->traverse_error = true;
 		DEBUG(DEBUG_ERR,("Failed to marshall record\n"));
 		return -1;
 	}
-	bd->records = talloc_realloc_size(NULL, bd->records, rec->length + bd->len);
-	if (bd->records == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to expand marshalling buffer\n"));
-		bd->traverse_error = true;
-		return -1;
+	if (bd->len + rec->length > bd->size) {
+		uint32_t size = MAX(2*bd->size, bd->len + rec->length);
+
+		bd->records = talloc_realloc_size(bd, bd->records, size);
+		if (bd->records == NULL) {
+			DEBUG(DEBUG_ERR,("Failed to expand marshalling buffer\n"));
+			bd->traverse_error = true;
+			return -1;
+		}
+		bd->size = size;
 	}
 	bd->records->count++;
 	memcpy(bd->len+(uint8_t *)bd->records, rec, rec->length);
@@ -5194,9 +5537,116 @@ static int backup_traverse(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data,
 	talloc_free(rec);
 
 	bd->total++;
+
+	if (bd->len >= DB_CHUNK_SIZE) {
+		if (backup_write_chunk(bd) != 0) {
+			bd->traverse_error = true;
+			return -1;
+		}
+	}
 	return 0;
 }
 
+/*
+ * traverse the hash chains of the database belonging to one worker
+ * and write them to the backup file
+ */
+static int backup_worker(struct ctdb_db_context *ctdb_db, int fh,
+			 uint32_t worker, uint32_t num_workers)
+{
+	struct backup_data *bd;
+	uint32_t hash_size;
+	int ret = -1;
+
+	bd = talloc_zero(ctdb_db, struct backup_data);
+	if (bd == NULL) {
+		DEBUG(DEBUG_ERR,("Failed to allocate backup_data\n"));
+		return -1;
+	}
+
+	bd->size = DB_CHUNK_SIZE;
+	bd->records = talloc_zero_size(bd, bd->size);
+	if (bd->records == NULL) {
+		DEBUG(DEBUG_ERR,("Failed to allocate ctdb_marshall_buffer\n"));
+		goto done;
+	}
+
+	bd->len = offsetof(struct ctdb_marshall_buffer, data);
+	bd->records->db_id = ctdb_db->db_id;
+	bd->fh = fh;
+	bd->compress = (options.compress != 0);
+
+	/* traverse the database writing the records as we go */
+	hash_size = tdb_hash_size(ctdb_db->ltdb->tdb);
+	if (tdb_traverse_read_range(ctdb_db->ltdb->tdb,
+				    worker * hash_size / num_workers,
+				    (worker+1) * hash_size / num_workers,
+				    backup_traverse, bd) == -1 ||
+	    bd->traverse_error) {
+		DEBUG(DEBUG_ERR,("Traverse error\n"));
+		goto done;
+	}
+
+	ret = backup_write_chunk(bd);
+
+done:
+	talloc_free(bd);
+	return ret;
+}
+
+/*
+ * run the backup workers
+ *
+ * The caller holds a transaction on the database, so the workers
+ * traverse it without taking locks of their own.
+ */
+static int backup_run_workers(struct ctdb_db_context *ctdb_db, int fh,
+			      uint32_t num_workers)
+{
+	pid_t *pids;
+	uint32_t i;
+	int status, ret = 0;
+
+	num_workers = MIN(num_workers, tdb_hash_size(ctdb_db->ltdb->tdb));
+	if (num_workers <= 1) {
+		return backup_worker(ctdb_db, fh, 0, 1);
+	}
+
+	pids = talloc_zero_array(ctdb_db, pid_t, num_workers);
+	if (pids == NULL) {
+		DEBUG(DEBUG_ERR,("Failed to allocate worker pids\n"));
+		return -1;
+	}
+
+	for (i=0; i<num_workers; i++) {
+		pids[i] = fork();
+		if (pids[i] == -1) {
+			DEBUG(DEBUG_ERR,("Failed to fork backup worker: %s\n",
+					 strerror(errno)));
+			ret = -1;
+			break;
+		}
+		if (pids[i] == 0) {
+			tdb_add_flags(ctdb_db->ltdb->tdb, TDB_NOLOCK);
+			_exit(backup_worker(ctdb_db, fh, i, num_workers) == 0 ? 0 : 1);
+		}
+	}
+
+	for (i=0; i<num_workers; i++) {
+		if (pids[i] <= 0) {
+			continue;
+		}
+		if (waitpid(pids[i], &status, 0) == -1 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			DEBUG(DEBUG_ERR,("Backup worker %u failed\n", i));
+			ret = -1;
+		}
+	}
+
+	talloc_free(pids);
+	return ret;
+}
+
 /*
  * backup a database to a file 
  */
@@ -5205,8 +5655,8 @@ static int control_backupdb(struct ctdb_context *ctdb, int argc, const char **ar
 	int ret;
 	TALLOC_CTX *tmp_ctx = talloc_new(ctdb);
 	struct db_file_header dbhdr;
+	struct db_file_chunk end;
 	struct ctdb_db_context *ctdb_db;
-	struct backup_data *bd;
 	int fh = -1;
 	int status = -1;
 	const char *reason = NULL;
@@ -5220,6 +5670,13 @@ static int control_backupdb(struct ctdb_context *ctdb, int argc, const char **ar
 		return -1;
 	}
 
+#ifndef HAVE_ZLIB
+	if (options.compress) {
+		DEBUG(DEBUG_ERR,("Compression is not supported in this build\n"));
+		return -1;
+	}
+#endif
+
 	if (!db_exists(ctdb, argv[0], &db_id, &flags)) {
 		return -1;
 	}
@@ -5263,64 +5720,48 @@ static int control_backupdb(struct ctdb_context *ctdb, int argc, const char **ar
 		return -1;
 	}
 
-
-	ret = tdb_transaction_start(ctdb_db->ltdb->tdb);
-	if (ret == -1) {
-		DEBUG(DEBUG_ERR,("Failed to start transaction\n"));
-		talloc_free(tmp_ctx);
-		return -1;
-	}
-
-
-	bd = talloc_zero(tmp_ctx, struct backup_data);
-	if (bd == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to allocate backup_data\n"));
-		talloc_free(tmp_ctx);
-		return -1;
-	}
-
-	bd->records = talloc_zero(bd, struct ctdb_marshall_buffer);
-	if (bd->records == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to allocate ctdb_marshall_buffer\n"));
+	if (strlen(argv[0]) >= MAX_DB_NAME) {
+		DEBUG(DEBUG_ERR,("Too long dbname\n"));
 		talloc_free(tmp_ctx);
 		return -1;
 	}
 
-	bd->len = offsetof(struct ctdb_marshall_buffer, data);
-	bd->records->db_id = ctdb_db->db_id;
-	/* traverse the database collecting all records */
-	if (tdb_traverse_read(ctdb_db->ltdb->tdb, backup_traverse, bd) == -1 ||
-	    bd->traverse_error) {
-		DEBUG(DEBUG_ERR,("Traverse error\n"));
-		talloc_free(tmp_ctx);
-		return -1;		
-	}
-
-	tdb_transaction_cancel(ctdb_db->ltdb->tdb);
-
-
-	fh = open(argv[1], O_RDWR|O_CREAT, 0600);
+	fh = open(argv[1], O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600);
 	if (fh == -1) {
 		DEBUG(DEBUG_ERR,("Failed to open file '%s'\n", argv[1]));
 		talloc_free(tmp_ctx);
 		return -1;
 	}
 
-	dbhdr.version = DB_VERSION;
+	ZERO_STRUCT(dbhdr);
+	dbhdr.version = DB_VERSION_STREAM;
 	dbhdr.timestamp = time(NULL);
 	dbhdr.persistent = flags & CTDB_DB_FLAGS_PERSISTENT;
-	dbhdr.size = bd->len;
-	if (strlen(argv[0]) >= MAX_DB_NAME) {
-		DEBUG(DEBUG_ERR,("Too long dbname\n"));
-		goto done;
-	}
+	dbhdr.size = 0;
 	strncpy(discard_const(dbhdr.name), argv[0], MAX_DB_NAME);
 	ret = write(fh, &dbhdr, sizeof(dbhdr));
 	if (ret == -1) {
 		DEBUG(DEBUG_ERR,("write failed: %s\n", strerror(errno)));
 		goto done;
 	}
-	ret = write(fh, bd->records, bd->len);
+
+	ret = tdb_transaction_start(ctdb_db->ltdb->tdb);
+	if (ret == -1) {
+		DEBUG(DEBUG_ERR,("Failed to start transaction\n"));
+		goto done;
+	}
+
+	ret = backup_run_workers(ctdb_db, fh, options.workers);
+
+	tdb_transaction_cancel(ctdb_db->ltdb->tdb);
+
+	if (ret != 0) {
+		goto done;
+	}
+
+	ZERO_STRUCT(end);
+	end.magic = DB_CHUNK_MAGIC;
+	ret = write(fh, &end, sizeof(end));
 	if (ret == -1) {
 		DEBUG(DEBUG_ERR,("write failed: %s\n", strerror(errno)));
 		goto done;
@@ -5335,12 +5776,240 @@ done:
 		}
 	}
 
-	DEBUG(DEBUG_ERR,("Database backed up to %s\n", argv[1]));
+	if (status == 0) {
+		DEBUG(DEBUG_ERR,("Database backed up to %s\n", argv[1]));
+	}
 
 	talloc_free(tmp_ctx);
 	return status;
 }
 
+/*
+ * reading a database backup file, either version 1 with a single
+ * marshall buffer or version 2 with a stream of chunks
+ */
+struct backup_file {
+	int fh;
+	struct db_file_header hdr;
+	bool done;
+};
+
+static int backup_file_open(const char *path, struct backup_file *bf)
+{
+	ssize_t n;
+
+	ZERO_STRUCTP(bf);
+
+	bf->fh = open(path, O_RDONLY);
+	if (bf->fh == -1) {
+		DEBUG(DEBUG_ERR,("Failed to open file '%s'\n", path));
+		return -1;
+	}
+
+	n = read(bf->fh, &bf->hdr, sizeof(bf->hdr));
+	if (n != sizeof(bf->hdr)) {
+		DEBUG(DEBUG_ERR,("Failed to read database backup header\n"));
+		close(bf->fh);
+		return -1;
+	}
+	if (bf->hdr.version != DB_VERSION &&
+	    bf->hdr.version != DB_VERSION_STREAM) {
+		DEBUG(DEBUG_ERR,("Invalid version of database dump. File is version %lu but expected version was %u or %u\n", bf->hdr.version, DB_VERSION, DB_VERSION_STREAM));
+		close(bf->fh);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int backup_file_read(struct backup_file *bf, void *buf, size_t len)
+{
+	ssize_t n;
+
+	n = read(bf->fh, buf, len);
+	if (n != len) {
+		DEBUG(DEBUG_ERR,("Failed to read database backup: %s\n",
+				 n == -1 ? strerror(errno) : "truncated file"));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * read the next marshall buffer from a backup file
+ * data->dsize is 0 once the end of the backup has been reached
+ */
+static int backup_file_next(struct backup_file *bf, TALLOC_CTX *mem_ctx,
+			    TDB_DATA *data)
+{
+	struct db_file_chunk chunk;
+	uint8_t *buf;
+
+	*data = tdb_null;
+
+	if (bf->done) {
+		return 0;
+	}
+
+	if (bf->hdr.version == DB_VERSION) {
+		bf->done = true;
+		chunk.compression = DB_COMPRESSION_NONE;
+		chunk.length = bf->hdr.size;
+		chunk.raw_length = bf->hdr.size;
+	} else {
+		if (backup_file_read(bf, &chunk, sizeof(chunk)) != 0) {
+			return -1;
+		}
+		if (chunk.magic != DB_CHUNK_MAGIC) {
+			DEBUG(DEBUG_ERR,("Corrupt chunk in database backup\n"));
+			return -1;
+		}
+		if (chunk.length == 0) {
+			bf->done = true;
+			return 0;
+		}
+	}
+
+	buf = talloc_size(mem_ctx, chunk.length);
+	if (buf == NULL) {
+		DEBUG(DEBUG_ERR,("Failed to allocate data of size '%u'\n", chunk.length));
+		return -1;
+	}
+	if (backup_file_read(bf, buf, chunk.length) != 0) {
+		talloc_free(buf);
+		return -1;
+	}
+
+	switch (chunk.compression) {
+	case DB_COMPRESSION_NONE:
+		data->dptr = buf;
+		data->dsize = chunk.length;
+		break;
+
+#ifdef HAVE_ZLIB
+	case DB_COMPRESSION_ZLIB: {
+		uLongf len = chunk.raw_length;
+
+		data->dptr = talloc_size(mem_ctx, chunk.raw_length);
+		if (data->dptr == NULL) {
+			DEBUG(DEBUG_ERR,("Failed to allocate data of size '%u'\n", chunk.raw_length));
+			talloc_free(buf);
+			return -1;
+		}
+		if (uncompress(data->dptr, &len, buf, chunk.length) != Z_OK ||
+		    len != chunk.raw_length) {
+			DEBUG(DEBUG_ERR,("Failed to uncompress database backup\n"));
+			talloc_free(data->dptr);
+			talloc_free(buf);
+			*data = tdb_null;
+			return -1;
+		}
+		data->dsize = len;
+		talloc_free(buf);
+		break;
+	}
+#endif
+
+	default:
+		DEBUG(DEBUG_ERR,("Unsupported compression %u in database backup\n",
+				 chunk.compression));
+		talloc_free(buf);
+		return -1;
+	}
+
+	if (data->dsize < offsetof(struct ctdb_marshall_buffer, data)) {
+		DEBUG(DEBUG_ERR,("Corrupt chunk in database backup\n"));
+		talloc_free(data->dptr);
+		*data = tdb_null;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * commit the cluster wide restore transaction, optionally starting
+ * the next one
+ */
+static int restore_commit(struct ctdb_context *ctdb, uint32_t *nodes,
+			  uint32_t generation, bool restart)
+{
+	TDB_DATA data;
+
+	data.dptr = (void *)&generation;
+	data.dsize = sizeof(generation);
+
+	if (ctdb_client_async_control(ctdb, CTDB_CONTROL_TRANSACTION_COMMIT,
+					nodes, 0,
+					TIMELIMIT(), false, data,
+					NULL, NULL,
+					NULL) != 0) {
+		DEBUG(DEBUG_ERR, ("Unable to commit databases.\n"));
+		return -1;
+	}
+
+	if (!restart) {
+		return 0;
+	}
+
+	if (ctdb_client_async_control(ctdb, CTDB_CONTROL_TRANSACTION_START,
+					nodes, 0,
+					TIMELIMIT(), false, data,
+					NULL, NULL,
+					NULL) != 0) {
+		DEBUG(DEBUG_ERR, ("Unable to start cluster wide transactions.\n"));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * A restore that fails after some batches were committed would leave
+ * the database partly restored.  Wipe it again, an empty database is
+ * not mistaken for a good copy
+ */
+static void restore_abort(struct ctdb_context *ctdb, uint32_t *nodes,
+			  struct ctdb_db_context *ctdb_db, uint32_t generation)
+{
+	struct ctdb_control_wipe_database w;
+	TDB_DATA data;
+
+	data.dptr = (void *)&generation;
+	data.dsize = sizeof(generation);
+
+	if (ctdb_client_async_control(ctdb, CTDB_CONTROL_TRANSACTION_START,
+					nodes, 0,
+					TIMELIMIT(), false, data,
+					NULL, NULL,
+					NULL) != 0) {
+		DEBUG(DEBUG_ERR, ("Unable to start cluster wide transactions, "
+				  "database '%s' is partly restored.\n",
+				  ctdb_db->db_name));
+		return;
+	}
+
+	w.db_id = ctdb_db->db_id;
+	w.transaction_id = generation;
+
+	data.dptr = (void *)&w;
+	data.dsize = sizeof(w);
+
+	if (ctdb_client_async_control(ctdb, CTDB_CONTROL_WIPE_DATABASE,
+					nodes, 0,
+					TIMELIMIT(), false, data,
+					NULL, NULL,
+					NULL) != 0 ||
+	    restore_commit(ctdb, nodes, generation, false) != 0) {
+		DEBUG(DEBUG_ERR, ("Unable to wipe database '%s', "
+				  "it is partly restored.\n",
+				  ctdb_db->db_name));
+		return;
+	}
+
+	DEBUG(DEBUG_ERR, ("Database '%s' has been wiped.\n", ctdb_db->db_name));
+}
+
 /*
  * restore a database from a file 
  */
@@ -5350,14 +6019,17 @@ static int control_restoredb(struct ctdb_context *ctdb, int argc, const char **a
 	TALLOC_CTX *tmp_ctx = talloc_new(ctdb);
 	TDB_DATA outdata;
 	TDB_DATA data;
-	struct db_file_header dbhdr;
+	struct backup_file bf;
+	struct ctdb_marshall_buffer *m;
 	struct ctdb_db_context *ctdb_db;
 	struct ctdb_node_map *nodemap=NULL;
 	struct ctdb_vnn_map *vnnmap=NULL;
-	int i, fh;
+	int i;
 	struct ctdb_control_wipe_database w;
 	uint32_t *nodes;
 	uint32_t generation;
+	size_t pushed;
+	bool committed = false;
 	struct tm *tm;
 	char tbuf[100];
 	char *dbname;
@@ -5369,45 +6041,26 @@ static int control_restoredb(struct ctdb_context *ctdb, int argc, const char **a
 		return -1;
 	}
 
-	fh = open(argv[0], O_RDONLY);
-	if (fh == -1) {
-		DEBUG(DEBUG_ERR,("Failed to open file '%s'\n", argv[0]));
+	if (backup_file_open(argv[0], &bf) != 0) {
 		talloc_free(tmp_ctx);
 		return -1;
 	}
 
-	read(fh, &dbhdr, sizeof(dbhdr));
-	if (dbhdr.version != DB_VERSION) {
-		DEBUG(DEBUG_ERR,("Invalid version of database dump. File is version %lu but expected version was %u\n", dbhdr.version, DB_VERSION));
-		talloc_free(tmp_ctx);
-		return -1;
-	}
-
-	dbname = discard_const(dbhdr.name);
+	dbname = discard_const(bf.hdr.name);
 	if (argc == 2) {
 		dbname = discard_const(argv[1]);
 	}
 
-	outdata.dsize = dbhdr.size;
-	outdata.dptr = talloc_size(tmp_ctx, outdata.dsize);
-	if (outdata.dptr == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to allocate data of size '%lu'\n", dbhdr.size));
-		close(fh);
-		talloc_free(tmp_ctx);
-		return -1;
-	}		
-	read(fh, outdata.dptr, outdata.dsize);
-	close(fh);
-
-	tm = localtime(&dbhdr.timestamp);
+	tm = localtime(&bf.hdr.timestamp);
 	strftime(tbuf,sizeof(tbuf)-1,"%Y/%m/%d %H:%M:%S", tm);
 	printf("Restoring database '%s' from backup @ %s\n",
 		dbname, tbuf);
 
 
-	ctdb_db = ctdb_attach(ctdb, TIMELIMIT(), dbname, dbhdr.persistent, 0);
+	ctdb_db = ctdb_attach(ctdb, TIMELIMIT(), dbname, bf.hdr.persistent, 0);
 	if (ctdb_db == NULL) {
 		DEBUG(DEBUG_ERR,("Unable to attach to database '%s'\n", dbname));
+		close(bf.fh);
 		talloc_free(tmp_ctx);
 		return -1;
 	}
@@ -5415,6 +6068,7 @@ static int control_restoredb(struct ctdb_context *ctdb, int argc, const char **a
 	ret = ctdb_ctrl_getnodemap(ctdb, TIMELIMIT(), options.pnn, ctdb, &nodemap);
 	if (ret != 0) {
 		DEBUG(DEBUG_ERR, ("Unable to get nodemap from node %u\n", options.pnn));
+		close(bf.fh);
 		talloc_free(tmp_ctx);
 		return ret;
 	}
@@ -5423,6 +6077,7 @@ static int control_restoredb(struct ctdb_context *ctdb, int argc, const char **a
 	ret = ctdb_ctrl_getvnnmap(ctdb, TIMELIMIT(), options.pnn, tmp_ctx, &vnnmap);
 	if (ret != 0) {
 		DEBUG(DEBUG_ERR, ("Unable to get vnnmap from node %u\n", options.pnn));
+		close(bf.fh);
 		talloc_free(tmp_ctx);
 		return ret;
 	}
@@ -5437,9 +6092,7 @@ static int control_restoredb(struct ctdb_context *ctdb, int argc, const char **a
 					NULL, NULL,
 					NULL) != 0) {
 			DEBUG(DEBUG_ERR, ("Unable to freeze nodes.\n"));
-			ctdb_ctrl_setrecmode(ctdb, TIMELIMIT(), options.pnn, CTDB_RECOVERY_ACTIVE);
-			talloc_free(tmp_ctx);
-			return -1;
+			goto fail;
 		}
 	}
 
@@ -5455,7 +6108,7 @@ static int control_restoredb(struct ctdb_context *ctdb, int argc, const char **a
 					NULL, NULL,
 					NULL) != 0) {
 		DEBUG(DEBUG_ERR, ("Unable to start cluster wide transactions.\n"));
-		return -1;
+		goto fail;
 	}
 
 
@@ -5473,22 +6126,42 @@ static int control_restoredb(struct ctdb_context *ctdb, int argc, const char **a
 					NULL, NULL,
 					NULL) != 0) {
 		DEBUG(DEBUG_ERR, ("Unable to wipe database.\n"));
-		ctdb_ctrl_setrecmode(ctdb, TIMELIMIT(), options.pnn, CTDB_RECOVERY_ACTIVE);
-		talloc_free(tmp_ctx);
-		return -1;
+		goto fail;
 	}
-	
-	/* push the database */
-	nodes = list_of_active_nodes(ctdb, nodemap, tmp_ctx, true);
-	if (ctdb_client_async_control(ctdb, CTDB_CONTROL_PUSH_DB,
-					nodes, 0,
-					TIMELIMIT(), false, outdata,
-					NULL, NULL,
-					NULL) != 0) {
-		DEBUG(DEBUG_ERR, ("Failed to push database.\n"));
-		ctdb_ctrl_setrecmode(ctdb, TIMELIMIT(), options.pnn, CTDB_RECOVERY_ACTIVE);
-		talloc_free(tmp_ctx);
-		return -1;
+
+	/* push the database one chunk at a time, committing
+	 * whenever enough data has been pushed */
+	pushed = 0;
+	while (true) {
+		if (backup_file_next(&bf, tmp_ctx, &outdata) != 0) {
+			goto fail;
+		}
+		if (outdata.dsize == 0) {
+			break;
+		}
+
+		m = (struct ctdb_marshall_buffer *)outdata.dptr;
+		m->db_id = ctdb_db->db_id;
+
+		if (ctdb_client_async_control(ctdb, CTDB_CONTROL_PUSH_DB,
+						nodes, 0,
+						TIMELIMIT(), false, outdata,
+						NULL, NULL,
+						NULL) != 0) {
+			DEBUG(DEBUG_ERR, ("Failed to push database.\n"));
+			goto fail;
+		}
+
+		pushed += outdata.dsize;
+		talloc_free(outdata.dptr);
+
+		if (pushed >= DB_RESTORE_TRANSACTION_SIZE) {
+			committed = true;
+			if (restore_commit(ctdb, nodes, generation, true) != 0) {
+				goto fail;
+			}
+			pushed = 0;
+		}
 	}
 
 	data.dptr = (void *)&ctdb_db->db_id;
@@ -5502,24 +6175,13 @@ static int control_restoredb(struct ctdb_context *ctdb, int argc, const char **a
 					NULL, NULL,
 					NULL) != 0) {
 		DEBUG(DEBUG_ERR, ("Failed to mark database as healthy.\n"));
-		ctdb_ctrl_setrecmode(ctdb, TIMELIMIT(), options.pnn, CTDB_RECOVERY_ACTIVE);
-		talloc_free(tmp_ctx);
-		return -1;
+		goto fail;
 	}
 
-	data.dptr = (void *)&generation;
-	data.dsize = sizeof(generation);
-
 	/* commit all the changes */
-	if (ctdb_client_async_control(ctdb, CTDB_CONTROL_TRANSACTION_COMMIT,
-					nodes, 0,
-					TIMELIMIT(), false, data,
-					NULL, NULL,
-					NULL) != 0) {
-		DEBUG(DEBUG_ERR, ("Unable to commit databases.\n"));
-		ctdb_ctrl_setrecmode(ctdb, TIMELIMIT(), options.pnn, CTDB_RECOVERY_ACTIVE);
-		talloc_free(tmp_ctx);
-		return -1;
+	committed = true;
+	if (restore_commit(ctdb, nodes, generation, false) != 0) {
+		goto fail;
 	}
 
 
@@ -5532,14 +6194,22 @@ static int control_restoredb(struct ctdb_context *ctdb, int argc, const char **a
 					NULL, NULL,
 					NULL) != 0) {
 		DEBUG(DEBUG_ERR, ("Unable to thaw nodes.\n"));
-		ctdb_ctrl_setrecmode(ctdb, TIMELIMIT(), options.pnn, CTDB_RECOVERY_ACTIVE);
-		talloc_free(tmp_ctx);
-		return -1;
+		goto fail;
 	}
 
 
+	close(bf.fh);
 	talloc_free(tmp_ctx);
 	return 0;
+
+fail:
+	if (committed) {
+		restore_abort(ctdb, nodes, ctdb_db, generation);
+	}
+	ctdb_ctrl_setrecmode(ctdb, TIMELIMIT(), options.pnn, CTDB_RECOVERY_ACTIVE);
+	close(bf.fh);
+	talloc_free(tmp_ctx);
+	return -1;
 }
 
 /*
@@ -5549,11 +6219,11 @@ static int control_dumpdbbackup(struct ctdb_context *ctdb, int argc, const char
 {
 	TALLOC_CTX *tmp_ctx = talloc_new(ctdb);
 	TDB_DATA outdata;
-	struct db_file_header dbhdr;
-	int i, fh;
+	struct backup_file bf;
+	int i, count;
 	struct tm *tm;
 	char tbuf[100];
-	struct ctdb_rec_data *rec = NULL;
+	struct ctdb_rec_data *rec;
 	struct ctdb_marshall_buffer *m;
 	struct ctdb_dump_db_context c;
 
@@ -5564,36 +6234,22 @@ static int control_dumpdbbackup(struct ctdb_context *ctdb, int argc, const char
 		return -1;
 	}
 
-	fh = open(argv[0], O_RDONLY);
-	if (fh == -1) {
-		DEBUG(DEBUG_ERR,("Failed to open file '%s'\n", argv[0]));
+	if (backup_file_open(argv[0], &bf) != 0) {
 		talloc_free(tmp_ctx);
 		return -1;
 	}
 
-	read(fh, &dbhdr, sizeof(dbhdr));
-	if (dbhdr.version != DB_VERSION) {
-		DEBUG(DEBUG_ERR,("Invalid version of database dump. File is version %lu but expected version was %u\n", dbhdr.version, DB_VERSION));
+	if (backup_file_next(&bf, tmp_ctx, &outdata) != 0) {
+		close(bf.fh);
 		talloc_free(tmp_ctx);
 		return -1;
 	}
 
-	outdata.dsize = dbhdr.size;
-	outdata.dptr = talloc_size(tmp_ctx, outdata.dsize);
-	if (outdata.dptr == NULL) {
-		DEBUG(DEBUG_ERR,("Failed to allocate data of size '%lu'\n", dbhdr.size));
-		close(fh);
-		talloc_free(tmp_ctx);
-		return -1;
-	}
-	read(fh, outdata.dptr, outdata.dsize);
-	close(fh);
-	m = (struct ctdb_marshall_buffer *)outdata.dptr;
-
-	tm = localtime(&dbhdr.timestamp);
+	tm = localtime(&bf.hdr.timestamp);
 	strftime(tbuf,sizeof(tbuf)-1,"%Y/%m/%d %H:%M:%S", tm);
+	m = (struct ctdb_marshall_buffer *)outdata.dptr;
 	printf("Backup of database name:'%s' dbid:0x%x08x from @ %s\n",
-		dbhdr.name, m->db_id, tbuf);
+		bf.hdr.name, m ? m->db_id : 0, tbuf);
 
 	ZERO_STRUCT(c);
 	c.f = stdout;
@@ -5603,18 +6259,32 @@ static int control_dumpdbbackup(struct ctdb_context *ctdb, int argc, const char
 	c.printhash = (bool)options.printhash;
 	c.printrecordflags = (bool)options.printrecordflags;
 
-	for (i=0; i < m->count; i++) {
-		uint32_t reqid = 0;
-		TDB_DATA key, data;
+	count = 0;
+	while (outdata.dsize != 0) {
+		m = (struct ctdb_marshall_buffer *)outdata.dptr;
+		rec = NULL;
+		for (i=0; i < m->count; i++) {
+			uint32_t reqid = 0;
+			TDB_DATA key, data;
+
+			/* we do not want the header splitted, so we pass NULL*/
+			rec = ctdb_marshall_loop_next(m, rec, &reqid,
+						      NULL, &key, &data);
 
-		/* we do not want the header splitted, so we pass NULL*/
-		rec = ctdb_marshall_loop_next(m, rec, &reqid,
-					      NULL, &key, &data);
+			ctdb_dumpdb_record(ctdb, key, data, &c);
+		}
+		count += m->count;
+		talloc_free(outdata.dptr);
 
-		ctdb_dumpdb_record(ctdb, key, data, &c);
+		if (backup_file_next(&bf, tmp_ctx, &outdata) != 0) {
+			close(bf.fh);
+			talloc_free(tmp_ctx);
+			return -1;
+		}
 	}
+	close(bf.fh);
 
-	printf("Dumped %d records\n", i);
+	printf("Dumped %d records\n", count);
 	talloc_free(tmp_ctx);
 	return 0;
 }
@@ -6011,6 +6681,9 @@ static const struct {
 	{ "statistics",      control_statistics,        false,	false, "show statistics" },
 	{ "statisticsreset", control_statistics_reset,  true,	false,  "reset statistics"},
 	{ "stats",           control_stats,             false,	false,  "show rolling statistics", "[number of history records]" },
+	{ "statsrange",      control_statsrange,        false,	false,  "show statistics history for a time range", "<start time> [<end time>]" },
+	{ "clientstats",     control_clientstats,       false,	false,  "show the request queues of the connected clients" },
+	{ "streamstats",     control_streamstats,       false,	false,  "show the queues of the streams to the other nodes" },
 	{ "ip",              control_ip,                false,	false,  "show which public ip's that ctdb manages" },
 	{ "ipinfo",          control_ipinfo,            true,	false,  "show details about a public ip that ctdb manages", "<ip>" },
 	{ "ifaces",          control_ifaces,            true,	false,  "show which interfaces that ctdb manages" },
@@ -6031,7 +6704,7 @@ static const struct {
 	{ "getdebug",        control_getdebug,          true,	false,  "get debug level" },
 	{ "getlog",          control_getlog,            true,	false,  "get the log data from the in memory ringbuffer", "[<level>] [recoverd]" },
 	{ "clearlog",          control_clearlog,        true,	false,  "clear the log data from the in memory ringbuffer", "[recoverd]" },
-	{ "attach",          control_attach,            true,	false,  "attach to a database",                 "<dbname> [persistent]" },
+	{ "attach",          control_attach,            true,	false,  "attach to a database",                 "<dbname> [persistent|mutex]" },
 	{ "dumpmemory",      control_dumpmemory,        true,	false,  "dump memory map to stdout" },
 	{ "rddumpmemory",    control_rddumpmemory,      true,	false,  "dump memory map from the recovery daemon to stdout" },
 	{ "getpid",          control_getpid,            true,	false,  "get ctdbd process ID" },
@@ -6088,6 +6761,7 @@ static const struct {
 	{ "getdbprio",        control_getdbprio,	false,	false, "Get DB priority", "<dbname|dbid>"},
 	{ "setdbreadonly",    control_setdbreadonly,	false,	false, "Set DB readonly capable", "<dbname|dbid>"},
 	{ "setdbsticky",      control_setdbsticky,	false,	false, "Set DB sticky-records capable", "<dbname|dbid>"},
+	{ "setdbshipcall",    control_setdbshipcall,	false,	false, "Run a DB call at the dmaster instead of migrating", "<dbname|dbid> <null|fetch|fetch_with_header|callid> {on|off}"},
 	{ "msglisten",        control_msglisten,	false,	false, "Listen on a srvid port for messages", "<msg srvid>"},
 	{ "msgsend",          control_msgsend,	false,	false, "Send a message to srvid", "<srvid> <message>"},
 	{ "pfetch", 	     control_pfetch,      	false,	false,  "fetch a record from a persistent database", "<dbname|dbid> <key> [<file>]" },
@@ -6156,6 +6830,8 @@ int main(int argc, const char *argv[])
 		{ "print-lmaster", 0, POPT_ARG_NONE, &options.printlmaster, 0, "print the record's lmaster in catdb", NULL },
 		{ "print-hash", 0, POPT_ARG_NONE, &options.printhash, 0, "print the record's hash when dumping databases", NULL },
 		{ "print-recordflags", 0, POPT_ARG_NONE, &options.printrecordflags, 0, "print the record flags in catdb and dumpdbbackup", NULL },
+		{ "compress", 0, POPT_ARG_NONE, &options.compress, 0, "compress the database backup (backupdb)", NULL },
+		{ "workers", 0, POPT_ARG_INT, &options.workers, 0, "number of parallel workers (backupdb)", "integer" },
 		POPT_TABLEEND
 	};
 	int opt;